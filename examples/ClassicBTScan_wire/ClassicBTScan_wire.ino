@@ -0,0 +1,54 @@
+#include <BTDevice.h>
+#include <BTScan.h>
+#include <BTWireFormat.h>
+
+
+#if !defined(CONFIG_BT_ENABLED) || !defined(CONFIG_BLUEDROID_ENABLED)
+#error Bluetooth is not enabled! Please run `make menuconfig` to and enable it
+#endif
+
+// Compare the size and encode time of the binary wire format against toString().
+
+uint8_t wireBuffer[2048];
+
+void setup() {
+  Serial.begin(115200);
+
+  BTDevice::init("");
+  BTScan* pBTScan = BTDevice::getScan();
+  BTScanResults results = pBTScan->start(Scan_duration);
+
+  size_t textBytes = 0;
+  uint32_t textStart = micros();
+  for (int i = 0; i < results.getCount(); i++) {
+    textBytes += results.getDevice(i).toString().length();
+  }
+  uint32_t textMicros = micros() - textStart;
+
+  BTWireEncoder encoder(wireBuffer, sizeof(wireBuffer));
+  uint32_t wireStart = micros();
+  encoder.reset(results.getScanStart());
+  encoder.addResults(results);
+  uint32_t wireMicros = micros() - wireStart;
+
+  int count = results.getCount();
+  Serial.printf("%d devices\n", count);
+  if (count > 0) {
+    Serial.printf("text: %u bytes (%u per device) in %u us\n", textBytes, textBytes / count, textMicros);
+    Serial.printf("wire: %u bytes (%u per device) in %u us\n", encoder.getLength(), encoder.getLength() / count, wireMicros);
+  }
+
+  BTWireDecoder decoder(encoder.getData(), encoder.getLength());
+  BTWireRecord record;
+  while (decoder.next(&record)) {
+    Serial.printf("%02x:%02x:%02x:%02x:%02x:%02x rssi=%d name=%s\n",
+      record.address[0], record.address[1], record.address[2],
+      record.address[3], record.address[4], record.address[5],
+      record.rssi, record.name);
+  }
+}
+
+void loop() {
+
+  delay(10000);
+}
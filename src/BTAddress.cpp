@@ -52,6 +52,18 @@ BTAddress::BTAddress(std::string stringAddress) {
 } // BTAddress
 
 
+/**
+ * @brief Create an address from its packed 48 bit form.
+ * @param [in] packedAddress The address as returned by toUint64().
+ */
+BTAddress::BTAddress(uint64_t packedAddress) {
+	for (int i = ESP_BD_ADDR_LEN - 1; i >= 0; i--) {
+		m_address[i] = (uint8_t)packedAddress;
+		packedAddress >>= 8;
+	}
+} // BTAddress
+
+
 /**
  * @brief Determine if this address equals another.
  * @param [in] otherAddress The other address to compare against.
@@ -80,4 +92,21 @@ std::string BTAddress::toString() {
 	stream << std::setfill('0') << std::setw(2) << std::hex << (int)((uint8_t *)(m_address))[5];
 	return stream.str();
 } // toString
+
+
+/**
+ * @brief Pack the address into the low 48 bits of an integer.
+ *
+ * The first byte of the address is the most significant so packed addresses sort in the same
+ * order as their string forms.
+ *
+ * @return The packed address.
+ */
+uint64_t BTAddress::toUint64() {
+	uint64_t packed = 0;
+	for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+		packed = (packed << 8) | m_address[i];
+	}
+	return packed;
+} // toUint64
 #endif
\ No newline at end of file
@@ -33,9 +33,11 @@ class BTAddress {
 	public:
 		BTAddress(esp_bd_addr_t address);
 		BTAddress(std::string stringAddress);
+		BTAddress(uint64_t packedAddress);
 		bool           equals(BTAddress otherAddress);
 		esp_bd_addr_t* getNative();
 		std::string    toString();
+		uint64_t       toUint64();
 
 	private:
 		esp_bd_addr_t m_address;
@@ -34,9 +34,11 @@
 #include <iomanip>
 #include <string.h>
 #include <stdio.h>
+#include <algorithm>
 
 
 #include "BTAdvertisedDevice.h"
+#include "BTProfiler.h"
 //#include "BTUtils.h"
 #ifdef ARDUINO_ARCH_ESP32
 #include "esp32-hal-log.h"
@@ -47,16 +49,24 @@
 
 BTAdvertisedDevice::BTAdvertisedDevice() {
 	m_adFlag           = 0;
-	m_manufacturerData = "";
-	m_name             = "";
+	m_name             = nullptr;
+	m_nameLen          = 0;
 	m_rssi             = -9999;
 	m_serviceData      = "";
 	m_deviceType	   = "";
 	m_serviceType	   = "";
+	m_serviceUUIDs     = nullptr;
+	m_serviceUUIDCount = 0;
+	m_uuidSignature    = 0;
+	m_haveLongUUID     = false;
 	m_txPower          = 0;
 	m_pScan            = nullptr;
+	m_pArena           = nullptr;
+	m_arenaEpoch       = 0;
+	m_timestamp        = 0;
+	m_transports       = 0;
+	m_eir_len          = 0;
 
-	m_haveManufacturerData = false;
 	m_haveName             = false;
 	m_haveRSSI             = false;
 	m_haveServiceData      = false;
@@ -82,19 +92,43 @@ BTAddress BTAdvertisedDevice::getAddress() {
 
 /**
  * @brief Get the manufacturer data.
- * @return The manufacturer data of the advertised device.
+ * @return A copy of the manufacturer data field of the EIR, company identifier included, empty when
+ * there is none, see haveManufacturerData().
  */
 std::string BTAdvertisedDevice::getManufacturerData() {
-	return m_manufacturerData;
+	uint8_t        length;
+	const uint8_t* data = m_eirIndex.find(m_eir, ESP_BT_EIR_TYPE_MANU_SPECIFIC, &length);
+	return (data != nullptr && length >= 2) ? std::string((const char*)data, length) : std::string();
 } // getManufacturerData
 
 
+/**
+ * @brief Get the manufacturer data without copying it.
+ * @return A view into the EIR held by this object, invalid (data is nullptr) when there is no
+ * manufacturer data.
+ */
+BTManufacturerData BTAdvertisedDevice::getManufacturerDataView() {
+	BTManufacturerData view = { 0, nullptr, 0 };
+	uint8_t            length;
+	const uint8_t*     data = m_eirIndex.find(m_eir, ESP_BT_EIR_TYPE_MANU_SPECIFIC, &length);
+	if (data != nullptr && length >= 2) {
+		view.companyId = data[0] | (data[1] << 8);
+		view.data      = data + 2;
+		view.length    = length - 2;
+	}
+	return view;
+} // getManufacturerDataView
+
+
 /**
  * @brief Get the name.
  * @return The name of the advertised device.
  */
 std::string BTAdvertisedDevice::getName() {
-	return m_name;
+	if (!haveName()) {
+		return std::string();
+	}
+	return std::string(m_name, m_nameLen);
 } // getName
 
 
@@ -141,13 +175,53 @@ BTUUID BTAdvertisedDevice::getServiceDataUUID() {
  * @return Return true if service is advertised
  */
 bool BTAdvertisedDevice::isAdvertisingService(BTUUID uuid){
-	for (int i = 0; i < m_serviceUUIDs.size(); ++i) {
-		if(m_serviceUUIDs[i].equals(uuid))
-			return true;
+	if (!haveServiceUUID() || uuid.bitSize() == 0) {
+		return false;
 	}
-	return false;
+	BTUUIDKey key = BTUUIDKey::fromUUID(uuid);
+	const BTUUIDKey* pEnd = m_serviceUUIDs + m_serviceUUIDCount;
+	const BTUUIDKey* pKey = std::lower_bound((const BTUUIDKey*)m_serviceUUIDs, pEnd, key);
+	return pKey != pEnd && *pKey == key;
 }
 
+
+/**
+ * @brief Check whether the device advertises at least one of the services of a query.
+ * @param [in] query The services looked for, built once and reused.
+ * @return True if any of them is advertised.
+ */
+bool BTAdvertisedDevice::isAdvertisingAny(BTUUIDQuery& query) {
+	if (!haveServiceUUID()) {
+		return false;
+	}
+	return query.matchesAny(m_serviceUUIDs, m_serviceUUIDCount, m_uuidSignature, m_haveLongUUID);
+} // isAdvertisingAny
+
+
+/**
+ * @brief Check whether the device advertises every service of a query.
+ * @param [in] query The services looked for, built once and reused.
+ * @return True if all of them are advertised.
+ */
+bool BTAdvertisedDevice::isAdvertisingAll(BTUUIDQuery& query) {
+	if (!haveServiceUUID()) {
+		return query.size() == 0;
+	}
+	return query.matchesAll(m_serviceUUIDs, m_serviceUUIDCount, m_uuidSignature, m_haveLongUUID);
+} // isAdvertisingAll
+
+
+/**
+ * @brief Get the lowest advertised service UUID.
+ * @return The service UUID in its shortest form, or an unset UUID if none is advertised.
+ */
+BTUUID BTAdvertisedDevice::getServiceUUID() {
+	if (!haveServiceUUID()) {
+		return BTUUID();
+	}
+	return m_serviceUUIDs[0].toUUID();
+} // getServiceUUID
+
 /**
  * @brief Get the TX Power.
  * @return The TX Power of the advertised device.
@@ -162,19 +236,24 @@ uint32_t BTAdvertisedDevice::getCod() {
 
 
 std::string BTAdvertisedDevice::getServiceType(){
-	return m_serviceType;
+	return std::string(m_serviceType);
 }
 
 std::string BTAdvertisedDevice::getDeviceType(){
-	return m_deviceType;
+	return std::string(m_deviceType);
 }
 
 /**
  * @brief Does this advertisement have manufacturer data?
+ *
+ * A field too short to hold the company identifier does not count, so this agrees with
+ * getManufacturerDataView().isValid().
+ *
  * @return True if there is manufacturer data present.
  */
 bool BTAdvertisedDevice::haveManufacturerData() {
-	return m_haveManufacturerData;
+	uint8_t length;
+	return m_eirIndex.find(m_eir, ESP_BT_EIR_TYPE_MANU_SPECIFIC, &length) != nullptr && length >= 2;
 } // haveManufacturerData
 
 
@@ -183,7 +262,7 @@ bool BTAdvertisedDevice::haveManufacturerData() {
  * @return True if there is a name value present.
  */
 bool BTAdvertisedDevice::haveName() {
-	return m_haveName;
+	return m_haveName && isArenaValid();
 } // haveName
 
 
@@ -210,7 +289,7 @@ bool BTAdvertisedDevice::haveServiceData() {
  * @return True if there is a service UUID value present.
  */
 bool BTAdvertisedDevice::haveServiceUUID() {
-	return m_haveServiceUUID;
+	return m_haveServiceUUID && isArenaValid();
 } // haveServiceUUID
 
 
@@ -228,207 +307,138 @@ bool BTAdvertisedDevice::haveCod() {
 
 
 /**
- * @brief Parse the advertising pay load.
- *
- * The pay load is a buffer of bytes that is either 31 bytes long or terminated by
- * a 0 length value.  Each entry in the buffer has the format:
- * [length][type][data...]
+ * @brief Parse a discovery result.
  *
- * The length does not include itself but does include everything after it until the next record.  A record
- * with a length value of 0 indicates a terminator.
+ * The name is taken, in order of preference, from the complete local name of the EIR, the remote
+ * name property and the shortened local name of the EIR.
  *
- * https://www.bluetooth.com/specifications/assigned-numbers/generic-access-profile
+ * @param [in] disc_res The discovery result reported by the GAP.
+ * @return False if a property was malformed and had to be skipped.
  */
-void BTAdvertisedDevice::parseDiscResult(esp_bt_gap_cb_param_t::disc_res_param* disc_res) {
+bool BTAdvertisedDevice::parseDiscResult(esp_bt_gap_cb_param_t::disc_res_param* disc_res) {
+	BT_PROFILE_SCOPE(BT_STAGE_PARSE_DISC_RESULT);
 
-    esp_bt_gap_dev_prop_t *p;
+	esp_bt_gap_dev_prop_t *p;
+	bool           valid      = true;
+	const uint8_t* bdname     = nullptr;
+	uint8_t        bdname_len = 0;
 
-	uint8_t bdname_len = 0;
-	uint8_t eir_len = 0;
-	uint32_t cod = 0;
-	int32_t rssi = -129;
-	uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
-	uint8_t bdname[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+	log_d("Device address %s", m_address.toString().c_str());
+	m_transports |= BT_TRANSPORT_CLASSIC;
 
-	BTAddress advertisedAddress(disc_res->bda);
-	log_i("Device adresse %s", advertisedAddress.toString().c_str());
-
-    for (int i = 0; i < disc_res->num_prop; i++) {
-        p = disc_res->prop + i;
-        switch (p->type) {
+	for (int i = 0; i < disc_res->num_prop; i++) {
+		p = disc_res->prop + i;
+		switch (p->type) {
 			case ESP_BT_GAP_DEV_PROP_COD: {
-				cod = *(uint32_t *)(p->val);
-				setCod(cod);
+				setCod(*(uint32_t *)(p->val));
 				break;
 			}
-			case ESP_BT_GAP_DEV_PROP_RSSI:{
-				rssi = *(int8_t *)(p->val);
-				setRSSI(rssi);
+			case ESP_BT_GAP_DEV_PROP_RSSI: {
+				setRSSI(*(int8_t *)(p->val));
 				break;
 			}
 			case ESP_BT_GAP_DEV_PROP_BDNAME: {
-				uint8_t bdname_len = (p->len > ESP_BT_GAP_MAX_BDNAME_LEN) ? ESP_BT_GAP_MAX_BDNAME_LEN :
-							(uint8_t)p->len;
-				memcpy(bdname, (uint8_t *)(p->val), bdname_len);
-				bdname[bdname_len] = '\0';
-
-				setName(std::string(reinterpret_cast<char*>(bdname)));
+				bdname     = (const uint8_t *)(p->val);
+				bdname_len = (p->len > ESP_BT_GAP_MAX_BDNAME_LEN) ? ESP_BT_GAP_MAX_BDNAME_LEN : (uint8_t)p->len;
+				break;
 			}
 			case ESP_BT_GAP_DEV_PROP_EIR: {
-				memcpy(eir, (uint8_t *)(p->val), p->len);
-				eir_len = p->len;
-				
-				//#ifndef WiFi_h //wait for Arduino IDF update to properly work with wifi > https://github.com/espressif/arduino-esp32/issues/1997
-				parseEir(eir);
-				//#endif
-				
-
+				if (p->val == nullptr || p->len > ESP_BT_GAP_EIR_DATA_LEN || !parseEir((const uint8_t *)(p->val), p->len)) {
+					log_w("Malformed EIR of %d bytes", p->len);
+					valid = false;
+				}
 				break;
 			}
-			default:{
+			default: {
 				break;
 			}
-        } // switch
-    } //for
-
-	
-
-	if (eir && !haveName()) {
-		log_v("Get name from eir");
-    	if(get_name_from_eir(eir, bdname, &bdname_len))
-			setName(std::string(reinterpret_cast<char*>(bdname)));
-    }
-
-	//log_i("Device name %s", p_dev.bdname);
-
-	//std::string bdname((char *) p_dev.bdname);
-	//log_i("Device name %s", bdname);
-
-
-	
-
-
-
+		} // switch
+	} // for
+
+	const uint8_t* name;
+	uint8_t        nameLen;
+	if ((name = m_eirIndex.find(m_eir, ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME, &nameLen)) != nullptr) {
+		setName(name, nameLen);
+	} else if (bdname != nullptr) {
+		setName(bdname, bdname_len);
+	} else if ((name = m_eirIndex.find(m_eir, ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME, &nameLen)) != nullptr) {
+		setName(name, nameLen);
+	}
 
+	return valid;
 } // parseDiscResult
 
-void BTAdvertisedDevice::parseEir(uint8_t* payload) {
-	uint8_t length;
-	uint8_t eir_type;
-	uint8_t sizeConsumed = 0;
-	bool finished = false;
-	setPayload(payload);
-
-	while(!finished) {
-		length = *payload;          // Retrieve the length of the record.
-		payload++;                  // Skip to type
-		sizeConsumed += 1 + length; // increase the size consumed.
-
-		if (length != 0) { // A length of 0 indicates that we have reached the end.
-			eir_type = *payload;
-			payload++;
-			length--;
-
-			char* pHex = BTUtils::buildHexData(nullptr, payload, length);
-			log_d("Type: 0x%.2x (%s), length: %d, data: %s",
-					eir_type, BTUtils::eirTypeToString(eir_type), length, pHex);
-			free(pHex);
-
-			switch(eir_type) {
-				case ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME: {   // eir Data Type: 0x08
-					setName(std::string(reinterpret_cast<char*>(payload), length));
-					break;
-				} // ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME
-
-				case ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME: {   // eir Data Type: 0x09
-					setName(std::string(reinterpret_cast<char*>(payload), length));
-					break;
-				} // ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME
-
-				case ESP_BT_EIR_TYPE_TX_POWER_LEVEL: {      
-					setTXPower(*payload);
-					break;
-				} // ESP_BLE_AD_TYPE_TX_PWR
-
-				case ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID :
-				case ESP_BT_EIR_TYPE_CMPL_16BITS_UUID: {   
-					for (int var = 0; var < length/2; ++var) {
-						setServiceUUID(BTUUID(*reinterpret_cast<uint16_t*>(payload+var*2)));
-					}
-					break;
-				} // ESP_BLE_AD_TYPE_16SRV_PART
-
-				case ESP_BT_EIR_TYPE_INCMPL_32BITS_UUID:
-				case ESP_BT_EIR_TYPE_CMPL_32BITS_UUID: {  
-					for (int var = 0; var < length/4; ++var) {
-						setServiceUUID(BTUUID(*reinterpret_cast<uint32_t*>(payload+var*4)));
-					}
-					break;
-				} // ESP_BLE_AD_TYPE_32SRV_PART
-
-				case ESP_BT_EIR_TYPE_INCMPL_128BITS_UUID: { // Adv Data Type: 0x07
-					setServiceUUID(BTUUID(payload, 16, false));
-					break;
-				} // ESP_BT_EIR_TYPE_INCMPL_128BITS_UUID
-
-				case ESP_BT_EIR_TYPE_CMPL_128BITS_UUID: { // Adv Data Type: 0x06
-					setServiceUUID(BTUUID(payload, 16, false));
-					break;
-				} // ESP_BT_EIR_TYPE_CMPL_128BITS_UUID
-
-				// See CSS Part A 1.4 Manufacturer Specific Data
-				case ESP_BT_EIR_TYPE_MANU_SPECIFIC: {
-					//setManufacturerData(std::string(reinterpret_cast<char*>(payload), length));
-					break;
-				} // ESP_BT_EIR_TYPE_MANU_SPECIFIC
-
-				
-				default: {
-					log_d("Unhandled type: eirType: %d - 0x%.2x", eir_type, eir_type);
-					break;
-				}
-			} // switch
-			payload += length;
-		} // Length <> 0
-
 
-		if (sizeConsumed >=31 || length == 0) {
-			finished = true;
-		}
-	} // !finished
-} // parseAdvertisement
+/**
+ * @brief Parse the extended inquiry response.
+ *
+ * The EIR is a buffer of up to 240 bytes, terminated early by a 0 length value.  Each entry in the
+ * buffer has the format:
+ * [length][type][data...]
+ *
+ * The length does not include itself but does include everything after it until the next record.
+ * The buffer is copied into the device and walked once: the walk builds the field index used by later
+ * lookups and hands every field to onEirField().
+ *
+ * https://www.bluetooth.com/specifications/assigned-numbers/generic-access-profile
+ *
+ * @param [in] payload The EIR.
+ * @param [in] length The size of the EIR, at most ESP_BT_GAP_EIR_DATA_LEN.
+ * @return False if a field was truncated.
+ */
+bool BTAdvertisedDevice::parseEir(const uint8_t* payload, size_t length) {
+	BT_PROFILE_SCOPE(BT_STAGE_PARSE_EIR);
+	memcpy(m_eir, payload, length);
+	m_eir_len = length;
+	return m_eirIndex.build(m_eir, m_eir_len, onEirField, this);
+} // parseEir
 
-bool BTAdvertisedDevice::get_name_from_eir(uint8_t *eir, uint8_t *bdname, uint8_t *bdname_len)
-{
-    uint8_t *rmt_bdname = NULL;
-    uint8_t rmt_bdname_len = 0;
 
-    if (!eir) {
-        return false;
-    }
+/**
+ * @brief Apply one EIR field to the device.  Names are resolved from the index afterwards.
+ */
+/* STATIC */ void BTAdvertisedDevice::onEirField(uint8_t type, const uint8_t* data, uint8_t length, void* pContext) {
+	BTAdvertisedDevice* pDevice = (BTAdvertisedDevice*)pContext;
+	log_d("Type: 0x%.2x (%s), length: %d", type, BTUtils::eirTypeToString(type), length);
+
+	switch(type) {
+		case ESP_BT_EIR_TYPE_TX_POWER_LEVEL: {
+			if (length >= 1) {
+				pDevice->setTXPower(*(int8_t*)data);
+			}
+			break;
+		} // ESP_BT_EIR_TYPE_TX_POWER_LEVEL
 
-    rmt_bdname = esp_bt_gap_resolve_eir_data(eir, ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME, &rmt_bdname_len);
-    if (!rmt_bdname) {
-        rmt_bdname = esp_bt_gap_resolve_eir_data(eir, ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME, &rmt_bdname_len);
-    }
+		case ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID:
+		case ESP_BT_EIR_TYPE_CMPL_16BITS_UUID: {
+			for (int var = 0; var < length/2; ++var) {
+				pDevice->setServiceUUID(BTUUID((uint16_t)(data[var*2] | (data[var*2+1] << 8))));
+			}
+			break;
+		} // ESP_BT_EIR_TYPE_CMPL_16BITS_UUID
+
+		case ESP_BT_EIR_TYPE_INCMPL_32BITS_UUID:
+		case ESP_BT_EIR_TYPE_CMPL_32BITS_UUID: {
+			for (int var = 0; var < length/4; ++var) {
+				const uint8_t* uuid = data + var*4;
+				pDevice->setServiceUUID(BTUUID((uint32_t)(uuid[0] | (uuid[1] << 8) | (uuid[2] << 16) | ((uint32_t)uuid[3] << 24))));
+			}
+			break;
+		} // ESP_BT_EIR_TYPE_CMPL_32BITS_UUID
 
-    if (rmt_bdname) {
-        if (rmt_bdname_len > ESP_BT_GAP_MAX_BDNAME_LEN) {
-            rmt_bdname_len = ESP_BT_GAP_MAX_BDNAME_LEN;
-        }
-
-        if (bdname) {
-            memcpy(bdname, rmt_bdname, rmt_bdname_len);
-            bdname[rmt_bdname_len] = '\0';
-        }
-        if (bdname_len) {
-            *bdname_len = rmt_bdname_len;
-        }
-        return true;
-    }
+		case ESP_BT_EIR_TYPE_INCMPL_128BITS_UUID:
+		case ESP_BT_EIR_TYPE_CMPL_128BITS_UUID: {
+			for (int var = 0; var < length/16; ++var) {
+				pDevice->setServiceUUID(BTUUID((uint8_t*)data + var*16, 16, false));
+			}
+			break;
+		} // ESP_BT_EIR_TYPE_CMPL_128BITS_UUID
 
-    return false;
-}
+		default: {
+			break;
+		}
+	} // switch
+} // onEirField
 
 
 /**
@@ -448,28 +458,28 @@ void BTAdvertisedDevice::setAdFlag(uint8_t adFlag) {
 } // setAdFlag
 
 
-/**
- * @brief Set the manufacturer data for this device.
- * @param [in] The discovered manufacturer data.
- */
-/*
-void BTAdvertisedDevice::setManufacturerData(std::string manufacturerData) {
-	m_manufacturerData     = manufacturerData;
-	m_haveManufacturerData = true;
-	char* pHex = BTUtils::buildHexData(nullptr, (uint8_t*)m_manufacturerData.data(), (uint8_t)m_manufacturerData.length());
-	log_d("- manufacturer data: %s", pHex);
-	free(pHex);
-} // setManufacturerData
-*/
-
 /**
  * @brief Set the name for this device.
- * @param [in] name The discovered name.
+ * @param [in] name The discovered name, not necessarily null terminated.
+ * @param [in] length The length of the name.
  */
-void BTAdvertisedDevice::setName(std::string name) {
-	m_name     = name;
+void BTAdvertisedDevice::setName(const uint8_t* name, size_t length) {
+	if (length > ESP_BT_GAP_MAX_BDNAME_LEN) {
+		length = ESP_BT_GAP_MAX_BDNAME_LEN;
+	}
+	if (m_pArena == nullptr) {
+		log_w("- setName(): no arena, name dropped");
+		return;
+	}
+	char* pName = (char*)m_pArena->allocate(length, 1);
+	if (pName == nullptr) {
+		return;
+	}
+	memcpy(pName, name, length);
+	m_name     = pName;
+	m_nameLen  = (uint8_t)length;
 	m_haveName = true;
-	log_d("- setName(): name: %s", m_name.c_str());
+	log_d("- setName(): name: %.*s", m_nameLen, m_name);
 } // setName
 
 
@@ -493,6 +503,79 @@ void BTAdvertisedDevice::setScan(BTScan* pScan) {
 } // setScan
 
 
+/**
+ * @brief Set the arena that the name and service UUIDs are carved from.
+ * @param [in] pArena The arena of the scan that found this device.
+ */
+void BTAdvertisedDevice::setArena(BTArena* pArena) {
+	m_pArena     = pArena;
+	m_arenaEpoch = pArena->getEpoch();
+} // setArena
+
+
+/**
+ * @brief Is the arena memory referenced by this device still alive?
+ */
+bool BTAdvertisedDevice::isArenaValid() {
+	return m_pArena != nullptr && m_pArena->getEpoch() == m_arenaEpoch;
+} // isArenaValid
+
+
+/**
+ * @brief Get the arena memory detach() needs for this device.
+ * @return The number of bytes, 0 if the device holds no scan arena memory.
+ */
+size_t BTAdvertisedDevice::getArenaBytes() {
+	if (m_pOwnedArena != nullptr || !isArenaValid()) {
+		return 0;
+	}
+	size_t bytes = m_haveName ? m_nameLen : 0;
+	if (m_haveServiceUUID) {
+		bytes += alignof(BTUUIDKey) + m_serviceUUIDCount * sizeof(BTUUIDKey);
+	}
+	return bytes;
+} // getArenaBytes
+
+
+/**
+ * @brief Move the name and service UUIDs out of the scan arena, so they outlive the next scan.
+ *
+ * Copies of the device share the new arena and keep it alive.  A device whose scan arena was
+ * already reset loses its name and service UUIDs.
+ *
+ * @param [in] pArena The arena to copy them to, see getArenaBytes().
+ */
+void BTAdvertisedDevice::detach(const std::shared_ptr<BTArena>& pArena) {
+	if (m_pOwnedArena != nullptr) {
+		return;
+	}
+	bool valid = isArenaValid();
+	setArena(pArena.get());
+	m_pOwnedArena = pArena;
+
+	char* pName = (valid && m_haveName) ? (char*)m_pArena->allocate(m_nameLen, 1) : nullptr;
+	if (pName != nullptr) {
+		memcpy(pName, m_name, m_nameLen);
+	} else {
+		m_nameLen  = 0;
+		m_haveName = false;
+	}
+	m_name = pName;
+
+	size_t     size  = m_serviceUUIDCount * sizeof(BTUUIDKey);
+	BTUUIDKey* pList = (valid && m_haveServiceUUID) ? (BTUUIDKey*)m_pArena->allocate(size, alignof(BTUUIDKey)) : nullptr;
+	if (pList != nullptr) {
+		memcpy(pList, m_serviceUUIDs, size);
+	} else {
+		m_serviceUUIDCount = 0;
+		m_uuidSignature    = 0;
+		m_haveLongUUID     = false;
+		m_haveServiceUUID  = false;
+	}
+	m_serviceUUIDs = pList;
+} // detach
+
+
 void BTAdvertisedDevice::setCod(uint32_t cod) {
 	if(esp_bt_gap_is_valid_cod(cod)){
 		m_cod = cod;
@@ -500,9 +583,9 @@ void BTAdvertisedDevice::setCod(uint32_t cod) {
 		log_d("- setCod(): cod: %d", m_cod);
 		
 		m_deviceType = deviceType(esp_bt_gap_get_cod_major_dev(cod));
-		log_d("- setCod(): deviceType: %s", m_deviceType.c_str());
+		log_d("- setCod(): deviceType: %s", m_deviceType);
 		m_serviceType = serviceType(esp_bt_gap_get_cod_srvc(cod));
-		log_d("- setCod(): serviceType: %s", m_serviceType.c_str());
+		log_d("- setCod(): serviceType: %s", m_serviceType);
 	}
 
 } // setScan
@@ -519,12 +602,59 @@ void BTAdvertisedDevice::setServiceUUID(const char* serviceUUID) {
 
 /**
  * @brief Set the Service UUID for this device.
+ *
+ * UUIDs are kept normalised, sorted and without duplicates so lookups are a binary search or a merge.
+ *
  * @param [in] serviceUUID The discovered serviceUUID
  */
 void BTAdvertisedDevice::setServiceUUID(BTUUID serviceUUID) {
-	m_serviceUUIDs.push_back(serviceUUID);
-	m_haveServiceUUID = true;
+	if (serviceUUID.bitSize() == 0) {
+		return;
+	}
 	log_d("- addServiceUUID(): serviceUUID: %s", serviceUUID.toString().c_str());
+	setServiceUUID(BTUUIDKey::fromUUID(serviceUUID));
+} // setServiceUUID
+
+
+/**
+ * @brief Add a service UUID that is already normalised, e.g. one found by service discovery.
+ * @param [in] key The UUID.
+ */
+void BTAdvertisedDevice::setServiceUUID(const BTUUIDKey& key) {
+	if (m_pArena == nullptr) {
+		log_w("- addServiceUUID(): no arena, UUID dropped");
+		return;
+	}
+	if (m_serviceUUIDCount == UINT8_MAX) {
+		return;
+	}
+	BTUUIDKey* pEnd  = m_serviceUUIDs + m_serviceUUIDCount;
+	BTUUIDKey* pSlot = std::lower_bound(m_serviceUUIDs, pEnd, key);
+	if (pSlot != pEnd && *pSlot == key) {
+		return;
+	}
+	size_t position = pSlot - m_serviceUUIDs;
+	size_t size     = m_serviceUUIDCount * sizeof(BTUUIDKey);
+	if (!m_pArena->extend(m_serviceUUIDs, size, size + sizeof(BTUUIDKey))) {
+		// Not the latest arena allocation any more, move the list.
+		BTUUIDKey* pList = (BTUUIDKey*)m_pArena->allocate(size + sizeof(BTUUIDKey), alignof(BTUUIDKey));
+		if (pList == nullptr) {
+			return;
+		}
+		if (size > 0) {
+			memcpy(pList, m_serviceUUIDs, size);
+		}
+		m_serviceUUIDs = pList;
+	}
+	memmove(m_serviceUUIDs + position + 1, m_serviceUUIDs + position, (m_serviceUUIDCount - position) * sizeof(BTUUIDKey));
+	m_serviceUUIDs[position] = key;
+	m_serviceUUIDCount++;
+	if (key.isShort()) {
+		m_uuidSignature |= key.signature();
+	} else {
+		m_haveLongUUID = true;
+	}
+	m_haveServiceUUID = true;
 } // setServiceUUID
 
 /**
@@ -557,34 +687,34 @@ void BTAdvertisedDevice::setTXPower(int8_t txPower) {
 	log_d("- txPower: %d", m_txPower);
 } // setTXPower
 
-std::string BTAdvertisedDevice::deviceType(uint32_t major_cod){ // enum esp_bt_cod_major_dev_t
+const char* BTAdvertisedDevice::deviceType(uint32_t major_cod){ // enum esp_bt_cod_major_dev_t
     switch (major_cod) {
-        case ESP_BT_COD_MAJOR_DEV_MISC:         return std::string("Miscellaneous");
-        case ESP_BT_COD_MAJOR_DEV_COMPUTER:     return std::string("Computer");
-        case ESP_BT_COD_MAJOR_DEV_PHONE:        return std::string("Phone");
-        case ESP_BT_COD_MAJOR_DEV_LAN_NAP:      return std::string("Network Access Point");
-        case ESP_BT_COD_MAJOR_DEV_AV:           return std::string("Audio/Video");
-        case ESP_BT_COD_MAJOR_DEV_PERIPHERAL:   return std::string("Peripheral");
-        case ESP_BT_COD_MAJOR_DEV_IMAGING:      return std::string("Imaging");
-        case ESP_BT_COD_MAJOR_DEV_WEARABLE:     return std::string("Wearable");
-        case ESP_BT_COD_MAJOR_DEV_TOY:          return std::string("Toy");
-        case ESP_BT_COD_MAJOR_DEV_HEALTH:       return std::string("Health");
-        case ESP_BT_COD_MAJOR_DEV_UNCATEGORIZED:return std::string("Uncategorized");
-        default:                                return std::string("Uncategorized");
+        case ESP_BT_COD_MAJOR_DEV_MISC:         return "Miscellaneous";
+        case ESP_BT_COD_MAJOR_DEV_COMPUTER:     return "Computer";
+        case ESP_BT_COD_MAJOR_DEV_PHONE:        return "Phone";
+        case ESP_BT_COD_MAJOR_DEV_LAN_NAP:      return "Network Access Point";
+        case ESP_BT_COD_MAJOR_DEV_AV:           return "Audio/Video";
+        case ESP_BT_COD_MAJOR_DEV_PERIPHERAL:   return "Peripheral";
+        case ESP_BT_COD_MAJOR_DEV_IMAGING:      return "Imaging";
+        case ESP_BT_COD_MAJOR_DEV_WEARABLE:     return "Wearable";
+        case ESP_BT_COD_MAJOR_DEV_TOY:          return "Toy";
+        case ESP_BT_COD_MAJOR_DEV_HEALTH:       return "Health";
+        case ESP_BT_COD_MAJOR_DEV_UNCATEGORIZED:return "Uncategorized";
+        default:                                return "Uncategorized";
     }
 }
 // TODO RETURN MULTIPLE RESULT
-std::string BTAdvertisedDevice::serviceType(uint32_t service_cod){ // enum esp_bt_cod_srvc_t
-    if (service_cod & ESP_BT_COD_SRVC_NONE)             return std::string("None indicates an invalid value");
-    if (service_cod & ESP_BT_COD_SRVC_LMTD_DISCOVER)    return std::string("Limited Discoverable Mode");
-    if ( service_cod & ESP_BT_COD_SRVC_POSITIONING)     return std::string("Positioning");
-    if ( service_cod & ESP_BT_COD_SRVC_NETWORKING)      return std::string("Networking");
-    if ( service_cod & ESP_BT_COD_SRVC_RENDERING)       return std::string("Rendering");
-    if ( service_cod & ESP_BT_COD_SRVC_CAPTURING)       return std::string("Capturing");
-    if ( service_cod & ESP_BT_COD_SRVC_AUDIO)           return std::string("Audio");
-    if ( service_cod & ESP_BT_COD_SRVC_TELEPHONY)       return std::string("Telephony");
-    if ( service_cod & ESP_BT_COD_SRVC_INFORMATION)     return std::string("Information");
-    return std::string("undefined");
+const char* BTAdvertisedDevice::serviceType(uint32_t service_cod){ // enum esp_bt_cod_srvc_t
+    if (service_cod & ESP_BT_COD_SRVC_NONE)             return "None indicates an invalid value";
+    if (service_cod & ESP_BT_COD_SRVC_LMTD_DISCOVER)    return "Limited Discoverable Mode";
+    if ( service_cod & ESP_BT_COD_SRVC_POSITIONING)     return "Positioning";
+    if ( service_cod & ESP_BT_COD_SRVC_NETWORKING)      return "Networking";
+    if ( service_cod & ESP_BT_COD_SRVC_RENDERING)       return "Rendering";
+    if ( service_cod & ESP_BT_COD_SRVC_CAPTURING)       return "Capturing";
+    if ( service_cod & ESP_BT_COD_SRVC_AUDIO)           return "Audio";
+    if ( service_cod & ESP_BT_COD_SRVC_TELEPHONY)       return "Telephony";
+    if ( service_cod & ESP_BT_COD_SRVC_INFORMATION)     return "Information";
+    return "undefined";
     
 }
 
@@ -597,7 +727,8 @@ std::string BTAdvertisedDevice::toString() {
 	std::stringstream ss;
 	ss << "Name: " << getName() << ", Address: " << getAddress().toString();
 	if (haveManufacturerData()) {
-		char *pHex = BTUtils::buildHexData(nullptr, (uint8_t*)getManufacturerData().data(), getManufacturerData().length());
+		std::string manufacturerData = getManufacturerData();
+		char *pHex = BTUtils::buildHexData(nullptr, (uint8_t*)manufacturerData.data(), manufacturerData.length());
 		ss << ", manufacturer data: " << pHex;
 		free(pHex);
 	}
@@ -611,12 +742,80 @@ std::string BTAdvertisedDevice::toString() {
 } // toString
 
 uint8_t* BTAdvertisedDevice::getPayload() {
-	return m_payload;
+	return m_eir_len != 0 ? m_eir : nullptr;
 }
 
-void BTAdvertisedDevice::setPayload(uint8_t* payload) {
-	m_payload = payload;
-}
+/**
+ * @brief Get the length of the EIR returned by getPayload().
+ */
+size_t BTAdvertisedDevice::getPayloadLength() {
+	return m_eir_len;
+} // getPayloadLength
+
+
+/**
+ * @brief Get a hash of the EIR and class of device, which changes when the device changes what it
+ * advertises.  See BTEirIndex::hash().
+ */
+uint32_t BTAdvertisedDevice::getEirHash() {
+	return BTEirIndex::hash(m_eir, m_eir_len, m_haveCod ? m_cod : 0);
+} // getEirHash
+
+
+/**
+ * @brief Get the time at which the device was seen.
+ * @return Milliseconds since boot when the scan recorded this device.
+ */
+uint32_t BTAdvertisedDevice::getTimestamp() {
+	return m_timestamp;
+} // getTimestamp
+
+
+void BTAdvertisedDevice::setTimestamp(uint32_t timestamp) {
+	m_timestamp = timestamp;
+} // setTimestamp
+
+
+/**
+ * @brief Get the transports the device was seen on during the scan.
+ * @return BT_TRANSPORT_CLASSIC and/or BT_TRANSPORT_BLE.
+ */
+uint8_t BTAdvertisedDevice::getTransports() {
+	return m_transports;
+} // getTransports
+
+
+#ifdef BT_HAVE_BLE
+/**
+ * @brief Parse a BLE scan result.
+ *
+ * Advertising data and scan response share the EIR [length][type][data...] format, so they are
+ * concatenated into the EIR buffer and go through the same single pass parser.
+ *
+ * @param [in] scan_rst The scan result reported by the BLE GAP.
+ * @return False if the advertising data was malformed.
+ */
+bool BTAdvertisedDevice::parseBleResult(esp_ble_gap_cb_param_t::ble_scan_result_evt_param* scan_rst) {
+	BT_PROFILE_SCOPE(BT_STAGE_PARSE_DISC_RESULT);
+	m_transports |= BT_TRANSPORT_BLE;
+	setRSSI(scan_rst->rssi);
+
+	size_t length = scan_rst->adv_data_len + scan_rst->scan_rsp_len;
+	if (length > sizeof(scan_rst->ble_adv)) {
+		log_w("Malformed advertisement of %d bytes", (int)length);
+		return false;
+	}
+	bool valid = parseEir(scan_rst->ble_adv, length);
+
+	const uint8_t* name;
+	uint8_t        nameLen;
+	if ((name = m_eirIndex.find(m_eir, ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME, &nameLen)) != nullptr ||
+		(name = m_eirIndex.find(m_eir, ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME, &nameLen)) != nullptr) {
+		setName(name, nameLen);
+	}
+	return valid;
+} // parseBleResult
+#endif
 
 
 
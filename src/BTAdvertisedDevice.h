@@ -19,22 +19,44 @@
 #if defined(CONFIG_BT_ENABLED)
 #include "esp_gap_bt_api.h"
 
+// BLE scanning needs a controller running in dual mode.
+#if defined(CONFIG_BTDM_CONTROLLER_MODE_BTDM) && !defined(BT_NO_BLE)
+  #define BT_HAVE_BLE
+  #include "esp_gap_ble_api.h"
+#endif
+
 #include <map>
+#include <memory>
 
 #include "BTScan.h"
 #include "BTAddress.h"
+#include "BTArena.h"
+#include "BTEirIndex.h"
+#include "BTManufacturerData.h"
 #include "BTUtils.h"
 #include "BTUUID.h"
+#include "BTUUIDSet.h"
+
+// Transports a device was seen on, see BTAdvertisedDevice::getTransports().
+#define BT_TRANSPORT_CLASSIC 0x01
+#define BT_TRANSPORT_BLE     0x02
 
 class BTAdvertisedDevice;
 class BTAdvertisedDeviceCallbacks;
 class BTClient;
 class BTScan;
+class BTArena;
 /**
  * @brief A representation of a %BLE advertised device found by a scan.
  *
  * When we perform a %BLE scan, the result will be a set of devices that are advertising.  This
  * class provides a model of a detected device.
+ *
+ * The name and service UUIDs are carved from the arena of the scan that found the device.  Devices
+ * read through BTScan::getResultsRef() or handed to the callbacks keep them until that scan is
+ * restarted or its results cleared; after that haveName() and haveServiceUUID() return false.  The
+ * copies made by BTScan::getResults(), the blocking BTScan::start() and BTScanResults::getDevice()
+ * carry their own copy and keep them for as long as they live.
  */
 class BTAdvertisedDevice {
 public:
@@ -42,6 +64,7 @@ public:
 
 	BTAddress  	getAddress();
 	std::string getManufacturerData();
+	BTManufacturerData getManufacturerDataView();
 	std::string getName();
 	uint32_t 	getCod();
 	std::string getServiceType();
@@ -53,9 +76,15 @@ public:
 	BTUUID      getServiceUUID();
 	int8_t      getTXPower();
 	uint8_t* 	getPayload();
+	size_t      getPayloadLength();
+	uint32_t    getEirHash();
+	uint32_t    getTimestamp();
+	uint8_t     getTransports();
 
 
 	bool		isAdvertisingService(BTUUID uuid);
+	bool        isAdvertisingAny(BTUUIDQuery& query);
+	bool        isAdvertisingAll(BTUUIDQuery& query);
 	bool        haveManufacturerData();
 	bool        haveName();
 	bool        haveRSSI();
@@ -68,28 +97,43 @@ public:
 
 private:
 	friend class BTScan;
-	void parseDiscResult(esp_bt_gap_cb_param_t::disc_res_param*  disc_res);
+	friend class BTScanResults;
+	friend class BTWireEncoder;
+	friend class BTJsonWriter;
+	friend class BTScanColumns;
+	friend class BTDeviceTracker;
+	friend class BTArenaStorage;
+	friend class BTServiceDiscovery;
+	friend struct BTDedupMerge;
+	template <class Storage, class Dedup, class Dispatch> friend class BTScanCore;
+	bool parseDiscResult(esp_bt_gap_cb_param_t::disc_res_param*  disc_res);
+#ifdef BT_HAVE_BLE
+	bool parseBleResult(esp_ble_gap_cb_param_t::ble_scan_result_evt_param* scan_rst);
+#endif
 	void setAddress(BTAddress address);
 	void setAdFlag(uint8_t adFlag);
-	void setManufacturerData(std::string manufacturerData);
-	void setName(std::string name);
+	void setName(const uint8_t* name, size_t length);
 	void setRSSI(int8_t rssi);
 	void setScan(BTScan* pScan);
+	void setArena(BTArena* pArena);
+	bool isArenaValid();
+	size_t getArenaBytes();
+	void detach(const std::shared_ptr<BTArena>& pArena);
 	void setServiceData(std::string data);
 	void setServiceUUID(const char* serviceUUID);
 	void setServiceUUID(BTUUID serviceUUID);
+	void setServiceUUID(const BTUUIDKey& key);
 	void setTXPower(int8_t txPower);
 	void setCod(uint32_t cod);
-	void setPayload(uint8_t* payload);
+	void setTimestamp(uint32_t timestamp);
 
-	bool get_name_from_eir(uint8_t *eir, uint8_t *bdname, uint8_t *bdname_len);
-	void parseEir(uint8_t* payload);
+	bool parseEir(const uint8_t* payload, size_t length);
+	static void onEirField(uint8_t type, const uint8_t* data, uint8_t length, void* pContext);
 
-	std::string deviceType(uint32_t major_cod);
-	std::string serviceType(uint32_t service_cod);
+	static const char* deviceType(uint32_t major_cod);
+	static const char* serviceType(uint32_t service_cod);
 
 
-	bool m_haveManufacturerData;
 	bool m_haveName;
 	bool m_haveRSSI;
 	bool m_haveServiceData;
@@ -100,22 +144,29 @@ private:
 
 	BTAddress   m_address = BTAddress((uint8_t*)"\0\0\0\0\0\0");
 	uint8_t     m_adFlag;
-	std::string m_manufacturerData;
-	std::string m_name;
+	const char* m_name;             // Arena memory, not null terminated.
+	uint8_t     m_nameLen;
 	BTScan*     m_pScan;
+	BTArena*    m_pArena;
+	uint32_t    m_arenaEpoch;
+	std::shared_ptr<BTArena> m_pOwnedArena;   // Of a detached copy, shared with the copies made from it.
 	uint8_t 	m_bdname_len;
     uint8_t 	m_eir_len;
     int 		m_rssi;
     uint32_t 	m_cod;
     uint8_t 	m_eir[ESP_BT_GAP_EIR_DATA_LEN];
-    uint8_t 	m_bdname[ESP_BT_GAP_MAX_BDNAME_LEN + 1];
+	BTEirIndex  m_eirIndex;
 	int8_t      m_txPower;
 	std::string m_serviceData;
-	std::string m_deviceType;
-	std::string m_serviceType;
-	std::vector<BTUUID> m_serviceUUIDs;
+	const char* m_deviceType;
+	const char* m_serviceType;
+	BTUUIDKey*  m_serviceUUIDs;         // Arena memory, sorted.
+	uint8_t     m_serviceUUIDCount;
+	uint64_t    m_uuidSignature;        // Signature of the 16 bit service UUIDs, see BTUUIDQuery.
+	bool        m_haveLongUUID;         // Some service UUID is not a 16 bit one.
 	BTUUID     m_serviceDataUUID;
-	uint8_t*	m_payload;
+	uint32_t    m_timestamp;
+	uint8_t     m_transports;           // BT_TRANSPORT_* flags.
 	
 
 };
@@ -137,6 +188,33 @@ public:
 	 * device that was found.  During any individual scan, a device will only be detected one time.
 	 */
 	virtual void onResult(BTAdvertisedDevice advertisedDevice) = 0;
+
+	/**
+	 * @brief Called when a device is evicted from full scan results.
+	 *
+	 * Only happens when a maximum number of results has been set with BTScan::setMaxResults().
+	 * Override it to spill the record elsewhere before its storage is reused.
+	 */
+	virtual void onEvicted(BTAdvertisedDevice& advertisedDevice) {}
+
+	/**
+	 * @brief Called when the SDP services of a stored device have been discovered.
+	 *
+	 * Only happens when BTScan::setServiceDiscovery() is in use, after the scan.  The services are
+	 * already merged into the device.
+	 */
+	virtual void onServicesDiscovered(BTAdvertisedDevice& advertisedDevice) {}
+
+	/**
+	 * @brief Called before onResult() for a device on the scan watchlist, see BTScan::getWatchlist().
+	 */
+	virtual void onWatchlistHit(BTAdvertisedDevice& advertisedDevice) {}
+
+	/**
+	 * @brief Called before onResult() for a device not on a non empty watchlist.  Never called in
+	 * match-only mode, where those results are dropped.
+	 */
+	virtual void onWatchlistMiss(BTAdvertisedDevice& advertisedDevice) {}
 };
 
 #endif /* CONFIG_BT_ENABLED */
@@ -0,0 +1,93 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BTAllocator.h"
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+#include <stdlib.h>
+
+#ifdef ESP_PLATFORM
+#include <esp_heap_caps.h>
+#endif
+
+
+void* BTHeapAllocator::allocate(size_t size) {
+	return malloc(size);
+} // allocate
+
+
+void BTHeapAllocator::deallocate(void* ptr) {
+	free(ptr);
+} // deallocate
+
+
+#ifdef ESP_PLATFORM
+/**
+ * @brief Create an allocator for a class of heap memory.
+ * @param [in] caps The heap capabilities required, e.g. MALLOC_CAP_SPIRAM.
+ * @param [in] fallback Use any 8 bit capable memory when the requested kind is exhausted.
+ */
+BTCapsAllocator::BTCapsAllocator(uint32_t caps, bool fallback) {
+	m_caps     = caps;
+	m_fallback = fallback;
+} // BTCapsAllocator
+
+
+void* BTCapsAllocator::allocate(size_t size) {
+	void* ptr = heap_caps_malloc(size, m_caps);
+	if (ptr == nullptr && m_fallback) {
+		ptr = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+	}
+	return ptr;
+} // allocate
+
+
+void BTCapsAllocator::deallocate(void* ptr) {
+	heap_caps_free(ptr);
+} // deallocate
+#endif
+
+
+/**
+ * @brief Get the allocator for memory that must stay in internal RAM.
+ */
+/* STATIC */ BTAllocator* BTAllocator::getInternal() {
+#ifdef ESP_PLATFORM
+	static BTCapsAllocator internal(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT, false);
+	return &internal;
+#else
+	return getDefault();
+#endif
+} // getInternal
+
+
+/**
+ * @brief Get the plain malloc/free allocator.
+ */
+/* STATIC */ BTAllocator* BTAllocator::getDefault() {
+	static BTHeapAllocator heap;
+	return &heap;
+} // getDefault
+
+
+#ifdef BT_HAVE_PSRAM
+/**
+ * @brief Get the PSRAM allocator.
+ */
+/* STATIC */ BTAllocator* BTAllocator::getPsram() {
+	static BTCapsAllocator psram(MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT, true);
+	return &psram;
+} // getPsram
+#endif
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
@@ -0,0 +1,159 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_ALLOCATOR_H_
+#define _BT_ALLOCATOR_H_
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <type_traits>
+
+#if defined(CONFIG_SPIRAM_SUPPORT) || defined(CONFIG_ESP32_SPIRAM_SUPPORT)
+#define BT_HAVE_PSRAM 1
+#endif
+
+/**
+ * @brief A source of memory for scan storage.
+ *
+ * Scan results are split in two tiers: the hot index (address lookup, recency list, RSSI and
+ * last-seen) always comes from internal RAM, while full device records, RSSI histories and tracked
+ * devices come from the record allocator, which can be pointed at PSRAM.
+ */
+class BTAllocator {
+public:
+	virtual ~BTAllocator() {}
+	virtual void* allocate(size_t size) = 0;
+	virtual void  deallocate(void* ptr) = 0;
+
+	static BTAllocator* getInternal();   // Internal RAM, used for hot data.
+	static BTAllocator* getDefault();    // Plain malloc/free.
+#ifdef BT_HAVE_PSRAM
+	static BTAllocator* getPsram();      // PSRAM, falling back to internal RAM when it is exhausted.
+#endif
+};
+
+
+/**
+ * @brief Allocate with malloc/free.  This is the stand-in used on a host.
+ */
+class BTHeapAllocator : public BTAllocator {
+public:
+	void* allocate(size_t size);
+	void  deallocate(void* ptr);
+};
+
+
+/**
+ * @brief Allocate from heap regions with the given capabilities, e.g. MALLOC_CAP_SPIRAM.
+ */
+#ifdef ESP_PLATFORM
+class BTCapsAllocator : public BTAllocator {
+public:
+	BTCapsAllocator(uint32_t caps, bool fallback);
+	void* allocate(size_t size);
+	void  deallocate(void* ptr);
+
+private:
+	uint32_t m_caps;
+	bool     m_fallback;
+};
+#endif
+
+
+/**
+ * @brief Hand out a single static buffer, for builds that must not touch the heap.
+ *
+ * Only one allocation can be live at a time, which is what a BTArena or a fixed size table needs;
+ * anything beyond that fails rather than falling back to the heap.
+ */
+template <size_t Size>
+class BTStaticAllocator : public BTAllocator {
+public:
+	BTStaticAllocator() : m_inUse(false) {}
+	void* allocate(size_t size) {
+		if (m_inUse || size > Size) {
+			return nullptr;
+		}
+		m_inUse = true;
+		return m_buffer;
+	}
+	void deallocate(void* ptr) {
+		if (ptr == m_buffer) {
+			m_inUse = false;
+		}
+	}
+
+private:
+	alignas(8) uint8_t m_buffer[Size];
+	bool               m_inUse;
+};
+
+
+/**
+ * @brief Adapt a BTAllocator to the allocator interface of the standard containers.
+ */
+template <typename T>
+class BTStlAllocator {
+public:
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	BTStlAllocator() : m_pAllocator(BTAllocator::getDefault()) {}
+	explicit BTStlAllocator(BTAllocator* pAllocator) : m_pAllocator(pAllocator) {}
+	template <typename U>
+	BTStlAllocator(const BTStlAllocator<U>& other) : m_pAllocator(other.getAllocator()) {}
+
+	T* allocate(size_t n) {
+		void* p = m_pAllocator->allocate(n * sizeof(T));
+		if (p == nullptr) {
+#ifdef __cpp_exceptions
+			throw std::bad_alloc();
+#else
+			abort();
+#endif
+		}
+		return static_cast<T*>(p);
+	}
+	void deallocate(T* p, size_t) {
+		m_pAllocator->deallocate(p);
+	}
+	BTAllocator* getAllocator() const {
+		return m_pAllocator;
+	}
+
+private:
+	BTAllocator* m_pAllocator;
+};
+
+template <typename T, typename U>
+bool operator==(const BTStlAllocator<T>& a, const BTStlAllocator<U>& b) {
+	return a.getAllocator() == b.getAllocator();
+}
+
+template <typename T, typename U>
+bool operator!=(const BTStlAllocator<T>& a, const BTStlAllocator<U>& b) {
+	return a.getAllocator() != b.getAllocator();
+}
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
+#endif /* _BT_ALLOCATOR_H_ */
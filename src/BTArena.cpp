@@ -0,0 +1,195 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include "BTArena.h"
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32-hal-log.h"
+#endif
+
+static const size_t minOverflowBlock = 1024;
+
+
+BTArena::BTArena() {
+	m_pAllocator    = BTAllocator::getDefault();
+	m_base          = nullptr;
+	m_capacity      = 0;
+	m_pOverflow     = nullptr;
+	m_highWater     = 0;
+	m_overflowCount = 0;
+	m_epoch         = 0;
+	reset();
+} // BTArena
+
+
+BTArena::~BTArena() {
+	release();
+	if (m_base != nullptr) {
+		m_pAllocator->deallocate(m_base);
+	}
+} // ~BTArena
+
+
+/**
+ * @brief Free the overflow blocks.
+ */
+void BTArena::release() {
+	while (m_pOverflow != nullptr) {
+		Block* pNext = m_pOverflow->next;
+		m_pAllocator->deallocate(m_pOverflow);
+		m_pOverflow = pNext;
+	}
+} // release
+
+
+/**
+ * @brief Make sure the main block holds at least size bytes, then reset the arena.
+ *
+ * The main block is only reallocated when it is too small or the allocator changes.
+ *
+ * @param [in] size The size of the main block.
+ * @param [in] pAllocator Where the blocks come from.
+ * @return False if the main block could not be allocated.
+ */
+bool BTArena::reserve(size_t size, BTAllocator* pAllocator) {
+	if (size > m_capacity || pAllocator != m_pAllocator) {
+		release();
+		if (m_base != nullptr) {
+			m_pAllocator->deallocate(m_base);
+		}
+		m_pAllocator = pAllocator;
+		m_base       = (uint8_t*)m_pAllocator->allocate(size);
+		m_capacity   = (m_base != nullptr) ? size : 0;
+		if (m_base == nullptr) {
+			log_e("reserve: unable to allocate %u bytes", (unsigned)size);
+		}
+	}
+	reset();
+	return m_base != nullptr;
+} // reserve
+
+
+/**
+ * @brief Carve memory out of the arena.
+ * @param [in] size The number of bytes.
+ * @param [in] align The required alignment, a power of two.
+ * @return The memory, or nullptr if even an overflow block could not be allocated.
+ */
+void* BTArena::allocate(size_t size, size_t align) {
+	uintptr_t addr = (uintptr_t)(m_current + m_offset);
+	size_t    pad  = (align - (addr & (align - 1))) & (align - 1);
+
+	if (m_current == nullptr || m_offset + pad + size > m_currentSize) {
+		size_t blockSize = (size + align > minOverflowBlock) ? size + align : minOverflowBlock;
+		Block* pBlock    = (Block*)m_pAllocator->allocate(sizeof(Block) + blockSize);
+		if (pBlock == nullptr) {
+			log_e("allocate: arena exhausted");
+			return nullptr;
+		}
+		pBlock->next  = m_pOverflow;
+		pBlock->size  = blockSize;
+		m_pOverflow   = pBlock;
+		m_current     = (uint8_t*)(pBlock + 1);
+		m_currentSize = blockSize;
+		m_offset      = 0;
+		m_overflowCount++;
+		addr = (uintptr_t)m_current;
+		pad  = (align - (addr & (align - 1))) & (align - 1);
+	}
+
+	void* ptr = m_current + m_offset + pad;
+	m_offset += pad + size;
+	m_used   += pad + size;
+	if (m_used > m_highWater) {
+		m_highWater = m_used;
+	}
+	m_last = ptr;
+	return ptr;
+} // allocate
+
+
+/**
+ * @brief Grow the most recent allocation in place.
+ * @param [in] ptr The allocation to grow.
+ * @param [in] oldSize Its current size.
+ * @param [in] newSize The size wanted.
+ * @return False if ptr is not the latest allocation or the block has no room left.
+ */
+bool BTArena::extend(void* ptr, size_t oldSize, size_t newSize) {
+	if (ptr == nullptr || ptr != m_last || newSize < oldSize) {
+		return false;
+	}
+	size_t start = (uint8_t*)ptr - m_current;
+	if (start + newSize > m_currentSize) {
+		return false;
+	}
+	m_offset = start + newSize;
+	m_used  += newSize - oldSize;
+	if (m_used > m_highWater) {
+		m_highWater = m_used;
+	}
+	return true;
+} // extend
+
+
+/**
+ * @brief Discard everything allocated from the arena.
+ */
+void BTArena::reset() {
+	release();
+	m_current     = m_base;
+	m_currentSize = m_capacity;
+	m_offset      = 0;
+	m_used        = 0;
+	m_last        = nullptr;
+	m_epoch++;
+} // reset
+
+
+/**
+ * @brief Get the number of resets so far.  Memory obtained under another epoch is gone.
+ */
+uint32_t BTArena::getEpoch() {
+	return m_epoch;
+} // getEpoch
+
+
+size_t BTArena::getCapacity() {
+	return m_capacity;
+} // getCapacity
+
+
+size_t BTArena::getUsed() {
+	return m_used;
+} // getUsed
+
+
+/**
+ * @brief Get the most memory ever in use between two resets.
+ */
+size_t BTArena::getHighWater() {
+	return m_highWater;
+} // getHighWater
+
+
+/**
+ * @brief Get how many overflow blocks had to be allocated so far.
+ */
+uint32_t BTArena::getOverflowCount() {
+	return m_overflowCount;
+} // getOverflowCount
+
+#endif /* CONFIG_BT_ENABLED */
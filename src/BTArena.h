@@ -0,0 +1,77 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_ARENA_H_
+#define _BT_ARENA_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "BTAllocator.h"
+
+#ifndef BT_SCAN_ARENA_SIZE
+  #define BT_SCAN_ARENA_SIZE 8192
+#endif
+
+/**
+ * @brief A bump pointer arena holding the names and UUID lists of one scan.
+ *
+ * Allocation moves a pointer forward; nothing is freed individually.  reset() discards everything
+ * at once and bumps the epoch, so holders of arena memory can tell that their data is gone.
+ *
+ * When the main block is exhausted an overflow block is taken from the allocator so no data is
+ * lost.  Overflow blocks are released on reset() and the main block is grown to the high water
+ * mark on the next reserve(), so a steady workload settles at zero allocations per sighting.
+ */
+class BTArena {
+public:
+	BTArena();
+	~BTArena();
+	bool     reserve(size_t size, BTAllocator* pAllocator);
+	void*    allocate(size_t size, size_t align = 4);
+	bool     extend(void* ptr, size_t oldSize, size_t newSize);
+	void     reset();
+	uint32_t getEpoch();
+	size_t   getCapacity();
+	size_t   getUsed();
+	size_t   getHighWater();
+	uint32_t getOverflowCount();
+
+private:
+	struct Block {
+		Block* next;
+		size_t size;
+	};
+
+	void release();
+
+	BTAllocator* m_pAllocator;
+	uint8_t*     m_base;
+	size_t       m_capacity;
+	uint8_t*     m_current;        // Block being carved, the main block or the newest overflow block.
+	size_t       m_currentSize;
+	size_t       m_offset;
+	void*        m_last;           // Most recent allocation, the only one extend() can grow.
+	Block*       m_pOverflow;
+	size_t       m_used;
+	size_t       m_highWater;
+	uint32_t     m_overflowCount;
+	uint32_t     m_epoch;
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_ARENA_H_ */
@@ -0,0 +1,490 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BTCapture.h"
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+#ifdef ESP_PLATFORM
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#endif
+
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32-hal-log.h"
+#endif
+
+#ifndef log_e
+#define log_e(...)
+#endif
+#ifndef log_w
+#define log_w(...)
+#endif
+#ifndef log_d
+#define log_d(...)
+#endif
+
+static const uint8_t captureMagic[4] = { 'B', 'T', 'C', 'P' };
+
+
+static uint64_t nowMicros() {
+#ifdef ESP_PLATFORM
+	return (uint64_t)esp_timer_get_time();
+#else
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+} // nowMicros
+
+
+static void sleepMicros(uint64_t micros) {
+#ifdef ESP_PLATFORM
+	vTaskDelay((micros / 1000) / portTICK_PERIOD_MS);
+#else
+	std::this_thread::sleep_for(std::chrono::microseconds(micros));
+#endif
+} // sleepMicros
+
+
+/**
+ * @brief Append an unsigned LEB128 value to a buffer.
+ * @return The number of bytes written.
+ */
+static size_t putVarint(uint8_t* target, uint64_t value) {
+	size_t i = 0;
+	while (value >= 0x80) {
+		target[i++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	target[i++] = (uint8_t)value;
+	return i;
+} // putVarint
+
+
+/**
+ * @brief The number of bytes putVarint() writes for a value.
+ */
+static size_t varintLength(uint64_t value) {
+	size_t i = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		i++;
+	}
+	return i;
+} // varintLength
+
+
+/**
+ * @brief Read an unsigned LEB128 value from a file.
+ * @return False on end of file or a malformed value.
+ */
+static bool readVarint(FILE* file, uint64_t* value) {
+	uint64_t result = 0;
+	for (int shift = 0; shift < 70; shift += 7) {
+		int c = fgetc(file);
+		if (c == EOF) {
+			return false;
+		}
+		result |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			*value = result;
+			return true;
+		}
+	}
+	return false;
+} // readVarint
+
+
+/**
+ * @brief Read an unsigned LEB128 value from memory.
+ * @return The number of bytes consumed or 0 if the value runs past the end.
+ */
+static size_t getVarint(const uint8_t* source, size_t length, uint32_t* value) {
+	uint32_t result = 0;
+	for (size_t i = 0; i < length && i < 5; i++) {
+		result |= (uint32_t)(source[i] & 0x7f) << (7 * i);
+		if ((source[i] & 0x80) == 0) {
+			*value = result;
+			return i + 1;
+		}
+	}
+	return 0;
+} // getVarint
+
+
+BTCaptureWriter::BTCaptureWriter() {
+	m_file         = nullptr;
+	m_ring         = nullptr;
+	m_ringSize     = 0;
+	m_head         = 0;
+	m_tail         = 0;
+	m_closing      = false;
+	m_lastMicros   = 0;
+	m_recordCount  = 0;
+	m_droppedCount = 0;
+} // BTCaptureWriter
+
+
+BTCaptureWriter::~BTCaptureWriter() {
+	close();
+} // ~BTCaptureWriter
+
+
+/**
+ * @brief Create a capture file, write its header and start the drain thread.
+ * @param [in] path The file to create.  Any existing file is truncated.
+ * @param [in] ringSize Bytes buffered ahead of the file, rounded up to a power of two.
+ * @return True if the file is ready to record.
+ */
+bool BTCaptureWriter::open(const char* path, size_t ringSize) {
+	close();
+	size_t size = 64;
+	while (size < ringSize) {
+		size <<= 1;
+	}
+	m_ring = new (std::nothrow) uint8_t[size];
+	if (m_ring == nullptr) {
+		log_e("open: no memory for a %d byte capture buffer", (int)size);
+		return false;
+	}
+	m_file = fopen(path, "wb");
+	if (m_file == nullptr) {
+		log_e("open: unable to create %s", path);
+		delete[] m_ring;
+		m_ring = nullptr;
+		return false;
+	}
+	uint8_t header[8] = { 0 };
+	memcpy(header, captureMagic, sizeof(captureMagic));
+	header[4] = BT_CAPTURE_VERSION;
+	fwrite(header, 1, sizeof(header), m_file);
+
+	m_ringSize     = size;
+	m_head         = 0;
+	m_tail         = 0;
+	m_closing      = false;
+	m_lastMicros   = nowMicros();
+	m_recordCount  = 0;
+	m_droppedCount = 0;
+	m_drainThread  = std::thread(&BTCaptureWriter::drain, this);
+	return true;
+} // open
+
+
+/**
+ * @brief Write out everything recorded so far and close the file.
+ */
+void BTCaptureWriter::close() {
+	if (m_file == nullptr) {
+		return;
+	}
+	m_closing = true;
+	m_drainWakeup.notify_one();
+	m_drainThread.join();
+	fclose(m_file);
+	m_file = nullptr;
+	delete[] m_ring;
+	m_ring = nullptr;
+	if (m_droppedCount > 0) {
+		log_w("close: %d events dropped, the capture buffer was full", m_droppedCount.load());
+	}
+} // close
+
+
+bool BTCaptureWriter::isOpen() {
+	return m_file != nullptr;
+} // isOpen
+
+
+/**
+ * @brief Copy bytes into the ring, wrapping at its end.
+ * @param [in] head The ring position to write at.
+ * @return The position following the copy.
+ */
+size_t BTCaptureWriter::put(size_t head, const void* data, size_t length) {
+	size_t index = head & (m_ringSize - 1);
+	size_t first = std::min(length, m_ringSize - index);
+	memcpy(m_ring + index, data, first);
+	memcpy(m_ring, (const uint8_t*)data + first, length - first);
+	return head + length;
+} // put
+
+
+/**
+ * @brief Queue one GAP event for the capture.
+ *
+ * Only encodes into the ring, the file is written by the drain thread.  The event is dropped when
+ * the ring does not have room for it.
+ *
+ * @param [in] event The event type.
+ * @param [in] param The event parameters as delivered by the stack.
+ */
+void BTCaptureWriter::record(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param) {
+	if (m_ring == nullptr) {
+		return;
+	}
+	size_t  payloadLen = 0;
+	int     numProp    = 0;
+	switch (event) {
+		case ESP_BT_GAP_DISC_RES_EVT: {
+			numProp    = std::min(param->disc_res.num_prop, 255);
+			payloadLen = ESP_BD_ADDR_LEN + 1;
+			for (int i = 0; i < numProp; i++) {
+				size_t len = (size_t)std::max(param->disc_res.prop[i].len, 0);
+				payloadLen += 1 + varintLength(len) + len;
+			}
+			break;
+		}
+		case ESP_BT_GAP_DISC_STATE_CHANGED_EVT: {
+			payloadLen = 1;
+			break;
+		}
+		default: {
+			break;
+		}
+	} // switch
+
+	uint64_t now = nowMicros();
+	uint8_t  header[16];
+	size_t   headerLen = putVarint(header, now - m_lastMicros);
+	header[headerLen++] = (uint8_t)event;
+	headerLen += putVarint(header + headerLen, payloadLen);
+
+	size_t head = m_head.load(std::memory_order_relaxed);
+	size_t used = head - m_tail.load(std::memory_order_acquire);
+	if (payloadLen > BT_CAPTURE_MAX_PAYLOAD || used + headerLen + payloadLen > m_ringSize) {
+		m_droppedCount++;
+		return;
+	}
+	m_lastMicros = now;
+
+	head = put(head, header, headerLen);
+	switch (event) {
+		case ESP_BT_GAP_DISC_RES_EVT: {
+			uint8_t count = (uint8_t)numProp;
+			head = put(head, param->disc_res.bda, ESP_BD_ADDR_LEN);
+			head = put(head, &count, 1);
+			for (int i = 0; i < numProp; i++) {
+				esp_bt_gap_dev_prop_t* p = param->disc_res.prop + i;
+				size_t  len = (size_t)std::max(p->len, 0);
+				uint8_t propHeader[6];
+				propHeader[0] = (uint8_t)p->type;
+				head = put(head, propHeader, 1 + putVarint(propHeader + 1, len));
+				head = put(head, p->val, len);
+			}
+			break;
+		}
+		case ESP_BT_GAP_DISC_STATE_CHANGED_EVT: {
+			uint8_t state = (uint8_t)param->disc_st_chg.state;
+			head = put(head, &state, 1);
+			break;
+		}
+		default: {
+			break;
+		}
+	} // switch
+	m_head.store(head, std::memory_order_release);
+	m_recordCount++;
+	m_drainWakeup.notify_one();
+} // record
+
+
+/**
+ * @brief Body of the drain thread: write whatever the ring holds until close() is called.
+ *
+ * record() does not take m_drainLock, so a wakeup can be missed; the timed wait bounds how long
+ * queued events then wait for the file.
+ */
+void BTCaptureWriter::drain() {
+	for (;;) {
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		size_t head = m_head.load(std::memory_order_acquire);
+		if (head == tail) {
+			if (m_closing) {
+				break;
+			}
+			std::unique_lock<std::mutex> lock(m_drainLock);
+			m_drainWakeup.wait_for(lock, std::chrono::milliseconds(BT_CAPTURE_DRAIN_MS));
+			continue;
+		}
+		size_t index  = tail & (m_ringSize - 1);
+		size_t length = std::min(head - tail, m_ringSize - index);
+		fwrite(m_ring + index, 1, length, m_file);
+		m_tail.store(tail + length, std::memory_order_release);
+	}
+	fflush(m_file);
+} // drain
+
+
+uint32_t BTCaptureWriter::getRecordCount() {
+	return m_recordCount;
+} // getRecordCount
+
+
+/**
+ * @brief Events dropped because the ring was full or the payload too large.
+ */
+uint32_t BTCaptureWriter::getDroppedCount() {
+	return m_droppedCount;
+} // getDroppedCount
+
+
+BTCaptureReplayer::BTCaptureReplayer() {
+	m_file = nullptr;
+} // BTCaptureReplayer
+
+
+BTCaptureReplayer::~BTCaptureReplayer() {
+	close();
+} // ~BTCaptureReplayer
+
+
+/**
+ * @brief Open a capture file and validate its header.
+ * @param [in] path The capture file.
+ * @return True if the file is a capture of a version we understand.
+ */
+bool BTCaptureReplayer::open(const char* path) {
+	close();
+	m_file = fopen(path, "rb");
+	if (m_file == nullptr) {
+		log_e("open: unable to read %s", path);
+		return false;
+	}
+	uint8_t header[8];
+	if (fread(header, 1, sizeof(header), m_file) != sizeof(header) ||
+		memcmp(header, captureMagic, sizeof(captureMagic)) != 0 ||
+		header[4] > BT_CAPTURE_VERSION) {
+		log_e("open: %s is not a supported capture", path);
+		close();
+		return false;
+	}
+	return true;
+} // open
+
+
+void BTCaptureReplayer::close() {
+	if (m_file != nullptr) {
+		fclose(m_file);
+		m_file = nullptr;
+	}
+} // close
+
+
+/**
+ * @brief Decode the next record of the capture.
+ *
+ * Property values of a DISC_RES event point into storage owned by the replayer and stay
+ * valid until the next call.
+ *
+ * @param [out] event The event type.
+ * @param [out] param The event parameters.
+ * @param [out] deltaMicros Time elapsed between the previous record and this one.
+ * @return False at the end of the capture or on a malformed record.
+ */
+bool BTCaptureReplayer::next(esp_bt_gap_cb_event_t* event, esp_bt_gap_cb_param_t* param, uint64_t* deltaMicros) {
+	if (m_file == nullptr) {
+		return false;
+	}
+	uint64_t delta;
+	uint64_t payloadLen;
+	if (!readVarint(m_file, &delta)) {
+		return false;   // Clean end of capture.
+	}
+	int type = fgetc(m_file);
+	if (type == EOF || !readVarint(m_file, &payloadLen) || payloadLen > sizeof(m_payload) ||
+		fread(m_payload, 1, payloadLen, m_file) != payloadLen) {
+		log_e("next: truncated record");
+		return false;
+	}
+
+	memset(param, 0, sizeof(*param));
+	*event       = (esp_bt_gap_cb_event_t)type;
+	*deltaMicros = delta;
+
+	switch (*event) {
+		case ESP_BT_GAP_DISC_RES_EVT: {
+			if (payloadLen < ESP_BD_ADDR_LEN + 1) {
+				return false;
+			}
+			memcpy(param->disc_res.bda, m_payload, ESP_BD_ADDR_LEN);
+			uint8_t count = m_payload[ESP_BD_ADDR_LEN];
+			size_t  pos   = ESP_BD_ADDR_LEN + 1;
+			int     num   = 0;
+			if (count > BT_CAPTURE_MAX_PROPS) {
+				log_w("next: %d of %d properties dropped", count - BT_CAPTURE_MAX_PROPS, count);
+			}
+			for (uint8_t i = 0; i < count && pos < payloadLen; i++) {
+				uint8_t  propType = m_payload[pos++];
+				uint32_t len;
+				size_t   used = getVarint(m_payload + pos, payloadLen - pos, &len);
+				if (used == 0 || pos + used + len > payloadLen) {
+					log_e("next: malformed property");
+					return false;
+				}
+				pos += used;
+				if (num < BT_CAPTURE_MAX_PROPS) {
+					m_props[num].type = (esp_bt_gap_dev_prop_type_t)propType;
+					m_props[num].len  = (int)len;
+					m_props[num].val  = m_payload + pos;
+					num++;
+				}
+				pos += len;
+			}
+			param->disc_res.num_prop = num;
+			param->disc_res.prop     = m_props;
+			break;
+		}
+		case ESP_BT_GAP_DISC_STATE_CHANGED_EVT: {
+			if (payloadLen >= 1) {
+				param->disc_st_chg.state = (esp_bt_gap_discovery_state_t)m_payload[0];
+			}
+			break;
+		}
+		default: {
+			break;
+		}
+	} // switch
+	return true;
+} // next
+
+
+/**
+ * @brief Feed every remaining record of the capture to a GAP handler.
+ * @param [in] handler The handler that receives the events.
+ * @param [in] realTime Reproduce the recorded spacing between events, otherwise replay as fast as possible.
+ * @return The number of events replayed.
+ */
+uint32_t BTCaptureReplayer::replay(GapHandler handler, bool realTime) {
+	esp_bt_gap_cb_event_t event;
+	esp_bt_gap_cb_param_t param;
+	uint64_t delta;
+	uint32_t count = 0;
+
+	while (next(&event, &param, &delta)) {
+		if (realTime && delta > 0) {
+			sleepMicros(delta);
+		}
+		handler(event, &param);
+		count++;
+	}
+	log_d("replay: %d events", count);
+	return count;
+} // replay
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
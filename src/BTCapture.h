@@ -0,0 +1,112 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_CAPTURE_H_
+#define _BT_CAPTURE_H_
+
+// Only the GAP types are needed, so a host build can supply esp_gap_bt_api.h from stand-in headers
+// and replay captures as test fixtures.
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+#include "esp_gap_bt_api.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#define BT_CAPTURE_VERSION     2    // 2: the time delta is a 64 bit varint.
+#define BT_CAPTURE_MAX_PROPS   8    // Properties kept per replayed DISC_RES record.
+#define BT_CAPTURE_MAX_PAYLOAD 1024 // Largest payload of a record, larger events are dropped.
+#define BT_CAPTURE_RING_SIZE   8192 // Bytes buffered between the GAP task and the file.
+#define BT_CAPTURE_DRAIN_MS    100  // Longest the drain thread sleeps without a wakeup.
+
+/**
+ * @brief Record GAP events to a versioned binary capture file.
+ *
+ * The file starts with an 8 byte header: "BTCP", the format version, a flags byte and
+ * two reserved bytes.  Every event is then stored as:
+ *
+ * ```
+ * [varint: micros since previous record][event][varint: payload length][payload...]
+ * ```
+ *
+ * A ESP_BT_GAP_DISC_RES_EVT payload is the 6 byte address, num_prop and for each property
+ * [type][varint: len][val...].  A ESP_BT_GAP_DISC_STATE_CHANGED_EVT payload is the state byte.
+ * Any other event is recorded with an empty payload.
+ *
+ * record() runs on the Bluedroid task, so it only encodes the event into a ring buffer allocated
+ * by open(); a drain thread writes the ring to the file.  When the ring is full the event is
+ * dropped and counted rather than blocking the stack.  record() has a single producer: stop
+ * feeding the writer (BTDevice::setCaptureWriter(nullptr)) before close().
+ */
+class BTCaptureWriter {
+public:
+	BTCaptureWriter();
+	~BTCaptureWriter();
+	bool     open(const char* path, size_t ringSize = BT_CAPTURE_RING_SIZE);
+	void     close();
+	bool     isOpen();
+	void     record(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param);
+	uint32_t getRecordCount();
+	uint32_t getDroppedCount();
+
+private:
+	void     drain();
+	size_t   put(size_t head, const void* data, size_t length);
+
+	FILE*                   m_file;
+	uint8_t*                m_ring;
+	size_t                  m_ringSize;      // A power of two.
+	std::atomic<size_t>     m_head;          // Bytes ever queued, only stored by record().
+	std::atomic<size_t>     m_tail;          // Bytes ever written, only stored by the drain thread.
+	std::atomic<bool>       m_closing;
+	std::thread             m_drainThread;
+	std::mutex              m_drainLock;
+	std::condition_variable m_drainWakeup;
+	uint64_t                m_lastMicros;
+	std::atomic<uint32_t>   m_recordCount;
+	std::atomic<uint32_t>   m_droppedCount;
+};
+
+
+/**
+ * @brief Read a capture file back and feed its events to a GAP handler.
+ *
+ * The replayer only depends on the GAP types and stdio so captures can be replayed on a host
+ * as deterministic fixtures.
+ */
+class BTCaptureReplayer {
+public:
+	typedef void (*GapHandler)(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param);
+
+	BTCaptureReplayer();
+	~BTCaptureReplayer();
+	bool     open(const char* path);
+	void     close();
+	bool     next(esp_bt_gap_cb_event_t* event, esp_bt_gap_cb_param_t* param, uint64_t* deltaMicros);
+	uint32_t replay(GapHandler handler, bool realTime);
+
+private:
+	FILE*                 m_file;
+	esp_bt_gap_dev_prop_t m_props[BT_CAPTURE_MAX_PROPS];
+	uint8_t               m_payload[BT_CAPTURE_MAX_PAYLOAD];
+};
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
+#endif /* _BT_CAPTURE_H_ */
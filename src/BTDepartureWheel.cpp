@@ -0,0 +1,340 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BTDepartureWheel.h"
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+#include <algorithm>
+
+static const uint32_t level0Slots = 1 << BT_DEPARTURE_LEVEL0_BITS;
+static const uint32_t levelSlots  = 1 << BT_DEPARTURE_LEVEL_BITS;
+static const uint32_t levelMask   = levelSlots - 1;
+static const uint32_t level1Shift = BT_DEPARTURE_LEVEL0_BITS;
+static const uint32_t level2Shift = BT_DEPARTURE_LEVEL0_BITS + BT_DEPARTURE_LEVEL_BITS;
+static const uint32_t horizon     = 1 << (BT_DEPARTURE_LEVEL0_BITS + 2 * BT_DEPARTURE_LEVEL_BITS);
+
+const uint32_t BTDepartureWheel::NONE;
+const size_t   BTDepartureWheel::SLOTS;
+
+
+/**
+ * @param [in] tickMs The resolution of deadlines.
+ * @param [in] defaultTimeoutMs The timeout of every device class until setClassTimeout().
+ */
+BTDepartureWheel::BTDepartureWheel(uint32_t tickMs, uint32_t defaultTimeoutMs) {
+	m_tickMs     = std::max(tickMs, (uint32_t)1);
+	m_pCallbacks = nullptr;
+	for (size_t i = 0; i < BT_DEPARTURE_CLASSES; i++) {
+		m_timeouts[i] = std::max(defaultTimeoutMs / m_tickMs, (uint32_t)1);
+	}
+	clear();
+} // BTDepartureWheel
+
+
+void BTDepartureWheel::setCallbacks(BTDepartureCallbacks* pCallbacks) {
+	m_pCallbacks = pCallbacks;
+} // setCallbacks
+
+
+/**
+ * @brief Get the major device class of a class of device, e.g. 1 for computers, 2 for phones.
+ */
+/* STATIC */ uint8_t BTDepartureWheel::majorClassOf(uint32_t cod) {
+	return (uint8_t)((cod >> 8) & 0x1f);
+} // majorClassOf
+
+
+/**
+ * @brief Set the timeout of a major device class.  Applies from the next sighting of each device.
+ * @param [in] majorClass The major device class, see majorClassOf().
+ * @param [in] timeoutMs The time a device may go unseen before it departs.
+ */
+void BTDepartureWheel::setClassTimeout(uint8_t majorClass, uint32_t timeoutMs) {
+	std::lock_guard<std::mutex> guard(m_lock);
+	m_timeouts[majorClass % BT_DEPARTURE_CLASSES] = std::max(timeoutMs / m_tickMs, (uint32_t)1);
+} // setClassTimeout
+
+
+/**
+ * @brief Give a tracked device its own timeout, overriding its class until it departs.
+ * @param [in] address The packed address.
+ * @param [in] timeoutMs The time the device may go unseen before it departs.
+ * @return False if the device is not tracked.
+ */
+bool BTDepartureWheel::setDeviceTimeout(uint64_t address, uint32_t timeoutMs) {
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::unordered_map<uint64_t, uint32_t>::iterator it = m_index.find(address);
+	if (it == m_index.end()) {
+		return false;
+	}
+	Node& node    = m_nodes[it->second];
+	uint32_t seen = node.deadline - node.timeout;
+	node.timeout  = std::max(timeoutMs / m_tickMs, (uint32_t)1);
+	node.deadline = seen + node.timeout;
+	node.custom   = true;
+	if ((int32_t)(node.deadline - node.filed) < 0) {
+		unlink(it->second);
+		file(it->second);
+	}
+	return true;
+} // setDeviceTimeout
+
+
+uint32_t BTDepartureWheel::toTicks(uint64_t ms) {
+	return (uint32_t)(ms / m_tickMs);
+} // toTicks
+
+
+/**
+ * @brief Put a node in the slot of its deadline, relative to the next tick to process.
+ */
+void BTDepartureWheel::file(uint32_t index) {
+	Node&    node  = m_nodes[index];
+	int32_t  ahead = (int32_t)(node.deadline - m_next);
+	uint32_t at    = node.deadline;
+	size_t   slot;
+	if (ahead < 0) {
+		at   = m_next;
+		slot = at & (level0Slots - 1);
+	} else if ((uint32_t)ahead < level0Slots) {
+		slot = at & (level0Slots - 1);
+	} else if ((uint32_t)ahead < (level0Slots << BT_DEPARTURE_LEVEL_BITS)) {
+		slot = level0Slots + ((at >> level1Shift) & levelMask);
+	} else {
+		if ((uint32_t)ahead >= horizon) {
+			at = m_next + horizon - 1;   // Filed again from there.
+		}
+		slot = level0Slots + levelSlots + ((at >> level2Shift) & levelMask);
+	}
+	node.filed = at;
+	node.slot  = (uint16_t)slot;
+	node.prev  = NONE;
+	node.next  = m_heads[slot];
+	if (node.next != NONE) {
+		m_nodes[node.next].prev = index;
+	}
+	m_heads[slot] = index;
+} // file
+
+
+void BTDepartureWheel::unlink(uint32_t index) {
+	Node& node = m_nodes[index];
+	if (node.prev != NONE) {
+		m_nodes[node.prev].next = node.next;
+	} else {
+		m_heads[node.slot] = node.next;
+	}
+	if (node.next != NONE) {
+		m_nodes[node.next].prev = node.prev;
+	}
+} // unlink
+
+
+void BTDepartureWheel::release(uint32_t index) {
+	m_index.erase(m_nodes[index].address);
+	m_nodes[index].next = m_free;
+	m_free = index;
+} // release
+
+
+/**
+ * @brief Record a sighting, pushing the device's deadline back.  O(1).
+ * @param [in] address The packed address.
+ * @param [in] nowMs The time of the sighting, on the clock given to advance().
+ * @param [in] majorClass The major device class, see majorClassOf().
+ * @return True if the device was not tracked yet.
+ */
+bool BTDepartureWheel::touch(uint64_t address, uint64_t nowMs, uint8_t majorClass) {
+	uint32_t now = toTicks(nowMs);
+	majorClass %= BT_DEPARTURE_CLASSES;
+	std::lock_guard<std::mutex> guard(m_lock);
+	if (!m_started) {
+		m_next    = now;
+		m_started = true;
+	}
+
+	std::unordered_map<uint64_t, uint32_t>::iterator it = m_index.find(address);
+	if (it != m_index.end()) {
+		Node& node = m_nodes[it->second];
+		if (!node.custom) {
+			node.majorClass = majorClass;
+			node.timeout    = m_timeouts[majorClass];
+		}
+		node.deadline = now + node.timeout;
+		if ((int32_t)(node.deadline - node.filed) < 0) {   // Only when the timeout got shorter.
+			unlink(it->second);
+			file(it->second);
+		}
+		return false;
+	}
+
+	uint32_t index;
+	if (m_free != NONE) {
+		index  = m_free;
+		m_free = m_nodes[index].next;
+	} else {
+		index = m_nodes.size();
+		m_nodes.push_back(Node());
+	}
+	Node& node      = m_nodes[index];
+	node.address    = address;
+	node.majorClass = majorClass;
+	node.custom     = false;
+	node.timeout    = m_timeouts[majorClass];
+	node.deadline   = now + node.timeout;
+	file(index);
+	m_index[address] = index;
+	return true;
+} // touch
+
+
+/**
+ * @brief Move the nodes of an upper level slot down, now that the wheel reached it.
+ */
+void BTDepartureWheel::cascade(size_t slot) {
+	uint32_t index = m_heads[slot];
+	m_heads[slot]  = NONE;
+	while (index != NONE) {
+		uint32_t next = m_nodes[index].next;
+		file(index);
+		index = next;
+	}
+} // cascade
+
+
+/**
+ * @brief Process the level 0 slot of the current tick: devices past their deadline depart, the
+ * others were seen since they were filed and are filed again.
+ */
+void BTDepartureWheel::expireSlot(size_t slot, std::vector<BTDeparture>& departures) {
+	uint32_t index = m_heads[slot];
+	m_heads[slot]  = NONE;
+	while (index != NONE) {
+		Node&    node = m_nodes[index];
+		uint32_t next = node.next;
+		if ((int32_t)(node.deadline - m_next) <= 0) {
+			BTDeparture departure;
+			departure.address    = node.address;
+			departure.lastSeenMs = (uint64_t)(node.deadline - node.timeout) * m_tickMs;
+			departure.majorClass = node.majorClass;
+			departures.push_back(departure);
+			release(index);
+		} else {
+			file(index);
+		}
+		index = next;
+	}
+} // expireSlot
+
+
+/**
+ * @brief Hand the oldest batch of departures to the callbacks, with the wheel unlocked.
+ * @return The number of departures handed over.
+ */
+size_t BTDepartureWheel::report(std::vector<BTDeparture>& departures, std::unique_lock<std::mutex>& guard) {
+	size_t count = std::min(departures.size(), (size_t)BT_DEPARTURE_BATCH);
+	if (m_pCallbacks != nullptr) {
+		std::vector<BTDeparture> batch(departures.begin(), departures.begin() + count);
+		guard.unlock();
+		m_pCallbacks->onDepartures(batch.data(), count);
+		guard.lock();
+	}
+	departures.erase(departures.begin(), departures.begin() + count);
+	return count;
+} // report
+
+
+/**
+ * @brief Turn the wheel up to a time and report the departures, in batches.
+ *
+ * Costs one slot per elapsed tick, plus the departures and cascades.  When no device is tracked the
+ * wheel jumps straight to the time.
+ *
+ * @param [in] nowMs The time, on the clock given to touch().
+ * @return The number of departures.
+ */
+size_t BTDepartureWheel::advance(uint64_t nowMs) {
+	uint32_t                     target = toTicks(nowMs);
+	size_t                       total  = 0;
+	std::vector<BTDeparture>     departures;
+	std::unique_lock<std::mutex> guard(m_lock);
+	if (!m_started) {
+		m_next    = target;
+		m_started = true;
+	}
+
+	while ((int32_t)(target - m_next) >= 0) {
+		if (m_index.empty()) {
+			m_next = target + 1;
+			break;
+		}
+		size_t slot = m_next & (level0Slots - 1);
+		if (slot == 0) {
+			size_t slot1 = (m_next >> level1Shift) & levelMask;
+			cascade(level0Slots + slot1);
+			if (slot1 == 0) {
+				cascade(level0Slots + levelSlots + ((m_next >> level2Shift) & levelMask));
+			}
+		}
+		expireSlot(slot, departures);
+		m_next++;
+		if (departures.size() >= BT_DEPARTURE_BATCH) {
+			total += report(departures, guard);
+		}
+	}
+	while (!departures.empty()) {
+		total += report(departures, guard);
+	}
+	return total;
+} // advance
+
+
+/**
+ * @brief Stop tracking a device without reporting it.
+ * @return False if it was not tracked.
+ */
+bool BTDepartureWheel::forget(uint64_t address) {
+	std::lock_guard<std::mutex> guard(m_lock);
+	std::unordered_map<uint64_t, uint32_t>::iterator it = m_index.find(address);
+	if (it == m_index.end()) {
+		return false;
+	}
+	uint32_t index = it->second;
+	unlink(index);
+	release(index);
+	return true;
+} // forget
+
+
+/**
+ * @brief Stop tracking every device.  The clock restarts at the next touch() or advance().
+ */
+void BTDepartureWheel::clear() {
+	std::lock_guard<std::mutex> guard(m_lock);
+	m_nodes.clear();
+	m_index.clear();
+	m_free    = NONE;
+	m_next    = 0;
+	m_started = false;
+	for (size_t i = 0; i < SLOTS; i++) {
+		m_heads[i] = NONE;
+	}
+} // clear
+
+
+size_t BTDepartureWheel::getCount() {
+	std::lock_guard<std::mutex> guard(m_lock);
+	return m_index.size();
+} // getCount
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
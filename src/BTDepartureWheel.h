@@ -0,0 +1,125 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_DEPARTURE_WHEEL_H_
+#define _BT_DEPARTURE_WHEEL_H_
+
+// Plain C++11 like BTPresence, so it can be driven by a simulated clock on a host.
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+#define BT_DEPARTURE_CLASSES      32     // One per major device class of the CoD.
+#define BT_DEPARTURE_BATCH        32     // Most departures per callback.
+#define BT_DEPARTURE_LEVEL0_BITS  8
+#define BT_DEPARTURE_LEVEL_BITS   6      // Of each level above the first.
+#define BT_DEPARTURE_LEVELS       3
+
+/**
+ * @brief A device that was not seen for its timeout.
+ */
+struct BTDeparture {
+	uint64_t address;
+	uint64_t lastSeenMs;   // To the tick.
+	uint8_t  majorClass;
+};
+
+
+class BTDepartureCallbacks {
+public:
+	virtual ~BTDepartureCallbacks() {}
+	/**
+	 * @brief Called with the devices that left, at most BT_DEPARTURE_BATCH at a time.
+	 *
+	 * Called from advance(), without the wheel locked, so the wheel may be used from here.
+	 */
+	virtual void onDepartures(const BTDeparture* departures, size_t count) = 0;
+};
+
+
+/**
+ * @brief Tell when devices leave, with a timeout per device class or per device.
+ *
+ * A hierarchical hashed timing wheel: 256 one tick slots, then two levels of 64 slots each 64 times
+ * coarser, for deadlines up to 2^20 ticks ahead.  Devices are intrusive list nodes in the slot of
+ * their deadline; further deadlines cascade down a level as the wheel turns, the way Linux timers do.
+ *
+ * A sighting only pushes the device's deadline back and leaves the node where it is; when the slot
+ * comes up the node is filed again under its new deadline.  So a sighting is O(1) with no list
+ * operations, and a tick costs one slot plus, every 256 ticks, one cascade, however many devices are
+ * tracked.
+ *
+ * Time only moves when advance() is called, with the caller's clock: a timer on a node, a simulated
+ * clock on a host.  Use BTScan::setDepartureWheel() to feed it every sighting of a scan.
+ */
+class BTDepartureWheel {
+public:
+	BTDepartureWheel(uint32_t tickMs = 1000, uint32_t defaultTimeoutMs = 120000);
+
+	void     setCallbacks(BTDepartureCallbacks* pCallbacks);
+	void     setClassTimeout(uint8_t majorClass, uint32_t timeoutMs);
+	bool     setDeviceTimeout(uint64_t address, uint32_t timeoutMs);
+	bool     touch(uint64_t address, uint64_t nowMs, uint8_t majorClass = 0);
+	size_t   advance(uint64_t nowMs);
+	bool     forget(uint64_t address);
+	void     clear();
+	size_t   getCount();
+
+	static uint8_t majorClassOf(uint32_t cod);
+
+private:
+	static const uint32_t NONE = 0xffffffff;
+	static const size_t   SLOTS = (1 << BT_DEPARTURE_LEVEL0_BITS) + (BT_DEPARTURE_LEVELS - 1) * (1 << BT_DEPARTURE_LEVEL_BITS);
+
+	struct Node {
+		uint64_t address;
+		uint32_t deadline;   // In ticks.
+		uint32_t filed;      // The tick of the slot the node is in.
+		uint32_t timeout;    // In ticks.
+		uint32_t prev;
+		uint32_t next;
+		uint16_t slot;
+		uint8_t  majorClass;
+		bool     custom;     // The timeout was set with setDeviceTimeout().
+	};
+
+	uint32_t toTicks(uint64_t ms);
+	void     file(uint32_t index);
+	void     unlink(uint32_t index);
+	void     release(uint32_t index);
+	void     cascade(size_t slot);
+	void     expireSlot(size_t slot, std::vector<BTDeparture>& departures);
+	size_t   report(std::vector<BTDeparture>& departures, std::unique_lock<std::mutex>& guard);
+
+	uint32_t                               m_tickMs;
+	uint32_t                               m_timeouts[BT_DEPARTURE_CLASSES];   // In ticks.
+	BTDepartureCallbacks*                  m_pCallbacks;
+	std::vector<Node>                      m_nodes;
+	uint32_t                               m_free;      // Head of the free nodes, chained by next.
+	uint32_t                               m_heads[SLOTS];
+	uint32_t                               m_next;      // The next tick to process.
+	bool                                   m_started;
+	std::unordered_map<uint64_t, uint32_t> m_index;     // Packed address to node.
+	std::mutex                             m_lock;
+};
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
+#endif /* _BT_DEPARTURE_WHEEL_H_ */
@@ -34,12 +34,15 @@
 #include <esp_gatt_common_api.h>// ESP32 BLE
 #include <esp_err.h>           // ESP32 ESP-IDF
 #include <esp_log.h>           // ESP32 ESP-IDF
+#include <string.h>
 #include <map>                 // Part of C++ Standard library
 #include <sstream>             // Part of C++ Standard library
 #include <iomanip>             // Part of C++ Standard library
 
 #include "BTDevice.h"
 #include "GeneralUtils.h"
+#include <esp_timer.h>
+#include "BTProfiler.h"
 #ifdef ARDUINO_ARCH_ESP32
 #include "esp32-hal-log.h"
 #include "esp32-hal-bt.h"
@@ -51,6 +54,13 @@
  */
 //BLEServer* BLEDevice::m_pServer = nullptr;
 BTScan*   BTDevice::m_pScan   = nullptr;
+BTCaptureWriter* BTDevice::m_pCaptureWriter = nullptr;
+bool       BTDevice::m_standby           = false;
+bool       BTDevice::m_bleMemoryReleased = false;
+uint32_t   BTDevice::m_initTimeMs        = 0;
+std::string BTDevice::m_deviceName;
+BTDevice::GapHandlerSlot BTDevice::m_gapHandlers[ESP_BT_GAP_EVT_MAX][BT_GAP_MAX_HANDLERS];
+FreeRTOS::Semaphore      BTDevice::m_gapHandlersLock = FreeRTOS::Semaphore("GapHandlers");
 //BLEClient* BLEDevice::m_pClient = nullptr;
 bool       BT_initialized          = false;   // Have we been initialized?
 //esp_ble_sec_act_t 	BLEDevice::m_securityLevel = (esp_ble_sec_act_t)0;
@@ -188,32 +198,166 @@ bool       BT_initialized          = false;   // Have we been initialized?
 */
 
 /**
- * @brief Handle GAP events.
+ * @brief Handle GAP events, passing each to the handlers registered for it.
  */
 /* STATIC */ void BTDevice::gapEventHandler(
 	esp_bt_gap_cb_event_t event,
 	esp_bt_gap_cb_param_t *param) {
 
-    /*
-	if (BLEDevice::m_pServer != nullptr) {
-		BLEDevice::m_pServer->handleGAPEvent(event, param);
+	BT_PROFILE_SCOPE(BT_STAGE_GAP_CALLBACK);
+	if (BTDevice::m_pCaptureWriter != nullptr) {
+		BTDevice::m_pCaptureWriter->record(event, param);
+	}
+	if (BTDevice::m_pScan != nullptr) {
+		m_pScan->m_metrics.inc(m_pScan->m_metrics.eventsReceived);   // Every event, consumed or not.
+	}
+	if ((uint32_t)event >= ESP_BT_GAP_EVT_MAX) {
+		return;
 	}
 
-	if (BLEDevice::m_pClient != nullptr) {
-		BLEDevice::m_pClient->handleGAPEvent(event, param);
+	GapHandlerSlot* slots = m_gapHandlers[event];
+	for (size_t i = 0; i < BT_GAP_MAX_HANDLERS; i++) {
+		BTGapHandler handler = slots[i].handler.load(std::memory_order_acquire);
+		if (handler == nullptr) {
+			continue;
+		}
+		int64_t start = esp_timer_get_time();
+		handler(event, param, slots[i].pArg);
+		uint32_t elapsedUs = (uint32_t)(esp_timer_get_time() - start);
+
+		// Only written from here, on the Bluedroid task, so the maximum needs no compare and swap.
+		slots[i].totalUs.fetch_add(elapsedUs, std::memory_order_relaxed);
+		if (elapsedUs > slots[i].maxUs.load(std::memory_order_relaxed)) {
+			slots[i].maxUs.store(elapsedUs, std::memory_order_relaxed);
+		}
+		slots[i].calls.fetch_add(1, std::memory_order_relaxed);
 	}
-    */
+} // gapEventHandler
 
-	if (BTDevice::m_pScan != nullptr) {
-		BTDevice::getScan()->handleGAPEvent(event, param);
+
+/**
+ * @brief Pass the events the scan consumes to it.
+ */
+/* STATIC */ void BTDevice::scanGapEventHandler(
+	esp_bt_gap_cb_event_t  event,
+	esp_bt_gap_cb_param_t* param,
+	void*                  pArg) {
+	((BTScan*)pArg)->handleGAPEvent(event, param);
+} // scanGapEventHandler
+
+
+/**
+ * @brief Add a consumer of a classic GAP event.
+ *
+ * Events are dispatched by a table lookup, to the handlers of the event in the order of their slots,
+ * with no allocation.  The time spent in each handler is kept, see getGapHandlerStats().  Handlers
+ * run on the Bluedroid task and hold up every other GAP event, so they must not block.
+ *
+ * @param [in] event The event.
+ * @param [in] handler The handler.
+ * @param [in] pArg Passed to the handler, so one handler can serve several objects.
+ * @return False if the handler is already registered for the event, or the event has
+ * BT_GAP_MAX_HANDLERS handlers.
+ */
+/* STATIC */ bool BTDevice::registerGapHandler(esp_bt_gap_cb_event_t event, BTGapHandler handler, void* pArg) {
+	if ((uint32_t)event >= ESP_BT_GAP_EVT_MAX || handler == nullptr) {
+		return false;
+	}
+	GapHandlerSlot* slots = m_gapHandlers[event];
+	GapHandlerSlot* pFree = nullptr;
+	m_gapHandlersLock.take("registerGapHandler");
+	for (size_t i = 0; i < BT_GAP_MAX_HANDLERS; i++) {
+		BTGapHandler current = slots[i].handler.load(std::memory_order_relaxed);
+		if (current == handler && slots[i].pArg == pArg) {
+			m_gapHandlersLock.give();
+			return false;
+		}
+		if (current == nullptr && pFree == nullptr) {
+			pFree = &slots[i];
+		}
 	}
+	if (pFree != nullptr) {
+		pFree->pArg = pArg;
+		pFree->calls.store(0, std::memory_order_relaxed);
+		pFree->totalUs.store(0, std::memory_order_relaxed);
+		pFree->maxUs.store(0, std::memory_order_relaxed);
+		pFree->handler.store(handler, std::memory_order_release);   // Publishes pArg with it.
+	}
+	m_gapHandlersLock.give();
+	if (pFree == nullptr) {
+		log_e("registerGapHandler: event %d already has %d handlers", event, BT_GAP_MAX_HANDLERS);
+		return false;
+	}
+	return true;
+} // registerGapHandler
 
-	/*
-	 * Security events:
-	 */
+
+/**
+ * @brief Remove a consumer of a classic GAP event.
+ *
+ * An event being dispatched while this runs may still reach the handler, so pArg must outlive it by
+ * one event.
+ *
+ * @return False if the handler was not registered for the event.
+ */
+/* STATIC */ bool BTDevice::unregisterGapHandler(esp_bt_gap_cb_event_t event, BTGapHandler handler, void* pArg) {
+	if ((uint32_t)event >= ESP_BT_GAP_EVT_MAX) {
+		return false;
+	}
+	bool found = false;
+	GapHandlerSlot* slots = m_gapHandlers[event];
+	m_gapHandlersLock.take("unregisterGapHandler");
+	for (size_t i = 0; i < BT_GAP_MAX_HANDLERS; i++) {
+		if (slots[i].handler.load(std::memory_order_relaxed) == handler && slots[i].pArg == pArg) {
+			slots[i].handler.store(nullptr, std::memory_order_release);
+			found = true;
+			break;
+		}
+	}
+	m_gapHandlersLock.give();
+	return found;
+} // unregisterGapHandler
 
 
-} // gapEventHandler
+/**
+ * @brief Get the calls to a GAP handler and the time spent in it, since it was registered.
+ * @return False if the handler is not registered for the event.
+ */
+/* STATIC */ bool BTDevice::getGapHandlerStats(esp_bt_gap_cb_event_t event, BTGapHandler handler, void* pArg, BTGapHandlerStats* pStats) {
+	if ((uint32_t)event >= ESP_BT_GAP_EVT_MAX || pStats == nullptr) {
+		return false;
+	}
+	bool found = false;
+	GapHandlerSlot* slots = m_gapHandlers[event];
+	m_gapHandlersLock.take("getGapHandlerStats");
+	for (size_t i = 0; i < BT_GAP_MAX_HANDLERS; i++) {
+		if (slots[i].handler.load(std::memory_order_relaxed) == handler && slots[i].pArg == pArg) {
+			pStats->calls   = slots[i].calls.load(std::memory_order_relaxed);
+			pStats->totalUs = slots[i].totalUs.load(std::memory_order_relaxed);
+			pStats->maxUs   = slots[i].maxUs.load(std::memory_order_relaxed);
+			found = true;
+			break;
+		}
+	}
+	m_gapHandlersLock.give();
+	return found;
+} // getGapHandlerStats
+
+
+#ifdef BT_HAVE_BLE
+/**
+ * @brief Handle BLE GAP events, used by dual mode scans.
+ */
+/* STATIC */ void BTDevice::bleGapEventHandler(
+	esp_gap_ble_cb_event_t  event,
+	esp_ble_gap_cb_param_t* param) {
+
+	BT_PROFILE_SCOPE(BT_STAGE_GAP_CALLBACK);
+	if (BTDevice::m_pScan != nullptr) {
+		BTDevice::getScan()->handleBLEGAPEvent(event, param);
+	}
+} // bleGapEventHandler
+#endif
 
 
 /**
@@ -238,6 +382,9 @@ bool       BT_initialized          = false;   // Have we been initialized?
 	if (m_pScan == nullptr) {
 		m_pScan = new BTScan();
 		log_d(" - creating a new scan object");
+		registerGapHandler(ESP_BT_GAP_DISC_RES_EVT, scanGapEventHandler, m_pScan);
+		registerGapHandler(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, scanGapEventHandler, m_pScan);
+		registerGapHandler(ESP_BT_GAP_RMT_SRVCS_EVT, scanGapEventHandler, m_pScan);
 	}
 	log_d("<< getScan: Returning object at 0x%x", (uint32_t)m_pScan);
 	return m_pScan;
@@ -262,18 +409,59 @@ bool       BT_initialized          = false;   // Have we been initialized?
 
 */
 
+/**
+ * @brief Start the controller, in classic mode only when the BLE memory was released.
+ *
+ * Arduino's btStart() always asks for the mode chosen at build time, normally dual mode, which the
+ * controller refuses once the BLE memory is gone.
+ *
+ * @return True if the controller is enabled.
+ */
+/* STATIC */ bool BTDevice::startController() {
+	if (!m_bleMemoryReleased) {
+		return btStart();
+	}
+	esp_err_t errRc;
+	if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_IDLE) {
+		esp_bt_controller_config_t cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+		cfg.mode = ESP_BT_MODE_CLASSIC_BT;
+		errRc = esp_bt_controller_init(&cfg);
+		if (errRc != ESP_OK) {
+			log_e("esp_bt_controller_init: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+			return false;
+		}
+	}
+	if (esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_INITED) {
+		errRc = esp_bt_controller_enable(ESP_BT_MODE_CLASSIC_BT);
+		if (errRc != ESP_OK) {
+			log_e("esp_bt_controller_enable: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+			return false;
+		}
+	}
+	return esp_bt_controller_get_status() == ESP_BT_CONTROLLER_STATUS_ENABLED;
+} // startController
+
+
 /**
  * @brief Initialize the %BLE environment.
+ *
+ * The controller and Bluedroid calls are synchronous, so the stack is ready when they return; there is
+ * no fixed delay.  Calling it again once initialized, or to leave standby, costs nothing more than a
+ * status check.  If a step fails the device stays uninitialized and a later call starts over from the
+ * steps not yet done.
+ *
  * @param deviceName The device name of the device.
  */
 /* STATIC */ void BTDevice::init(std::string deviceName) {
 	if(!BT_initialized){
-		BT_initialized = true;   // Set the initialization flag to ensure we are only initialized once.
+		int64_t initStart = esp_timer_get_time();
+		m_deviceName = deviceName;
 
         esp_err_t errRc = ESP_OK;
 
-        if (!btStarted() && !btStart()){
+        if (!btStarted() && !startController()){
             log_e("initialize controller failed");
+            return;
         }
         
         esp_bluedroid_status_t bt_state = esp_bluedroid_get_status();
@@ -299,16 +487,154 @@ bool       BT_initialized          = false;   // Have we been initialized?
             return;
         }
 
+#ifdef BT_HAVE_BLE
+        if (!m_bleMemoryReleased) {
+            errRc = esp_ble_gap_register_callback(BTDevice::bleGapEventHandler);
+            if (errRc != ESP_OK) {
+                log_e("esp_ble_gap_register_callback: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+                return;
+            }
+        }
+#endif
+
         errRc = ::esp_bt_dev_set_device_name(deviceName.c_str());
         if (errRc != ESP_OK) {
             log_e("esp_ble_gap_set_device_name: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
             return;
         };
+
+        BT_initialized = true;   // Only once every step succeeded, so that a failed init can be retried.
+        m_initTimeMs   = (uint32_t)((esp_timer_get_time() - initStart) / 1000);
+        log_i("init: ready in %u ms", (unsigned)m_initTimeMs);
+    } else if (m_standby) {
+        resume();
     }
-	vTaskDelay(200/portTICK_PERIOD_MS); // Delay for 200 msecs as a workaround to an apparent Arduino environment issue.
 } // init
 
 
+/**
+ * @brief Release the controller memory reserved for BLE.
+ *
+ * Only possible before the controller is started, i.e. before the first init().  The memory cannot be
+ * reclaimed afterwards, so dual mode scanning is no longer available.
+ *
+ * @return ESP_OK, or ESP_ERR_INVALID_STATE if the controller was already started.
+ */
+/* STATIC */ esp_err_t BTDevice::releaseBleMemory() {
+	if (esp_bt_controller_get_status() != ESP_BT_CONTROLLER_STATUS_IDLE) {
+		log_e("releaseBleMemory: the controller is already started");
+		return ESP_ERR_INVALID_STATE;
+	}
+	esp_err_t errRc = esp_bt_controller_mem_release(ESP_BT_MODE_BLE);
+	if (errRc != ESP_OK) {
+		log_e("esp_bt_controller_mem_release: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+		return errRc;
+	}
+	m_bleMemoryReleased = true;
+	return ESP_OK;
+} // releaseBleMemory
+
+
+/**
+ * @brief Has the BLE controller memory been released?
+ */
+/* STATIC */ bool BTDevice::isBleMemoryReleased() {
+	return m_bleMemoryReleased;
+} // isBleMemoryReleased
+
+
+/**
+ * @brief Park the stack without tearing it down.
+ *
+ * Any scan is stopped and the device stops being discoverable and connectable, but Bluedroid stays
+ * enabled, so resume() or the next scan starts without paying the init cost again.
+ */
+/* STATIC */ void BTDevice::standby() {
+	if (!BT_initialized || m_standby) {
+		return;
+	}
+	if (m_pScan != nullptr) {
+		m_pScan->stop();
+	}
+	esp_err_t errRc = esp_bt_gap_set_scan_mode(ESP_BT_SCAN_MODE_NONE);
+	if (errRc != ESP_OK) {
+		log_e("esp_bt_gap_set_scan_mode: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+	}
+	m_standby = true;
+} // standby
+
+
+/**
+ * @brief Leave standby.  BTScan::start() does this implicitly.
+ */
+/* STATIC */ void BTDevice::resume() {
+	if (!m_standby) {
+		return;
+	}
+	esp_err_t errRc = esp_bt_gap_set_scan_mode(ESP_BT_SCAN_MODE_CONNECTABLE_DISCOVERABLE);
+	if (errRc != ESP_OK) {
+		log_e("esp_bt_gap_set_scan_mode: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+	}
+	m_standby = false;
+} // resume
+
+
+/* STATIC */ bool BTDevice::isStandby() {
+	return m_standby;
+} // isStandby
+
+
+/**
+ * @brief Tear the stack down completely: Bluedroid is disabled and the controller stopped.
+ *
+ * A later init() starts from scratch.  Prefer standby() when scanning will resume.
+ */
+/* STATIC */ void BTDevice::deinit() {
+	if (m_pScan != nullptr) {
+		m_pScan->stop();
+	}
+	if (btStarted()) {
+		esp_bluedroid_disable();
+		esp_bluedroid_deinit();
+		btStop();
+	}
+	BT_initialized = false;
+	m_standby      = false;
+} // deinit
+
+
+/**
+ * @brief Restart the stack after it stopped answering, with the name given to init().
+ *
+ * Unlike deinit() the scan is left alone, so a scan in progress can carry on once the stack is back;
+ * this is the last resort of the BTScan watchdog.
+ */
+/* STATIC */ void BTDevice::reinit() {
+	log_w("reinit: restarting the stack");
+	if (btStarted()) {
+		esp_bluedroid_disable();
+		esp_bluedroid_deinit();
+		btStop();
+	}
+	BT_initialized = false;
+	m_standby      = false;
+	init(m_deviceName);
+	esp_err_t errRc = esp_bt_gap_set_scan_mode(ESP_BT_SCAN_MODE_CONNECTABLE_DISCOVERABLE);
+	if (errRc != ESP_OK) {
+		log_e("esp_bt_gap_set_scan_mode: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+	}
+} // reinit
+
+
+/**
+ * @brief Get how long the last init() took to bring the stack up.
+ * @return Milliseconds, 0 if the stack was already up.
+ */
+/* STATIC */ uint32_t BTDevice::getInitTime() {
+	return m_initTimeMs;
+} // getInitTime
+
+
 /**
  * @brief Set the transmission power.
  * The power level can be one of:
@@ -359,34 +685,28 @@ bool       BT_initialized          = false;   // Have we been initialized?
 
 
 /**
- * @brief Add an entry to the BLE white list.
+ * @brief Add an entry to the white list, the watchlist of the scan.
+ *
+ * Scan results of listed devices are reported with BTAdvertisedDeviceCallbacks::onWatchlistHit(); see
+ * BTScan::setMatchOnly() to drop all the others.  Use BTScan::getWatchlist() to load many at once.
+ *
  * @param [in] address The address to add to the white list.
  */
 void BTDevice::whiteListAdd(BTAddress address) {
-    /*
 	log_d(">> whiteListAdd: %s", address.toString().c_str());
-	esp_err_t errRc = esp_ble_gap_update_whitelist(true, *address.getNative());  // True to add an entry.
-	if (errRc != ESP_OK) {
-		log_e("esp_ble_gap_update_whitelist: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
-	}
+	getScan()->getWatchlist().add(address.toUint64());
 	log_d("<< whiteListAdd");
-    */
 } // whiteListAdd
 
 
 /**
- * @brief Remove an entry from the BLE white list.
+ * @brief Remove an entry from the white list.
  * @param [in] address The address to remove from the white list.
  */
 void BTDevice::whiteListRemove(BTAddress address) {
-    /*
 	log_d(">> whiteListRemove: %s", address.toString().c_str());
-	esp_err_t errRc = esp_ble_gap_update_whitelist(false, *address.getNative());  // False to remove an entry.
-	if (errRc != ESP_OK) {
-		log_e("esp_ble_gap_update_whitelist: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
-	}
+	getScan()->getWatchlist().remove(address.toUint64());
 	log_d("<< whiteListRemove");
-    */
 } // whiteListRemove
 
 /*
@@ -436,4 +756,24 @@ uint16_t BLEDevice::getMTU() {
 bool BTDevice::getInitialized() {
 	return BT_initialized;
 }
+
+
+/**
+ * @brief Record every GAP event received from the stack.
+ * @param [in] pWriter An open capture writer, or nullptr to stop recording.  The caller keeps ownership.
+ */
+/* STATIC */ void BTDevice::setCaptureWriter(BTCaptureWriter* pWriter) {
+	m_pCaptureWriter = pWriter;
+} // setCaptureWriter
+
+
+/**
+ * @brief Feed a recorded capture through the GAP event handler as if the stack had produced it.
+ * @param [in] pReplayer An open capture replayer.
+ * @param [in] realTime Reproduce the recorded timing, otherwise replay at maximum speed.
+ * @return The number of events replayed.
+ */
+/* STATIC */ uint32_t BTDevice::replayCapture(BTCaptureReplayer* pReplayer, bool realTime) {
+	return pReplayer->replay(BTDevice::gapEventHandler, realTime);
+} // replayCapture
 #endif // CONFIG_BT_ENABLED
\ No newline at end of file
@@ -17,6 +17,7 @@
 #include "sdkconfig.h"
 #if defined(CONFIG_BT_ENABLED)
 
+#include <atomic>
 #include <map>               // Part of C++ STL
 #include <string>
 #include <esp_bt.h>
@@ -27,12 +28,35 @@
 
 #include "BTAddress.h"
 #include "BTAdvertisedDevice.h"
+#include "BTCapture.h"
 #include "BTScan.h"
+#include "FreeRTOS.h"
 
 class BTAdvertisedDevice;
 class BTAdvertisedDeviceCallbacks;
 class BTScan;
 
+// Most handlers of each GAP event, see BTDevice::registerGapHandler().
+#ifndef BT_GAP_MAX_HANDLERS
+  #define BT_GAP_MAX_HANDLERS 4
+#endif
+
+/**
+ * @brief A consumer of classic GAP events, called from the Bluedroid task.
+ * @param [in] pArg The argument given at registration.
+ */
+typedef void (*BTGapHandler)(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param, void* pArg);
+
+/**
+ * @brief The time spent in a GAP handler, since it was registered.  Each field is exact, but they can
+ * be a call apart when read during a call.
+ */
+struct BTGapHandlerStats {
+	uint32_t calls;
+	uint32_t totalUs;
+	uint32_t maxUs;
+};
+
 
 /**
  * @brief %BLE functions.
@@ -49,17 +73,45 @@ public:
 //	static void        setPower(esp_power_level_t powerLevel);  // Set our power level.
 //	static void        setValue(BLEAddress bdAddress, BLEUUID serviceUUID, BLEUUID characteristicUUID, std::string value);   // Set the value of a characteristic on a service on a server.
 	static std::string toString();        // Return a string representation of our device.
-	static void        whiteListAdd(BTAddress address);    // Add an entry to the BLE white list.
-	static void        whiteListRemove(BTAddress address); // Remove an entry from the BLE white list.
+	static void        whiteListAdd(BTAddress address);    // Add an entry to the scan watchlist.
+	static void        whiteListRemove(BTAddress address); // Remove an entry from the scan watchlist.
 //	static void		   setEncryptionLevel(esp_ble_sec_act_t level);
 //	static void		   setSecurityCallbacks(BLESecurityCallbacks* pCallbacks);
 //	static esp_err_t   setMTU(uint16_t mtu);
 //	static uint16_t	   getMTU();
 	static bool        getInitialized(); // Returns the state of the device, is it initialized or not?
+	static esp_err_t   releaseBleMemory();    // Give the BLE controller memory back, before init().
+	static bool        isBleMemoryReleased();
+	static void        standby();             // Park the stack without deinit.
+	static void        resume();              // Leave standby.
+	static bool        isStandby();
+	static void        deinit();              // Tear the stack down.
+	static void        reinit();              // Tear the stack down and bring it back up, keeping the scan.
+	static uint32_t    getInitTime();         // Duration of the last init() in ms.
+	static void        setCaptureWriter(BTCaptureWriter* pWriter); // Record every GAP event, nullptr to stop.
+	static uint32_t    replayCapture(BTCaptureReplayer* pReplayer, bool realTime = false); // Feed a capture to the GAP handler.
+	static bool        registerGapHandler(esp_bt_gap_cb_event_t event, BTGapHandler handler, void* pArg = nullptr);
+	static bool        unregisterGapHandler(esp_bt_gap_cb_event_t event, BTGapHandler handler, void* pArg = nullptr);
+	static bool        getGapHandlerStats(esp_bt_gap_cb_event_t event, BTGapHandler handler, void* pArg, BTGapHandlerStats* pStats);
 
 private:
 //	static BLEServer *m_pServer;
 	static BTScan   *m_pScan;
+	static BTCaptureWriter *m_pCaptureWriter;
+	static bool     m_standby;
+	static bool     m_bleMemoryReleased;
+	static uint32_t m_initTimeMs;
+	static std::string m_deviceName;
+
+	struct GapHandlerSlot {
+		std::atomic<BTGapHandler> handler;   // nullptr when the slot is free.
+		void*                     pArg;
+		std::atomic<uint32_t>     calls;     // Written on the Bluedroid task, read from any.
+		std::atomic<uint32_t>     totalUs;
+		std::atomic<uint32_t>     maxUs;
+	};
+	static GapHandlerSlot m_gapHandlers[ESP_BT_GAP_EVT_MAX][BT_GAP_MAX_HANDLERS];
+	static FreeRTOS::Semaphore m_gapHandlersLock;
 //	static BLEClient *m_pClient;
 //	static esp_ble_sec_act_t 	m_securityLevel;
 //	static BLESecurityCallbacks* m_securityCallbacks;
@@ -79,10 +131,23 @@ private:
 	   esp_ble_gatts_cb_param_t* param);
 
 */
+	static bool startController();
+
 	static void gapEventHandler(
 		esp_bt_gap_cb_event_t  event,
 		esp_bt_gap_cb_param_t* param);
 
+	static void scanGapEventHandler(
+		esp_bt_gap_cb_event_t  event,
+		esp_bt_gap_cb_param_t* param,
+		void*                  pArg);
+
+#ifdef BT_HAVE_BLE
+	static void bleGapEventHandler(
+		esp_gap_ble_cb_event_t  event,
+		esp_ble_gap_cb_param_t* param);
+#endif
+
 
 }; // class BLE
 
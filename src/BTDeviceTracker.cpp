@@ -0,0 +1,287 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <stdlib.h>
+
+#include "BTDeviceTracker.h"
+#include "BTAdvertisedDevice.h"
+#include "BTUtils.h"
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32-hal-log.h"
+#endif
+
+
+BTDeviceTracker::BTDeviceTracker() {
+	m_firstChange      = 0;
+	m_changeCount      = 0;
+	m_enabled          = false;
+	m_pHead            = nullptr;
+	m_pTail            = nullptr;
+	m_generation       = 0;
+	m_oldestGeneration = 1;
+	m_rssiThreshold    = 10;
+	m_departureScans   = 1;
+	m_history          = 8;
+} // BTDeviceTracker
+
+
+void BTDeviceTracker::unlink(Entry* pEntry) {
+	if (pEntry->prev != nullptr) pEntry->prev->next = pEntry->next; else m_pHead = pEntry->next;
+	if (pEntry->next != nullptr) pEntry->next->prev = pEntry->prev; else m_pTail = pEntry->prev;
+	pEntry->prev = nullptr;
+	pEntry->next = nullptr;
+} // unlink
+
+
+void BTDeviceTracker::pushFront(Entry* pEntry) {
+	pEntry->prev = nullptr;
+	pEntry->next = m_pHead;
+	if (m_pHead != nullptr) m_pHead->prev = pEntry; else m_pTail = pEntry;
+	m_pHead = pEntry;
+} // pushFront
+
+
+BTScanChange& BTDeviceTracker::changeAt(size_t i) {
+	return m_changes[(m_firstChange + i) % m_changes.size()];
+} // changeAt
+
+
+/**
+ * @brief Drop the oldest change of the log.  Its generation is no longer complete in the log.
+ */
+void BTDeviceTracker::dropOldestChange() {
+	uint32_t generation = changeAt(0).generation;
+	if (generation + 1 > m_oldestGeneration) {
+		m_oldestGeneration = generation + 1;
+	}
+	m_firstChange = (m_firstChange + 1) % m_changes.size();
+	m_changeCount--;
+} // dropOldestChange
+
+
+void BTDeviceTracker::log(BTScanChangeType type, uint8_t changed, Entry* pEntry) {
+	if (m_changeCount == m_changes.size()) {
+		dropOldestChange();
+	}
+	BTScanChange& change = changeAt(m_changeCount++);
+	change.generation = m_generation;
+	change.type       = type;
+	change.changed    = changed;
+	change.address    = pEntry->address;
+	change.rssi       = pEntry->rssi;
+	change.cod        = pEntry->cod;
+} // log
+
+
+/**
+ * @brief Start tracking devices, from the current generation on.
+ *
+ * Every device seen afterwards is first reported as arrived, including those already in the results
+ * when tracking started.  changesSince() an earlier generation returns false.  Calling it again does
+ * nothing.
+ */
+void BTDeviceTracker::enable() {
+	if (m_enabled) {
+		return;
+	}
+	m_changes.assign(BT_TRACKER_MAX_CHANGES, BTScanChange());
+	m_firstChange      = 0;
+	m_changeCount      = 0;
+	m_oldestGeneration = m_generation + 1;
+	m_enabled          = true;
+} // enable
+
+
+bool BTDeviceTracker::isEnabled() {
+	return m_enabled;
+} // isEnabled
+
+
+/**
+ * @brief Take the tracked devices and the change log from another allocator.
+ *
+ * Both are dropped: the devices tracked so far arrive again with the next scan, and changesSince()
+ * an earlier generation returns false.
+ *
+ * @param [in] pAllocator The allocator.  It must outlive the tracker.
+ */
+void BTDeviceTracker::setAllocator(BTAllocator* pAllocator) {
+	m_entries = EntryMap(0, std::hash<uint64_t>(), std::equal_to<uint64_t>(),
+		BTStlAllocator<std::pair<const uint64_t, Entry> >(pAllocator));
+	m_changes = ChangeRing(BTStlAllocator<BTScanChange>(pAllocator));
+	m_pHead   = nullptr;
+	m_pTail   = nullptr;
+	if (m_enabled) {
+		m_changes.assign(BT_TRACKER_MAX_CHANGES, BTScanChange());
+		m_firstChange      = 0;
+		m_changeCount      = 0;
+		m_oldestGeneration = m_generation + 1;
+	}
+} // setAllocator
+
+
+/**
+ * @brief Start a new generation, called when a scan starts.
+ *
+ * Changes older than the configured history are dropped from the log.
+ *
+ * @return The number of the new generation.
+ */
+uint32_t BTDeviceTracker::beginGeneration() {
+	m_generation++;
+	if (m_enabled && m_generation > m_history) {
+		while (m_changeCount != 0 && changeAt(0).generation <= m_generation - m_history) {
+			dropOldestChange();
+		}
+		if (m_generation - m_history + 1 > m_oldestGeneration) {
+			m_oldestGeneration = m_generation - m_history + 1;
+		}
+	}
+	return m_generation;
+} // beginGeneration
+
+
+/**
+ * @brief Record a sighting in the current generation.
+ * @param [in] device The device that was seen.
+ */
+void BTDeviceTracker::update(BTAdvertisedDevice& device) {
+	if (!m_enabled) {
+		return;
+	}
+	uint64_t address  = device.m_address.toUint64();
+	uint32_t nameHash = device.haveName() ? BTUtils::hash32(reinterpret_cast<const uint8_t*>(device.m_name), device.m_nameLen) : 0;
+	uint32_t cod      = device.m_haveCod ? device.m_cod : 0;
+	int8_t   rssi     = device.m_haveRSSI ? (int8_t)device.m_rssi : -128;
+
+	EntryMap::iterator it = m_entries.find(address);
+	if (it == m_entries.end()) {
+		Entry& entry = m_entries[address];
+		entry.address        = address;
+		entry.lastGeneration = m_generation;
+		entry.nameHash       = nameHash;
+		entry.cod            = cod;
+		entry.rssi           = rssi;
+		pushFront(&entry);
+		log(BT_CHANGE_ARRIVED, 0, &entry);
+		return;
+	}
+
+	Entry* pEntry = &it->second;
+	if (pEntry->lastGeneration != m_generation) {
+		pEntry->lastGeneration = m_generation;
+		unlink(pEntry);
+		pushFront(pEntry);
+	}
+
+	uint8_t changed = 0;
+	if (device.haveName() && nameHash != pEntry->nameHash) {
+		pEntry->nameHash = nameHash;
+		changed |= BT_CHANGED_NAME;
+	}
+	if (device.m_haveCod && cod != pEntry->cod) {
+		pEntry->cod = cod;
+		changed |= BT_CHANGED_COD;
+	}
+	if (device.m_haveRSSI && abs(rssi - pEntry->rssi) >= m_rssiThreshold) {
+		pEntry->rssi = rssi;
+		changed |= BT_CHANGED_RSSI;
+	}
+	if (changed != 0) {
+		log(BT_CHANGE_UPDATED, changed, pEntry);
+	}
+} // update
+
+
+/**
+ * @brief Close the current generation, called when a scan completes.
+ *
+ * Devices that have not been seen for the configured number of scans are logged as departed
+ * and forgotten.
+ */
+void BTDeviceTracker::endGeneration() {
+	if (!m_enabled) {
+		return;
+	}
+	while (m_pTail != nullptr && m_generation - m_pTail->lastGeneration >= m_departureScans) {
+		Entry* pEntry = m_pTail;
+		unlink(pEntry);
+		log(BT_CHANGE_DEPARTED, 0, pEntry);
+		m_entries.erase(pEntry->address);
+	}
+} // endGeneration
+
+
+/**
+ * @brief Collect the changes logged after a generation.
+ * @param [in] generation The last generation the caller has processed; 0 asks for everything logged.
+ * @param [out] changes Receives the changes in the order they were observed.
+ * @return False if some changes after that generation have already been dropped from the log, or
+ * tracking is not enabled, in which case the caller should resynchronize from the full scan results.
+ */
+bool BTDeviceTracker::changesSince(uint32_t generation, std::vector<BTScanChange>& changes) {
+	changes.clear();
+	if (!m_enabled) {
+		return false;
+	}
+	size_t lo = 0;
+	size_t hi = m_changeCount;
+	while (lo < hi) {   // First change with a generation above the requested one.
+		size_t mid = (lo + hi) / 2;
+		if (changeAt(mid).generation <= generation) lo = mid + 1; else hi = mid;
+	}
+	changes.reserve(m_changeCount - lo);
+	for (size_t i = lo; i < m_changeCount; i++) {
+		changes.push_back(changeAt(i));
+	}
+	return generation + 1 >= m_oldestGeneration;
+} // changesSince
+
+
+uint32_t BTDeviceTracker::getGeneration() {
+	return m_generation;
+} // getGeneration
+
+
+size_t BTDeviceTracker::getTrackedCount() {
+	return m_entries.size();
+} // getTrackedCount
+
+
+/**
+ * @brief Set how far, in dBm, the RSSI must move before a change is reported.
+ */
+void BTDeviceTracker::setRssiThreshold(uint8_t rssiThreshold) {
+	m_rssiThreshold = rssiThreshold;
+} // setRssiThreshold
+
+
+/**
+ * @brief Set after how many scans without a sighting a device is reported as departed.
+ */
+void BTDeviceTracker::setDepartureScans(uint8_t departureScans) {
+	m_departureScans = departureScans > 0 ? departureScans : 1;
+} // setDepartureScans
+
+
+/**
+ * @brief Set how many generations of changes are kept in the log.
+ */
+void BTDeviceTracker::setHistory(uint8_t generations) {
+	m_history = generations > 0 ? generations : 1;
+} // setHistory
+
+#endif /* CONFIG_BT_ENABLED */
@@ -0,0 +1,126 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_DEVICE_TRACKER_H_
+#define _BT_DEVICE_TRACKER_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+
+#include "BTAllocator.h"
+
+class BTAdvertisedDevice;
+
+#ifndef BT_TRACKER_MAX_CHANGES
+  #define BT_TRACKER_MAX_CHANGES 512
+#endif
+
+// What changed on a BT_CHANGE_UPDATED entry.
+#define BT_CHANGED_NAME   0x01
+#define BT_CHANGED_COD    0x02
+#define BT_CHANGED_RSSI   0x04
+
+typedef enum {
+	BT_CHANGE_ARRIVED,
+	BT_CHANGE_DEPARTED,
+	BT_CHANGE_UPDATED
+} BTScanChangeType;
+
+/**
+ * @brief One entry of the change log kept between scans.
+ */
+struct BTScanChange {
+	uint32_t         generation;   // The scan during which the change was observed.
+	BTScanChangeType type;
+	uint8_t          changed;      // BT_CHANGED_* flags for BT_CHANGE_UPDATED.
+	uint64_t         address;      // Packed address, see BTAddress::toUint64().
+	int8_t           rssi;
+	uint32_t         cod;
+};
+
+
+/**
+ * @brief Follow devices across scans and log arrivals, departures and changes.
+ *
+ * Every scan is a generation.  Tracked devices are kept on a list ordered by the generation in
+ * which they were last seen, so at the end of a scan the devices that went missing are found by
+ * walking the tail of that list; the cost is the number of departures, not the number of devices.
+ * Changes are appended to a log ordered by generation, so changesSince() costs a binary search plus
+ * the number of changes returned.
+ *
+ * Tracking is off until enable() is called: until then update() and endGeneration() do nothing.  The
+ * change log is a ring of BT_TRACKER_MAX_CHANGES entries, allocated by enable(); when it is full the
+ * oldest change is dropped and changesSince() reports that the log no longer reaches back that far.
+ *
+ * The tracked devices and the log come from the allocator given to setAllocator(), the record
+ * allocator of the scan, since both grow with the number of devices around.
+ */
+class BTDeviceTracker {
+public:
+	BTDeviceTracker();
+	void     enable();
+	bool     isEnabled();
+	void     setAllocator(BTAllocator* pAllocator);
+	uint32_t beginGeneration();
+	void     update(BTAdvertisedDevice& device);
+	void     endGeneration();
+	bool     changesSince(uint32_t generation, std::vector<BTScanChange>& changes);
+	uint32_t getGeneration();
+	size_t   getTrackedCount();
+	void     setRssiThreshold(uint8_t rssiThreshold);
+	void     setDepartureScans(uint8_t departureScans);
+	void     setHistory(uint8_t generations);
+
+private:
+	struct Entry {
+		uint64_t address;
+		uint32_t lastGeneration;
+		uint32_t nameHash;
+		uint32_t cod;
+		int8_t   rssi;            // RSSI at the time of the last reported change.
+		Entry*   prev;            // Towards more recently seen devices.
+		Entry*   next;            // Towards less recently seen devices.
+	};
+
+	typedef std::unordered_map<uint64_t, Entry, std::hash<uint64_t>, std::equal_to<uint64_t>,
+		BTStlAllocator<std::pair<const uint64_t, Entry> > > EntryMap;
+	typedef std::vector<BTScanChange, BTStlAllocator<BTScanChange> > ChangeRing;
+
+	void unlink(Entry* pEntry);
+	void pushFront(Entry* pEntry);
+	void log(BTScanChangeType type, uint8_t changed, Entry* pEntry);
+	BTScanChange& changeAt(size_t i);
+	void dropOldestChange();
+
+	EntryMap                            m_entries;
+	ChangeRing                          m_changes;            // Ring, empty until enable().
+	size_t                              m_firstChange;
+	size_t                              m_changeCount;
+	std::atomic<bool>                   m_enabled;
+	Entry*                              m_pHead;
+	Entry*                              m_pTail;
+	uint32_t                            m_generation;
+	uint32_t                            m_oldestGeneration;   // Changes from this generation on are still logged.
+	uint8_t                             m_rssiThreshold;
+	uint8_t                             m_departureScans;
+	uint8_t                             m_history;
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_DEVICE_TRACKER_H_ */
@@ -0,0 +1,141 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <string.h>
+
+#include "BTEirIndex.h"
+#include "BTUtils.h"
+
+static const uint8_t noSlot = 0xff;
+
+
+BTEirIndex::BTEirIndex() {
+	clear();
+} // BTEirIndex
+
+
+void BTEirIndex::clear() {
+	memset(m_offset, 0, sizeof(m_offset));
+	m_fieldCount = 0;
+} // clear
+
+
+/**
+ * @brief Map an EIR data type to its slot in the index.
+ * @return The slot, or 0xff if the type is not indexed.
+ */
+uint8_t BTEirIndex::slotOf(uint8_t type) {
+	if (type == 0xff) {
+		return 0;
+	}
+	return (type != 0 && type < BT_EIR_INDEX_SLOTS) ? type : noSlot;
+} // slotOf
+
+
+/**
+ * @brief Index an EIR buffer in a single pass.
+ *
+ * The walk stops at the first zero length (the significant part of the EIR ends there) or at the end
+ * of the buffer.  A field whose length runs past the end of the buffer is malformed: it and anything
+ * after it are ignored.
+ *
+ * @param [in] eir The EIR buffer, at most 255 bytes.
+ * @param [in] length The size of the buffer, normally ESP_BT_GAP_EIR_DATA_LEN.
+ * @param [in] handler Optional, called for every field in order, including repeated types.
+ * @param [in] pContext Passed to the handler.
+ * @return False if a malformed field was found.
+ */
+bool BTEirIndex::build(const uint8_t* eir, size_t length, FieldHandler handler, void* pContext) {
+	clear();
+	if (eir == nullptr) {
+		return true;
+	}
+	if (length > 255) {
+		length = 255;
+	}
+
+	size_t pos = 0;
+	while (pos < length) {
+		uint8_t fieldLength = eir[pos];
+		if (fieldLength == 0) {
+			break;
+		}
+		if (pos + 1 + fieldLength > length) {
+			return false;
+		}
+		uint8_t type = eir[pos + 1];
+		uint8_t slot = slotOf(type);
+		if (slot != noSlot && m_offset[slot] == 0) {
+			m_offset[slot] = (uint8_t)(pos + 2);
+		}
+		m_fieldCount++;
+		if (handler != nullptr) {
+			handler(type, eir + pos + 2, fieldLength - 1, pContext);
+		}
+		pos += 1 + fieldLength;
+	}
+	return true;
+} // build
+
+
+/**
+ * @brief Find the first field of a type.
+ * @param [in] eir The buffer the index was built from.
+ * @param [in] type The EIR data type.
+ * @param [out] pLength Receives the length of the field data.
+ * @return The field data, or nullptr if there is no such field.
+ */
+const uint8_t* BTEirIndex::find(const uint8_t* eir, uint8_t type, uint8_t* pLength) {
+	uint8_t slot = slotOf(type);
+	if (slot == noSlot || m_offset[slot] == 0) {
+		return nullptr;
+	}
+	uint8_t offset = m_offset[slot];
+	*pLength = eir[offset - 2] - 1;
+	return eir + offset;
+} // find
+
+
+bool BTEirIndex::has(uint8_t type) {
+	uint8_t slot = slotOf(type);
+	return slot != noSlot && m_offset[slot] != 0;
+} // has
+
+
+/**
+ * @brief Get the number of well formed fields in the buffer.
+ */
+uint8_t BTEirIndex::getFieldCount() {
+	return m_fieldCount;
+} // getFieldCount
+
+
+/**
+ * @brief Hash an EIR along with a class of device, to tell whether a device changed what it advertises.
+ *
+ * BTUtils::hash32() over the three CoD bytes, low byte first, then the EIR bytes.
+ *
+ * @param [in] eir The EIR, nullptr when there is none.
+ * @param [in] length The length of the EIR.
+ * @param [in] cod The class of device, 0 when unknown.
+ * @return The hash.
+ */
+/* STATIC */ uint32_t BTEirIndex::hash(const uint8_t* eir, size_t length, uint32_t cod) {
+	uint8_t codBytes[3] = { (uint8_t)cod, (uint8_t)(cod >> 8), (uint8_t)(cod >> 16) };
+	return BTUtils::hash32(eir, length, BTUtils::hash32(codBytes, 3));
+} // hash
+
+#endif /* CONFIG_BT_ENABLED */
@@ -0,0 +1,57 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_EIR_INDEX_H_
+#define _BT_EIR_INDEX_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BT_EIR_INDEX_SLOTS 64   // EIR data types 0x01-0x3F, with 0xFF (manufacturer data) folded into slot 0.
+
+/**
+ * @brief An offset index over the [length][type][data...] fields of an EIR buffer.
+ *
+ * build() walks the whole buffer once, bounds checking every field, and remembers where the data of
+ * the first field of each type starts, so later lookups are O(1).  The index holds offsets only and
+ * is used together with the buffer it was built from, so it stays valid when both are copied.
+ */
+class BTEirIndex {
+public:
+	/**
+	 * @brief Called for every well formed field found by build().
+	 */
+	typedef void (*FieldHandler)(uint8_t type, const uint8_t* data, uint8_t length, void* pContext);
+
+	BTEirIndex();
+	bool           build(const uint8_t* eir, size_t length, FieldHandler handler = nullptr, void* pContext = nullptr);
+	void           clear();
+	const uint8_t* find(const uint8_t* eir, uint8_t type, uint8_t* pLength);
+	bool           has(uint8_t type);
+	uint8_t        getFieldCount();
+
+	static uint32_t hash(const uint8_t* eir, size_t length, uint32_t cod);
+
+private:
+	static uint8_t slotOf(uint8_t type);
+
+	uint8_t m_offset[BT_EIR_INDEX_SLOTS];   // Offset of the data of each type, 0 when absent.
+	uint8_t m_fieldCount;
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_EIR_INDEX_H_ */
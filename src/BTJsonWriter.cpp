@@ -0,0 +1,312 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <string.h>
+
+#include "BTJsonWriter.h"
+#include "BTAdvertisedDevice.h"
+#include "BTScan.h"
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32-hal-log.h"
+#endif
+
+static const char hexDigits[] = "0123456789abcdef";
+
+
+/**
+ * @brief Length of the valid UTF-8 sequence starting at data, or 0 if it is not valid.
+ */
+static size_t utf8SequenceLength(const uint8_t* data, size_t length) {
+	uint8_t c = data[0];
+	size_t  need;
+	uint32_t min;
+	if (c < 0x80)                { return 1; }
+	else if ((c & 0xe0) == 0xc0) { need = 2; min = 0x80; }
+	else if ((c & 0xf0) == 0xe0) { need = 3; min = 0x800; }
+	else if ((c & 0xf8) == 0xf0) { need = 4; min = 0x10000; }
+	else                         { return 0; }
+
+	if (need > length) {
+		return 0;
+	}
+	uint32_t cp = c & (0xff >> (need + 1));
+	for (size_t i = 1; i < need; i++) {
+		if ((data[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+		cp = (cp << 6) | (data[i] & 0x3f);
+	}
+	// Reject overlong forms, surrogates and values past the Unicode range.
+	if (cp < min || (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+		return 0;
+	}
+	return need;
+} // utf8SequenceLength
+
+
+/**
+ * @brief Create a writer.
+ * @param [in] buffer Where JSON text is assembled.
+ * @param [in] capacity The size of the buffer.
+ * @param [in] sink Receives the buffer content each time it fills up and on flush().  May be nullptr.
+ * @param [in] pArg Passed unchanged to the sink.
+ */
+BTJsonWriter::BTJsonWriter(char* buffer, size_t capacity, BTJsonSink sink, void* pArg) {
+	m_buffer   = buffer;
+	m_capacity = capacity;
+	m_sink     = sink;
+	m_pArg     = pArg;
+	m_fields   = BT_JSON_DEFAULT;
+	reset();
+} // BTJsonWriter
+
+
+/**
+ * @brief Select the device fields to write.
+ * @param [in] fields A combination of the BT_JSON_* flags.
+ */
+void BTJsonWriter::setFields(uint16_t fields) {
+	m_fields = fields;
+} // setFields
+
+
+/**
+ * @brief Discard buffered output and clear the failure flag.
+ */
+void BTJsonWriter::reset() {
+	m_length   = 0;
+	m_failed   = false;
+	m_firstKey = true;
+} // reset
+
+
+/**
+ * @brief Hand any buffered output to the sink.
+ * @return False if the sink rejected the data or an earlier write failed.
+ */
+bool BTJsonWriter::flush() {
+	if (m_sink != nullptr && m_length > 0 && !m_failed) {
+		if (!m_sink(m_buffer, m_length, m_pArg)) {
+			m_failed = true;
+		}
+		m_length = 0;
+	}
+	return !m_failed;
+} // flush
+
+
+void BTJsonWriter::put(char c) {
+	if (m_failed) {
+		return;
+	}
+	if (m_length == m_capacity) {
+		if (m_sink == nullptr || !flush()) {
+			m_failed = true;
+			return;
+		}
+	}
+	m_buffer[m_length++] = c;
+} // put
+
+
+void BTJsonWriter::put(const char* str) {
+	while (*str) {
+		put(*str++);
+	}
+} // put
+
+
+void BTJsonWriter::putKey(const char* key) {
+	if (!m_firstKey) {
+		put(',');
+	}
+	m_firstKey = false;
+	put('"');
+	put(key);
+	put('"');
+	put(':');
+} // putKey
+
+
+void BTJsonWriter::putInt(int32_t value) {
+	if (value < 0) {
+		put('-');
+	}
+	putUint((value < 0) ? (uint32_t)(-(int64_t)value) : (uint32_t)value);
+} // putInt
+
+
+/**
+ * @brief Write an unsigned value, for timestamps and counts that must not turn negative past 2^31.
+ */
+void BTJsonWriter::putUint(uint32_t value) {
+	char digits[10];
+	int  n = 0;
+	do {
+		digits[n++] = '0' + (value % 10);
+		value /= 10;
+	} while (value > 0);
+	while (n > 0) {
+		put(digits[--n]);
+	}
+} // putUint
+
+
+void BTJsonWriter::putString(const uint8_t* data, size_t length) {
+	put('"');
+	size_t i = 0;
+	while (i < length) {
+		uint8_t c = data[i];
+		if (c == '"' || c == '\\') {
+			put('\\');
+			put((char)c);
+			i++;
+			continue;
+		}
+		if (c >= 0x20 && c < 0x7f) {
+			put((char)c);
+			i++;
+			continue;
+		}
+		size_t seq = (c >= 0x80) ? utf8SequenceLength(data + i, length - i) : 0;
+		if (seq > 0) {
+			for (size_t j = 0; j < seq; j++) {
+				put((char)data[i + j]);
+			}
+			i += seq;
+			continue;
+		}
+		// Control character, DEL or a stray byte: escape it as a code point.
+		put('\\');
+		put('u');
+		put('0');
+		put('0');
+		put(hexDigits[c >> 4]);
+		put(hexDigits[c & 0x0f]);
+		i++;
+	}
+	put('"');
+} // putString
+
+
+void BTJsonWriter::putAddress(const uint8_t* address) {
+	put('"');
+	for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+		if (i > 0) {
+			put(':');
+		}
+		put(hexDigits[address[i] >> 4]);
+		put(hexDigits[address[i] & 0x0f]);
+	}
+	put('"');
+} // putAddress
+
+
+/**
+ * @brief Write one device as a JSON object.
+ * @param [in] device The device to write.
+ * @return False if the output did not fit or the sink failed.
+ */
+bool BTJsonWriter::writeDevice(BTAdvertisedDevice& device) {
+	put('{');
+	m_firstKey = true;
+	if (m_fields & BT_JSON_ADDRESS) {
+		putKey("address");
+		putAddress(*device.m_address.getNative());
+	}
+	if ((m_fields & BT_JSON_NAME) && device.haveName()) {
+		putKey("name");
+		putString(reinterpret_cast<const uint8_t*>(device.m_name), device.m_nameLen);
+	}
+	if ((m_fields & BT_JSON_RSSI) && device.m_haveRSSI) {
+		putKey("rssi");
+		putInt(device.m_rssi);
+	}
+	if ((m_fields & BT_JSON_COD) && device.m_haveCod) {
+		putKey("cod");
+		putUint(device.m_cod);
+	}
+	if ((m_fields & BT_JSON_DEVICE_TYPE) && device.m_haveCod) {
+		putKey("deviceType");
+		putString(reinterpret_cast<const uint8_t*>(device.m_deviceType), strlen(device.m_deviceType));
+	}
+	if ((m_fields & BT_JSON_SERVICE_TYPE) && device.m_haveCod) {
+		putKey("serviceType");
+		putString(reinterpret_cast<const uint8_t*>(device.m_serviceType), strlen(device.m_serviceType));
+	}
+	if ((m_fields & BT_JSON_TXPOWER) && device.m_haveTXPower) {
+		putKey("txPower");
+		putInt(device.m_txPower);
+	}
+	if (m_fields & BT_JSON_TIMESTAMP) {
+		putKey("timestamp");
+		putUint(device.m_timestamp);
+	}
+	put('}');
+	m_firstKey = false;
+	return !m_failed;
+} // writeDevice
+
+
+/**
+ * @brief Write a whole scan as {"scanStart":..,"count":..,"devices":[..]} and flush it to the sink.
+ * @param [in] results The scan results.
+ * @return False if the output did not fit or the sink failed.
+ */
+bool BTJsonWriter::writeResults(BTScanResults& results) {
+	BTScanResults::RecordVector& devices = results.m_vectorAdvertisedDevices;
+
+	put('{');
+	m_firstKey = true;
+	putKey("scanStart");
+	putUint(results.m_scanStart);
+	putKey("count");
+	putUint((uint32_t)devices.size());
+	putKey("devices");
+	put('[');
+	for (size_t i = 0; i < devices.size() && !m_failed; i++) {
+		if (i > 0) {
+			put(',');
+		}
+		writeDevice(devices[i]);
+	}
+	put(']');
+	put('}');
+	return flush();
+} // writeResults
+
+
+/**
+ * @brief Get the buffered JSON text.  It is not null terminated.
+ */
+const char* BTJsonWriter::getData() {
+	return m_buffer;
+} // getData
+
+
+size_t BTJsonWriter::getLength() {
+	return m_length;
+} // getLength
+
+
+/**
+ * @brief Did a write run out of buffer space or did the sink abort?
+ */
+bool BTJsonWriter::hasFailed() {
+	return m_failed;
+} // hasFailed
+
+#endif /* CONFIG_BT_ENABLED */
@@ -0,0 +1,88 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_JSON_WRITER_H_
+#define _BT_JSON_WRITER_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Fields written for each device.
+#define BT_JSON_ADDRESS        0x0001
+#define BT_JSON_NAME           0x0002
+#define BT_JSON_RSSI           0x0004
+#define BT_JSON_COD            0x0008
+#define BT_JSON_DEVICE_TYPE    0x0010
+#define BT_JSON_SERVICE_TYPE   0x0020
+#define BT_JSON_TXPOWER        0x0040
+#define BT_JSON_TIMESTAMP      0x0080
+#define BT_JSON_DEFAULT        (BT_JSON_ADDRESS | BT_JSON_NAME | BT_JSON_RSSI | BT_JSON_COD)
+#define BT_JSON_ALL            0x00ff
+
+class BTAdvertisedDevice;
+class BTScanResults;
+
+/**
+ * @brief Called with each chunk of JSON produced by a BTJsonWriter.
+ * @return False to abort the serialization.
+ */
+typedef bool (*BTJsonSink)(const char* data, size_t length, void* pArg);
+
+
+/**
+ * @brief Serialize devices and scan results to JSON without allocating.
+ *
+ * Output goes to a caller supplied buffer.  With a sink the buffer is a working area that is
+ * handed to the sink whenever it fills up, so any number of devices can be written through a
+ * few hundred bytes.  Without a sink the whole document must fit in the buffer.
+ *
+ * Names are written byte for byte when they are valid UTF-8.  Control characters and bytes that
+ * are not part of a valid UTF-8 sequence are escaped as \\u00XX.
+ */
+class BTJsonWriter {
+public:
+	BTJsonWriter(char* buffer, size_t capacity, BTJsonSink sink = nullptr, void* pArg = nullptr);
+	void        setFields(uint16_t fields);
+	bool        writeDevice(BTAdvertisedDevice& device);
+	bool        writeResults(BTScanResults& results);
+	bool        flush();
+	void        reset();
+	const char* getData();
+	size_t      getLength();
+	bool        hasFailed();
+
+private:
+	void put(char c);
+	void put(const char* str);
+	void putKey(const char* key);
+	void putInt(int32_t value);
+	void putUint(uint32_t value);
+	void putString(const uint8_t* data, size_t length);
+	void putAddress(const uint8_t* address);
+
+	char*      m_buffer;
+	size_t     m_capacity;
+	size_t     m_length;
+	BTJsonSink m_sink;
+	void*      m_pArg;
+	uint16_t   m_fields;
+	bool       m_failed;
+	bool       m_firstKey;
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_JSON_WRITER_H_ */
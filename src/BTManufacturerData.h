@@ -0,0 +1,87 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_MANUFACTURER_DATA_H_
+#define _BT_MANUFACTURER_DATA_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief A view of the manufacturer specific data of an EIR.
+ *
+ * The view points into the EIR stored in the BTAdvertisedDevice it was obtained from; nothing is
+ * copied.  It is only valid while that device object is alive and unchanged.
+ */
+struct BTManufacturerData {
+	uint16_t       companyId;   // Bluetooth SIG company identifier, the first two bytes of the field.
+	const uint8_t* data;        // Vendor payload following the company identifier.
+	uint8_t        length;      // Length of the vendor payload.
+
+	bool isValid() const { return data != nullptr; }
+};
+
+
+/**
+ * @brief A set of manufacturer data decoders dispatched at compile time on the company identifier.
+ *
+ * Each decoder is a type providing a company identifier and a static decode function:
+ *
+ *     struct AppleDecoder {
+ *         static const uint16_t companyId = 0x004C;
+ *         static void decode(const BTManufacturerData& data, MyContext& context);
+ *     };
+ *
+ *     typedef BTManufacturerDecoders<AppleDecoder, MicrosoftDecoder> MyDecoders;
+ *     MyDecoders::dispatch(advertisedDevice.getManufacturerDataView(), context);
+ *
+ * dispatch() expands into a chain of comparisons against constants that the compiler inlines, so a
+ * sighting costs no virtual call, table lookup or allocation.  The context type is up to the
+ * application and is passed through unchanged.
+ */
+template<typename... Decoders>
+struct BTManufacturerDecoders;
+
+template<>
+struct BTManufacturerDecoders<> {
+	template<typename Context>
+	static bool dispatch(const BTManufacturerData& data, Context& context) {
+		return false;
+	}
+};
+
+template<typename Decoder, typename... Others>
+struct BTManufacturerDecoders<Decoder, Others...> {
+	/**
+	 * @brief Hand the data to the decoder registered for its company identifier.
+	 * @return False if the data is absent or no decoder handles its company identifier.
+	 */
+	template<typename Context>
+	static bool dispatch(const BTManufacturerData& data, Context& context) {
+		if (!data.isValid()) {
+			return false;
+		}
+		if (data.companyId == Decoder::companyId) {
+			Decoder::decode(data, context);
+			return true;
+		}
+		return BTManufacturerDecoders<Others...>::dispatch(data, context);
+	}
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_MANUFACTURER_DATA_H_ */
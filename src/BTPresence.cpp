@@ -0,0 +1,370 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BTPresence.h"
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+#include <algorithm>
+
+static const int16_t defaultMissing = -100 * 16;
+
+
+static int32_t square(int32_t value) {
+	return value * value;
+} // square
+
+
+/**
+ * @param [in] nodeCount The number of scanners, node ids run from 0 to nodeCount - 1.
+ * @param [in] windowMs The length of the sliding window.
+ */
+BTPresenceClassifier::BTPresenceClassifier(uint8_t nodeCount, uint32_t windowMs) {
+	m_nodeCount = std::min(std::max(nodeCount, (uint8_t)1), (uint8_t)BT_PRESENCE_MAX_NODES);
+	m_bucketMs  = std::max(windowMs / BT_PRESENCE_BUCKETS, (uint32_t)1);
+	m_k         = 1;
+	m_missing   = defaultMissing;
+} // BTPresenceClassifier
+
+
+/**
+ * @brief Add a calibration fingerprint.
+ * @param [in] zone The zone the fingerprint was taken in.
+ * @param [in] rssi One RSSI per node, BT_PRESENCE_UNHEARD for nodes that did not hear it.
+ * @return The index of the fingerprint.
+ */
+int32_t BTPresenceClassifier::addFingerprint(uint16_t zone, const int8_t* rssi) {
+	m_raw.insert(m_raw.end(), rssi, rssi + m_nodeCount);
+	m_zones.push_back(zone);
+	rebuild();
+	return m_zones.size() - 1;
+} // addFingerprint
+
+
+void BTPresenceClassifier::clearFingerprints() {
+	m_raw.clear();
+	m_zones.clear();
+	rebuild();
+} // clearFingerprints
+
+
+/**
+ * @brief Set how many of the nearest fingerprints vote, 1 for nearest fingerprint matching.
+ */
+void BTPresenceClassifier::setK(uint8_t k) {
+	m_k = std::max(k, (uint8_t)1);
+} // setK
+
+
+/**
+ * @brief Set the RSSI standing for a node that did not hear a device, -100 dBm by default.
+ */
+void BTPresenceClassifier::setMissingRssi(int8_t rssi) {
+	m_missing = rssi * 16;
+	rebuild();
+} // setMissingRssi
+
+
+/**
+ * @brief Convert the fingerprints to fixed point and recompute the distances of every device.
+ *
+ * This is the one O(devices x fingerprints x nodes) operation; it only runs on calibration changes.
+ */
+void BTPresenceClassifier::rebuild() {
+	m_fingerprints.resize(m_raw.size());
+	for (size_t i = 0; i < m_raw.size(); i++) {
+		m_fingerprints[i] = (m_raw[i] == BT_PRESENCE_UNHEARD) ? m_missing : m_raw[i] * 16;
+	}
+	for (size_t d = 0; d < m_devices.size(); d++) {
+		Device& device = m_devices[d];
+		device.distance.assign(m_zones.size(), 0);
+		for (size_t f = 0; f < m_zones.size(); f++) {
+			const int16_t* fingerprint = &m_fingerprints[f * m_nodeCount];
+			for (uint8_t n = 0; n < m_nodeCount; n++) {
+				device.distance[f] += square(device.mean[n] - fingerprint[n]);
+			}
+		}
+		device.zone = -1;
+	}
+} // rebuild
+
+
+uint32_t BTPresenceClassifier::epochOf(uint64_t ms) {
+	return (uint32_t)(ms / m_bucketMs);
+} // epochOf
+
+
+void BTPresenceClassifier::initDevice(Device& device, uint32_t epoch) {
+	Bucket empty = { 0, 0, 0 };
+	device.buckets.assign(m_nodeCount * BT_PRESENCE_BUCKETS, empty);
+	device.mean.assign(m_nodeCount, m_missing);
+	device.distance.assign(m_zones.size(), 0);
+	for (size_t f = 0; f < m_zones.size(); f++) {
+		const int16_t* fingerprint = &m_fingerprints[f * m_nodeCount];
+		for (uint8_t n = 0; n < m_nodeCount; n++) {
+			device.distance[f] += square(m_missing - fingerprint[n]);
+		}
+	}
+	device.epoch    = epoch;
+	device.lastSeen = 0;
+	device.zone     = -1;
+} // initDevice
+
+
+/**
+ * @brief Recompute the windowed mean of one node and move the distances by its change.
+ * @param [in] device The device.
+ * @param [in] node The node.
+ * @param [in] epoch The current bucket number.
+ */
+void BTPresenceClassifier::refreshNode(Device& device, uint8_t node, uint32_t epoch) {
+	const Bucket* buckets = &device.buckets[node * BT_PRESENCE_BUCKETS];
+	int32_t sum   = 0;
+	int32_t count = 0;
+	for (int b = 0; b < BT_PRESENCE_BUCKETS; b++) {
+		if (buckets[b].count > 0 && buckets[b].epoch + BT_PRESENCE_BUCKETS > epoch) {
+			sum   += buckets[b].sum;
+			count += buckets[b].count;
+		}
+	}
+	int16_t mean = m_missing;
+	if (count > 0) {
+		int32_t scaled = sum * 16;
+		mean = (int16_t)((scaled >= 0 ? scaled + count / 2 : scaled - count / 2) / count);
+	}
+
+	int16_t old = device.mean[node];
+	if (mean == old) {
+		return;
+	}
+	device.mean[node] = mean;
+	for (size_t f = 0; f < m_zones.size(); f++) {
+		int16_t centre = m_fingerprints[f * m_nodeCount + node];
+		device.distance[f] += square(mean - centre) - square(old - centre);
+	}
+} // refreshNode
+
+
+/**
+ * @brief Age out the buckets that left the window, for every node.  Free within a bucket.
+ */
+void BTPresenceClassifier::refresh(Device& device, uint32_t epoch) {
+	if (epoch <= device.epoch) {
+		return;
+	}
+	device.epoch = epoch;
+	for (uint8_t n = 0; n < m_nodeCount; n++) {
+		refreshNode(device, n, epoch);
+	}
+} // refresh
+
+
+/**
+ * @brief Pick the zone of a device from its distances.
+ */
+BTPresenceResult BTPresenceClassifier::decide(Device& device) {
+	BTPresenceResult result = { -1, UINT32_MAX, UINT32_MAX, false };
+	size_t count = m_zones.size();
+	if (count == 0) {
+		return result;
+	}
+
+	if (m_k == 1 || count == 1) {
+		size_t best = 0;
+		for (size_t f = 1; f < count; f++) {
+			if (device.distance[f] < device.distance[best]) {
+				best = f;
+			}
+		}
+		result.zone     = m_zones[best];
+		result.distance = device.distance[best];
+	} else {
+		// Let the k nearest fingerprints vote; ties go to the zone with the nearest fingerprint.
+		size_t k = std::min((size_t)m_k, count);
+		std::vector<uint32_t> order(count);
+		for (size_t f = 0; f < count; f++) {
+			order[f] = f;
+		}
+		const uint32_t* distance = device.distance.data();
+		std::partial_sort(order.begin(), order.begin() + k, order.end(),
+			[distance](uint32_t a, uint32_t b) { return distance[a] < distance[b]; });
+		size_t bestVotes = 0;
+		for (size_t i = 0; i < k; i++) {
+			size_t votes = 0;
+			for (size_t j = 0; j < k; j++) {
+				votes += m_zones[order[j]] == m_zones[order[i]];
+			}
+			if (votes > bestVotes) {   // Strictly more, so the nearest wins ties.
+				bestVotes       = votes;
+				result.zone     = m_zones[order[i]];
+				result.distance = distance[order[i]];
+			}
+		}
+	}
+
+	for (size_t f = 0; f < count; f++) {
+		if ((int32_t)m_zones[f] != result.zone) {   // 0 when a vote overruled a nearer zone.
+			uint32_t margin = device.distance[f] >= result.distance ? device.distance[f] - result.distance : 0;
+			result.margin   = std::min(result.margin, margin);
+		}
+	}
+	result.changed = result.zone != device.zone;
+	device.zone    = result.zone;
+	return result;
+} // decide
+
+
+/**
+ * @brief Record a sighting and classify the device.
+ *
+ * Costs O(fingerprints) for the node that made the sighting, plus O(nodes x fingerprints) at most
+ * once per bucket period per device when old buckets age out.
+ *
+ * @param [in] address The packed address of the device.
+ * @param [in] node The node that made the sighting.
+ * @param [in] rssi The RSSI of the sighting.
+ * @param [in] nowMs The time of the sighting, on a time base shared by all the nodes.
+ * @return The classification after the sighting.
+ */
+BTPresenceResult BTPresenceClassifier::ingest(uint64_t address, uint16_t node, int8_t rssi, uint64_t nowMs) {
+	BTPresenceResult result = { -1, UINT32_MAX, UINT32_MAX, false };
+	if (node >= m_nodeCount) {
+		return result;
+	}
+	uint32_t epoch = epochOf(nowMs);
+
+	std::unordered_map<uint64_t, uint32_t>::iterator it = m_index.find(address);
+	if (it == m_index.end()) {
+		it = m_index.insert(std::make_pair(address, (uint32_t)m_devices.size())).first;
+		m_devices.push_back(Device());
+		initDevice(m_devices.back(), epoch);
+		m_devices.back().address = address;
+	}
+	Device& device = m_devices[it->second];
+
+	if (epoch + BT_PRESENCE_BUCKETS > device.epoch) {   // Late sightings older than the window are dropped.
+		Bucket& bucket = device.buckets[node * BT_PRESENCE_BUCKETS + epoch % BT_PRESENCE_BUCKETS];
+		if (bucket.epoch != epoch) {   // Holds an older period that has left the window.
+			bucket.sum   = 0;
+			bucket.count = 0;
+			bucket.epoch = epoch;
+		}
+		if (bucket.count < UINT16_MAX) {
+			bucket.sum += rssi;
+			bucket.count++;
+		}
+		device.lastSeen = std::max(device.lastSeen, nowMs);
+	}
+
+	if (epoch > device.epoch) {
+		refresh(device, epoch);   // Covers this node too.
+	} else {
+		refreshNode(device, node, device.epoch);
+	}
+	return decide(device);
+} // ingest
+
+
+/**
+ * @brief Feed every entry of a merged snapshot, see BTScanSnapshot.
+ *
+ * Each entry counts as one sighting at its best RSSI and last seen time.
+ */
+void BTPresenceClassifier::ingest(const BTScanSnapshot& snapshot) {
+	const BTSnapshotEntry* entries = snapshot.getEntries();
+	for (size_t i = 0; i < snapshot.getCount(); i++) {
+		ingest(entries[i].address, entries[i].node, entries[i].bestRssi, entries[i].lastSeen);
+	}
+} // ingest
+
+
+/**
+ * @brief Classify a device as of a time, aging out sightings that left the window.
+ */
+BTPresenceResult BTPresenceClassifier::classify(uint64_t address, uint64_t nowMs) {
+	std::unordered_map<uint64_t, uint32_t>::iterator it = m_index.find(address);
+	if (it == m_index.end()) {
+		BTPresenceResult result = { -1, UINT32_MAX, UINT32_MAX, false };
+		return result;
+	}
+	Device& device = m_devices[it->second];
+	refresh(device, epochOf(nowMs));
+	return decide(device);
+} // classify
+
+
+/**
+ * @brief Get the windowed RSSI vector of a device.
+ * @param [in] address The packed address of the device.
+ * @param [in] nowMs The current time.
+ * @param [out] rssi Receives one RSSI per node, BT_PRESENCE_UNHEARD for nodes without sightings.
+ * @return False if the device is unknown.
+ */
+bool BTPresenceClassifier::getVector(uint64_t address, uint64_t nowMs, int8_t* rssi) {
+	std::unordered_map<uint64_t, uint32_t>::iterator it = m_index.find(address);
+	if (it == m_index.end()) {
+		return false;
+	}
+	Device& device = m_devices[it->second];
+	refresh(device, epochOf(nowMs));
+	for (uint8_t n = 0; n < m_nodeCount; n++) {
+		bool heard = false;
+		for (int b = 0; b < BT_PRESENCE_BUCKETS; b++) {
+			const Bucket& bucket = device.buckets[n * BT_PRESENCE_BUCKETS + b];
+			heard |= bucket.count > 0 && bucket.epoch + BT_PRESENCE_BUCKETS > device.epoch;
+		}
+		int16_t mean = device.mean[n];
+		rssi[n] = heard ? (int8_t)((mean >= 0 ? mean + 8 : mean - 8) / 16) : (int8_t)BT_PRESENCE_UNHEARD;
+	}
+	return true;
+} // getVector
+
+
+/**
+ * @brief Drop the devices without any sighting left in the window.
+ * @return The number of devices dropped.
+ */
+size_t BTPresenceClassifier::expire(uint64_t nowMs) {
+	uint64_t windowMs = (uint64_t)m_bucketMs * BT_PRESENCE_BUCKETS;
+	size_t   dropped  = 0;
+	for (size_t d = 0; d < m_devices.size();) {
+		if (m_devices[d].lastSeen + windowMs <= nowMs) {
+			forget(m_devices[d].address);   // Moves the last device into d.
+			dropped++;
+		} else {
+			d++;
+		}
+	}
+	return dropped;
+} // expire
+
+
+void BTPresenceClassifier::forget(uint64_t address) {
+	std::unordered_map<uint64_t, uint32_t>::iterator it = m_index.find(address);
+	if (it == m_index.end()) {
+		return;
+	}
+	uint32_t slot = it->second;
+	m_index.erase(it);
+	if (slot + 1 != m_devices.size()) {   // Move the last device into the freed slot.
+		m_index[m_devices.back().address] = slot;
+		m_devices[slot] = std::move(m_devices.back());
+	}
+	m_devices.pop_back();
+} // forget
+
+
+size_t BTPresenceClassifier::getDeviceCount() {
+	return m_devices.size();
+} // getDeviceCount
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
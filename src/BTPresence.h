@@ -0,0 +1,114 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_PRESENCE_H_
+#define _BT_PRESENCE_H_
+
+// Like BTScanSnapshot, plain C++11 so that it runs on the aggregating host as well as on a node.
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+#include "BTScanSnapshot.h"
+
+#define BT_PRESENCE_MAX_NODES     32
+#define BT_PRESENCE_BUCKETS       4      // Sub windows per sliding window.
+#define BT_PRESENCE_UNHEARD       (-128) // RSSI of a node that did not hear the device.
+
+/**
+ * @brief Outcome of classifying a device.
+ */
+struct BTPresenceResult {
+	int32_t  zone;       // Zone id, -1 if there are no fingerprints or the device is unknown.
+	uint32_t distance;   // Squared distance to the match, RSSI in 1/16 dB.
+	uint32_t margin;     // Distance to the runner up zone minus distance to the match.
+	bool     changed;    // The zone differs from the previous classification of the device.
+};
+
+
+/**
+ * @brief Decide which zone, typically a room, devices are in from the RSSI several scanners see.
+ *
+ * Sightings tagged with the node that made them are folded into a per device RSSI vector holding,
+ * per node, the mean RSSI over a sliding window.  The window is made of BT_PRESENCE_BUCKETS time
+ * buckets, so old sightings age out a bucket at a time without being stored individually.  A node
+ * without sightings in the window counts as the missing RSSI, -100 dBm by default.
+ *
+ * Zones are described by calibrated fingerprints: RSSI vectors recorded, or averaged, in each zone.
+ * With k = 1 a device goes to the zone of its nearest fingerprint, which is nearest centroid matching
+ * when there is one averaged fingerprint per zone; with k > 1 the k nearest fingerprints vote.
+ *
+ * All arithmetic is integer.  Every device keeps its squared distance to every fingerprint and a
+ * sighting only moves the component of the node that made it, so the distances are adjusted by the
+ * change of that one component rather than recomputed.
+ */
+class BTPresenceClassifier {
+public:
+	BTPresenceClassifier(uint8_t nodeCount, uint32_t windowMs = 10000);
+
+	int32_t          addFingerprint(uint16_t zone, const int8_t* rssi);
+	void             clearFingerprints();
+	void             setK(uint8_t k);
+	void             setMissingRssi(int8_t rssi);
+
+	BTPresenceResult ingest(uint64_t address, uint16_t node, int8_t rssi, uint64_t nowMs);
+	void             ingest(const BTScanSnapshot& snapshot);
+	BTPresenceResult classify(uint64_t address, uint64_t nowMs);
+	bool             getVector(uint64_t address, uint64_t nowMs, int8_t* rssi);
+	size_t           expire(uint64_t nowMs);
+	void             forget(uint64_t address);
+	size_t           getDeviceCount();
+
+private:
+	struct Bucket {
+		int32_t  sum;      // RSSI sum, in dB.
+		uint16_t count;
+		uint32_t epoch;    // Bucket number the sums belong to.
+	};
+	struct Device {
+		std::vector<Bucket>   buckets;    // nodeCount x BT_PRESENCE_BUCKETS.
+		std::vector<int16_t>  mean;       // Per node mean, in 1/16 dB.
+		std::vector<uint32_t> distance;   // Per fingerprint squared distance.
+		uint32_t              epoch;      // Bucket number the means were last computed for.
+		uint64_t              address;
+		uint64_t              lastSeen;
+		int32_t               zone;
+	};
+
+	uint32_t         epochOf(uint64_t ms);
+	void             initDevice(Device& device, uint32_t epoch);
+	void             refreshNode(Device& device, uint8_t node, uint32_t epoch);
+	void             refresh(Device& device, uint32_t epoch);
+	BTPresenceResult decide(Device& device);
+	void             rebuild();
+
+	uint8_t                               m_nodeCount;
+	uint32_t                              m_bucketMs;
+	uint8_t                               m_k;
+	int16_t                               m_missing;        // In 1/16 dB.
+	std::vector<int8_t>                   m_raw;            // fingerprint x node, as given.
+	std::vector<int16_t>                  m_fingerprints;   // fingerprint x node, in 1/16 dB.
+	std::vector<uint16_t>                 m_zones;          // Zone of each fingerprint.
+	std::vector<Device>                   m_devices;
+	std::unordered_map<uint64_t, uint32_t> m_index;        // Packed address to device.
+};
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
+#endif /* _BT_PRESENCE_H_ */
@@ -0,0 +1,190 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include "BTProfiler.h"
+
+#ifdef BT_PROFILING
+#include <string.h>
+
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32-hal-log.h"
+#endif
+
+#ifndef log_i
+#define log_i(...)
+#endif
+
+// Frequency of the cycle counter, used to convert ticks to time.  Changing the CPU frequency at run
+// time requires overriding it.
+#ifndef BT_PROFILE_CPU_MHZ
+  #ifdef CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+    #define BT_PROFILE_CPU_MHZ CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ
+  #else
+    #define BT_PROFILE_CPU_MHZ 240
+  #endif
+#endif
+
+BTLatencyHistogram BTProfiler::m_histograms[BT_STAGE_COUNT];
+
+
+BTLatencyHistogram::BTLatencyHistogram() {
+	reset();
+} // BTLatencyHistogram
+
+
+/**
+ * @brief Map a value to its bucket: values below 4 get a bucket each, then every power of two is
+ * split in 4 by the two bits following the most significant one.
+ */
+uint32_t BTLatencyHistogram::bucketOf(uint32_t value) {
+	if (value < 4) {
+		return value;
+	}
+	uint32_t msb = 31 - __builtin_clz(value);
+	return (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+} // bucketOf
+
+
+/**
+ * @brief Get the largest value that falls in a bucket.
+ */
+uint32_t BTLatencyHistogram::upperBound(uint32_t bucket) {
+	if (bucket < 4) {
+		return bucket;
+	}
+	uint32_t msb   = bucket / 4 + 1;
+	uint32_t lower = (4 | (bucket & 3)) << (msb - 2);
+	return lower + ((1u << (msb - 2)) - 1);
+} // upperBound
+
+
+void BTLatencyHistogram::add(uint32_t value) {
+	m_buckets[bucketOf(value)]++;
+	m_count++;
+	if (value > m_max) {
+		m_max = value;
+	}
+} // add
+
+
+void BTLatencyHistogram::reset() {
+	memset(m_buckets, 0, sizeof(m_buckets));
+	m_count = 0;
+	m_max   = 0;
+} // reset
+
+
+uint32_t BTLatencyHistogram::getCount() {
+	return m_count;
+} // getCount
+
+
+uint32_t BTLatencyHistogram::getMax() {
+	return m_max;
+} // getMax
+
+
+/**
+ * @brief Get a percentile of the recorded values.
+ * @param [in] percent The percentile wanted, e.g. 50 or 99.
+ * @return The upper bound of the bucket holding that percentile, never more than the maximum.
+ */
+uint32_t BTLatencyHistogram::percentile(uint8_t percent) {
+	if (m_count == 0) {
+		return 0;
+	}
+	uint64_t rank = ((uint64_t)m_count * percent + 99) / 100;   // Rounded up, at least 1.
+	if (rank == 0) {
+		rank = 1;
+	}
+	uint64_t seen = 0;
+	for (uint32_t i = 0; i < BT_HISTOGRAM_BUCKETS; i++) {
+		seen += m_buckets[i];
+		if (seen >= rank) {
+			uint32_t bound = upperBound(i);
+			return bound < m_max ? bound : m_max;
+		}
+	}
+	return m_max;
+} // percentile
+
+
+/**
+ * @brief Add a duration to a stage.
+ * @param [in] stage The stage that was timed.
+ * @param [in] ticks The duration, in BTProfiler::now() ticks.
+ */
+void BTProfiler::record(BTProfileStage stage, uint32_t ticks) {
+	m_histograms[stage].add(ticks);
+} // record
+
+
+BTLatencyHistogram& BTProfiler::getHistogram(BTProfileStage stage) {
+	return m_histograms[stage];
+} // getHistogram
+
+
+/**
+ * @brief Convert a duration from BTProfiler::now() ticks to nanoseconds.
+ */
+uint32_t BTProfiler::ticksToNanos(uint32_t ticks) {
+#if defined(ESP_PLATFORM) && defined(__XTENSA__)
+	return (uint32_t)((uint64_t)ticks * 1000 / BT_PROFILE_CPU_MHZ);
+#elif defined(ESP_PLATFORM)
+	return (uint32_t)((uint64_t)ticks * 1000);
+#else
+	return ticks;
+#endif
+} // ticksToNanos
+
+
+const char* BTProfiler::stageToString(BTProfileStage stage) {
+	switch (stage) {
+		case BT_STAGE_GAP_CALLBACK:      return "gap_callback";
+		case BT_STAGE_PARSE_DISC_RESULT: return "parse_disc_result";
+		case BT_STAGE_PARSE_EIR:         return "parse_eir";
+		case BT_STAGE_DEDUP:             return "dedup";
+		case BT_STAGE_INSERT:            return "insert";
+		case BT_STAGE_ON_RESULT:         return "on_result";
+		case BT_STAGE_SCAN_COMPLETE:     return "scan_complete";
+		default:                         return "Unknown";
+	}
+} // stageToString
+
+
+/**
+ * @brief Log the count, p50, p99 and maximum of every stage, in nanoseconds.
+ */
+void BTProfiler::dump() {
+	for (int i = 0; i < BT_STAGE_COUNT; i++) {
+		log_i("%-18s n=%u p50=%uns p99=%uns max=%uns", stageToString((BTProfileStage)i),
+			(unsigned)m_histograms[i].getCount(),
+			(unsigned)ticksToNanos(m_histograms[i].percentile(50)),
+			(unsigned)ticksToNanos(m_histograms[i].percentile(99)),
+			(unsigned)ticksToNanos(m_histograms[i].getMax()));
+	}
+} // dump
+
+
+void BTProfiler::reset() {
+	for (int i = 0; i < BT_STAGE_COUNT; i++) {
+		m_histograms[i].reset();
+	}
+} // reset
+
+#endif /* BT_PROFILING */
+#endif /* CONFIG_BT_ENABLED */
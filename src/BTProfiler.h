@@ -0,0 +1,141 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_PROFILER_H_
+#define _BT_PROFILER_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stdint.h>
+
+/*
+ * Stage profiling is opt-in: build with -DBT_PROFILING to enable it.  Without it the macros below
+ * expand to nothing and the profiler costs neither time nor memory.
+ *
+ *   BT_PROFILE_SCOPE(stage)        Time the rest of the enclosing block.
+ *   BT_PROFILE_BEGIN(mark)         Start timing a region, keeping the start in a local named mark.
+ *   BT_PROFILE_END(stage, mark)    Record the time elapsed since BT_PROFILE_BEGIN(mark).
+ */
+#ifdef BT_PROFILING
+  #define BT_PROFILE_CONCAT_(a, b)     a##b
+  #define BT_PROFILE_CONCAT(a, b)      BT_PROFILE_CONCAT_(a, b)
+  #define BT_PROFILE_SCOPE(stage)      BTProfileScope BT_PROFILE_CONCAT(_btProfileScope, __LINE__)(stage)
+  #define BT_PROFILE_BEGIN(mark)       uint32_t mark = BTProfiler::now()
+  #define BT_PROFILE_END(stage, mark)  BTProfiler::record(stage, BTProfiler::now() - (mark))
+#else
+  #define BT_PROFILE_SCOPE(stage)
+  #define BT_PROFILE_BEGIN(mark)
+  #define BT_PROFILE_END(stage, mark)
+#endif
+
+#ifdef BT_PROFILING
+
+#if defined(ESP_PLATFORM) && defined(__XTENSA__)
+#include <xtensa/hal.h>
+#elif defined(ESP_PLATFORM)
+#include <esp_timer.h>
+#else
+#include <chrono>
+#endif
+
+/**
+ * @brief The stages of the path from the radio reporting a device to the application seeing it.
+ */
+typedef enum {
+	BT_STAGE_GAP_CALLBACK,       // Whole GAP callback, from BTDevice::gapEventHandler entry to exit.
+	BT_STAGE_PARSE_DISC_RESULT,  // BTAdvertisedDevice::parseDiscResult().
+	BT_STAGE_PARSE_EIR,          // BTAdvertisedDevice::parseEir().
+	BT_STAGE_DEDUP,              // Lookup of the address in the results.
+	BT_STAGE_INSERT,             // Insertion of a new device in the results.
+	BT_STAGE_ON_RESULT,          // BTAdvertisedDeviceCallbacks::onResult().
+	BT_STAGE_SCAN_COMPLETE,      // Scan complete callback.
+	BT_STAGE_COUNT
+} BTProfileStage;
+
+#define BT_HISTOGRAM_BUCKETS 124
+
+/**
+ * @brief A fixed size log-linear histogram of durations.
+ *
+ * Each power of two is split into 4 buckets, so a reported percentile is within 25% of the true
+ * value whatever its magnitude.  Values below 8 are exact.
+ */
+class BTLatencyHistogram {
+public:
+	BTLatencyHistogram();
+	void     add(uint32_t value);
+	void     reset();
+	uint32_t getCount();
+	uint32_t getMax();
+	uint32_t percentile(uint8_t percent);
+
+private:
+	static uint32_t bucketOf(uint32_t value);
+	static uint32_t upperBound(uint32_t bucket);
+
+	uint32_t m_buckets[BT_HISTOGRAM_BUCKETS];
+	uint32_t m_count;
+	uint32_t m_max;
+};
+
+
+/**
+ * @brief Per stage latency histograms.
+ *
+ * Durations are measured in ticks of the cheapest clock available: the CPU cycle counter on Xtensa,
+ * esp_timer microseconds on other ESP32 targets and a steady clock in nanoseconds on a host, so
+ * profiles can be taken from simulated event streams.  Recording is not synchronized; all stages run
+ * on the Bluetooth task.
+ */
+class BTProfiler {
+public:
+	static inline uint32_t now() {
+#if defined(ESP_PLATFORM) && defined(__XTENSA__)
+		return xthal_get_ccount();
+#elif defined(ESP_PLATFORM)
+		return (uint32_t)esp_timer_get_time();
+#else
+		return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+	static void                record(BTProfileStage stage, uint32_t ticks);
+	static BTLatencyHistogram& getHistogram(BTProfileStage stage);
+	static uint32_t            ticksToNanos(uint32_t ticks);
+	static const char*         stageToString(BTProfileStage stage);
+	static void                dump();
+	static void                reset();
+
+private:
+	static BTLatencyHistogram m_histograms[BT_STAGE_COUNT];
+};
+
+
+/**
+ * @brief Records the lifetime of a block into a stage, see BT_PROFILE_SCOPE.
+ */
+class BTProfileScope {
+public:
+	BTProfileScope(BTProfileStage stage) : m_stage(stage), m_start(BTProfiler::now()) {}
+	~BTProfileScope() { BTProfiler::record(m_stage, BTProfiler::now() - m_start); }
+
+private:
+	BTProfileStage m_stage;
+	uint32_t       m_start;
+};
+
+#endif /* BT_PROFILING */
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_PROFILER_H_ */
@@ -0,0 +1,292 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <algorithm>
+
+#include "BTRssiHistory.h"
+
+static const uint8_t longForm = 0x80;
+
+
+static size_t putVarint(uint8_t* target, uint32_t value) {
+	size_t i = 0;
+	while (value >= 0x80) {
+		target[i++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	target[i++] = (uint8_t)value;
+	return i;
+} // putVarint
+
+
+static size_t getVarint(const uint8_t* source, size_t length, uint32_t* value) {
+	uint32_t result = 0;
+	for (size_t i = 0; i < length && i < 5; i++) {
+		result |= (uint32_t)(source[i] & 0x7f) << (7 * i);
+		if ((source[i] & 0x80) == 0) {
+			*value = result;
+			return i + 1;
+		}
+	}
+	return 0;
+} // getVarint
+
+
+static uint32_t zigzag(int32_t value) {
+	return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+} // zigzag
+
+
+static int32_t unzigzag(uint32_t value) {
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+} // unzigzag
+
+
+/**
+ * @param [in] blocks The number of blocks, each holding BT_RSSI_HISTORY_BLOCK_BYTES of samples.
+ * @param [in] pAllocator Where the blocks come from.
+ */
+BTRssiHistory::BTRssiHistory(uint8_t blocks, BTAllocator* pAllocator) :
+	m_blocks(BTStlAllocator<Block>(pAllocator)) {
+	m_blocks.resize(std::max(blocks, (uint8_t)2));
+	clear();
+} // BTRssiHistory
+
+
+void BTRssiHistory::clear() {
+	m_head  = 0;
+	m_used  = 0;
+	m_count = 0;
+} // clear
+
+
+/**
+ * @brief Append a sample.  Samples must come in time order; an earlier time is taken as the last one.
+ * @param [in] timeMs The time of the sample in milliseconds since boot.
+ * @param [in] rssi The RSSI.
+ */
+void BTRssiHistory::add(uint32_t timeMs, int8_t rssi) {
+	if (m_used > 0) {
+		Block& block = m_blocks[(m_head + m_used - 1) % m_blocks.size()];
+		uint32_t units = timeMs > block.lastTime ?
+			(timeMs - block.lastTime + BT_RSSI_HISTORY_UNIT_MS / 2) / BT_RSSI_HISTORY_UNIT_MS : 0;
+		uint32_t delta = zigzag(rssi - block.lastRssi);
+
+		uint8_t encoded[11];
+		size_t  length;
+		if (units < 16 && delta < 8) {
+			encoded[0] = (uint8_t)((units << 3) | delta);
+			length = 1;
+		} else {
+			encoded[0] = longForm;
+			length = 1 + putVarint(encoded + 1, units);
+			length += putVarint(encoded + length, delta);
+		}
+
+		if (block.used + length <= BT_RSSI_HISTORY_BLOCK_BYTES) {
+			std::copy(encoded, encoded + length, block.data + block.used);
+			block.used     += length;
+			block.lastTime += units * BT_RSSI_HISTORY_UNIT_MS;
+			block.lastRssi  = rssi;
+			block.minRssi   = std::min(block.minRssi, rssi);
+			block.maxRssi   = std::max(block.maxRssi, rssi);
+			block.sum      += rssi;
+			block.count++;
+			m_count++;
+			return;
+		}
+		timeMs = std::max(timeMs, block.lastTime);   // The new block must not start before this one ends.
+	}
+
+	// Open a new block, dropping the oldest one when all are in use.
+	if (m_used == m_blocks.size()) {
+		m_count -= m_blocks[m_head].count;
+		m_head = (m_head + 1) % m_blocks.size();
+		m_used--;
+	}
+	Block& block = m_blocks[(m_head + m_used) % m_blocks.size()];
+	m_used++;
+	block.firstTime = timeMs;
+	block.lastTime  = timeMs;
+	block.firstRssi = rssi;
+	block.lastRssi  = rssi;
+	block.minRssi   = rssi;
+	block.maxRssi   = rssi;
+	block.sum       = rssi;
+	block.count     = 1;
+	block.used      = 0;
+	m_count++;
+} // add
+
+
+const BTRssiHistory::Block& BTRssiHistory::blockAt(size_t i) const {
+	return m_blocks[(m_head + i) % m_blocks.size()];
+} // blockAt
+
+
+/**
+ * @brief Call visitor(time, rssi) for every sample of a block, oldest first.
+ */
+template <typename Visitor>
+void BTRssiHistory::decode(const Block& block, Visitor& visitor) const {
+	uint32_t time = block.firstTime;
+	int32_t  rssi = block.firstRssi;
+	visitor(time, (int8_t)rssi);
+	size_t i = 0;
+	while (i < block.used) {
+		uint32_t units = 0;
+		uint32_t delta = 0;
+		if ((block.data[i] & longForm) == 0) {
+			units = block.data[i] >> 3;
+			delta = block.data[i] & 0x07;
+			i++;
+		} else {
+			i++;
+			i += getVarint(block.data + i, block.used - i, &units);
+			i += getVarint(block.data + i, block.used - i, &delta);
+		}
+		time += units * BT_RSSI_HISTORY_UNIT_MS;
+		rssi += unzigzag(delta);
+		visitor(time, (int8_t)rssi);
+	}
+} // decode
+
+
+size_t BTRssiHistory::getCount() const {
+	return m_count;
+} // getCount
+
+
+/**
+ * @brief Get the time of the oldest sample held, 0 if there is none.
+ */
+uint32_t BTRssiHistory::getFirstTime() const {
+	return m_used > 0 ? blockAt(0).firstTime : 0;
+} // getFirstTime
+
+
+/**
+ * @brief Get the time of the latest sample, 0 if there is none.
+ */
+uint32_t BTRssiHistory::getLastTime() const {
+	return m_used > 0 ? blockAt(m_used - 1).lastTime : 0;
+} // getLastTime
+
+
+size_t BTRssiHistory::getMemoryUsage() const {
+	return sizeof(*this) + m_blocks.size() * sizeof(Block);
+} // getMemoryUsage
+
+
+/**
+ * @brief Get the samples in a time range.  Only the blocks overlapping the range are decoded.
+ * @param [in] fromMs Start of the range, inclusive.
+ * @param [in] toMs End of the range, inclusive.
+ * @param [out] samples Receives the samples, oldest first.
+ * @param [in] maxSamples The size of samples.
+ * @return The number of samples written.
+ */
+size_t BTRssiHistory::query(uint32_t fromMs, uint32_t toMs, BTRssiSample* samples, size_t maxSamples) const {
+	size_t written = 0;
+	auto collect = [&](uint32_t time, int8_t rssi) {
+		if (time >= fromMs && time <= toMs && written < maxSamples) {
+			samples[written].time = time;
+			samples[written].rssi = rssi;
+			written++;
+		}
+	};
+	for (size_t b = 0; b < m_used && written < maxSamples; b++) {
+		const Block& block = blockAt(b);
+		if (block.firstTime > toMs) {
+			break;
+		}
+		if (block.lastTime >= fromMs) {
+			decode(block, collect);
+		}
+	}
+	return written;
+} // query
+
+
+/**
+ * @brief Summarise a time range in fixed width buckets.
+ * @param [in] fromMs Start of the first bucket.
+ * @param [in] toMs End of the range, inclusive.
+ * @param [in] bucketMs Width of a bucket.
+ * @param [out] buckets Receives the buckets.
+ * @param [in] maxBuckets The size of buckets; samples beyond the last bucket are ignored.
+ * @return The number of buckets written, empty ones included.
+ */
+size_t BTRssiHistory::downsample(uint32_t fromMs, uint32_t toMs, uint32_t bucketMs,
+		BTRssiBucket* buckets, size_t maxBuckets) const {
+	if (bucketMs == 0 || toMs < fromMs) {
+		return 0;
+	}
+	size_t count = std::min((size_t)((toMs - fromMs) / bucketMs + 1), maxBuckets);
+	for (size_t i = 0; i < count; i++) {
+		buckets[i].start = fromMs + i * bucketMs;
+		buckets[i].count = 0;
+		buckets[i].sum   = 0;
+		buckets[i].min   = INT8_MAX;
+		buckets[i].max   = INT8_MIN;
+	}
+	auto fold = [&](uint32_t time, int8_t rssi) {
+		if (time < fromMs || time > toMs) {
+			return;
+		}
+		size_t i = (time - fromMs) / bucketMs;
+		if (i < count) {
+			buckets[i].count++;
+			buckets[i].sum += rssi;
+			buckets[i].min  = std::min(buckets[i].min, rssi);
+			buckets[i].max  = std::max(buckets[i].max, rssi);
+		}
+	};
+
+	for (size_t b = 0; b < m_used; b++) {
+		const Block& block = blockAt(b);
+		if (block.firstTime > toMs) {
+			break;
+		}
+		if (block.lastTime < fromMs) {
+			continue;
+		}
+		size_t first = (block.firstTime >= fromMs) ? (block.firstTime - fromMs) / bucketMs : count;
+		size_t last  = (block.lastTime <= toMs) ? (block.lastTime - fromMs) / bucketMs : count;
+		if (first == last && first < count) {
+			// The whole block falls in one bucket: its header has all we need.
+			buckets[first].count += block.count;
+			buckets[first].sum   += block.sum;
+			buckets[first].min    = std::min(buckets[first].min, block.minRssi);
+			buckets[first].max    = std::max(buckets[first].max, block.maxRssi);
+		} else {
+			decode(block, fold);
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		if (buckets[i].count > 0) {
+			int32_t sum = buckets[i].sum;
+			int32_t n   = buckets[i].count;
+			buckets[i].mean = (int8_t)((sum >= 0 ? sum + n / 2 : sum - n / 2) / n);
+		} else {
+			buckets[i].mean = 0;
+		}
+	}
+	return count;
+} // downsample
+
+#endif /* CONFIG_BT_ENABLED */
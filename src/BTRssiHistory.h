@@ -0,0 +1,103 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_RSSI_HISTORY_H_
+#define _BT_RSSI_HISTORY_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "BTAllocator.h"
+
+#define BT_RSSI_HISTORY_BLOCK_BYTES 48    // Encoded samples per block, after the one in the header.
+#define BT_RSSI_HISTORY_BLOCKS      6     // Default number of blocks.
+#ifndef BT_RSSI_HISTORY_UNIT_MS
+  #define BT_RSSI_HISTORY_UNIT_MS   100   // Time resolution of the samples.
+#endif
+
+struct BTRssiSample {
+	uint32_t time;   // Milliseconds since boot, rounded to BT_RSSI_HISTORY_UNIT_MS.
+	int8_t   rssi;
+};
+
+/**
+ * @brief One bucket of BTRssiHistory::downsample().
+ */
+struct BTRssiBucket {
+	uint32_t start;  // Milliseconds since boot.
+	uint32_t count;  // Samples in the bucket, the other fields are only valid when not 0.
+	int32_t  sum;
+	int8_t   min;
+	int8_t   max;
+	int8_t   mean;
+};
+
+
+/**
+ * @brief A fixed size ring of RSSI samples.
+ *
+ * Samples go into blocks.  A block header holds the first sample in full along with the time span and
+ * the minimum, maximum and sum of the block; the other samples are stored as deltas to the previous
+ * one.  A sample less than 16 units after the previous one and within -4 to +3 dB of it takes a single
+ * byte, [0][time: 4][zigzag rssi: 3]; any other takes [0x80][varint time][varint zigzag rssi].  With
+ * steady sightings a block of 48 bytes holds around 50 samples.
+ *
+ * When every block is full the oldest block is dropped.  Queries use the headers to skip the blocks
+ * outside their range, and downsample() folds a block that lies in a single bucket from its header
+ * without decoding it.  The blocks come from the allocator given to the constructor.
+ */
+class BTRssiHistory {
+public:
+	BTRssiHistory(uint8_t blocks = BT_RSSI_HISTORY_BLOCKS, BTAllocator* pAllocator = BTAllocator::getDefault());
+
+	void     add(uint32_t timeMs, int8_t rssi);
+	void     clear();
+	size_t   getCount() const;
+	uint32_t getFirstTime() const;
+	uint32_t getLastTime() const;
+	size_t   getMemoryUsage() const;
+
+	size_t   query(uint32_t fromMs, uint32_t toMs, BTRssiSample* samples, size_t maxSamples) const;
+	size_t   downsample(uint32_t fromMs, uint32_t toMs, uint32_t bucketMs, BTRssiBucket* buckets, size_t maxBuckets) const;
+
+private:
+	struct Block {
+		uint32_t firstTime;
+		uint32_t lastTime;
+		int32_t  sum;
+		uint16_t count;
+		int8_t   firstRssi;
+		int8_t   lastRssi;
+		int8_t   minRssi;
+		int8_t   maxRssi;
+		uint8_t  used;       // Bytes of data in use.
+		uint8_t  data[BT_RSSI_HISTORY_BLOCK_BYTES];
+	};
+
+	template <typename Visitor>
+	void           decode(const Block& block, Visitor& visitor) const;
+	const Block&   blockAt(size_t i) const;   // i-th block in use, oldest first.
+
+	std::vector<Block, BTStlAllocator<Block> > m_blocks;
+	uint8_t                                    m_head;    // Oldest block.
+	uint8_t                                    m_used;    // Blocks in use.
+	size_t                                     m_count;   // Samples held.
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_RSSI_HISTORY_H_ */
@@ -17,6 +17,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <cmath>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
@@ -24,6 +25,10 @@
 #include "esp_bt_main.h"
 #include "esp_gap_bt_api.h"
 #include "esp_bt_device.h"
+#include "esp_timer.h"
+#ifdef ESP_PLATFORM
+#include "esp_system.h"
+#endif
 #include <esp_log.h>
 #include <algorithm>
 #include "GeneralUtils.h" 
@@ -36,6 +41,8 @@
 #endif
 
 #include "BTScan.h"
+#include "BTProfiler.h"
+#include "BTDevice.h"
 
 /*
 static char *uuid2str(esp_bt_uuid_t *uuid, char *str, size_t size){
@@ -60,14 +67,115 @@ static char *uuid2str(esp_bt_uuid_t *uuid, char *str, size_t size){
 }
 */
 
+const uint32_t BTScanResults::NO_SLOT;
+
+
+/**
+ * @brief Home bucket of an address in the results index, before masking.
+ */
+static inline size_t indexHash(uint64_t address) {
+	return (size_t)((address * 0x9E3779B97F4A7C15ULL) >> 32);
+} // indexHash
+
+
+/**
+ * @brief Pick the RSSI out of a discovery result without parsing the rest of it.
+ * @param [in] disc_res The discovery result.
+ * @return The RSSI, or -128 if the result has none.
+ */
+/* STATIC */ int8_t BTScan::discResultRSSI(esp_bt_gap_cb_param_t::disc_res_param* disc_res) {
+	for (int i = 0; i < disc_res->num_prop; i++) {
+		if (disc_res->prop[i].type == ESP_BT_GAP_DEV_PROP_RSSI) {
+			return *(int8_t*)(disc_res->prop[i].val);
+		}
+	}
+	return -128;
+} // discResultRSSI
+
+
+/**
+ * @brief Hash the EIR and CoD of a discovery result without parsing it, see BTEirIndex::hash().
+ * @return The hash, or 0 if the result cannot be matched against a stored record: it carries a
+ * remote name or a malformed EIR.
+ */
+static uint32_t discResultHash(esp_bt_gap_cb_param_t::disc_res_param* disc_res) {
+	const uint8_t* eir    = nullptr;
+	size_t         eirLen = 0;
+	uint32_t       cod    = 0;
+	for (int i = 0; i < disc_res->num_prop; i++) {
+		esp_bt_gap_dev_prop_t* p = disc_res->prop + i;
+		switch (p->type) {
+			case ESP_BT_GAP_DEV_PROP_COD: {
+				cod = *(uint32_t*)(p->val);
+				break;
+			}
+			case ESP_BT_GAP_DEV_PROP_EIR: {
+				if (p->val == nullptr || p->len > ESP_BT_GAP_EIR_DATA_LEN) {
+					return 0;
+				}
+				eir    = (const uint8_t*)(p->val);
+				eirLen = p->len;
+				break;
+			}
+			case ESP_BT_GAP_DEV_PROP_BDNAME: {
+				return 0;
+			}
+			default: {
+				break;
+			}
+		} // switch
+	}
+	uint32_t h = BTEirIndex::hash(eir, eirLen, cod);
+	return h != 0 ? h : 1;
+} // discResultHash
+
+
  BTScan::BTScan() {
 	m_pAdvertisedDeviceCallbacks     = nullptr;
 	m_stopped                        = true;
 	m_wantDuplicates                 = false;
+	m_arenaSize                      = BT_SCAN_ARENA_SIZE;
+	m_scanCompleteCB                 = nullptr;
+	m_scanCompleteRefCB              = nullptr;
+	m_dualMode                       = false;
+	m_classicSlice                   = 4;
+	m_bleSlice                       = 2;
+	m_budgetEnd                      = 0;
+	m_sliceTransport                 = BT_TRANSPORT_CLASSIC;
+	m_bleScanning                    = false;
+	m_bleParamsSet                   = false;
+	m_bleSliceSeconds                = 0;
+	m_startRequested                 = 0;
+	m_restartLatencyMs               = 0;
+	m_firstResultMs                  = 0;
+	m_pServiceDiscovery              = nullptr;
+	m_matchOnly                      = false;
+	m_pDepartureWheel                = nullptr;
+	m_watchdogTimer                  = nullptr;
+	m_watchdogGraceMs                = BT_SCAN_WATCHDOG_GRACE_MS;
+	m_watchdogRetries                = 2;
+	m_watchdogReinit                 = true;
+	m_watchdogTask                   = nullptr;
+	m_watchdogArmed                  = 0;
+	m_missedDeadlines                = 0;
+	m_slice                          = 1;
+	m_inquirySlice                   = 0;
+	m_scanActive                     = false;
+	m_maxLatencyMs                   = 0;
+	m_recoveryStart                  = 0;
+	m_recoveryMs                     = 0;
+	m_recoveryMaxMs                  = 0;
 } // BLEScan
 
 
 BTScan::~BTScan(void) {
+	if (m_watchdogTimer != nullptr) {
+		esp_timer_stop(m_watchdogTimer);
+		esp_timer_delete(m_watchdogTimer);
+	}
+	if (m_watchdogTask != nullptr) {
+		vTaskDelete(m_watchdogTask);
+	}
     stop_bt();
 }
 
@@ -77,42 +185,49 @@ void BTScan::handleGAPEvent( esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t*
             if (m_stopped) { // If we are not scanning, nothing to do with the extra results.
 			    break;
 			}
+            m_metrics.inc(m_metrics.discResults);
 
             // Examine our list of previously scanned addresses and, if we found this one already,
             // ignore it.
             BTAddress advertisedAddress(param->disc_res.bda);
-            bool found = false;
-
-            for (int i=0; i<m_scanResults.getCount(); i++) {
-                if (m_scanResults.getDevice(i).getAddress().equals(advertisedAddress)) {
-                    found = true;
-                    break;
-                }
+            uint64_t  packedAddress = advertisedAddress.toUint64();
+            int32_t   slot;
+            if (m_matchOnly && !m_watchlist.contains(packedAddress)) {
+                m_metrics.inc(m_metrics.watchlistDropped);
+                break;
             }
-            if (found && !m_wantDuplicates) {  // If we found a previous entry AND we don't want duplicates, then we are done.
+            if (isDuplicate(packedAddress, discResultRSSI(&param->disc_res), BT_TRANSPORT_CLASSIC, &slot)) {
                 log_d("Ignoring %s, already seen it.", advertisedAddress.toString().c_str());
                 vTaskDelay(1);
                 break;
             }
 
+            // A repeat sighting with the same EIR and CoD as the stored record reuses it in place;
+            // only the RSSI (refreshed by isDuplicate()) and the timestamp (by addSighting()) change.
+            uint32_t eirHash = discResultHash(&param->disc_res);
+            if (slot >= 0) {
+                if (eirHash != 0 && m_scanResults.m_hot[slot].eirHash == eirHash) {
+                    m_metrics.inc(m_metrics.eirCacheHits);
+                    addSighting(m_scanResults.m_vectorAdvertisedDevices[slot], packedAddress, slot);
+                    break;
+                }
+                m_metrics.inc(m_metrics.eirCacheMisses);
+            }
+
             // We now construct a model of the advertised device that we have just found for the first
-            // time.
+            // time, or that changed what it advertises.
             BTAdvertisedDevice advertisedDevice;
             log_d( "Device found: %s", advertisedAddress.toString().c_str());
 
             advertisedDevice.setAddress(advertisedAddress);
-            advertisedDevice.parseDiscResult(&param->disc_res);
             advertisedDevice.setScan(this);
-
-            if (m_pAdvertisedDeviceCallbacks) {
-                m_pAdvertisedDeviceCallbacks->onResult(advertisedDevice);
+            advertisedDevice.setArena(&m_arena);
+            bool parsed = advertisedDevice.parseDiscResult(&param->disc_res);
+            if (!parsed) {
+                m_metrics.inc(m_metrics.parseFailures);
+                eirHash = 0;
             }
-
-            if (!found) {   // If we have previously seen this device, don't record it again.
-                m_scanResults.m_vectorAdvertisedDevices.push_back(advertisedDevice);
-            }
-
-
+            addSighting(advertisedDevice, packedAddress, slot, eirHash, slot >= 0 && parsed);
             break;
         }
 		case ESP_BT_GAP_DISC_STATE_CHANGED_EVT: {
@@ -123,15 +238,28 @@ void BTScan::handleGAPEvent( esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t*
 				// Event that indicates that the duration allowed for the search has completed or that we have been
 				// asked to stop.
 				case ESP_BT_GAP_DISCOVERY_STOPPED: {
-					m_stopped = true;
-					if (m_scanCompleteCB != nullptr) {
-						m_scanCompleteCB(m_scanResults);
+					// Stale unless the inquiry of the current slice reported started: it ends one the
+					// watchdog gave up on, possibly before that one even started.  Once stop() was called
+					// any stop event will do.
+					uint32_t slice   = m_slice;
+					uint32_t inquiry = m_inquirySlice.exchange(0);
+					if ((inquiry != slice && !(m_stopped && inquiry == 0)) ||
+						(m_sliceTransport != BT_TRANSPORT_CLASSIC && !m_stopped) || !claimSlice(slice)) {
+						break;
+					}
+					m_missedDeadlines = 0;
+					if (m_stopped || !nextSlice()) {
+						scanCompleted();
 					}
-					m_semaphoreScanEnd.give();
 					break;
 				} // ESP_BT_GAP_DISC_STATE_CHANGED_EVT
 				case ESP_BT_GAP_DISCOVERY_STARTED: {
 					 log_i("Discovery started.");
+					m_inquirySlice = m_slice.load();
+					if (m_startRequested != 0) {
+						m_restartLatencyMs = (uint32_t)((esp_timer_get_time() - m_startRequested) / 1000);
+						m_startRequested   = 0;
+					}
 					break;
 				}
 				default: {
@@ -140,12 +268,413 @@ void BTScan::handleGAPEvent( esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t*
 			} // switch - search_evt
 			break;
 		} // ESP_GAP_BLE_SCAN_RESULT_EVT
+		case ESP_BT_GAP_RMT_SRVCS_EVT: {
+			if (m_pServiceDiscovery == nullptr) {
+				break;
+			}
+			uint32_t now     = (uint32_t)(esp_timer_get_time() / 1000);
+			uint64_t address = BTAddress(param->rmt_srvcs.bda).toUint64();
+			if (m_pServiceDiscovery->onServices(&param->rmt_srvcs, now)) {
+				int32_t slot = m_scanResults.find(address);
+				if (slot >= 0) {
+					BTAdvertisedDevice& stored = m_scanResults.m_vectorAdvertisedDevices[slot];
+					m_pServiceDiscovery->merge(address, stored);
+					if (m_pAdvertisedDeviceCallbacks) {
+						m_pAdvertisedDeviceCallbacks->onServicesDiscovered(stored);
+					}
+				}
+			}
+			if (m_stopped) {
+				m_pServiceDiscovery->pump(now);
+			}
+			break;
+		} // ESP_BT_GAP_RMT_SRVCS_EVT
 		default: {
 			break;
 		} // default
 	} // End switch
 } // gapEventHandler
 
+
+#ifdef BT_HAVE_BLE
+/**
+ * @brief Handle BLE GAP events during a dual mode scan.
+ *
+ * BLE advertisements go through the same dedup, tracking and callback path as classic results, into
+ * the same results.
+ */
+void BTScan::handleBLEGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+	m_metrics.inc(m_metrics.eventsReceived);
+	switch(event) {
+		case ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT: {
+			m_bleParamsSet = true;
+			if (m_bleScanning && !m_stopped) {
+				esp_err_t errRc = esp_ble_gap_start_scanning(m_bleSliceSeconds);
+				if (errRc != ESP_OK) {
+					log_e("esp_ble_gap_start_scanning: err: %d, text: %s", errRc, GeneralUtils::errorToString(errRc));
+					m_metrics.inc(m_metrics.inquiryErrors);
+					m_bleScanning = false;
+					if (claimSlice(m_slice)) {
+						scanCompleted();
+					}
+				}
+			}
+			break;
+		} // ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT
+
+		case ESP_GAP_BLE_SCAN_RESULT_EVT: {
+			switch(param->scan_rst.search_evt) {
+				case ESP_GAP_SEARCH_INQ_RES_EVT: {
+					if (m_stopped) {
+						break;
+					}
+					m_metrics.inc(m_metrics.discResults);
+
+					BTAddress advertisedAddress(param->scan_rst.bda);
+					uint64_t  packedAddress = advertisedAddress.toUint64();
+					int32_t   slot;
+					if (m_matchOnly && !m_watchlist.contains(packedAddress)) {
+						m_metrics.inc(m_metrics.watchlistDropped);
+						break;
+					}
+					if (isDuplicate(packedAddress, (int8_t)param->scan_rst.rssi, BT_TRANSPORT_BLE, &slot)) {
+						break;
+					}
+
+					BTAdvertisedDevice advertisedDevice;
+					log_d("BLE device found: %s", advertisedAddress.toString().c_str());
+					advertisedDevice.setAddress(advertisedAddress);
+					advertisedDevice.setScan(this);
+					advertisedDevice.setArena(&m_arena);
+					if (!advertisedDevice.parseBleResult(&param->scan_rst)) {
+						m_metrics.inc(m_metrics.parseFailures);
+					}
+					addSighting(advertisedDevice, packedAddress, slot);
+					break;
+				} // ESP_GAP_SEARCH_INQ_RES_EVT
+
+				case ESP_GAP_SEARCH_INQ_CMPL_EVT: {
+					if (!m_bleScanning.exchange(false) || !claimSlice(m_slice)) {
+						break;   // A slice the watchdog already stopped.
+					}
+					m_missedDeadlines = 0;
+					if (m_stopped || !nextSlice()) {
+						scanCompleted();
+					}
+					break;
+				} // ESP_GAP_SEARCH_INQ_CMPL_EVT
+
+				default: {
+					break;
+				}
+			} // switch - search_evt
+			break;
+		} // ESP_GAP_BLE_SCAN_RESULT_EVT
+
+		case ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT: {
+			// Only stop() waits for this; a slice the watchdog stopped was already replaced.
+			if (m_stopped && m_bleScanning.exchange(false) && claimSlice(m_slice)) {
+				scanCompleted();
+			}
+			break;
+		} // ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT
+
+		default: {
+			break;
+		}
+	} // switch
+} // handleBLEGAPEvent
+#endif
+
+
+/**
+ * @brief Look up a sighting in the results.
+ *
+ * A device already in the results has its hot entry refreshed and the transport recorded.
+ *
+ * @param [in] packedAddress The address of the device.
+ * @param [in] rssi The RSSI of the sighting.
+ * @param [in] transport The BT_TRANSPORT_* the device was seen on.
+ * @param [out] pSlot Receives the slot of the device, or -1 if it is new.
+ * @return True if the sighting should be ignored: the device is known on this transport and duplicates
+ * are not wanted.
+ */
+bool BTScan::isDuplicate(uint64_t packedAddress, int8_t rssi, uint8_t transport, int32_t* pSlot) {
+	BT_PROFILE_SCOPE(BT_STAGE_DEDUP);
+	int32_t slot = m_scanResults.find(packedAddress);
+	*pSlot = slot;
+	if (slot < 0) {
+		return false;
+	}
+	uint32_t now = (uint32_t)(esp_timer_get_time() / 1000);
+	m_scanResults.touch(slot, now, rssi);
+	BTAdvertisedDevice& stored = m_scanResults.m_vectorAdvertisedDevices[slot];
+	if (m_pDepartureWheel != nullptr) {
+		m_pDepartureWheel->touch(packedAddress, now, BTDepartureWheel::majorClassOf(stored.getCod()));
+	}
+	if (rssi != -128) {
+		stored.m_rssi     = rssi;   // Keep getRSSI() on the latest sighting, not the first.
+		stored.m_haveRSSI = true;
+	}
+	bool newTransport = (stored.m_transports & transport) == 0;
+	stored.m_transports |= transport;
+	if (!m_wantDuplicates && !newTransport) {
+		m_metrics.inc(m_metrics.duplicatesSuppressed);
+		return true;
+	}
+	return false;
+} // isDuplicate
+
+
+/**
+ * @brief Report a parsed sighting and store it if the device is new.
+ * @param [in] device The device parsed from the sighting, or the stored record of slot when it is
+ * reused as is; its timestamp is set to now.
+ * @param [in] packedAddress The address of the device.
+ * @param [in] slot The slot returned by isDuplicate().
+ * @param [in] eirHash The hash of the EIR and CoD the device was parsed from, 0 if it was not.
+ * @param [in] replace The device is known but advertises something new: its record in slot is
+ * replaced by this one.
+ */
+void BTScan::addSighting(BTAdvertisedDevice& device, uint64_t packedAddress, int32_t slot, uint32_t eirHash, bool replace) {
+	device.setTimestamp((uint32_t)(esp_timer_get_time() / 1000));
+	if (m_firstResultMs == 0) {
+		m_firstResultMs = device.getTimestamp();
+	}
+	if (slot >= 0) {
+		device.m_transports |= m_scanResults.m_vectorAdvertisedDevices[slot].m_transports;
+	}
+	m_tracker.update(device);
+	if (slot < 0 && m_pDepartureWheel != nullptr) {
+		m_pDepartureWheel->touch(packedAddress, device.getTimestamp(), BTDepartureWheel::majorClassOf(device.getCod()));
+	}
+	if ((slot < 0 || replace) && m_pServiceDiscovery != nullptr && (device.m_transports & BT_TRANSPORT_CLASSIC)) {
+		m_pServiceDiscovery->lookup(device, packedAddress, device.getTimestamp());   // Cached services are reported with the device.
+	}
+
+	if (m_pAdvertisedDeviceCallbacks) {
+		bool empty = false;   // In match-only mode the result already matched, no need to look again.
+		if (m_matchOnly || m_watchlist.contains(packedAddress, &empty)) {
+			m_pAdvertisedDeviceCallbacks->onWatchlistHit(device);
+		} else if (!empty) {
+			m_pAdvertisedDeviceCallbacks->onWatchlistMiss(device);
+		}
+	}
+
+	if (m_pAdvertisedDeviceCallbacks) {
+		BT_PROFILE_BEGIN(onResultStart);
+		int64_t callbackStart = esp_timer_get_time();
+		m_pAdvertisedDeviceCallbacks->onResult(device);
+		BT_PROFILE_END(BT_STAGE_ON_RESULT, onResultStart);
+		m_metrics.addCallbackTime((uint32_t)(esp_timer_get_time() - callbackStart));
+	}
+
+	if (slot < 0) {   // If we have previously seen this device, don't record it again.
+		m_metrics.inc(m_metrics.uniqueDevices);
+		if (m_scanResults.isFull()) {
+			m_metrics.inc(m_metrics.evictions);
+			if (m_pAdvertisedDeviceCallbacks) {
+				m_pAdvertisedDeviceCallbacks->onEvicted(m_scanResults.m_vectorAdvertisedDevices[m_scanResults.m_lruTail]);
+			}
+		}
+		BT_PROFILE_BEGIN(insertStart);
+		uint32_t stored = m_scanResults.insert(packedAddress, device);
+		m_scanResults.m_hot[stored].eirHash = eirHash;
+		BT_PROFILE_END(BT_STAGE_INSERT, insertStart);
+	} else if (replace) {
+		m_scanResults.m_vectorAdvertisedDevices[slot] = device;
+		m_scanResults.m_hot[slot].eirHash = eirHash;
+	}
+} // addSighting
+
+
+/**
+ * @brief Close the current scan: log departures, run the completion callback and release waiters.
+ */
+void BTScan::scanCompleted() {
+	if (!m_scanActive.exchange(false)) {
+		return;   // Already closed, by the watchdog or by a late event.
+	}
+	if (m_watchdogTimer != nullptr) {
+		esp_timer_stop(m_watchdogTimer);
+	}
+	if (m_recoveryStart != 0) {
+		m_recoveryMs    = (uint32_t)((esp_timer_get_time() - m_recoveryStart) / 1000);
+		m_recoveryMaxMs = std::max(m_recoveryMaxMs.load(), m_recoveryMs.load());
+		m_recoveryStart = 0;
+	}
+	m_stopped = true;
+	m_tracker.endGeneration();
+	if (m_scanCompleteCB != nullptr || m_scanCompleteRefCB != nullptr) {
+		BT_PROFILE_BEGIN(scanCompleteStart);
+		int64_t callbackStart = esp_timer_get_time();
+		if (m_scanCompleteRefCB != nullptr) {
+			m_scanCompleteRefCB(m_scanResults);
+		} else {
+			m_scanCompleteCB(m_scanResults.detached());   // Copies every result.
+		}
+		BT_PROFILE_END(BT_STAGE_SCAN_COMPLETE, scanCompleteStart);
+		m_metrics.addCallbackTime((uint32_t)(esp_timer_get_time() - callbackStart));
+	}
+	if (m_pServiceDiscovery != nullptr) {
+		m_pServiceDiscovery->pump((uint32_t)(esp_timer_get_time() / 1000));
+	}
+	m_semaphoreScanEnd.give();
+} // scanCompleted
+
+
+/**
+ * @brief Take the end of a slice.
+ *
+ * The controller and the watchdog can both report the end of the same slice, from different tasks.
+ * Only the first report wins; it moves to the next slice id before starting the next slice or
+ * completing the scan, so every later report of the same slice is recognised as stale.
+ *
+ * @param [in] slice The id of the slice reported ended.
+ * @return False if that slice already ended.
+ */
+bool BTScan::claimSlice(uint32_t slice) {
+	return m_slice.compare_exchange_strong(slice, slice + 1);
+} // claimSlice
+
+
+/**
+ * @brief Start the next slice of a dual mode scan.
+ *
+ * Slices alternate between classic inquiry and BLE scanning until the time budget given to start()
+ * is spent.  A slice is shortened to fit the remaining budget; when the preferred transport cannot
+ * fit, the other one is tried.
+ *
+ * @return False if the budget is spent or no slice could be started.
+ */
+bool BTScan::nextSlice() {
+#ifdef BT_HAVE_BLE
+	if (!m_dualMode) {
+		return false;
+	}
+	int32_t remaining = (int32_t)(m_budgetEnd - (uint32_t)(esp_timer_get_time() / 1000));
+	if (remaining <= 0) {
+		return false;
+	}
+	uint8_t classicUnits = std::min<int32_t>(m_classicSlice, remaining / 1280);   // Inquiry length unit is 1.28 s.
+	uint8_t bleSeconds   = std::min<int32_t>(m_bleSlice, remaining / 1000);
+
+	if (m_sliceTransport == BT_TRANSPORT_CLASSIC) {
+		return (bleSeconds > 0 && startBleSlice(bleSeconds)) || (classicUnits > 0 && startClassicSlice(classicUnits));
+	}
+	return (classicUnits > 0 && startClassicSlice(classicUnits)) || (bleSeconds > 0 && startBleSlice(bleSeconds));
+#else
+	return false;
+#endif
+} // nextSlice
+
+
+/**
+ * @brief Get the inquiry length used for a classic scan of a given duration.
+ * @param [in] duration The duration given to start(), in seconds.
+ * @return The inquiry length, in units of 1.28 seconds, from 1 to 10.
+ */
+/* STATIC */ uint8_t BTScan::inquiryUnits(uint32_t duration) {
+	return std::max(1, std::min(static_cast<int>(round(0.78 * duration)), 10));
+} // inquiryUnits
+
+
+/**
+ * @brief Make the local device connectable and discoverable before an inquiry, leaving standby if
+ * the stack is parked.
+ */
+/* STATIC */ void BTScan::prepareInquiry() {
+	if (BTDevice::isStandby()) {
+		BTDevice::resume();
+	} else {
+		esp_bt_gap_set_scan_mode(ESP_BT_SCAN_MODE_CONNECTABLE_DISCOVERABLE);
+	}
+} // prepareInquiry
+
+
+/**
+ * @brief Start a classic inquiry.
+ * @param [in] units The inquiry length, in units of 1.28 seconds.
+ */
+bool BTScan::startClassicSlice(uint8_t units) {
+	m_sliceTransport = BT_TRANSPORT_CLASSIC;
+	m_inquirySlice   = 0;   // Until this inquiry reports started.
+	esp_err_t errRc = esp_bt_gap_start_discovery(ESP_BT_INQ_MODE_GENERAL_INQUIRY, units, 0);
+	if (errRc != ESP_OK) {
+		log_e("esp_bt_gap_start_discovery: err: %d, text: %s", errRc, GeneralUtils::errorToString(errRc));
+		m_metrics.inc(m_metrics.inquiryErrors);
+		return false;
+	}
+	m_metrics.inc(m_metrics.inquiryStarts);
+	armWatchdog(units * 1280);
+	return true;
+} // startClassicSlice
+
+
+#ifdef BT_HAVE_BLE
+/**
+ * @brief Start a BLE scan.  Scan parameters are set on first use, scanning then starts from the
+ * parameter set complete event.
+ * @param [in] seconds The scan duration.
+ */
+bool BTScan::startBleSlice(uint8_t seconds) {
+	m_sliceTransport  = BT_TRANSPORT_BLE;
+	m_bleSliceSeconds = seconds;
+	m_bleScanning     = true;
+	esp_err_t errRc;
+	if (!m_bleParamsSet) {
+		esp_ble_scan_params_t scanParams;
+		scanParams.scan_type          = BLE_SCAN_TYPE_ACTIVE;
+		scanParams.own_addr_type      = BLE_ADDR_TYPE_PUBLIC;
+		scanParams.scan_filter_policy = BLE_SCAN_FILTER_ALLOW_ALL;
+		scanParams.scan_interval      = 0x50;   // 50 ms
+		scanParams.scan_window        = 0x30;   // 30 ms, leaving air time to the classic side.
+		scanParams.scan_duplicate     = BLE_SCAN_DUPLICATE_DISABLE;
+		errRc = esp_ble_gap_set_scan_params(&scanParams);
+	} else {
+		errRc = esp_ble_gap_start_scanning(seconds);
+	}
+	if (errRc != ESP_OK) {
+		log_e("BLE scan start: err: %d, text: %s", errRc, GeneralUtils::errorToString(errRc));
+		m_metrics.inc(m_metrics.inquiryErrors);
+		m_bleScanning = false;
+		return false;
+	}
+	m_metrics.inc(m_metrics.inquiryStarts);
+	armWatchdog(seconds * 1000);
+	return true;
+} // startBleSlice
+#endif
+
+
+/**
+ * @brief Interleave BLE scanning with classic inquiries.
+ *
+ * In dual mode the duration given to start() is a time budget shared by alternating slices of classic
+ * inquiry and BLE scanning.  Devices found on either transport go to the same results and the same
+ * callbacks; getTransports() tells which transports a device was seen on.  Requires a controller in
+ * dual mode (CONFIG_BTDM_CONTROLLER_MODE_BTDM).
+ *
+ * @param [in] enable True for dual mode, false for classic inquiry only.
+ * @param [in] classicSlice Length of each classic inquiry, in units of 1.28 seconds.
+ * @param [in] bleSlice Length of each BLE scan, in seconds.
+ */
+void BTScan::setDualMode(bool enable, uint8_t classicSlice, uint8_t bleSlice) {
+#ifdef BT_HAVE_BLE
+	m_dualMode     = enable;
+	m_classicSlice = classicSlice > 0 ? classicSlice : 1;
+	m_bleSlice     = bleSlice > 0 ? bleSlice : 1;
+	if (enable && BTDevice::isBleMemoryReleased()) {
+		log_e("setDualMode: the BLE controller memory was released, BLE scanning is not available");
+		m_dualMode = false;
+	}
+#else
+	if (enable) {
+		log_e("setDualMode: the controller is not in dual mode, BLE scanning is not available");
+	}
+#endif
+} // setDualMode
+
 void BTScan::setAdvertisedDeviceCallbacks(BTAdvertisedDeviceCallbacks* pAdvertisedDeviceCallbacks, bool wantDuplicates) {
 	m_wantDuplicates = wantDuplicates;
 	m_pAdvertisedDeviceCallbacks = pAdvertisedDeviceCallbacks;
@@ -161,27 +690,79 @@ bool BTScan::stop_bt() {
 }
 
 
+/**
+ * @brief Start scanning and call a function once the scan is over.
+ *
+ * The callback receives its own copy of the results: every device record, the hot index and the RSSI
+ * histories are copied on the Bluetooth task.  Prefer the overload taking a const reference.
+ *
+ * @param [in] duration The duration in seconds for which to scan.
+ * @param [in] scanCompleteCB The function called with a copy of the results when the scan ends.
+ * @return False if the scan could not be started.
+ */
 bool BTScan::start(uint32_t duration, void (*scanCompleteCB)(BTScanResults)) {
+	return startScan(duration, scanCompleteCB, nullptr);
+} // start
+
+
+/**
+ * @brief Start scanning and call a function once the scan is over, without copying the results.
+ * @param [in] duration The duration in seconds for which to scan.
+ * @param [in] scanCompleteCB The function called when the scan ends.  The reference is only valid
+ * until the next start() or clearResults(); copy what must outlive it.
+ * @return False if the scan could not be started.
+ */
+bool BTScan::start(uint32_t duration, void (*scanCompleteCB)(const BTScanResults&)) {
+	return startScan(duration, nullptr, scanCompleteCB);
+} // start
+
+
+bool BTScan::startScan(uint32_t duration, void (*scanCompleteCB)(BTScanResults),
+	void (*scanCompleteRefCB)(const BTScanResults&)) {
 	log_d(">> start(duration=%d)", duration);
 
-	m_semaphoreScanEnd.take(std::string("start"));
-	m_scanCompleteCB = scanCompleteCB;                  // Save the callback to be invoked when the scan completes.
+	// A scan in progress ends within its latency bound, so waiting longer means the semaphore is lost.
+	if (m_watchdogGraceMs == 0) {
+		m_semaphoreScanEnd.take(std::string("start"));
+	} else if (!m_semaphoreScanEnd.take(m_maxLatencyMs + m_watchdogGraceMs, std::string("start"))) {
+		log_e("start: the previous scan did not end");
+		return false;
+	}
+	m_scanCompleteCB    = scanCompleteCB;               // Save the callback to be invoked when the scan completes.
+	m_scanCompleteRefCB = scanCompleteRefCB;
+	m_startRequested = esp_timer_get_time();
 
-	m_scanResults.m_vectorAdvertisedDevices.clear();
+	m_scanResults.clear();
+	m_arena.reserve(std::max(m_arenaSize, m_arena.getHighWater()),
+		m_scanResults.m_vectorAdvertisedDevices.get_allocator().getAllocator());
+	m_scanResults.m_scanStart = (uint32_t)(esp_timer_get_time() / 1000);
+	m_tracker.beginGeneration();
+	m_budgetEnd    = m_scanResults.m_scanStart + duration * 1000;
+	m_maxLatencyMs = getMaxScanLatency(duration);
+	m_slice++;   // Leaves the events and deadlines of an earlier scan stale.
 
-    m_stopped = false;
+    m_stopped    = false;
+    m_scanActive = true;
 
     /* set discoverable and connectable mode, wait to be connected */
-    esp_bt_gap_set_scan_mode(ESP_BT_SCAN_MODE_CONNECTABLE_DISCOVERABLE);
+    prepareInquiry();
 
     /* start to discover nearby Bluetooth devices */
     log_i("start to discover nearby Bluetooth devices");
 
-    uint8_t scan_duration =  std::min(static_cast<int>(round(0.78*duration)),10);
-
-    esp_err_t errRc = esp_bt_gap_start_discovery(ESP_BT_INQ_MODE_GENERAL_INQUIRY, scan_duration, 0);
-    if (errRc != ESP_OK) {
-	    log_e("esp_ble_gap_set_scan_params: err: %d, text: %s", errRc, GeneralUtils::errorToString(errRc));
+    bool started;
+    if (m_dualMode) {
+        m_sliceTransport = BT_TRANSPORT_BLE;   // So that the first slice is a classic one.
+        started = nextSlice();
+    } else {
+        started = startClassicSlice(inquiryUnits(duration));
+    }
+    if (!started) {
+		m_scanActive = false;
+		if (m_watchdogTimer != nullptr) {
+			esp_timer_stop(m_watchdogTimer);
+		}
+		m_stopped = true;
 		m_semaphoreScanEnd.give();
 		return false;
 	}
@@ -193,14 +774,19 @@ bool BTScan::start(uint32_t duration, void (*scanCompleteCB)(BTScanResults)) {
 
 /**
  * @brief Start scanning and block until scanning has been completed.
+ *
+ * The results are returned by value, which copies every device record, the hot index and the RSSI
+ * histories.  To block without the copy, start with a const reference callback and wait on it, or
+ * read getResultsRef() once the scan is over.
+ *
  * @param [in] duration The duration in seconds for which to scan.
- * @return The BLEScanResults.
+ * @return A copy of the scan results.
  */
 BTScanResults BTScan::start(uint32_t duration) {
-	if(start(duration, nullptr)) {
+	if(startScan(duration, nullptr, nullptr)) {
 		m_semaphoreScanEnd.wait("start");   // Wait for the semaphore to release.
 	}
-	return m_scanResults;
+	return m_scanResults.detached();
 } // start
 
 
@@ -212,6 +798,12 @@ void BTScan::stop() {
 	log_d(">> stop()");
 
     esp_bt_gap_cancel_discovery();
+#ifdef BT_HAVE_BLE
+	if (m_bleScanning) {
+		esp_ble_gap_stop_scanning();
+	}
+#endif
+	m_metrics.inc(m_metrics.inquiryCancels);
 
 	m_stopped = true;
 
@@ -224,7 +816,7 @@ void BTScan::stop() {
 /**
  * @brief Dump the scan results to the log.
  */
-void BTScanResults::dump() {
+void BTScanResults::dump() const {
 	log_d(">> Dump scan results:");
 	for (int i=0; i<getCount(); i++) {
 		log_d("- %s", getDevice(i).toString().c_str());
@@ -236,7 +828,7 @@ void BTScanResults::dump() {
  * @brief Return the count of devices found in the last scan.
  * @return The number of devices found in the last scan.
  */
-int BTScanResults::getCount() {
+int BTScanResults::getCount() const {
 	return m_vectorAdvertisedDevices.size();
 } // getCount
 
@@ -245,21 +837,745 @@ int BTScanResults::getCount() {
  * @brief Return the specified device at the given index.
  * The index should be between 0 and getCount()-1.
  * @param [in] i The index of the device.
- * @return The device at the specified index.
+ * @return A copy of the device at the specified index, which keeps its name and service UUIDs
+ * after the next scan.
  */
-BTAdvertisedDevice BTScanResults::getDevice(uint32_t i) {
-	return m_vectorAdvertisedDevices.at(i);
+BTAdvertisedDevice BTScanResults::getDevice(uint32_t i) const {
+	BTAdvertisedDevice device = m_vectorAdvertisedDevices.at(i);
+	size_t bytes = device.getArenaBytes();
+	if (bytes != 0) {
+		std::shared_ptr<BTArena> pArena = std::make_shared<BTArena>();
+		pArena->reserve(bytes, BTAllocator::getDefault());
+		device.detach(pArena);
+	}
+	return device;
 }
 
+/**
+ * @brief Return the time at which the scan that produced these results was started.
+ * @return Milliseconds since boot.
+ */
+uint32_t BTScanResults::getScanStart() const {
+	return m_scanStart;
+} // getScanStart
+
+BTScanResults::BTScanResults() :
+	m_vectorAdvertisedDevices(BTStlAllocator<BTAdvertisedDevice>(BTAllocator::getDefault())),
+	m_hot(BTStlAllocator<HotEntry>(BTAllocator::getInternal())),
+	m_history(BTStlAllocator<BTRssiHistory>(BTAllocator::getDefault())),
+	m_index(BTStlAllocator<uint32_t>(BTAllocator::getInternal())) {
+} // BTScanResults
+
+
+/**
+ * @brief Return the maximum number of devices kept, 0 when unbounded.
+ */
+uint32_t BTScanResults::getCapacity() const {
+	return m_capacity;
+} // getCapacity
+
+
+/**
+ * @brief Look up the slot holding an address.
+ * @param [in] address The packed address.
+ * @return The slot, or -1 if the address is not in the results.
+ */
+int32_t BTScanResults::find(uint64_t address) {
+	if (m_index.empty()) {
+		return -1;
+	}
+	size_t mask = m_index.size() - 1;
+	for (size_t i = indexHash(address) & mask; m_index[i] != NO_SLOT; i = (i + 1) & mask) {
+		if (m_hot[m_index[i]].address == address) {
+			return (int32_t)m_index[i];
+		}
+	}
+	return -1;
+} // find
+
+
+/**
+ * @brief Add a slot to the address index, keyed by its hot entry address.
+ *
+ * The table is kept at most half full.  It only grows, by doubling, when the results are unbounded;
+ * setCapacity() sizes it once for bounded results.
+ *
+ * @param [in] slot The slot, whose address is already set.
+ */
+void BTScanResults::indexInsert(uint32_t slot) {
+	if (m_hot.size() * 2 > m_index.size()) {
+		indexResize(std::max(m_index.size() * 2, (size_t)16));
+	}
+	size_t mask = m_index.size() - 1;
+	size_t i    = indexHash(m_hot[slot].address) & mask;
+	while (m_index[i] != NO_SLOT) {
+		i = (i + 1) & mask;
+	}
+	m_index[i] = slot;
+} // indexInsert
+
+
+/**
+ * @brief Remove an address from the index.
+ *
+ * Linear probing without tombstones: the entries that follow in the cluster are shifted back into
+ * the hole unless that would move them before their home bucket.
+ *
+ * @param [in] address The packed address.
+ */
+void BTScanResults::indexErase(uint64_t address) {
+	if (m_index.empty()) {
+		return;
+	}
+	size_t mask = m_index.size() - 1;
+	size_t i    = indexHash(address) & mask;
+	while (m_index[i] != NO_SLOT && m_hot[m_index[i]].address != address) {
+		i = (i + 1) & mask;
+	}
+	if (m_index[i] == NO_SLOT) {
+		return;
+	}
+	for (size_t j = (i + 1) & mask; m_index[j] != NO_SLOT; j = (j + 1) & mask) {
+		size_t home = indexHash(m_hot[m_index[j]].address) & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			m_index[i] = m_index[j];
+			i = j;
+		}
+	}
+	m_index[i] = NO_SLOT;
+} // indexErase
+
+
+/**
+ * @brief Rebuild the address index with a number of buckets.
+ * @param [in] size The number of buckets, a power of two larger than the number of slots.
+ */
+void BTScanResults::indexResize(size_t size) {
+	m_index.assign(size, NO_SLOT);
+	size_t mask = size - 1;
+	for (uint32_t slot = 0; slot < m_vectorAdvertisedDevices.size(); slot++) {
+		size_t i = indexHash(m_hot[slot].address) & mask;
+		while (m_index[i] != NO_SLOT) {
+			i = (i + 1) & mask;
+		}
+		m_index[i] = slot;
+	}
+} // indexResize
+
+
+void BTScanResults::unlink(uint32_t slot) {
+	uint32_t prev = m_hot[slot].prev;
+	uint32_t next = m_hot[slot].next;
+	if (prev != NO_SLOT) m_hot[prev].next = next; else m_lruHead = next;
+	if (next != NO_SLOT) m_hot[next].prev = prev; else m_lruTail = prev;
+} // unlink
+
+
+void BTScanResults::pushFront(uint32_t slot) {
+	m_hot[slot].prev = NO_SLOT;
+	m_hot[slot].next = m_lruHead;
+	if (m_lruHead != NO_SLOT) m_hot[m_lruHead].prev = slot; else m_lruTail = slot;
+	m_lruHead = slot;
+} // pushFront
+
+
+/**
+ * @brief Record a new sighting of a slot and mark it as the most recently seen.
+ * @param [in] slot The slot that was seen.
+ * @param [in] now The time of the sighting in milliseconds since boot.
+ * @param [in] rssi The RSSI of the sighting.
+ */
+void BTScanResults::touch(uint32_t slot, uint32_t now, int8_t rssi) {
+	m_hot[slot].lastSeen = now;
+	m_hot[slot].rssi     = rssi;
+	m_hot[slot].bestRssi = std::max(m_hot[slot].bestRssi, rssi);
+	m_hot[slot].sightings++;
+	if (m_historyBlocks != 0 && rssi != -128) {
+		m_history[slot].add(now, rssi);
+	}
+	if (slot != m_lruHead) {
+		unlink(slot);
+		pushFront(slot);
+	}
+} // touch
+
+
+bool BTScanResults::isFull() {
+	return m_capacity != 0 && m_vectorAdvertisedDevices.size() >= m_capacity;
+} // isFull
+
+
+/**
+ * @brief Store a device that is not yet in the results.
+ *
+ * When the results are full the least recently seen device is overwritten.
+ *
+ * @param [in] address The packed address of the device.
+ * @param [in] device The device to store.
+ * @return The slot now holding the device.
+ */
+uint32_t BTScanResults::insert(uint64_t address, BTAdvertisedDevice& device) {
+	uint32_t slot;
+	if (isFull()) {
+		slot = m_lruTail;
+		indexErase(m_hot[slot].address);
+		unlink(slot);
+		m_vectorAdvertisedDevices[slot] = device;
+	} else {
+		slot = m_vectorAdvertisedDevices.size();
+		m_vectorAdvertisedDevices.push_back(device);
+		m_hot.push_back(HotEntry());
+	}
+	m_hot[slot].address   = address;
+	m_hot[slot].lastSeen  = device.getTimestamp();
+	m_hot[slot].rssi      = device.haveRSSI() ? (int8_t)device.getRSSI() : -128;
+	m_hot[slot].bestRssi  = m_hot[slot].rssi;
+	m_hot[slot].sightings = 1;
+	m_hot[slot].eirHash   = 0;
+	m_hot[slot].epoch     = ++m_epoch;
+	if (m_historyBlocks != 0) {
+		if (slot == m_history.size()) {
+			m_history.push_back(BTRssiHistory(m_historyBlocks, m_history.get_allocator().getAllocator()));   // Only when unbounded.
+		} else {
+			m_history[slot].clear();
+		}
+		if (device.haveRSSI()) {
+			m_history[slot].add(device.getTimestamp(), (int8_t)device.getRSSI());
+		}
+	}
+	indexInsert(slot);
+	pushFront(slot);
+	return slot;
+} // insert
+
+
+/**
+ * @brief Copy the results, with the names and service UUIDs of all the devices moved to a single
+ * arena of their own, so the copy outlives the next scan.
+ * @return The copy.
+ */
+BTScanResults BTScanResults::detached() const {
+	BTScanResults copy = *this;
+	size_t bytes = 0;
+	for (size_t i = 0; i < copy.m_vectorAdvertisedDevices.size(); i++) {
+		bytes += copy.m_vectorAdvertisedDevices[i].getArenaBytes();
+	}
+	if (bytes != 0) {
+		std::shared_ptr<BTArena> pArena = std::make_shared<BTArena>();
+		pArena->reserve(bytes, BTAllocator::getDefault());
+		for (size_t i = 0; i < copy.m_vectorAdvertisedDevices.size(); i++) {
+			copy.m_vectorAdvertisedDevices[i].detach(pArena);
+		}
+	}
+	return copy;
+} // detached
+
+
+/**
+ * @brief Forget every device.  Storage, the address index and the RSSI histories are kept for reuse.
+ */
+void BTScanResults::clear() {
+	m_vectorAdvertisedDevices.clear();
+	m_hot.clear();
+	std::fill(m_index.begin(), m_index.end(), NO_SLOT);
+	m_lruHead = NO_SLOT;
+	m_lruTail = NO_SLOT;
+} // clear
+
+
+/**
+ * @brief Set the maximum number of devices and reserve their storage.
+ *
+ * Records, hot entries, the address index and the RSSI histories are all sized here, so that storing
+ * a new device in bounded results does not allocate.
+ *
+ * @param [in] capacity The maximum number of devices, 0 for no limit.
+ */
+void BTScanResults::setCapacity(uint32_t capacity) {
+	clear();
+	m_capacity = capacity;
+	if (capacity != 0) {
+		m_vectorAdvertisedDevices.reserve(capacity);
+		m_hot.reserve(capacity);
+		size_t size = 16;
+		while (size < (size_t)capacity * 2) {
+			size <<= 1;
+		}
+		indexResize(size);
+	}
+	setHistoryBlocks(m_historyBlocks);
+} // setCapacity
+
+
+/**
+ * @brief Set the size of the RSSI histories and, for bounded results, allocate one per slot.
+ * @param [in] blocks The number of blocks per device, 0 to keep no history.
+ */
+void BTScanResults::setHistoryBlocks(uint8_t blocks) {
+	clear();
+	m_historyBlocks = blocks;
+	m_history.clear();
+	if (blocks != 0 && m_capacity != 0) {
+		m_history.assign(m_capacity, BTRssiHistory(blocks, m_history.get_allocator().getAllocator()));
+	}
+} // setHistoryBlocks
+
+
+/**
+ * @brief Move the device records and RSSI histories to another allocator.  The results are cleared.
+ * @param [in] pAllocator The allocator for the device records.
+ */
+void BTScanResults::setRecordAllocator(BTAllocator* pAllocator) {
+	clear();
+	m_vectorAdvertisedDevices = RecordVector(BTStlAllocator<BTAdvertisedDevice>(pAllocator));
+	if (m_capacity != 0) {
+		m_vectorAdvertisedDevices.reserve(m_capacity);
+	}
+	m_history = HistoryVector(BTStlAllocator<BTRssiHistory>(pAllocator));
+	setHistoryBlocks(m_historyBlocks);
+} // setRecordAllocator
+
+
+/**
+ * @brief Return the RSSI of the latest sighting of a device, read from the hot index.
+ * @param [in] i The index of the device.
+ */
+int8_t BTScanResults::getRSSI(uint32_t i) const {
+	return m_hot.at(i).rssi;
+} // getRSSI
+
+
+/**
+ * @brief Return the time of the latest sighting of a device, read from the hot index.
+ * @param [in] i The index of the device.
+ * @return Milliseconds since boot.
+ */
+uint32_t BTScanResults::getLastSeen(uint32_t i) const {
+	return m_hot.at(i).lastSeen;
+} // getLastSeen
+
+
+/**
+ * @brief Get the RSSI history of a device, see BTScan::setRssiHistory().
+ * @param [in] i The index of the device.
+ * @return The history, or nullptr when histories are not kept.
+ */
+const BTRssiHistory* BTScanResults::getRssiHistory(uint32_t i) const {
+	return (i < m_history.size() && i < m_vectorAdvertisedDevices.size()) ? &m_history[i] : nullptr;
+} // getRssiHistory
+
+
+/**
+ * @brief Estimate the memory held by the results: device records, hot index and address index.
+ * @return The number of bytes.
+ */
+size_t BTScanResults::getMemoryUsage() const {
+	return m_vectorAdvertisedDevices.capacity() * sizeof(BTAdvertisedDevice)
+		+ m_hot.capacity() * sizeof(HotEntry)
+		+ m_index.capacity() * sizeof(uint32_t)
+		+ (m_history.empty() ? 0 : m_history.size() * m_history[0].getMemoryUsage());
+} // getMemoryUsage
+
+
+/**
+ * @brief Get a copy of the results of the current or last scan.
+ *
+ * Every device record, the hot index and the RSSI histories are copied, and the names and service
+ * UUIDs moved out of the scan arena so the copy outlives the next scan; getResultsRef() does not copy.
+ *
+ * @return A copy of the scan results.
+ */
 BTScanResults BTScan::getResults() {
+	return m_scanResults.detached();
+} // getResults
+
+
+/**
+ * @brief Get the results of the current or last scan without copying them.
+ *
+ * The results keep changing while a scan runs, on the Bluetooth task; read them once the scan is over.
+ * The reference stays valid for the life of the scanner, its content until the next start() or
+ * clearResults().
+ *
+ * @return The scan results.
+ */
+const BTScanResults& BTScan::getResultsRef() {
 	return m_scanResults;
-}
+} // getResultsRef
+
+/**
+ * @brief Get the generation of the current or last scan, and start tracking changes.
+ *
+ * Every call to start() begins a new generation.  Keep the value returned here and pass it to
+ * changesSince() after the next scan to get only what changed in between.  Change tracking costs a
+ * map entry per device and a log record per change on the Bluetooth task, so it only starts with the
+ * first call to this method or to setChangeThresholds().
+ *
+ * @return The generation number.
+ */
+uint32_t BTScan::getGeneration() {
+	m_tracker.enable();
+	return m_tracker.getGeneration();
+} // getGeneration
+
+
+/**
+ * @brief Get the arrivals, departures and changes observed after a generation.
+ * @param [in] generation A value previously returned by getGeneration(), or 0.
+ * @param [out] changes Receives the changes in the order they were observed.
+ * @return False if the change log no longer reaches back to that generation, or tracking has not
+ * been started by getGeneration().  The caller should then resynchronize from getResults().
+ */
+bool BTScan::changesSince(uint32_t generation, std::vector<BTScanChange>& changes) {
+	return m_tracker.changesSince(generation, changes);
+} // changesSince
+
+
+/**
+ * @brief Configure when a device is reported as changed or departed, and start tracking changes.
+ * @param [in] rssiThreshold Minimum RSSI movement, in dBm, reported as a change.
+ * @param [in] departureScans Number of scans without a sighting after which a device has departed.
+ */
+void BTScan::setChangeThresholds(uint8_t rssiThreshold, uint8_t departureScans) {
+	m_tracker.setRssiThreshold(rssiThreshold);
+	m_tracker.setDepartureScans(departureScans);
+	m_tracker.enable();
+} // setChangeThresholds
+
 
 void BTScan::clearResults() {
 	//for(auto _dev : m_scanResults.m_vectorAdvertisedDevices){
 	//	delete _dev.second;
 	//}
-	m_scanResults.m_vectorAdvertisedDevices.clear();
+	m_scanResults.clear();
+	m_arena.reset();
 }
 
+
+/**
+ * @brief Bound the number of devices kept in the results.
+ *
+ * Storage for maxResults devices is reserved up front: records, hot index, address index and RSSI
+ * histories, so the results do not allocate for a new device.  Change tracking, once started by
+ * getGeneration(), still allocates an entry the first time it sees a device, see BTDeviceTracker.
+ * Once the results are full, the least recently seen device is evicted for each
+ * new one and handed to BTAdvertisedDeviceCallbacks::onEvicted().
+ *
+ * @param [in] maxResults The maximum number of devices, 0 for no limit.
+ */
+void BTScan::setMaxResults(uint32_t maxResults) {
+	m_scanResults.setCapacity(maxResults);
+} // setMaxResults
+
+
+/**
+ * @brief Choose where device records are stored, e.g. BTAllocator::getPsram().
+ *
+ * Everything that grows with the number of devices follows it: the device records, the arena
+ * behind their variable fields, their RSSI histories and the entries of the change tracker.  Only
+ * the hot index stays in internal RAM.  The current results are cleared and the tracked devices
+ * forgotten; nothing stays allocated from the previous allocator.
+ *
+ * @param [in] pAllocator The allocator for the device records.  It must outlive the scan.
+ */
+void BTScan::setRecordAllocator(BTAllocator* pAllocator) {
+	m_scanResults.setRecordAllocator(pAllocator);
+	m_arena.reserve(m_arena.getCapacity(), pAllocator);
+	m_tracker.setAllocator(pAllocator);
+} // setRecordAllocator
+
+
+/**
+ * @brief Set the size of the arena that holds device names and service UUIDs.
+ *
+ * The arena is reserved when a scan starts and reset, in O(1), by every start() and clearResults().
+ * It never shrinks below the most memory a previous scan needed.
+ *
+ * @param [in] arenaSize The arena size in bytes.
+ */
+void BTScan::setArenaSize(size_t arenaSize) {
+	m_arenaSize = arenaSize;
+} // setArenaSize
+
+
+/**
+ * @brief Keep an RSSI history of every device, see BTScanResults::getRssiHistory().
+ *
+ * Each device gets blocks x BT_RSSI_HISTORY_BLOCK_BYTES of encoded samples plus their headers.  Every
+ * sighting is recorded, including those suppressed as duplicates.  The results are cleared.
+ *
+ * @param [in] blocks The number of blocks per device, 0 to keep no history.
+ */
+void BTScan::setRssiHistory(uint8_t blocks) {
+	m_scanResults.setHistoryBlocks(blocks);
+} // setRssiHistory
+
+
+/**
+ * @brief Enrich classic devices with their SDP service UUIDs, see BTServiceDiscovery.
+ *
+ * New classic devices found in the cache are reported with their services.  The others are queued
+ * and discovered once the scan is over; BTAdvertisedDeviceCallbacks::onServicesDiscovered() is then
+ * called with the stored device.
+ *
+ * @param [in] pServiceDiscovery The discovery stage, owned by the caller, or nullptr to disable it.
+ */
+void BTScan::setServiceDiscovery(BTServiceDiscovery* pServiceDiscovery) {
+	m_pServiceDiscovery = pServiceDiscovery;
+} // setServiceDiscovery
+
+
+/**
+ * @brief Expire overdue service requests and start queued ones.
+ *
+ * Requests are started when a scan completes and chained as answers arrive; call this periodically
+ * between scans so a request that never gets an answer times out.  Does nothing while scanning.
+ */
+void BTScan::pollServiceDiscovery() {
+	if (m_pServiceDiscovery != nullptr && m_stopped) {
+		m_pServiceDiscovery->pump((uint32_t)(esp_timer_get_time() / 1000));
+	}
+} // pollServiceDiscovery
+
+
+/**
+ * @brief Get the watchlist of the scan, also filled by BTDevice::whiteListAdd().
+ *
+ * While it is not empty, every reported result is preceded by
+ * BTAdvertisedDeviceCallbacks::onWatchlistHit() or onWatchlistMiss().
+ */
+BTWatchlist& BTScan::getWatchlist() {
+	return m_watchlist;
+} // getWatchlist
+
+
+/**
+ * @brief Only keep results from watched devices.
+ *
+ * Other results are dropped as soon as their address is known, before dedup, parsing or any
+ * allocation, and counted in BTScanStats::watchlistDropped.  With an empty watchlist every result is
+ * dropped.
+ *
+ * @param [in] matchOnly True to drop the results of devices that are not watched.
+ */
+void BTScan::setMatchOnly(bool matchOnly) {
+	m_matchOnly = matchOnly;
+} // setMatchOnly
+
+
+/**
+ * @brief Feed every sighting, duplicates included, to a departure wheel.
+ *
+ * Devices are filed under the major class of their CoD.  The wheel is not advanced by the scan: call
+ * BTDepartureWheel::advance() with esp_timer_get_time() / 1000, from a timer or the loop, to have its
+ * departures reported.  Devices evicted from full results are still tracked by the wheel.
+ *
+ * @param [in] pDepartureWheel The wheel, owned by the caller, or nullptr to stop feeding it.
+ */
+void BTScan::setDepartureWheel(BTDepartureWheel* pDepartureWheel) {
+	m_pDepartureWheel = pDepartureWheel;
+} // setDepartureWheel
+
+
+/**
+ * @brief Configure the scan watchdog.
+ *
+ * Every inquiry or BLE slice gets a deadline: its length plus graceMs.  If the controller has not
+ * reported the end by then, e.g. after a lost ESP_BT_GAP_DISCOVERY_STOPPED or a failed cancel, the
+ * watchdog cancels it and restarts discovery for what is left of the scan's duration.  After
+ * maxRetries missed deadlines in a row it restarts the stack with BTDevice::reinit(), if allowed, and
+ * after that it only ends scans with the results found so far.  An inquiry that ends on its own resets
+ * the count.  Either way start() returns and the completion callback runs within
+ * getMaxScanLatency(), plus the time of the stack restart if there was one.  The recovery, and a completion callback it leads to, run on a task of the
+ * watchdog's own, see BT_SCAN_WATCHDOG_STACK; its timer only wakes that task.
+ *
+ * @param [in] graceMs The time allowed past the end of an inquiry, 0 to turn the watchdog off.
+ * @param [in] maxRetries The cancel and restart attempts before the stack is restarted.
+ * @param [in] allowReinit False to never restart the stack.
+ */
+void BTScan::setWatchdog(uint32_t graceMs, uint8_t maxRetries, bool allowReinit) {
+	m_watchdogGraceMs = graceMs;
+	m_watchdogRetries = maxRetries;
+	m_watchdogReinit  = allowReinit;
+} // setWatchdog
+
+
+/**
+ * @brief Get the longest a scan can take with the watchdog on.
+ *
+ * Restarted inquiries are cut to the scan's duration, so the bound is the longer of the duration and
+ * the first inquiry, plus the grace.  A stack restart is not included: its controller and Bluedroid
+ * calls block the watchdog task for as long as they take, which nothing here can cut short.  When
+ * allowReinit is set the bound can be exceeded by that time; BTScanStats::initTimeMs reports the
+ * bring-up part of the last restart.
+ *
+ * @param [in] duration The duration given to start(), in seconds.
+ * @return The bound in milliseconds, 0 with the watchdog off.
+ */
+uint32_t BTScan::getMaxScanLatency(uint32_t duration) {
+	if (m_watchdogGraceMs == 0) {
+		return 0;
+	}
+	uint32_t scanMs = duration * 1000;
+	if (!m_dualMode) {
+		scanMs = std::max(scanMs, (uint32_t)inquiryUnits(duration) * 1280);
+	}
+	return scanMs + m_watchdogGraceMs;
+} // getMaxScanLatency
+
+
+/**
+ * @brief Give the current inquiry or BLE slice a deadline, replacing the previous one.
+ * @param [in] sliceMs The length of the inquiry or slice.
+ */
+void BTScan::armWatchdog(uint32_t sliceMs) {
+	if (m_watchdogGraceMs == 0) {
+		return;
+	}
+	if (m_watchdogTask == nullptr &&
+		xTaskCreate(&BTScan::watchdogTask, "BTScanWatchdog", BT_SCAN_WATCHDOG_STACK, this,
+			BT_SCAN_WATCHDOG_PRIORITY, &m_watchdogTask) != pdPASS) {
+		log_e("xTaskCreate: the scan watchdog task could not be created");
+		m_watchdogTask = nullptr;
+		return;
+	}
+	if (m_watchdogTimer == nullptr) {
+		esp_timer_create_args_t args;
+		args.callback        = &BTScan::watchdogCallback;
+		args.arg             = this;
+		args.dispatch_method = ESP_TIMER_TASK;
+		args.name            = "BTScanWatchdog";
+		esp_err_t errRc = esp_timer_create(&args, &m_watchdogTimer);
+		if (errRc != ESP_OK) {
+			log_e("esp_timer_create: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+			m_watchdogTimer = nullptr;
+			return;
+		}
+	}
+	esp_timer_stop(m_watchdogTimer);   // Fails harmlessly when it is not running.
+	uint32_t deadline = (uint32_t)(esp_timer_get_time() / 1000) + sliceMs + m_watchdogGraceMs;
+	m_watchdogArmed = ((uint64_t)m_slice << 32) | deadline;
+	esp_timer_start_once(m_watchdogTimer, (uint64_t)(sliceMs + m_watchdogGraceMs) * 1000);
+} // armWatchdog
+
+
+/**
+ * @brief Wake the watchdog task, from the esp_timer task, which must not block.
+ */
+/* STATIC */ void BTScan::watchdogCallback(void* pArg) {
+	xTaskNotifyGive(((BTScan*)pArg)->m_watchdogTask);
+} // watchdogCallback
+
+
+/* STATIC */ void BTScan::watchdogTask(void* pArg) {
+	BTScan* pScan = (BTScan*)pArg;
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		pScan->onWatchdog();
+	}
+} // watchdogTask
+
+
+/**
+ * @brief Recover from a missed deadline, on the watchdog task.
+ *
+ * The wake up may be late: the slice can have ended, or a later one been armed, since the timer fired.
+ * Only a slice that is still in progress and past its deadline is taken over.
+ */
+void BTScan::onWatchdog() {
+	uint64_t armed    = m_watchdogArmed;
+	uint32_t deadline = (uint32_t)armed;
+	if (!m_scanActive || (int32_t)((uint32_t)(esp_timer_get_time() / 1000) - deadline) < 0 ||
+		!claimSlice((uint32_t)(armed >> 32))) {
+		return;
+	}
+	m_metrics.inc(m_metrics.watchdogFires);
+	if (m_recoveryStart == 0) {
+		m_recoveryStart = esp_timer_get_time();
+	}
+	if (m_stopped) {   // stop() was called but the controller never confirmed.
+		scanCompleted();
+		return;
+	}
+
+	m_missedDeadlines++;
+	log_w("watchdog: scan deadline missed, %d in a row", m_missedDeadlines.load());
+	esp_bt_gap_cancel_discovery();
+#ifdef BT_HAVE_BLE
+	if (m_bleScanning) {
+		esp_ble_gap_stop_scanning();
+		m_bleScanning = false;
+	}
+#endif
+
+	if (m_missedDeadlines > m_watchdogRetries) {
+		if (!m_watchdogReinit || m_missedDeadlines > m_watchdogRetries + 1) {
+			m_metrics.inc(m_metrics.watchdogAborts);
+			scanCompleted();
+			return;
+		}
+		m_metrics.inc(m_metrics.watchdogReinits);
+		BTDevice::reinit();
+		m_bleParamsSet = false;
+		m_inquirySlice = 0;   // The cancelled inquiry went away with the stack.
+	}
+	if (!restartScan()) {
+		m_metrics.inc(m_metrics.watchdogAborts);
+		scanCompleted();
+	}
+} // onWatchdog
+
+
+/**
+ * @brief Restart discovery for what is left of the scan's duration.
+ * @return False if nothing is left or discovery could not be started.
+ */
+bool BTScan::restartScan() {
+	bool started;
+	if (m_dualMode) {
+		started = nextSlice();
+	} else {
+		int32_t remaining = (int32_t)(m_budgetEnd - (uint32_t)(esp_timer_get_time() / 1000));
+		started = remaining >= 1280 && startClassicSlice(std::min(remaining / 1280, (int32_t)10));
+	}
+	if (started) {
+		m_metrics.inc(m_metrics.watchdogRestarts);
+	}
+	return started;
+} // restartScan
+
+
+/**
+ * @brief Get a snapshot of the scan counters and gauges.
+ *
+ * Counters are updated lock free from the Bluetooth task, so this may be called from any task.
+ * Passing reset makes each call return the activity since the previous one and marks the snapshot so
+ * that BTScanStats::toPrometheus() exports the counters as gauges and BTScanStats::toBinary() sets
+ * BT_METRICS_FLAG_RESET.  A Prometheus scraper wants monotonic counters, i.e. no reset.
+ *
+ * @param [in] reset Zero the counters once read.
+ * @return The snapshot.
+ */
+BTScanStats BTScan::getStats(bool reset) {
+	BTScanStats stats;
+	m_metrics.snapshot(&stats, reset);
+	stats.resultCount    = m_scanResults.getCount();
+	stats.resultBytes    = m_scanResults.getMemoryUsage() + m_arena.getCapacity();
+	stats.arenaHighWater = m_arena.getHighWater();
+	stats.arenaOverflows = m_arena.getOverflowCount();
+#ifdef ESP_PLATFORM
+	stats.heapFree       = esp_get_free_heap_size();
+	stats.heapLowWater   = esp_get_minimum_free_heap_size();
+#else
+	stats.heapFree       = 0;
+	stats.heapLowWater   = 0;
+#endif
+	stats.initTimeMs          = BTDevice::getInitTime();
+	stats.bootToFirstResultMs = m_firstResultMs;
+	stats.restartLatencyMs    = m_restartLatencyMs;
+	stats.recoveryTimeMs      = m_recoveryMs;
+	stats.recoveryMaxMs       = m_recoveryMaxMs;
+	return stats;
+} // getStats
+
 #endif
\ No newline at end of file
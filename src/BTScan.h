@@ -19,6 +19,19 @@
   #define Scan_duration 10
 #endif
 
+// Time allowed past the end of an inquiry before the scan watchdog steps in.
+#ifndef BT_SCAN_WATCHDOG_GRACE_MS
+  #define BT_SCAN_WATCHDOG_GRACE_MS 3000
+#endif
+
+// The task the scan watchdog recovers from, woken by its timer.
+#ifndef BT_SCAN_WATCHDOG_STACK
+  #define BT_SCAN_WATCHDOG_STACK 4096
+#endif
+#ifndef BT_SCAN_WATCHDOG_PRIORITY
+  #define BT_SCAN_WATCHDOG_PRIORITY 5
+#endif
+
 #include "sdkconfig.h"
 
 #if defined(CONFIG_BT_ENABLED) && defined(CONFIG_BLUEDROID_ENABLED)
@@ -30,26 +43,103 @@
 
 #include "esp_gap_bt_api.h"
 
+#include <atomic>
 #include <vector>
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "FreeRTOS.h"
 
 #include "BTAddress.h"
 #include "BTAdvertisedDevice.h"
+#include "BTAllocator.h"
+#include "BTArena.h"
+#include "BTDepartureWheel.h"
+#include "BTDeviceTracker.h"
+#include "BTScanMetrics.h"
+#include "BTRssiHistory.h"
+#include "BTServiceDiscovery.h"
+#include "BTWatchlist.h"
 
 class BTAdvertisedDevice;
 class BTAdvertisedDeviceCallbacks;
 class BTScan;
 
-
+/**
+ * @brief The devices found by a scan.
+ *
+ * Results are optionally bounded.  When a capacity is set and the results are full, the least
+ * recently seen device is evicted in O(1) to make room for a new one; the evicted slot is reused so
+ * getDevice() indexes stay dense.
+ *
+ * Storage is split in two tiers.  The hot index (address lookup, recency list, RSSI and last-seen
+ * time of each slot) always lives in internal RAM.  The full device records and their RSSI histories
+ * come from the record allocator, which can be moved to PSRAM with BTScan::setRecordAllocator().
+ */
 class BTScanResults {
 public:
-	void                dump();
-	int                 getCount();
-	BTAdvertisedDevice  getDevice(uint32_t i);
+	BTScanResults();
+	void                dump() const;
+	int                 getCount() const;
+	BTAdvertisedDevice  getDevice(uint32_t i) const;
+	uint32_t            getScanStart() const;
+	uint32_t            getCapacity() const;
+	int8_t              getRSSI(uint32_t i) const;
+	uint32_t            getLastSeen(uint32_t i) const;
+	const BTRssiHistory* getRssiHistory(uint32_t i) const;
+	size_t              getMemoryUsage() const;
 
 private:
 	friend class BTScan;
-	std::vector<BTAdvertisedDevice> m_vectorAdvertisedDevices;
+	friend class BTWireEncoder;
+	friend class BTJsonWriter;
+	friend class BTScanColumns;
+	friend class BTScanSnapshot;
+
+	static const uint32_t NO_SLOT = 0xffffffff;
+
+	struct HotEntry {
+		uint64_t address;    // Packed, what the address index compares against.
+		uint32_t prev;       // Towards more recently seen slots.
+		uint32_t next;       // Towards less recently seen slots.
+		uint32_t lastSeen;   // Milliseconds since boot.
+		uint32_t sightings;  // In this scan.
+		uint32_t epoch;      // Of the insert that filled the slot, see m_epoch.
+		int8_t   rssi;
+		int8_t   bestRssi;
+		uint32_t eirHash;    // Of the EIR and CoD the record was parsed from, 0 if not reusable.
+	};
+
+	typedef std::vector<BTAdvertisedDevice, BTStlAllocator<BTAdvertisedDevice> > RecordVector;
+	typedef std::vector<BTRssiHistory, BTStlAllocator<BTRssiHistory> > HistoryVector;
+	typedef std::vector<HotEntry, BTStlAllocator<HotEntry> > HotVector;
+	typedef std::vector<uint32_t, BTStlAllocator<uint32_t> > IndexTable;
+
+	int32_t  find(uint64_t address);
+	void     indexInsert(uint32_t slot);
+	void     indexErase(uint64_t address);
+	void     indexResize(size_t size);
+	void     touch(uint32_t slot, uint32_t now, int8_t rssi);
+	bool     isFull();
+	uint32_t insert(uint64_t address, BTAdvertisedDevice& device);
+	void     clear();
+	BTScanResults detached() const;
+	void     setCapacity(uint32_t capacity);
+	void     setHistoryBlocks(uint8_t blocks);
+	void     setRecordAllocator(BTAllocator* pAllocator);
+	void     unlink(uint32_t slot);
+	void     pushFront(uint32_t slot);
+
+	RecordVector                           m_vectorAdvertisedDevices;   // Cold tier.
+	HotVector                              m_hot;                       // Hot tier, one entry per slot.
+	HistoryVector                          m_history;                   // Per slot, kept across clear(), empty when disabled.
+	uint8_t                                m_historyBlocks = 0;
+	IndexTable                             m_index;                     // Open addressing, slot or NO_SLOT, a power of two.
+	uint32_t                               m_lruHead  = NO_SLOT;
+	uint32_t                               m_lruTail  = NO_SLOT;
+	uint32_t                               m_capacity = 0;   // 0 for unbounded.
+	uint32_t                               m_scanStart = 0;
+	uint32_t                               m_epoch = 0;     // Counts inserts, so a slot's sightings restarting is visible.
 };
 
 class BTScan
@@ -59,24 +149,99 @@ class BTScan
                       BTAdvertisedDeviceCallbacks* pAdvertisedDeviceCallbacks,
                       bool wantDuplicates = false);
     bool           start(uint32_t duration, void (*scanCompleteCB)(BTScanResults));
+    bool           start(uint32_t duration, void (*scanCompleteCB)(const BTScanResults&));
     BTScanResults  start(uint32_t duration);
     void           stop();
     BTScanResults getResults();
+    const BTScanResults& getResultsRef();
     void			clearResults();
+    uint32_t       getGeneration();
+    bool           changesSince(uint32_t generation, std::vector<BTScanChange>& changes);
+    void           setChangeThresholds(uint8_t rssiThreshold, uint8_t departureScans = 1);
+    void           setMaxResults(uint32_t maxResults);
+    void           setRecordAllocator(BTAllocator* pAllocator);
+    void           setArenaSize(size_t arenaSize);
+    BTScanStats    getStats(bool reset = false);
+    void           setDualMode(bool enable, uint8_t classicSlice = 4, uint8_t bleSlice = 2);
+    void           setRssiHistory(uint8_t blocks);
+    void           setServiceDiscovery(BTServiceDiscovery* pServiceDiscovery);
+    void           pollServiceDiscovery();
+    BTWatchlist&   getWatchlist();
+    void           setMatchOnly(bool matchOnly);
+    void           setDepartureWheel(BTDepartureWheel* pDepartureWheel);
+    void           setWatchdog(uint32_t graceMs, uint8_t maxRetries = 2, bool allowReinit = true);
+    uint32_t       getMaxScanLatency(uint32_t duration);
+
+    // Shared with BTScanCore.
+    static int8_t  discResultRSSI(esp_bt_gap_cb_param_t::disc_res_param* disc_res);
+    static uint8_t inquiryUnits(uint32_t duration);
+    static void    prepareInquiry();
 
   private:
     BTScan();
     ~BTScan(void);
     friend class BTDevice;
     void handleGAPEvent(esp_bt_gap_cb_event_t  event, esp_bt_gap_cb_param_t* param);
+#ifdef BT_HAVE_BLE
+    void handleBLEGAPEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
+    bool startBleSlice(uint8_t seconds);
+#endif
+    bool isDuplicate(uint64_t packedAddress, int8_t rssi, uint8_t transport, int32_t* pSlot);
+    void addSighting(BTAdvertisedDevice& device, uint64_t packedAddress, int32_t slot, uint32_t eirHash = 0,
+                     bool replace = false);
+    bool startScan(uint32_t duration, void (*scanCompleteCB)(BTScanResults),
+                   void (*scanCompleteRefCB)(const BTScanResults&));
+    void scanCompleted();
+    bool claimSlice(uint32_t slice);
+    bool nextSlice();
+    bool startClassicSlice(uint8_t units);
+    void armWatchdog(uint32_t sliceMs);
+    void onWatchdog();
+    bool restartScan();
+    static void watchdogCallback(void* pArg);
+    static void watchdogTask(void* pArg);
     //void parseAdvertisement(BLEClient* pRemoteDevice, uint8_t *payload);
 
     BTAdvertisedDeviceCallbacks*  m_pAdvertisedDeviceCallbacks;
-    bool                          m_stopped;
+    std::atomic<bool>             m_stopped;
     FreeRTOS::Semaphore           m_semaphoreScanEnd = FreeRTOS::Semaphore("ScanEnd");
     BTScanResults                 m_scanResults;
     bool                          m_wantDuplicates;
     void                        (*m_scanCompleteCB)(BTScanResults scanResults);
+    void                        (*m_scanCompleteRefCB)(const BTScanResults& scanResults);
+    BTDeviceTracker               m_tracker;
+    BTScanMetrics                 m_metrics;
+    BTArena                       m_arena;
+    size_t                        m_arenaSize;
+    bool                          m_dualMode;
+    uint8_t                       m_classicSlice;      // Classic inquiry slice, in 1.28 s units.
+    uint8_t                       m_bleSlice;          // BLE scan slice, in seconds.
+    uint32_t                      m_budgetEnd;         // End of the scan, milliseconds since boot.
+    uint8_t                       m_sliceTransport;    // Transport of the current or last slice.
+    std::atomic<bool>             m_bleScanning;
+    std::atomic<bool>             m_bleParamsSet;
+    uint8_t                       m_bleSliceSeconds;
+    int64_t                       m_startRequested;    // When start() was called, 0 once discovery started.
+    uint32_t                      m_restartLatencyMs;
+    uint32_t                      m_firstResultMs;     // Milliseconds since boot, 0 until the first result.
+    BTServiceDiscovery*           m_pServiceDiscovery;
+    BTWatchlist                   m_watchlist;
+    bool                          m_matchOnly;
+    BTDepartureWheel*             m_pDepartureWheel;
+    esp_timer_handle_t            m_watchdogTimer;
+    uint32_t                      m_watchdogGraceMs;   // 0 when the watchdog is off.
+    uint8_t                       m_watchdogRetries;
+    bool                          m_watchdogReinit;
+    TaskHandle_t                  m_watchdogTask;
+    std::atomic<uint64_t>         m_watchdogArmed;     // Slice id in the high word, deadline in ms since boot.
+    std::atomic<uint8_t>          m_missedDeadlines;   // In a row, reset by an inquiry ending on its own.
+    std::atomic<uint32_t>         m_slice;             // Id of the slice in progress, see claimSlice().
+    std::atomic<uint32_t>         m_inquirySlice;      // Slice of the last inquiry reported started, 0 until the last one requested did.
+    std::atomic<bool>             m_scanActive;        // Between start() and scanCompleted().
+    uint32_t                      m_maxLatencyMs;      // Of the scan in progress.
+    std::atomic<int64_t>          m_recoveryStart;     // First missed deadline of the scan, 0 if none.
+    std::atomic<uint32_t>         m_recoveryMs;
+    std::atomic<uint32_t>         m_recoveryMaxMs;
     bool                          stop_bt();
 
 
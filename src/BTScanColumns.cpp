@@ -0,0 +1,261 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BTScanColumns.h"
+#if !defined(ESP_PLATFORM) || (defined(CONFIG_BT_ENABLED) && defined(CONFIG_BLUEDROID_ENABLED))
+#include <string.h>
+#include <algorithm>
+
+#if defined(CONFIG_BT_ENABLED)
+#include "BTScan.h"
+#endif
+
+
+BTColumnFilter::BTColumnFilter() {
+	minRssi     = -128;
+	codMask     = 0;
+	codValue    = 0;
+	flagsMask   = 0;
+	flagsValue  = 0;
+	minLastSeen = 0;
+} // BTColumnFilter
+
+
+/**
+ * @brief Only accept devices heard at or above an RSSI.
+ */
+BTColumnFilter& BTColumnFilter::rssiAtLeast(int8_t rssi) {
+	minRssi    = rssi;
+	flagsMask  |= BT_COLUMN_HAVE_RSSI;
+	flagsValue |= BT_COLUMN_HAVE_RSSI;
+	return *this;
+} // rssiAtLeast
+
+
+/**
+ * @brief Only accept devices of a class of device major class, e.g. 0x02 for phones, 0x04 for audio.
+ */
+BTColumnFilter& BTColumnFilter::majorClass(uint8_t majorClass) {
+	codMask    = 0x1f00;
+	codValue   = (uint32_t)(majorClass & 0x1f) << 8;
+	flagsMask  |= BT_COLUMN_HAVE_COD;
+	flagsValue |= BT_COLUMN_HAVE_COD;
+	return *this;
+} // majorClass
+
+
+/**
+ * @brief Only accept devices having all of the given BT_COLUMN_HAVE_* flags.
+ */
+BTColumnFilter& BTColumnFilter::withFlags(uint8_t flags) {
+	flagsMask  |= flags;
+	flagsValue |= flags;
+	return *this;
+} // withFlags
+
+
+/**
+ * @brief Only accept devices seen at or after a time, in milliseconds since boot.
+ */
+BTColumnFilter& BTColumnFilter::seenSince(uint32_t millis) {
+	minLastSeen = millis;
+	return *this;
+} // seenSince
+
+
+BTScanColumns::BTScanColumns(BTAllocator* pAllocator) :
+	m_address(BTStlAllocator<uint64_t>(pAllocator)),
+	m_cod(BTStlAllocator<uint32_t>(pAllocator)),
+	m_rssi(BTStlAllocator<int8_t>(pAllocator)),
+	m_lastSeen(BTStlAllocator<uint32_t>(pAllocator)),
+	m_flags(BTStlAllocator<uint8_t>(pAllocator)) {
+} // BTScanColumns
+
+
+#if defined(CONFIG_BT_ENABLED)
+/**
+ * @brief Copy scan results into the columns, replacing the previous snapshot.
+ *
+ * RSSI and last seen time come from the hot index, so they reflect the latest sighting.  Storage is
+ * reused across snapshots.
+ *
+ * @param [in] results The results to copy.
+ */
+void BTScanColumns::snapshot(BTScanResults& results) {
+	size_t count = results.m_vectorAdvertisedDevices.size();
+	m_address.resize(count);
+	m_cod.resize(count);
+	m_rssi.resize(count);
+	m_lastSeen.resize(count);
+	m_flags.resize(count);
+
+	for (size_t i = 0; i < count; i++) {
+		BTAdvertisedDevice& device = results.m_vectorAdvertisedDevices[i];
+		m_address[i]  = device.m_address.toUint64();
+		m_cod[i]      = device.m_haveCod ? device.m_cod : 0;
+		m_rssi[i]     = results.m_hot[i].rssi;
+		m_lastSeen[i] = results.m_hot[i].lastSeen;
+		m_flags[i]    = (device.haveName()             ? BT_COLUMN_HAVE_NAME         : 0) |
+		                (device.m_haveCod              ? BT_COLUMN_HAVE_COD          : 0) |
+		                (device.m_haveRSSI             ? BT_COLUMN_HAVE_RSSI         : 0) |
+		                (device.haveServiceUUID()      ? BT_COLUMN_HAVE_UUID         : 0) |
+		                (device.m_haveTXPower          ? BT_COLUMN_HAVE_TXPOWER      : 0) |
+		                (device.haveManufacturerData() ? BT_COLUMN_HAVE_MANUFACTURER : 0) |
+		                ((device.m_transports & BT_TRANSPORT_CLASSIC) ? BT_COLUMN_SEEN_CLASSIC : 0) |
+		                ((device.m_transports & BT_TRANSPORT_BLE)     ? BT_COLUMN_SEEN_BLE     : 0);
+	}
+} // snapshot
+#endif
+
+
+/**
+ * @brief Drop every row.  Storage is kept for the next rows.
+ */
+void BTScanColumns::clear() {
+	m_address.clear();
+	m_cod.clear();
+	m_rssi.clear();
+	m_lastSeen.clear();
+	m_flags.clear();
+} // clear
+
+
+/**
+ * @brief Add a row, for columns filled from something other than local scan results.
+ * @param [in] address The packed address, see BTAddress::toUint64().
+ * @param [in] cod The class of device, 0 when unknown.
+ * @param [in] rssi The RSSI of the latest sighting.
+ * @param [in] lastSeen The time of the latest sighting, in milliseconds.
+ * @param [in] flags The BT_COLUMN_* flags of the device.
+ */
+void BTScanColumns::append(uint64_t address, uint32_t cod, int8_t rssi, uint32_t lastSeen, uint8_t flags) {
+	m_address.push_back(address);
+	m_cod.push_back(cod);
+	m_rssi.push_back(rssi);
+	m_lastSeen.push_back(lastSeen);
+	m_flags.push_back(flags);
+} // append
+
+
+size_t BTScanColumns::getCount() {
+	return m_address.size();
+} // getCount
+
+
+/**
+ * @brief Get the packed address of a device, see BTAddress::toUint64().
+ */
+uint64_t BTScanColumns::getAddress(size_t i) {
+	return m_address.at(i);
+} // getAddress
+
+
+uint32_t BTScanColumns::getCod(size_t i) {
+	return m_cod.at(i);
+} // getCod
+
+
+int8_t BTScanColumns::getRSSI(size_t i) {
+	return m_rssi.at(i);
+} // getRSSI
+
+
+uint32_t BTScanColumns::getLastSeen(size_t i) {
+	return m_lastSeen.at(i);
+} // getLastSeen
+
+
+uint8_t BTScanColumns::getFlags(size_t i) {
+	return m_flags.at(i);
+} // getFlags
+
+
+/**
+ * @brief Evaluate a filter on one row without branching.
+ * @return 1 if the row passes, 0 otherwise.
+ */
+inline uint32_t BTScanColumns::matches(const BTColumnFilter& filter, size_t i) {
+	return (uint32_t)(m_rssi[i] >= filter.minRssi) &
+	       (uint32_t)((m_cod[i] & filter.codMask) == filter.codValue) &
+	       (uint32_t)((m_flags[i] & filter.flagsMask) == filter.flagsValue) &
+	       (uint32_t)(m_lastSeen[i] >= filter.minLastSeen);
+} // matches
+
+
+/**
+ * @brief Count the devices passing a filter.
+ */
+size_t BTScanColumns::count(const BTColumnFilter& filter) {
+	size_t   rows  = m_address.size();
+	uint32_t total = 0;
+	for (size_t i = 0; i < rows; i++) {
+		total += matches(filter, i);
+	}
+	return total;
+} // count
+
+
+/**
+ * @brief Collect the rows passing a filter.
+ * @param [in] filter The filter.
+ * @param [out] selection Receives the row indexes, in row order.
+ * @return The number of rows selected.
+ */
+size_t BTScanColumns::select(const BTColumnFilter& filter, std::vector<uint32_t>& selection) {
+	size_t rows = m_address.size();
+	selection.resize(rows);
+	size_t selected = 0;
+	for (size_t i = 0; i < rows; i++) {
+		selection[selected] = i;          // Always written, kept only when the row passes.
+		selected += matches(filter, i);
+	}
+	selection.resize(selected);
+	return selected;
+} // select
+
+
+/**
+ * @brief Collect the k rows with the strongest RSSI among those passing a filter.
+ * @param [in] filter The filter.
+ * @param [in] k The number of rows wanted.
+ * @param [out] selection Receives the row indexes, strongest first.
+ * @return The number of rows selected, at most k.
+ */
+size_t BTScanColumns::topRssi(const BTColumnFilter& filter, size_t k, std::vector<uint32_t>& selection) {
+	size_t selected = select(filter, selection);
+	if (k > selected) {
+		k = selected;
+	}
+	const int8_t* rssi = m_rssi.data();
+	std::partial_sort(selection.begin(), selection.begin() + k, selection.end(),
+		[rssi](uint32_t a, uint32_t b) { return rssi[a] > rssi[b]; });
+	selection.resize(k);
+	return k;
+} // topRssi
+
+
+/**
+ * @brief Count the devices passing a filter by class of device major class.
+ * @param [in] filter The filter.
+ * @param [out] counts Receives one count per major class, indexed by (cod >> 8) & 0x1f.
+ */
+void BTScanColumns::countByMajorClass(const BTColumnFilter& filter, uint32_t counts[BT_COD_MAJOR_CLASSES]) {
+	memset(counts, 0, BT_COD_MAJOR_CLASSES * sizeof(uint32_t));
+	size_t rows = m_address.size();
+	for (size_t i = 0; i < rows; i++) {
+		counts[(m_cod[i] >> 8) & 0x1f] += matches(filter, i);
+	}
+} // countByMajorClass
+
+#endif /* !ESP_PLATFORM || (CONFIG_BT_ENABLED && CONFIG_BLUEDROID_ENABLED) */
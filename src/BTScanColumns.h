@@ -0,0 +1,105 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_SCAN_COLUMNS_H_
+#define _BT_SCAN_COLUMNS_H_
+
+// Like BTScanSnapshot, the columns and the queries are plain C++11, so that a host can run them over
+// rows it appends itself; only snapshot() needs the ESP32 Bluetooth stack.
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#if !defined(ESP_PLATFORM) || (defined(CONFIG_BT_ENABLED) && defined(CONFIG_BLUEDROID_ENABLED))
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "BTAllocator.h"
+
+class BTScanResults;
+
+// Per device flags column.
+#define BT_COLUMN_HAVE_NAME         0x01
+#define BT_COLUMN_HAVE_COD          0x02
+#define BT_COLUMN_HAVE_RSSI         0x04
+#define BT_COLUMN_HAVE_UUID         0x08
+#define BT_COLUMN_HAVE_TXPOWER      0x10
+#define BT_COLUMN_HAVE_MANUFACTURER 0x20
+#define BT_COLUMN_SEEN_CLASSIC      0x40
+#define BT_COLUMN_SEEN_BLE          0x80
+
+#define BT_COD_MAJOR_CLASSES        32
+
+/**
+ * @brief A predicate over the columns of a snapshot.  A default constructed filter accepts everything.
+ *
+ * A device passes when rssi >= minRssi, (cod & codMask) == codValue, (flags & flagsMask) == flagsValue
+ * and lastSeen >= minLastSeen.
+ */
+struct BTColumnFilter {
+	BTColumnFilter();
+	BTColumnFilter& rssiAtLeast(int8_t rssi);
+	BTColumnFilter& majorClass(uint8_t majorClass);
+	BTColumnFilter& withFlags(uint8_t flags);
+	BTColumnFilter& seenSince(uint32_t millis);
+
+	int8_t   minRssi;
+	uint32_t codMask;
+	uint32_t codValue;
+	uint8_t  flagsMask;
+	uint8_t  flagsValue;
+	uint32_t minLastSeen;
+};
+
+
+/**
+ * @brief A structure of arrays copy of scan results, for analytics queries.
+ *
+ * snapshot() copies the fields queries need into parallel arrays, once.  The queries then run as flat
+ * loops over those arrays: predicates are combined with bitwise operations rather than branches, so
+ * the loops auto-vectorise on a host and stay branch light on the ESP32.
+ */
+class BTScanColumns {
+public:
+	BTScanColumns(BTAllocator* pAllocator = BTAllocator::getDefault());
+#if defined(CONFIG_BT_ENABLED)
+	void     snapshot(BTScanResults& results);
+#endif
+	void     clear();
+	void     append(uint64_t address, uint32_t cod, int8_t rssi, uint32_t lastSeen, uint8_t flags);
+	size_t   getCount();
+	uint64_t getAddress(size_t i);
+	uint32_t getCod(size_t i);
+	int8_t   getRSSI(size_t i);
+	uint32_t getLastSeen(size_t i);
+	uint8_t  getFlags(size_t i);
+
+	size_t   count(const BTColumnFilter& filter);
+	size_t   select(const BTColumnFilter& filter, std::vector<uint32_t>& selection);
+	size_t   topRssi(const BTColumnFilter& filter, size_t k, std::vector<uint32_t>& selection);
+	void     countByMajorClass(const BTColumnFilter& filter, uint32_t counts[BT_COD_MAJOR_CLASSES]);
+
+private:
+	uint32_t matches(const BTColumnFilter& filter, size_t i);
+
+	std::vector<uint64_t, BTStlAllocator<uint64_t> > m_address;
+	std::vector<uint32_t, BTStlAllocator<uint32_t> > m_cod;
+	std::vector<int8_t, BTStlAllocator<int8_t> >     m_rssi;
+	std::vector<uint32_t, BTStlAllocator<uint32_t> > m_lastSeen;
+	std::vector<uint8_t, BTStlAllocator<uint8_t> >   m_flags;
+};
+
+#endif /* !ESP_PLATFORM || (CONFIG_BT_ENABLED && CONFIG_BLUEDROID_ENABLED) */
+#endif /* _BT_SCAN_COLUMNS_H_ */
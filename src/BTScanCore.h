@@ -0,0 +1,500 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_SCAN_CORE_H_
+#define _BT_SCAN_CORE_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED) && defined(CONFIG_BLUEDROID_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <new>
+#include <vector>
+#include <unordered_map>
+
+#include "esp_bt.h"
+#include "esp_gap_bt_api.h"
+#include "esp_timer.h"
+
+#include "BTAddress.h"
+#include "BTAdvertisedDevice.h"
+#include "BTAllocator.h"
+#include "BTArena.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+
+// ---------------------------------------------------------------------------------------------------
+// Storage policies.  A storage keeps one record per slot and offers:
+//
+//   BTAdvertisedDevice* find(uint64_t address);     The record of an address, nullptr if none.
+//   BTAdvertisedDevice* insert(uint64_t address);   A fresh record for an address, nullptr when full.
+//   BTAdvertisedDevice& at(size_t i);
+//   size_t              size();
+//   void                clear();
+// ---------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Records in a growing std::vector, looked up through a hash map.
+ */
+class BTVectorStorage {
+public:
+	BTVectorStorage() : m_capacity(0) {}
+
+	/**
+	 * @brief Bound the number of records, 0 for no bound.  Storage is reserved up front.
+	 */
+	void setCapacity(size_t capacity) {
+		clear();
+		m_capacity = capacity;
+		m_devices.reserve(capacity);
+		m_index.reserve(capacity);
+	}
+	BTAdvertisedDevice* find(uint64_t address) {
+		std::unordered_map<uint64_t, uint32_t>::iterator it = m_index.find(address);
+		return it == m_index.end() ? nullptr : &m_devices[it->second];
+	}
+	BTAdvertisedDevice* insert(uint64_t address) {
+		if (m_capacity != 0 && m_devices.size() >= m_capacity) {
+			return nullptr;
+		}
+		m_index[address] = m_devices.size();
+		m_devices.push_back(BTAdvertisedDevice());
+		return &m_devices.back();
+	}
+	BTAdvertisedDevice& at(size_t i) {
+		return m_devices.at(i);
+	}
+	size_t size() {
+		return m_devices.size();
+	}
+	void clear() {
+		m_devices.clear();
+		m_index.clear();
+	}
+
+private:
+	std::vector<BTAdvertisedDevice>        m_devices;
+	std::unordered_map<uint64_t, uint32_t> m_index;
+	size_t                                 m_capacity;
+};
+
+
+/**
+ * @brief Records in a fixed array inside the scan object, no heap at all.
+ *
+ * Lookup is a linear scan over a packed array of addresses, which for the few tens of devices such
+ * builds keep is cheaper than hashing.
+ *
+ * @tparam Capacity The number of records.
+ */
+template <size_t Capacity>
+class BTStaticStorage {
+public:
+	BTStaticStorage() : m_count(0) {}
+
+	BTAdvertisedDevice* find(uint64_t address) {
+		for (size_t i = 0; i < m_count; i++) {
+			if (m_addresses[i] == address) {
+				return &m_devices[i];
+			}
+		}
+		return nullptr;
+	}
+	BTAdvertisedDevice* insert(uint64_t address) {
+		if (m_count == Capacity) {
+			return nullptr;
+		}
+		m_addresses[m_count] = address;
+		m_devices[m_count]   = BTAdvertisedDevice();
+		return &m_devices[m_count++];
+	}
+	BTAdvertisedDevice& at(size_t i) {
+		return m_devices[i];
+	}
+	size_t size() {
+		return m_count;
+	}
+	void clear() {
+		m_count = 0;
+	}
+
+private:
+	uint64_t           m_addresses[Capacity];
+	BTAdvertisedDevice m_devices[Capacity];
+	size_t             m_count;
+};
+
+
+/**
+ * @brief Records and an open addressing index carved from one BTArena block.
+ *
+ * The block is sized for the capacity when the storage is set up and reused across scans, so the
+ * allocator, e.g. PSRAM or a BTStaticAllocator, is only asked once.
+ */
+class BTArenaStorage {
+public:
+	BTArenaStorage() : m_devices(nullptr), m_table(nullptr), m_mask(0), m_capacity(0), m_count(0) {}
+	~BTArenaStorage() {
+		clear();
+	}
+
+	/**
+	 * @brief Carve storage for a number of records.
+	 * @param [in] capacity The number of records.
+	 * @param [in] pAllocator Where the block comes from.
+	 * @return False if the block could not be allocated.
+	 */
+	bool setCapacity(size_t capacity, BTAllocator* pAllocator = BTAllocator::getDefault()) {
+		clear();
+		size_t slots = 1;
+		while (slots < capacity * 2) {
+			slots <<= 1;
+		}
+		size_t size = capacity * sizeof(BTAdvertisedDevice) + slots * sizeof(uint32_t) + 16;
+		m_devices  = nullptr;
+		m_table    = nullptr;
+		m_capacity = 0;
+		if (capacity == 0 || !m_arena.reserve(size, pAllocator)) {
+			return false;
+		}
+		m_devices  = (BTAdvertisedDevice*)m_arena.allocate(capacity * sizeof(BTAdvertisedDevice), alignof(BTAdvertisedDevice));
+		m_table    = (uint32_t*)m_arena.allocate(slots * sizeof(uint32_t), alignof(uint32_t));
+		m_mask     = slots - 1;
+		m_capacity = capacity;
+		memset(m_table, 0xff, slots * sizeof(uint32_t));
+		return true;
+	}
+	BTAdvertisedDevice* find(uint64_t address) {
+		if (m_capacity == 0) {
+			return nullptr;
+		}
+		for (size_t i = hash(address) & m_mask; m_table[i] != empty; i = (i + 1) & m_mask) {
+			if (m_devices[m_table[i]].m_address.toUint64() == address) {
+				return &m_devices[m_table[i]];
+			}
+		}
+		return nullptr;
+	}
+	BTAdvertisedDevice* insert(uint64_t address) {
+		if (m_count == m_capacity) {
+			return nullptr;
+		}
+		size_t i = hash(address) & m_mask;
+		while (m_table[i] != empty) {
+			i = (i + 1) & m_mask;
+		}
+		m_table[i] = m_count;
+		BTAdvertisedDevice* pDevice = new (&m_devices[m_count++]) BTAdvertisedDevice();
+		pDevice->setAddress(BTAddress(address));   // find() compares against the record.
+		return pDevice;
+	}
+	BTAdvertisedDevice& at(size_t i) {
+		return m_devices[i];
+	}
+	size_t size() {
+		return m_count;
+	}
+	void clear() {
+		for (size_t i = 0; i < m_count; i++) {
+			m_devices[i].~BTAdvertisedDevice();
+		}
+		m_count = 0;
+		if (m_table != nullptr) {
+			memset(m_table, 0xff, (m_mask + 1) * sizeof(uint32_t));
+		}
+	}
+
+private:
+	static const uint32_t empty = 0xffffffff;
+
+	static size_t hash(uint64_t address) {
+		return (size_t)((address * 0x9E3779B97F4A7C15ULL) >> 32);
+	}
+
+	BTArena             m_arena;
+	BTAdvertisedDevice* m_devices;
+	uint32_t*           m_table;
+	size_t              m_mask;
+	size_t              m_capacity;
+	size_t              m_count;
+};
+
+
+// ---------------------------------------------------------------------------------------------------
+// Dedup policies.  lookup says whether repeats are searched for at all; repeat() is given the stored
+// record, the RSSI and time of a repeat sighting, and returns whether to dispatch the stored record.
+// ---------------------------------------------------------------------------------------------------
+
+/**
+ * @brief No dedup: every sighting gets its own record and is dispatched.  The cheapest path, for
+ * logging raw sightings.
+ */
+struct BTDedupNone {
+	static const bool lookup = false;
+	static bool repeat(BTAdvertisedDevice&, int8_t, uint32_t) {
+		return true;
+	}
+};
+
+/**
+ * @brief Keep and dispatch the first sighting of each address only; repeats cost one lookup.
+ */
+struct BTDedupFirstSeen {
+	static const bool lookup = true;
+	static bool repeat(BTAdvertisedDevice&, int8_t, uint32_t) {
+		return false;
+	}
+};
+
+/**
+ * @brief Dispatch the first sighting; fold the RSSI and time of repeats into the stored record.
+ */
+struct BTDedupMerge {
+	static const bool lookup = true;
+	static bool repeat(BTAdvertisedDevice& stored, int8_t rssi, uint32_t now) {
+		if (rssi != -128) {
+			stored.m_rssi     = rssi;
+			stored.m_haveRSSI = true;
+		}
+		stored.m_timestamp = now;
+		return false;
+	}
+};
+
+
+// ---------------------------------------------------------------------------------------------------
+// Dispatch policies.  The scan core derives from its dispatch policy, so a stateless functor costs
+// no space and its call is inlined.
+// ---------------------------------------------------------------------------------------------------
+
+/**
+ * @brief Call a BTAdvertisedDeviceCallbacks set at run time.
+ */
+class BTVirtualDispatch {
+public:
+	BTVirtualDispatch() : m_pCallbacks(nullptr) {}
+	void setAdvertisedDeviceCallbacks(BTAdvertisedDeviceCallbacks* pCallbacks) {
+		m_pCallbacks = pCallbacks;
+	}
+
+protected:
+	void dispatch(BTAdvertisedDevice& device) {
+		if (m_pCallbacks != nullptr) {
+			m_pCallbacks->onResult(device);
+		}
+	}
+
+private:
+	BTAdvertisedDeviceCallbacks* m_pCallbacks;
+};
+
+/**
+ * @brief Call a functor chosen at compile time, with the record by reference.
+ * @tparam Functor A type with void operator()(BTAdvertisedDevice&).
+ */
+template <class Functor>
+class BTStaticDispatch {
+public:
+	Functor& getFunctor() {
+		return m_functor;
+	}
+
+protected:
+	void dispatch(BTAdvertisedDevice& device) {
+		m_functor(device);
+	}
+
+private:
+	Functor m_functor;
+};
+
+/**
+ * @brief Dispatch nothing; results are only read back from the storage.
+ */
+class BTNoDispatch {
+protected:
+	void dispatch(BTAdvertisedDevice&) {}
+};
+
+
+/**
+ * @brief A classic inquiry scan whose storage, dedup and dispatch are fixed at compile time.
+ *
+ * BTScan decides these at run time and carries the LRU index, change tracking, metrics and dual mode
+ * with it.  A build that needs none of that can instantiate only what it uses:
+ *
+ * ```
+ * struct OnDevice { void operator()(BTAdvertisedDevice& d) { ... } };
+ * static BTAllocator* pNames = new BTStaticAllocator<1024>();   // Or a static instance.
+ * static BTScanCore<BTStaticStorage<16>, BTDedupFirstSeen, BTStaticDispatch<OnDevice> > scan(pNames, 1024);
+ *
+ * BTDevice::init("");
+ * scan.attach();
+ * scan.start(5);
+ * ```
+ *
+ * With BTStaticStorage and a BTStaticAllocator for names and UUIDs, scanning allocates nothing.
+ *
+ * attach() registers the core with BTDevice::registerGapHandler(), next to BTScan.  Both see every
+ * inquiry, so start only one of them at a time.
+ *
+ * @tparam Storage A storage policy.
+ * @tparam Dedup A dedup policy.
+ * @tparam Dispatch A dispatch policy.
+ */
+template <class Storage = BTVectorStorage, class Dedup = BTDedupFirstSeen, class Dispatch = BTVirtualDispatch>
+class BTScanCore : public Dispatch {
+public:
+	/**
+	 * @param [in] pArenaAllocator Where the arena for names and service UUIDs comes from.
+	 * @param [in] arenaSize The size of that arena.
+	 */
+	BTScanCore(BTAllocator* pArenaAllocator = BTAllocator::getDefault(), size_t arenaSize = BT_SCAN_ARENA_SIZE) :
+		m_pArenaAllocator(pArenaAllocator), m_arenaSize(arenaSize), m_scanning(false),
+		m_completeCB(nullptr), m_pCompleteContext(nullptr), m_dropped(0) {}
+
+	/**
+	 * @brief Route the classic GAP events of an inquiry to this scan.
+	 * @return False if BTDevice has no room for another handler.
+	 */
+	bool attach() {
+		if (!BTDevice::registerGapHandler(ESP_BT_GAP_DISC_RES_EVT, &BTScanCore::gapHandler, this)) {
+			return false;
+		}
+		if (!BTDevice::registerGapHandler(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, &BTScanCore::gapHandler, this)) {
+			BTDevice::unregisterGapHandler(ESP_BT_GAP_DISC_RES_EVT, &BTScanCore::gapHandler, this);
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * @brief Stop routing GAP events to this scan.  Call before the core is destroyed.
+	 */
+	void detach() {
+		BTDevice::unregisterGapHandler(ESP_BT_GAP_DISC_RES_EVT, &BTScanCore::gapHandler, this);
+		BTDevice::unregisterGapHandler(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, &BTScanCore::gapHandler, this);
+	}
+
+	/**
+	 * @brief Start a scan.  Results from a previous scan are cleared.
+	 * @param [in] duration The duration in seconds, rounded to 1.28 s inquiry units, at most 12.8 s.
+	 * @return False if the inquiry could not be started.
+	 */
+	bool start(uint32_t duration) {
+		m_storage.clear();
+		m_arena.reserve(m_arenaSize, m_pArenaAllocator);
+		m_dropped = 0;
+		BTScan::prepareInquiry();
+		m_scanning = esp_bt_gap_start_discovery(ESP_BT_INQ_MODE_GENERAL_INQUIRY, BTScan::inquiryUnits(duration), 0) == ESP_OK;
+		return m_scanning;
+	}
+
+	void stop() {
+		esp_bt_gap_cancel_discovery();
+	}
+
+	/**
+	 * @brief Set a function called when a scan ends.
+	 */
+	void setCompleteCallback(void (*completeCB)(void* pContext), void* pContext = nullptr) {
+		m_completeCB       = completeCB;
+		m_pCompleteContext = pContext;
+	}
+
+	bool isScanning() {
+		return m_scanning;
+	}
+	size_t getCount() {
+		return m_storage.size();
+	}
+	BTAdvertisedDevice& getDevice(size_t i) {
+		return m_storage.at(i);
+	}
+	Storage& getStorage() {
+		return m_storage;
+	}
+	uint32_t getDroppedCount() {   // New devices that did not fit in the storage.
+		return m_dropped;
+	}
+
+	/**
+	 * @brief Handle a classic GAP event.  attach() routes events here; call it directly to feed events
+	 * from another handler.
+	 */
+	void handleGAPEvent(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param) {
+		switch (event) {
+			case ESP_BT_GAP_DISC_RES_EVT: {
+				onDiscResult(&param->disc_res);
+				break;
+			}
+			case ESP_BT_GAP_DISC_STATE_CHANGED_EVT: {
+				if (param->disc_st_chg.state == ESP_BT_GAP_DISCOVERY_STOPPED && m_scanning) {
+					m_scanning = false;
+					if (m_completeCB != nullptr) {
+						m_completeCB(m_pCompleteContext);
+					}
+				}
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+	}
+
+private:
+	void onDiscResult(esp_bt_gap_cb_param_t::disc_res_param* disc_res) {
+		uint64_t packed = BTAddress(disc_res->bda).toUint64();
+		uint32_t now    = (uint32_t)(esp_timer_get_time() / 1000);
+		if (Dedup::lookup) {
+			BTAdvertisedDevice* pStored = m_storage.find(packed);
+			if (pStored != nullptr) {
+				if (Dedup::repeat(*pStored, BTScan::discResultRSSI(disc_res), now)) {
+					this->dispatch(*pStored);
+				}
+				return;
+			}
+		}
+		BTAdvertisedDevice* pDevice = m_storage.insert(packed);
+		if (pDevice == nullptr) {
+			m_dropped++;
+			return;
+		}
+		pDevice->setAddress(BTAddress(disc_res->bda));
+		pDevice->setArena(&m_arena);
+		pDevice->parseDiscResult(disc_res);
+		pDevice->setTimestamp(now);
+		pDevice->m_transports = BT_TRANSPORT_CLASSIC;
+		this->dispatch(*pDevice);
+	}
+
+	static void gapHandler(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param, void* pArg) {
+		static_cast<BTScanCore*>(pArg)->handleGAPEvent(event, param);
+	}
+
+	Storage       m_storage;
+	BTArena       m_arena;
+	BTAllocator*  m_pArenaAllocator;
+	size_t        m_arenaSize;
+	volatile bool m_scanning;
+	void        (*m_completeCB)(void* pContext);
+	void*         m_pCompleteContext;
+	uint32_t      m_dropped;
+};
+
+#endif /* CONFIG_BT_ENABLED && CONFIG_BLUEDROID_ENABLED */
+#endif /* _BT_SCAN_CORE_H_ */
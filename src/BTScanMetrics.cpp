@@ -0,0 +1,188 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <stdio.h>
+
+#include "BTScanMetrics.h"
+
+
+BTScanMetrics::BTScanMetrics() :
+	eventsReceived(0), discResults(0), uniqueDevices(0), duplicatesSuppressed(0),
+	parseFailures(0), inquiryStarts(0), inquiryCancels(0), inquiryErrors(0),
+	evictions(0), callbackCount(0), callbackTimeUs(0), callbackMaxUs(0), eirCacheHits(0),
+	eirCacheMisses(0), watchlistDropped(0), watchdogFires(0), watchdogRestarts(0), watchdogReinits(0),
+	watchdogAborts(0) {
+} // BTScanMetrics
+
+
+/**
+ * @brief Increment a counter.
+ */
+void BTScanMetrics::inc(std::atomic<uint32_t>& counter) {
+	counter.fetch_add(1, std::memory_order_relaxed);
+} // inc
+
+
+/**
+ * @brief Account for the time spent in an application callback.
+ * @param [in] micros The duration of the callback.
+ */
+void BTScanMetrics::addCallbackTime(uint32_t micros) {
+	callbackCount.fetch_add(1, std::memory_order_relaxed);
+	callbackTimeUs.fetch_add(micros, std::memory_order_relaxed);
+	uint32_t max = callbackMaxUs.load(std::memory_order_relaxed);
+	while (micros > max && !callbackMaxUs.compare_exchange_weak(max, micros, std::memory_order_relaxed)) {
+	}
+} // addCallbackTime
+
+
+uint32_t BTScanMetrics::take(std::atomic<uint32_t>& counter, bool reset) {
+	return reset ? counter.exchange(0, std::memory_order_relaxed) : counter.load(std::memory_order_relaxed);
+} // take
+
+
+/**
+ * @brief Copy the counters into a snapshot.  Gauges are left for the caller to fill in.
+ * @param [out] pStats The snapshot.
+ * @param [in] reset Zero each counter as it is read.
+ */
+void BTScanMetrics::snapshot(BTScanStats* pStats, bool reset) {
+	pStats->eventsReceived       = take(eventsReceived, reset);
+	pStats->discResults          = take(discResults, reset);
+	pStats->uniqueDevices        = take(uniqueDevices, reset);
+	pStats->duplicatesSuppressed = take(duplicatesSuppressed, reset);
+	pStats->parseFailures        = take(parseFailures, reset);
+	pStats->inquiryStarts        = take(inquiryStarts, reset);
+	pStats->inquiryCancels       = take(inquiryCancels, reset);
+	pStats->inquiryErrors        = take(inquiryErrors, reset);
+	pStats->evictions            = take(evictions, reset);
+	pStats->callbackCount        = take(callbackCount, reset);
+	pStats->callbackTimeUs       = take(callbackTimeUs, reset);
+	pStats->callbackMaxUs        = take(callbackMaxUs, reset);
+	pStats->eirCacheHits         = take(eirCacheHits, reset);
+	pStats->eirCacheMisses       = take(eirCacheMisses, reset);
+	pStats->watchlistDropped     = take(watchlistDropped, reset);
+	pStats->watchdogFires        = take(watchdogFires, reset);
+	pStats->watchdogRestarts     = take(watchdogRestarts, reset);
+	pStats->watchdogReinits      = take(watchdogReinits, reset);
+	pStats->watchdogAborts       = take(watchdogAborts, reset);
+	pStats->countersReset        = reset;
+} // snapshot
+
+
+/**
+ * @brief Format the snapshot in the Prometheus text exposition format.
+ *
+ * Counters are exported as monotonic `_total` counters.  When the snapshot was taken with a reset they
+ * only cover the time since the previous read, so they are exported as gauges without the suffix
+ * instead: a scraper must use one mode or the other, not both.
+ *
+ * @param [out] buffer Where the text is written, null terminated.
+ * @param [in] length The size of the buffer.
+ * @return The length of the text, or 0 if it did not fit.
+ */
+size_t BTScanStats::toPrometheus(char* buffer, size_t length) {
+	enum Kind { GAUGE, COUNTER, MONOTONIC };   // COUNTER is zeroed by getStats(true), MONOTONIC never is.
+	struct Metric {
+		const char* name;
+		Kind        kind;
+		uint32_t    value;
+	} metrics[] = {
+		{ "btscan_events_received",         COUNTER,   eventsReceived },
+		{ "btscan_disc_results",            COUNTER,   discResults },
+		{ "btscan_unique_devices",          COUNTER,   uniqueDevices },
+		{ "btscan_duplicates_suppressed",   COUNTER,   duplicatesSuppressed },
+		{ "btscan_parse_failures",          COUNTER,   parseFailures },
+		{ "btscan_inquiry_starts",          COUNTER,   inquiryStarts },
+		{ "btscan_inquiry_cancels",         COUNTER,   inquiryCancels },
+		{ "btscan_inquiry_errors",          COUNTER,   inquiryErrors },
+		{ "btscan_evictions",               COUNTER,   evictions },
+		{ "btscan_callbacks",               COUNTER,   callbackCount },
+		{ "btscan_callback_time_us",        COUNTER,   callbackTimeUs },
+		{ "btscan_callback_max_us",         GAUGE,     callbackMaxUs },
+		{ "btscan_result_count",            GAUGE,     resultCount },
+		{ "btscan_result_bytes",            GAUGE,     resultBytes },
+		{ "btscan_arena_high_water_bytes",  GAUGE,     arenaHighWater },
+		{ "btscan_arena_overflows",         MONOTONIC, arenaOverflows },
+		{ "btscan_heap_free_bytes",         GAUGE,     heapFree },
+		{ "btscan_heap_low_water_bytes",    GAUGE,     heapLowWater },
+		{ "btscan_init_time_ms",            GAUGE,     initTimeMs },
+		{ "btscan_boot_to_first_result_ms", GAUGE,     bootToFirstResultMs },
+		{ "btscan_restart_latency_ms",      GAUGE,     restartLatencyMs },
+		{ "btscan_eir_cache_hits",          COUNTER,   eirCacheHits },
+		{ "btscan_eir_cache_misses",        COUNTER,   eirCacheMisses },
+		{ "btscan_watchlist_dropped",       COUNTER,   watchlistDropped },
+		{ "btscan_watchdog_fires",          COUNTER,   watchdogFires },
+		{ "btscan_watchdog_restarts",       COUNTER,   watchdogRestarts },
+		{ "btscan_watchdog_reinits",        COUNTER,   watchdogReinits },
+		{ "btscan_watchdog_aborts",         COUNTER,   watchdogAborts },
+		{ "btscan_recovery_time_ms",        GAUGE,     recoveryTimeMs },
+		{ "btscan_recovery_max_ms",         GAUGE,     recoveryMaxMs },
+	};
+
+	size_t used = 0;
+	for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+		bool        counter = metrics[i].kind == MONOTONIC || (metrics[i].kind == COUNTER && !countersReset);
+		const char* suffix  = counter ? "_total" : "";
+		int n = snprintf(buffer + used, length - used, "# TYPE %s%s %s\n%s%s %u\n",
+			metrics[i].name, suffix, counter ? "counter" : "gauge", metrics[i].name, suffix,
+			(unsigned)metrics[i].value);
+		if (n < 0 || (size_t)n >= length - used) {
+			return 0;
+		}
+		used += n;
+	}
+	return used;
+} // toPrometheus
+
+
+/**
+ * @brief Encode the snapshot as [version][field count][flags][varint fields...] in declaration order.
+ * @param [out] buffer Where the bytes are written.
+ * @param [in] length The size of the buffer; 153 bytes always suffice.
+ * @return The number of bytes written, or 0 if they did not fit.
+ */
+size_t BTScanStats::toBinary(uint8_t* buffer, size_t length) {
+	const uint32_t fields[] = {
+		eventsReceived, discResults, uniqueDevices, duplicatesSuppressed, parseFailures,
+		inquiryStarts, inquiryCancels, inquiryErrors, evictions, callbackCount, callbackTimeUs,
+		callbackMaxUs, resultCount, resultBytes, arenaHighWater, arenaOverflows, heapFree, heapLowWater,
+		initTimeMs, bootToFirstResultMs, restartLatencyMs, eirCacheHits, eirCacheMisses,
+		watchlistDropped, watchdogFires, watchdogRestarts, watchdogReinits, watchdogAborts, recoveryTimeMs,
+		recoveryMaxMs
+	};
+	const size_t count = sizeof(fields) / sizeof(fields[0]);
+	if (length < 3) {
+		return 0;
+	}
+	size_t used = 0;
+	buffer[used++] = BT_METRICS_BINARY_VERSION;
+	buffer[used++] = (uint8_t)count;
+	buffer[used++] = countersReset ? BT_METRICS_FLAG_RESET : 0;
+	for (size_t i = 0; i < count; i++) {
+		uint32_t value = fields[i];
+		do {
+			if (used >= length) {
+				return 0;
+			}
+			buffer[used++] = (uint8_t)((value & 0x7f) | (value >= 0x80 ? 0x80 : 0));
+			value >>= 7;
+		} while (value != 0);
+	}
+	return used;
+} // toBinary
+
+#endif /* CONFIG_BT_ENABLED */
@@ -0,0 +1,121 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_SCAN_METRICS_H_
+#define _BT_SCAN_METRICS_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Version of the BTScanStats::toBinary() layout, bumped whenever fields are added or reordered:
+//   1  the counters and gauges up to heapLowWater
+//   2  + initTimeMs, bootToFirstResultMs, restartLatencyMs
+//   3  + eirCacheHits, eirCacheMisses
+//   4  + watchlistDropped
+//   5  + the watchdog counters, recoveryTimeMs, recoveryMaxMs
+//   6  + a flags byte after the field count
+#define BT_METRICS_BINARY_VERSION 6
+
+#define BT_METRICS_FLAG_RESET 0x01   // The counters were zeroed by the read; they count since the previous one.
+
+/**
+ * @brief A snapshot of the counters and gauges of a scan.
+ */
+struct BTScanStats {
+	// Counters, reset by BTScan::getStats(true).
+	uint32_t eventsReceived;       // GAP events from Bluedroid, classic and BLE, consumed by the scan or not.
+	uint32_t discResults;          // ESP_BT_GAP_DISC_RES_EVT events while scanning.
+	uint32_t uniqueDevices;        // Devices added to the results.
+	uint32_t duplicatesSuppressed; // Sightings of a device already in the results.
+	uint32_t parseFailures;        // Discovery results with malformed or truncated properties.
+	uint32_t inquiryStarts;
+	uint32_t inquiryCancels;
+	uint32_t inquiryErrors;        // esp_bt_gap_start_discovery() failures.
+	uint32_t evictions;            // Devices dropped from full results to make room for new ones.
+	uint32_t callbackCount;        // onResult and scan complete invocations.
+	uint32_t callbackTimeUs;       // Total time spent in those callbacks.
+	uint32_t callbackMaxUs;        // Longest single callback.
+	// Gauges, sampled when the snapshot is taken.
+	uint32_t resultCount;          // Devices currently in the results.
+	uint32_t resultBytes;          // Memory held by the results: records, hot index and arena.
+	uint32_t arenaHighWater;       // Most arena memory used by one scan, in bytes.
+	uint32_t arenaOverflows;       // Times the arena had to take an overflow block from the heap.
+	uint32_t heapFree;             // Free heap now.
+	uint32_t heapLowWater;         // Lowest free heap since boot.
+	// Latencies, in milliseconds.
+	uint32_t initTimeMs;           // Last BTDevice::init() bring up.
+	uint32_t bootToFirstResultMs;  // Boot to the first device ever reported, 0 until then.
+	uint32_t restartLatencyMs;     // Last start() call to the controller reporting discovery started.
+	// Counters, reset by BTScan::getStats(true).
+	uint32_t eirCacheHits;         // Repeat sightings with an unchanged EIR and CoD, not parsed again.
+	uint32_t eirCacheMisses;       // Repeat sightings that had to be parsed.
+	uint32_t watchlistDropped;     // Results dropped unparsed by match-only mode.
+	uint32_t watchdogFires;        // Scan deadlines missed, see BTScan::setWatchdog().
+	uint32_t watchdogRestarts;     // Inquiries restarted by the watchdog.
+	uint32_t watchdogReinits;      // Stack restarts by the watchdog.
+	uint32_t watchdogAborts;       // Scans the watchdog ended with the results found so far.
+	// Gauges, in milliseconds.
+	uint32_t recoveryTimeMs;       // Last missed deadline to the end of its scan.
+	uint32_t recoveryMaxMs;        // Longest recovery since boot.
+	// How the snapshot was taken.
+	bool     countersReset;        // Taken by getStats(true): the counters cover the time since the previous read.
+
+	size_t toPrometheus(char* buffer, size_t length);
+	size_t toBinary(uint8_t* buffer, size_t length);
+};
+
+
+/**
+ * @brief Live counters of a scan.
+ *
+ * Counters are relaxed atomics so they can be bumped from the Bluetooth task and read or reset
+ * from any other task without a lock.
+ */
+class BTScanMetrics {
+public:
+	BTScanMetrics();
+	void inc(std::atomic<uint32_t>& counter);
+	void addCallbackTime(uint32_t micros);
+	void snapshot(BTScanStats* pStats, bool reset);
+
+	std::atomic<uint32_t> eventsReceived;
+	std::atomic<uint32_t> discResults;
+	std::atomic<uint32_t> uniqueDevices;
+	std::atomic<uint32_t> duplicatesSuppressed;
+	std::atomic<uint32_t> parseFailures;
+	std::atomic<uint32_t> inquiryStarts;
+	std::atomic<uint32_t> inquiryCancels;
+	std::atomic<uint32_t> inquiryErrors;
+	std::atomic<uint32_t> evictions;
+	std::atomic<uint32_t> callbackCount;
+	std::atomic<uint32_t> callbackTimeUs;
+	std::atomic<uint32_t> callbackMaxUs;
+	std::atomic<uint32_t> eirCacheHits;
+	std::atomic<uint32_t> eirCacheMisses;
+	std::atomic<uint32_t> watchlistDropped;
+	std::atomic<uint32_t> watchdogFires;
+	std::atomic<uint32_t> watchdogRestarts;
+	std::atomic<uint32_t> watchdogReinits;
+	std::atomic<uint32_t> watchdogAborts;
+
+private:
+	static uint32_t take(std::atomic<uint32_t>& counter, bool reset);
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_SCAN_METRICS_H_ */
@@ -0,0 +1,488 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BTScanSnapshot.h"
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+#include <algorithm>
+#include <thread>
+
+#if defined(CONFIG_BT_ENABLED)
+#include "BTScan.h"
+#endif
+
+// Largest encoded entry: address delta, node, rssi, count, lastSeen delta.
+static const size_t maxEntryLen  = 10 + 3 + 1 + 5 + 10;
+static const size_t maxHeaderLen = 1 + 10 + 10;
+
+// Below this many entries mergeParallel() does not bother starting threads.
+static const size_t parallelThreshold = 65536;
+
+
+static size_t putVarint(uint8_t* target, uint64_t value) {
+	size_t i = 0;
+	while (value >= 0x80) {
+		target[i++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	target[i++] = (uint8_t)value;
+	return i;
+} // putVarint
+
+
+static size_t getVarint(const uint8_t* source, size_t length, uint64_t* value) {
+	uint64_t result = 0;
+	for (size_t i = 0; i < length && i < 10; i++) {
+		result |= (uint64_t)(source[i] & 0x7f) << (7 * i);
+		if ((source[i] & 0x80) == 0) {
+			*value = result;
+			return i + 1;
+		}
+	}
+	return 0;
+} // getVarint
+
+
+static bool addressLess(const BTSnapshotEntry& entry, uint64_t address) {
+	return entry.address < address;
+} // addressLess
+
+
+/**
+ * @brief Fold another entry for the same key into this one.
+ */
+void BTSnapshotEntry::absorb(const BTSnapshotEntry& other) {
+	lastSeen = std::max(lastSeen, other.lastSeen);
+	count    = std::max(count, other.count);
+	bestRssi = std::max(bestRssi, other.bestRssi);
+} // absorb
+
+
+BTScanSnapshot::BTScanSnapshot() {
+	m_sorted = true;
+} // BTScanSnapshot
+
+
+/**
+ * @brief Add an entry.  Call normalize() once done adding, before the snapshot is merged or read.
+ */
+void BTScanSnapshot::add(const BTSnapshotEntry& entry) {
+	if (!m_entries.empty() && !(m_entries.back() < entry)) {
+		m_sorted = false;
+	}
+	m_entries.push_back(entry);
+} // add
+
+
+/**
+ * @brief Sort the entries and fold those sharing a key.
+ */
+void BTScanSnapshot::normalize() {
+	if (m_sorted) {
+		return;
+	}
+	std::sort(m_entries.begin(), m_entries.end());
+	size_t kept = 0;
+	for (size_t i = 0; i < m_entries.size(); i++) {
+		if (kept > 0 && m_entries[kept - 1].sameKey(m_entries[i])) {
+			m_entries[kept - 1].absorb(m_entries[i]);
+		} else {
+			m_entries[kept++] = m_entries[i];
+		}
+	}
+	m_entries.resize(kept);
+	m_sorted = true;
+} // normalize
+
+
+void BTScanSnapshot::clear() {
+	m_entries.clear();
+	m_sorted = true;
+} // clear
+
+
+size_t BTScanSnapshot::getCount() const {
+	return m_entries.size();
+} // getCount
+
+
+const BTSnapshotEntry* BTScanSnapshot::getEntries() const {
+	return m_entries.data();
+} // getEntries
+
+
+const BTSnapshotEntry& BTScanSnapshot::getEntry(size_t i) const {
+	return m_entries.at(i);
+} // getEntry
+
+
+/**
+ * @brief Merge another snapshot into this one.
+ */
+void BTScanSnapshot::mergeFrom(const BTScanSnapshot& other) {
+	BTScanSnapshot merged;
+	const BTScanSnapshot* inputs[] = { this, &other };
+	merge(inputs, 2, merged);
+	m_entries.swap(merged.m_entries);
+} // mergeFrom
+
+
+/**
+ * @brief Collapse the nodes of each device.
+ * @param [out] devices Receives one summary per address, in address order.
+ */
+void BTScanSnapshot::summarize(std::vector<BTSnapshotDevice>& devices) const {
+	devices.clear();
+	for (size_t i = 0; i < m_entries.size(); i++) {
+		const BTSnapshotEntry& entry = m_entries[i];
+		if (devices.empty() || devices.back().address != entry.address) {
+			BTSnapshotDevice device;
+			device.address   = entry.address;
+			device.lastSeen  = entry.lastSeen;
+			device.count     = entry.count;
+			device.bestNode  = entry.node;
+			device.nodeCount = 1;
+			device.bestRssi  = entry.bestRssi;
+			devices.push_back(device);
+			continue;
+		}
+		BTSnapshotDevice& device = devices.back();
+		device.lastSeen = std::max(device.lastSeen, entry.lastSeen);
+		device.count   += entry.count;
+		device.nodeCount++;
+		if (entry.bestRssi > device.bestRssi) {
+			device.bestRssi = entry.bestRssi;
+			device.bestNode = entry.node;
+		}
+	}
+} // summarize
+
+
+/**
+ * @brief Get a buffer size serialize() is sure to fit in.
+ */
+size_t BTScanSnapshot::getMaxSerializedSize() const {
+	return maxHeaderLen + m_entries.size() * maxEntryLen;
+} // getMaxSerializedSize
+
+
+/**
+ * @brief Encode the snapshot for shipping to the aggregator.
+ *
+ * The layout is [version][varint: count][varint: base lastSeen] followed, for each entry, by
+ * [varint: address delta][varint: node][rssi: 1][varint: count][varint: lastSeen - base].  Addresses
+ * are sorted so their deltas are small.
+ *
+ * @param [out] buffer Where the bytes are written.
+ * @param [in] length The size of the buffer.
+ * @return The number of bytes written, or 0 if they did not fit.
+ */
+size_t BTScanSnapshot::serialize(uint8_t* buffer, size_t length) const {
+	uint64_t base = UINT64_MAX;
+	for (size_t i = 0; i < m_entries.size(); i++) {
+		base = std::min(base, m_entries[i].lastSeen);
+	}
+	if (m_entries.empty()) {
+		base = 0;
+	}
+	if (length < maxHeaderLen) {
+		return 0;
+	}
+	size_t used = 0;
+	buffer[used++] = BT_SNAPSHOT_VERSION;
+	used += putVarint(buffer + used, m_entries.size());
+	used += putVarint(buffer + used, base);
+
+	uint64_t previous = 0;
+	for (size_t i = 0; i < m_entries.size(); i++) {
+		const BTSnapshotEntry& entry = m_entries[i];
+		if (length - used < maxEntryLen) {
+			return 0;
+		}
+		used += putVarint(buffer + used, entry.address - previous);
+		used += putVarint(buffer + used, entry.node);
+		buffer[used++] = (uint8_t)entry.bestRssi;
+		used += putVarint(buffer + used, entry.count);
+		used += putVarint(buffer + used, entry.lastSeen - base);
+		previous = entry.address;
+	}
+	return used;
+} // serialize
+
+
+/**
+ * @brief Replace the snapshot with one decoded by serialize().
+ * @return False, leaving the snapshot empty, if the buffer is truncated or not a snapshot.
+ */
+bool BTScanSnapshot::deserialize(const uint8_t* buffer, size_t length) {
+	clear();
+	if (length < 1 || buffer[0] != BT_SNAPSHOT_VERSION) {
+		return false;
+	}
+	size_t   used = 1;
+	uint64_t count;
+	uint64_t base;
+	size_t   n;
+	if ((n = getVarint(buffer + used, length - used, &count)) == 0) return false;
+	used += n;
+	if ((n = getVarint(buffer + used, length - used, &base)) == 0) return false;
+	used += n;
+	if (count > (length - used) / 5) {   // An entry takes at least 5 bytes.
+		return false;
+	}
+
+	m_entries.reserve(count);
+	uint64_t previous = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t delta, node, sightings, lastSeen;
+		if ((n = getVarint(buffer + used, length - used, &delta)) == 0) break;
+		used += n;
+		if ((n = getVarint(buffer + used, length - used, &node)) == 0) break;
+		used += n;
+		if (used >= length) break;
+		int8_t rssi = (int8_t)buffer[used++];
+		if ((n = getVarint(buffer + used, length - used, &sightings)) == 0) break;
+		used += n;
+		if ((n = getVarint(buffer + used, length - used, &lastSeen)) == 0) break;
+		used += n;
+
+		BTSnapshotEntry entry;
+		entry.address  = previous + delta;
+		entry.node     = (uint16_t)node;
+		entry.bestRssi = rssi;
+		entry.count    = (uint32_t)sightings;
+		entry.lastSeen = base + lastSeen;
+		add(entry);
+		previous = entry.address;
+	}
+	if (m_entries.size() != count) {
+		clear();
+		return false;
+	}
+	normalize();   // Only does work if the sender was not normalized.
+	return true;
+} // deserialize
+
+
+/**
+ * @brief K-way merge sorted ranges, folding equal keys.
+ * @param [in] ranges The ranges; consumed.
+ * @param [in] count The number of ranges.
+ * @param [out] output Receives the merged entries; must have room for all the input entries.
+ * @return The number of entries written.
+ */
+/* STATIC */ size_t BTScanSnapshot::mergeRanges(Range* ranges, size_t count, BTSnapshotEntry* output) {
+	// Binary min heap of the non empty ranges, ordered by their first entry.
+	std::vector<Range*> heap;
+	heap.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		if (ranges[i].begin != ranges[i].end) {
+			heap.push_back(&ranges[i]);
+		}
+	}
+	auto later = [](const Range* a, const Range* b) { return *b->begin < *a->begin; };
+	std::make_heap(heap.begin(), heap.end(), later);
+
+	size_t written = 0;
+	while (!heap.empty()) {
+		Range* smallest = heap.front();
+		const BTSnapshotEntry& entry = *smallest->begin;
+		if (written > 0 && output[written - 1].sameKey(entry)) {
+			output[written - 1].absorb(entry);
+		} else {
+			output[written++] = entry;
+		}
+		std::pop_heap(heap.begin(), heap.end(), later);
+		if (++smallest->begin == smallest->end) {
+			heap.pop_back();
+		} else {
+			std::push_heap(heap.begin(), heap.end(), later);
+		}
+	}
+	return written;
+} // mergeRanges
+
+
+/**
+ * @brief Merge normalized snapshots in one pass.
+ * @param [in] inputs The snapshots.
+ * @param [in] count The number of snapshots.
+ * @param [out] output Receives the merge.  It must not be one of the inputs.
+ */
+/* STATIC */ void BTScanSnapshot::merge(const BTScanSnapshot* const* inputs, size_t count, BTScanSnapshot& output) {
+	std::vector<Range> ranges(count);
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		ranges[i].begin = inputs[i]->m_entries.data();
+		ranges[i].end   = ranges[i].begin + inputs[i]->m_entries.size();
+		total += inputs[i]->m_entries.size();
+	}
+	output.m_entries.resize(total);
+	output.m_entries.resize(mergeRanges(ranges.data(), count, output.m_entries.data()));
+	output.m_sorted = true;
+} // merge
+
+
+/**
+ * @brief Merge normalized snapshots using several threads.
+ *
+ * The address space is cut into one band per thread at quantiles sampled from every input, so bands
+ * hold similar numbers of entries even when the inputs differ in size.  Each thread k-way merges its
+ * band of every input into its own region of the output, which is then compacted.  Cuts fall between
+ * addresses, never between the nodes of one address.
+ *
+ * @param [in] inputs The snapshots.
+ * @param [in] count The number of snapshots.
+ * @param [out] output Receives the merge.  It must not be one of the inputs.
+ * @param [in] threads The number of threads, 0 for one per core.
+ */
+/* STATIC */ void BTScanSnapshot::mergeParallel(const BTScanSnapshot* const* inputs, size_t count,
+		BTScanSnapshot& output, unsigned threads) {
+	size_t total = 0;
+	for (size_t i = 0; i < count; i++) {
+		total += inputs[i]->m_entries.size();
+	}
+	if (threads == 0) {
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if (threads <= 1 || total < parallelThreshold) {
+		merge(inputs, count, output);
+		return;
+	}
+
+	// Sample addresses evenly from each input and cut at the quantiles of the samples.
+	const size_t perInput = threads * 16;
+	std::vector<uint64_t> samples;
+	for (size_t i = 0; i < count; i++) {
+		const std::vector<BTSnapshotEntry>& entries = inputs[i]->m_entries;
+		size_t step = std::max((size_t)1, entries.size() / perInput);
+		for (size_t j = step / 2; j < entries.size(); j += step) {
+			samples.push_back(entries[j].address);
+		}
+	}
+	std::sort(samples.begin(), samples.end());
+	std::vector<uint64_t> cuts;   // Band b holds addresses in [cuts[b - 1], cuts[b]).
+	for (unsigned b = 1; b < threads; b++) {
+		uint64_t cut = samples[samples.size() * b / threads];
+		if (cuts.empty() || cut > cuts.back()) {
+			cuts.push_back(cut);
+		}
+	}
+	size_t bands = cuts.size() + 1;
+
+	// Slice every input into bands and give each band an output region as large as its input.
+	std::vector<Range>  ranges(bands * count);
+	std::vector<size_t> offsets(bands + 1, 0);
+	for (size_t i = 0; i < count; i++) {
+		const BTSnapshotEntry* begin = inputs[i]->m_entries.data();
+		const BTSnapshotEntry* end   = begin + inputs[i]->m_entries.size();
+		const BTSnapshotEntry* from  = begin;
+		for (size_t b = 0; b < bands; b++) {
+			const BTSnapshotEntry* to = (b + 1 < bands) ? std::lower_bound(from, end, cuts[b], addressLess) : end;
+			ranges[b * count + i].begin = from;
+			ranges[b * count + i].end   = to;
+			offsets[b + 1] += to - from;
+			from = to;
+		}
+	}
+	for (size_t b = 0; b < bands; b++) {
+		offsets[b + 1] += offsets[b];
+	}
+
+	output.m_entries.resize(total);
+	BTSnapshotEntry*    target = output.m_entries.data();
+	std::vector<size_t> written(bands);
+	std::vector<std::thread> workers;
+	for (size_t b = 1; b < bands; b++) {
+		workers.push_back(std::thread([&, b]() {
+			written[b] = mergeRanges(&ranges[b * count], count, target + offsets[b]);
+		}));
+	}
+	written[0] = mergeRanges(&ranges[0], count, target);
+	for (size_t t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+
+	size_t used = written[0];
+	for (size_t b = 1; b < bands; b++) {
+		std::copy(target + offsets[b], target + offsets[b] + written[b], target + used);
+		used += written[b];
+	}
+	output.m_entries.resize(used);
+	output.m_sorted = true;
+} // mergeParallel
+
+
+#if defined(CONFIG_BT_ENABLED)
+/**
+ * @brief Replace the snapshot with the content of scan results.
+ *
+ * The count of each entry is the running sighting total of the device, which the snapshot carries
+ * from one call to the next: the results only count the sightings of each slot since the device
+ * was stored, and those restart with start(), clearResults() and eviction.  Successive snapshots of a
+ * node therefore never lower a count.  Sightings of a device that is evicted between two calls are
+ * lost with its slot.  The totals take one entry per device ever reported, on the caller's task
+ * rather than in the results, which keep constant memory.
+ *
+ * @param [in] results The results.
+ * @param [in] node The id of this scanner.
+ * @param [in] epochOffsetMs Added to the milliseconds since boot of the results, normally the Unix
+ * time of boot so that all the nodes share a time base.
+ */
+void BTScanSnapshot::fromResults(const BTScanResults& results, uint16_t node, uint64_t epochOffsetMs) {
+	size_t count = results.m_vectorAdvertisedDevices.size();
+	std::vector<uint32_t> slots(count);
+	for (size_t i = 0; i < count; i++) {
+		slots[i] = i;
+	}
+	std::sort(slots.begin(), slots.end(), [&results](uint32_t a, uint32_t b) {
+		return results.m_hot[a].address < results.m_hot[b].address;
+	});
+
+	// One pass merging the sorted slots into the sorted tallies.
+	std::vector<Tally> tallies;
+	tallies.reserve(m_tallies.size() + count);
+	size_t old = 0;
+	clear();
+	m_entries.reserve(count);
+	for (size_t i = 0; i < count; i++) {
+		const BTScanResults::HotEntry& hot = results.m_hot[slots[i]];
+		while (old < m_tallies.size() && m_tallies[old].address < hot.address) {
+			tallies.push_back(m_tallies[old++]);
+		}
+		Tally tally = { hot.address, 0, 0, hot.epoch };
+		if (old < m_tallies.size() && m_tallies[old].address == hot.address) {
+			tally = m_tallies[old++];
+		}
+		if (tally.epoch != hot.epoch) {   // The slot started counting after the last call.
+			tally.base  = tally.count;
+			tally.epoch = hot.epoch;
+		}
+		tally.count = std::max(tally.count, tally.base + hot.sightings);
+		tallies.push_back(tally);
+
+		BTSnapshotEntry entry;
+		entry.address  = hot.address;
+		entry.node     = node;
+		entry.bestRssi = hot.bestRssi;
+		entry.count    = tally.count;
+		entry.lastSeen = epochOffsetMs + hot.lastSeen;
+		add(entry);
+	}
+	tallies.insert(tallies.end(), m_tallies.begin() + old, m_tallies.end());
+	m_tallies.swap(tallies);
+	normalize();
+} // fromResults
+#endif
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
@@ -0,0 +1,125 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_SCAN_SNAPSHOT_H_
+#define _BT_SCAN_SNAPSHOT_H_
+
+// The merge side of this file is plain C++11 so that the host aggregating the scanners can build it
+// on its own; only BTScanSnapshot::fromResults() needs the ESP32 Bluetooth stack.
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define BT_SNAPSHOT_VERSION 1
+
+class BTScanResults;
+
+/**
+ * @brief What one scanner knows about one device.
+ *
+ * Entries are keyed by (address, node).  Every other field only ever grows at its node: the strongest
+ * RSSI, the latest sighting and the running sighting count.  Combining two entries for the same key
+ * takes the maximum of each field, which makes merging commutative, associative and idempotent, so
+ * snapshots can be merged in any order, any grouping and any number of times.
+ */
+struct BTSnapshotEntry {
+	uint64_t address;    // Packed address, see BTAddress::toUint64().
+	uint64_t lastSeen;   // Milliseconds, on the time base chosen by the node, normally Unix time.
+	uint32_t count;      // Sightings since the node started counting.
+	uint16_t node;       // Scanner id.
+	int8_t   bestRssi;   // Strongest RSSI the node heard, -128 if unknown.
+
+	bool operator<(const BTSnapshotEntry& other) const {
+		return address < other.address || (address == other.address && node < other.node);
+	}
+	bool sameKey(const BTSnapshotEntry& other) const {
+		return address == other.address && node == other.node;
+	}
+	void absorb(const BTSnapshotEntry& other);
+};
+
+
+/**
+ * @brief One device over all the nodes that heard it, see BTScanSnapshot::summarize().
+ */
+struct BTSnapshotDevice {
+	uint64_t address;
+	uint64_t lastSeen;   // Latest sighting over all nodes.
+	uint32_t count;      // Sightings summed over all nodes.
+	uint16_t bestNode;   // Node that heard the device strongest.
+	uint16_t nodeCount;  // Nodes that heard the device.
+	int8_t   bestRssi;
+};
+
+
+/**
+ * @brief A set of entries sorted by (address, node), with at most one entry per key.
+ *
+ * Being sorted, any number of snapshots merge in a single linear k-way pass.  Each node builds its
+ * snapshot with fromResults() and ships it with serialize(); the aggregator deserializes them and
+ * merges with merge() or, for large sites, mergeParallel(), which splits the address space between
+ * threads.
+ */
+class BTScanSnapshot {
+public:
+	BTScanSnapshot();
+
+	void     add(const BTSnapshotEntry& entry);
+	void     normalize();
+	void     clear();
+	size_t   getCount() const;
+	const BTSnapshotEntry* getEntries() const;
+	const BTSnapshotEntry& getEntry(size_t i) const;
+	void     mergeFrom(const BTScanSnapshot& other);
+	void     summarize(std::vector<BTSnapshotDevice>& devices) const;
+
+	size_t   serialize(uint8_t* buffer, size_t length) const;
+	size_t   getMaxSerializedSize() const;
+	bool     deserialize(const uint8_t* buffer, size_t length);
+
+	static void merge(const BTScanSnapshot* const* inputs, size_t count, BTScanSnapshot& output);
+	static void mergeParallel(const BTScanSnapshot* const* inputs, size_t count, BTScanSnapshot& output,
+		unsigned threads = 0);
+
+#if defined(CONFIG_BT_ENABLED)
+	void     fromResults(const BTScanResults& results, uint16_t node, uint64_t epochOffsetMs = 0);
+#endif
+
+private:
+	struct Range {
+		const BTSnapshotEntry* begin;
+		const BTSnapshotEntry* end;
+	};
+	static size_t mergeRanges(Range* ranges, size_t count, BTSnapshotEntry* output);
+
+	// Running count of one device of this node, see fromResults().
+	struct Tally {
+		uint64_t address;
+		uint32_t count;      // Published so far.
+		uint32_t base;       // Of count, when the slot it is read from started counting.
+		uint32_t epoch;      // Of that slot, see BTScanResults::m_epoch.
+	};
+
+	std::vector<BTSnapshotEntry> m_entries;
+	std::vector<Tally>           m_tallies;   // Sorted by address, one per device the node ever reported.
+	bool                         m_sorted;
+};
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
+#endif /* _BT_SCAN_SNAPSHOT_H_ */
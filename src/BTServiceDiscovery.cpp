@@ -0,0 +1,297 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <string.h>
+#include <algorithm>
+
+#include "BTServiceDiscovery.h"
+#include "BTAdvertisedDevice.h"
+#include "BTAddress.h"
+#include "GeneralUtils.h"
+
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32-hal-log.h"
+#endif
+
+
+/**
+ * @param [in] cacheSize The most devices whose services are remembered.
+ */
+BTServiceDiscovery::BTServiceDiscovery(size_t cacheSize) {
+	m_cacheSize     = std::max(cacheSize, (size_t)1);
+	m_concurrency   = 1;
+	m_timeoutMs     = 5000;
+	m_backoffBaseMs = 2000;
+	m_backoffMaxMs  = 60000;
+	m_maxAttempts   = 4;
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_cache.reserve(m_cacheSize);
+} // BTServiceDiscovery
+
+
+/**
+ * @brief Set how many requests may be outstanding at once.  Bluedroid serves them one after the
+ * other, so more than 1 only hides the latency of starting the next one.
+ */
+void BTServiceDiscovery::setConcurrency(uint8_t concurrency) {
+	m_concurrency = std::max(concurrency, (uint8_t)1);
+} // setConcurrency
+
+
+void BTServiceDiscovery::setTimeout(uint32_t timeoutMs) {
+	m_timeoutMs = timeoutMs;
+} // setTimeout
+
+
+/**
+ * @brief Set the retry policy.  Attempt n waits baseMs << (n - 1), at most maxMs, after a failure.
+ * @param [in] baseMs The delay after the first failure.
+ * @param [in] maxMs The longest delay.
+ * @param [in] maxAttempts The attempts before giving up until the device's EIR changes.
+ */
+void BTServiceDiscovery::setBackoff(uint32_t baseMs, uint32_t maxMs, uint8_t maxAttempts) {
+	m_backoffBaseMs = baseMs;
+	m_backoffMaxMs  = maxMs;
+	m_maxAttempts   = std::max(maxAttempts, (uint8_t)1);
+} // setBackoff
+
+
+/**
+ * @brief Forget every cached result and queued device.  Outstanding answers are still accepted.
+ */
+void BTServiceDiscovery::clear() {
+	m_lock.take("clear");
+	m_cache.clear();
+	m_queue.clear();
+	m_inFlight.clear();
+	m_lock.give();
+} // clear
+
+
+BTServiceDiscoveryStats BTServiceDiscovery::getStats() {
+	m_lock.take("getStats");
+	BTServiceDiscoveryStats stats = m_stats;
+	stats.queued   = m_queue.size();
+	stats.inFlight = m_inFlight.size();
+	stats.cached   = m_cache.size();
+	m_lock.give();
+	return stats;
+} // getStats
+
+
+/**
+ * @brief Get the entry of an address, making room for it if needed.
+ * @return The entry, or nullptr if the cache is full of pending requests.
+ */
+BTServiceDiscovery::Entry* BTServiceDiscovery::prepare(uint64_t address, uint32_t now) {
+	std::unordered_map<uint64_t, Entry>::iterator it = m_cache.find(address);
+	if (it != m_cache.end()) {
+		return &it->second;
+	}
+	if (m_cache.size() >= m_cacheSize) {
+		// Evict the least recently used entry that is not waiting for an answer.
+		std::unordered_map<uint64_t, Entry>::iterator victim = m_cache.end();
+		for (it = m_cache.begin(); it != m_cache.end(); ++it) {
+			if (it->second.state != QUEUED && it->second.state != IN_FLIGHT &&
+				(victim == m_cache.end() || now - it->second.lastUsed > now - victim->second.lastUsed)) {
+				victim = it;
+			}
+		}
+		if (victim == m_cache.end()) {
+			return nullptr;
+		}
+		m_cache.erase(victim);
+	}
+	Entry& entry   = m_cache[address];
+	entry.state    = FAILED;
+	entry.failures = 0;
+	entry.eirHash  = 0;
+	entry.deadline = 0;
+	entry.lastUsed = now;
+	return &entry;
+} // prepare
+
+
+/**
+ * @brief Find a newly seen device in the cache.
+ *
+ * On a hit the cached service UUIDs are merged into the device.  On a miss, or when the device's EIR
+ * changed, the device is queued for discovery.
+ *
+ * @param [in] device The device, which must have its arena set.
+ * @param [in] address The packed address of the device.
+ * @param [in] now The time in milliseconds since boot.
+ * @return True on a cache hit.
+ */
+bool BTServiceDiscovery::lookup(BTAdvertisedDevice& device, uint64_t address, uint32_t now) {
+	uint32_t eirHash = device.getEirHash();
+	bool     hit     = false;
+	m_lock.take("lookup");
+	std::unordered_map<uint64_t, Entry>::iterator it = m_cache.find(address);
+	Entry* pEntry = (it != m_cache.end()) ? &it->second : nullptr;
+
+	if (pEntry != nullptr && pEntry->eirHash == eirHash) {
+		pEntry->lastUsed = now;
+		if (pEntry->state == DONE) {
+			mergeEntry(*pEntry, device);
+			m_stats.hits++;
+			hit = true;
+		} else if (pEntry->state == BACKOFF && (int32_t)(now - pEntry->deadline) >= 0) {
+			pEntry->state = QUEUED;
+			m_queue.push_back(address);
+		}
+	} else {
+		pEntry = prepare(address, now);
+		if (pEntry != nullptr) {
+			m_stats.misses++;
+			pEntry->eirHash  = eirHash;
+			pEntry->failures = 0;
+			pEntry->uuids.clear();
+			if (pEntry->state != IN_FLIGHT && pEntry->state != QUEUED) {   // A pending answer still counts.
+				pEntry->state = QUEUED;
+				m_queue.push_back(address);
+			}
+		}
+	}
+	m_lock.give();
+	return hit;
+} // lookup
+
+
+/**
+ * @brief Record a failed or timed out request and schedule the retry.
+ */
+void BTServiceDiscovery::fail(Entry& entry, uint32_t now) {
+	m_stats.failures++;
+	entry.failures++;
+	if (entry.failures >= m_maxAttempts) {
+		entry.state = FAILED;
+		return;
+	}
+	uint32_t shift = std::min((uint32_t)entry.failures - 1, (uint32_t)16);
+	entry.state    = BACKOFF;
+	entry.deadline = now + std::min(m_backoffBaseMs << shift, m_backoffMaxMs);
+} // fail
+
+
+/**
+ * @brief Expire overdue requests and start queued ones, up to the concurrency.  Called by BTScan when
+ * no inquiry is running; see BTScan::pollServiceDiscovery().
+ * @param [in] now The time in milliseconds since boot.
+ */
+void BTServiceDiscovery::pump(uint32_t now) {
+	m_lock.take("pump");
+	for (size_t i = 0; i < m_inFlight.size();) {
+		std::unordered_map<uint64_t, Entry>::iterator it = m_cache.find(m_inFlight[i]);
+		if (it == m_cache.end() || it->second.state != IN_FLIGHT) {
+			m_inFlight.erase(m_inFlight.begin() + i);
+		} else if ((int32_t)(now - it->second.deadline) >= 0) {
+			log_w("pump: no services from %s", BTAddress(m_inFlight[i]).toString().c_str());
+			m_stats.timeouts++;
+			fail(it->second, now);
+			m_inFlight.erase(m_inFlight.begin() + i);
+		} else {
+			i++;
+		}
+	}
+
+	while (m_inFlight.size() < m_concurrency && !m_queue.empty()) {
+		uint64_t address = m_queue.front();
+		m_queue.pop_front();
+		std::unordered_map<uint64_t, Entry>::iterator it = m_cache.find(address);
+		if (it == m_cache.end() || it->second.state != QUEUED) {
+			continue;
+		}
+		BTAddress bda(address);
+		m_stats.requests++;
+		esp_err_t errRc = esp_bt_gap_get_remote_services(*bda.getNative());
+		if (errRc != ESP_OK) {
+			log_e("esp_bt_gap_get_remote_services: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+			fail(it->second, now);
+			continue;
+		}
+		it->second.state    = IN_FLIGHT;
+		it->second.deadline = now + m_timeoutMs;
+		m_inFlight.push_back(address);
+	}
+	m_lock.give();
+} // pump
+
+
+/**
+ * @brief Take the answer to a request, from ESP_BT_GAP_RMT_SRVCS_EVT.
+ *
+ * Answers are accepted even after their request timed out, they are still valid.
+ *
+ * @param [in] rmt_srvcs The event parameters.
+ * @param [in] now The time in milliseconds since boot.
+ * @return True if services were stored and can be merged.
+ */
+bool BTServiceDiscovery::onServices(esp_bt_gap_cb_param_t::rmt_srvcs_param* rmt_srvcs, uint32_t now) {
+	uint64_t address = BTAddress(rmt_srvcs->bda).toUint64();
+	bool     stored  = false;
+	m_lock.take("onServices");
+	std::vector<uint64_t>::iterator pending = std::find(m_inFlight.begin(), m_inFlight.end(), address);
+	if (pending != m_inFlight.end()) {
+		m_inFlight.erase(pending);
+	}
+	Entry* pEntry = prepare(address, now);
+	if (pEntry != nullptr) {
+		if (rmt_srvcs->stat == ESP_BT_STATUS_SUCCESS) {
+			pEntry->uuids.clear();
+			for (int i = 0; i < rmt_srvcs->num_uuids; i++) {
+				pEntry->uuids.push_back(BTUUIDKey::fromUUID(BTUUID(rmt_srvcs->uuid_list[i])));
+			}
+			std::sort(pEntry->uuids.begin(), pEntry->uuids.end());
+			pEntry->uuids.erase(std::unique(pEntry->uuids.begin(), pEntry->uuids.end()), pEntry->uuids.end());
+			pEntry->state    = DONE;
+			pEntry->failures = 0;
+			pEntry->lastUsed = now;
+			m_stats.successes++;
+			stored = true;
+		} else if (pEntry->state == IN_FLIGHT) {
+			fail(*pEntry, now);
+		}
+	}
+	m_lock.give();
+	return stored;
+} // onServices
+
+
+/**
+ * @brief Merge the discovered services of an address into a device.
+ * @return False if the services of the address are not known.
+ */
+bool BTServiceDiscovery::merge(uint64_t address, BTAdvertisedDevice& device) {
+	bool merged = false;
+	m_lock.take("merge");
+	std::unordered_map<uint64_t, Entry>::iterator it = m_cache.find(address);
+	if (it != m_cache.end() && it->second.state == DONE) {
+		mergeEntry(it->second, device);
+		merged = true;
+	}
+	m_lock.give();
+	return merged;
+} // merge
+
+
+void BTServiceDiscovery::mergeEntry(Entry& entry, BTAdvertisedDevice& device) {
+	for (size_t i = 0; i < entry.uuids.size(); i++) {
+		device.setServiceUUID(entry.uuids[i]);
+	}
+} // mergeEntry
+
+#endif /* CONFIG_BT_ENABLED */
@@ -0,0 +1,110 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_SERVICE_DISCOVERY_H_
+#define _BT_SERVICE_DISCOVERY_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+
+#include "esp_gap_bt_api.h"
+#include "FreeRTOS.h"
+
+#include "BTUUIDSet.h"
+
+class BTAdvertisedDevice;
+
+struct BTServiceDiscoveryStats {
+	uint32_t hits;        // Devices whose services came from the cache.
+	uint32_t misses;      // Devices queued for discovery, new or with a changed EIR.
+	uint32_t requests;    // esp_bt_gap_get_remote_services() calls.
+	uint32_t successes;
+	uint32_t failures;    // Failed requests, timeouts included.
+	uint32_t timeouts;
+	uint32_t queued;      // Devices waiting for a request now.
+	uint32_t inFlight;    // Requests outstanding now.
+	uint32_t cached;      // Cache entries now.
+};
+
+
+/**
+ * @brief Enrich classic devices with the service UUIDs their SDP records list.
+ *
+ * An opt-in stage of BTScan, see BTScan::setServiceDiscovery().  New classic devices are looked up in
+ * a cache keyed by address; an entry only counts while the hash of the device's EIR and class of
+ * device is unchanged, so a device that starts advertising something else is discovered again.  A
+ * hit merges the cached UUIDs into the device before it is reported, so repeat scans cost nothing
+ * over the air.  A miss queues the device.
+ *
+ * Queued devices are discovered with esp_bt_gap_get_remote_services() once the inquiry is over, at
+ * most setConcurrency() at a time.  A request that fails or gets no answer within the timeout is
+ * retried with exponential backoff, when the device is seen again, up to a number of attempts.
+ */
+class BTServiceDiscovery {
+public:
+	BTServiceDiscovery(size_t cacheSize = 64);
+
+	void     setConcurrency(uint8_t concurrency);
+	void     setTimeout(uint32_t timeoutMs);
+	void     setBackoff(uint32_t baseMs, uint32_t maxMs, uint8_t maxAttempts);
+	void     clear();
+	BTServiceDiscoveryStats getStats();
+
+	bool     lookup(BTAdvertisedDevice& device, uint64_t address, uint32_t now);
+	bool     onServices(esp_bt_gap_cb_param_t::rmt_srvcs_param* rmt_srvcs, uint32_t now);
+	bool     merge(uint64_t address, BTAdvertisedDevice& device);
+	void     pump(uint32_t now);
+
+private:
+	enum State : uint8_t {
+		QUEUED,
+		IN_FLIGHT,
+		DONE,
+		BACKOFF,     // Failed, may be retried after deadline.
+		FAILED       // Out of attempts until the EIR changes.
+	};
+	struct Entry {
+		std::vector<BTUUIDKey> uuids;   // Sorted.
+		uint32_t               eirHash;
+		uint32_t               lastUsed;
+		uint32_t               deadline;
+		State                  state;
+		uint8_t                failures;
+	};
+
+	Entry*   prepare(uint64_t address, uint32_t now);
+	void     fail(Entry& entry, uint32_t now);
+	void     mergeEntry(Entry& entry, BTAdvertisedDevice& device);
+
+	std::unordered_map<uint64_t, Entry> m_cache;
+	std::deque<uint64_t>                m_queue;
+	std::vector<uint64_t>               m_inFlight;
+	size_t                              m_cacheSize;
+	uint8_t                             m_concurrency;
+	uint32_t                            m_timeoutMs;
+	uint32_t                            m_backoffBaseMs;
+	uint32_t                            m_backoffMaxMs;
+	uint8_t                             m_maxAttempts;
+	BTServiceDiscoveryStats             m_stats;
+	FreeRTOS::Semaphore                 m_lock = FreeRTOS::Semaphore("ServiceDiscovery");
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_SERVICE_DISCOVERY_H_ */
@@ -0,0 +1,182 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <algorithm>
+#include <string>
+
+#include "BTUUIDSet.h"
+
+// Bluetooth base UUID 00000000-0000-1000-8000-00805F9B34FB.
+static const uint64_t baseHi = 0x0000000000001000ULL;
+static const uint64_t baseLo = 0x800000805F9B34FBULL;
+
+
+/**
+ * @brief Normalise a UUID.
+ * @param [in] uuid The UUID, in any of its forms.
+ * @return The key, all zero for an unset UUID.
+ */
+/* STATIC */ BTUUIDKey BTUUIDKey::fromUUID(BTUUID uuid) {
+	BTUUIDKey key = { 0, 0 };
+	if (uuid.bitSize() == 0) {
+		return key;
+	}
+	BTUUID         uuid128 = uuid.to128();   // Must outlive bytes.
+	const uint8_t* bytes   = uuid128.getNative()->uuid.uuid128;   // Little endian.
+	for (int i = 15; i >= 8; i--) {
+		key.hi = (key.hi << 8) | bytes[i];
+	}
+	for (int i = 7; i >= 0; i--) {
+		key.lo = (key.lo << 8) | bytes[i];
+	}
+	return key;
+} // fromUUID
+
+
+/**
+ * @brief Convert back to a UUID, in its shortest form.
+ */
+BTUUID BTUUIDKey::toUUID() const {
+	if (lo == baseLo && (hi & 0xffffffffULL) == baseHi) {
+		uint32_t value = (uint32_t)(hi >> 32);
+		return value <= 0xffff ? BTUUID((uint16_t)value) : BTUUID(value);
+	}
+	uint8_t bytes[16];
+	for (int i = 0; i < 8; i++) {
+		bytes[i]     = (uint8_t)(lo >> (8 * i));
+		bytes[i + 8] = (uint8_t)(hi >> (8 * i));
+	}
+	return BTUUID(bytes, 16, false);
+} // toUUID
+
+
+bool BTUUIDKey::isShort() const {
+	return lo == baseLo && (hi & 0xffffffffULL) == baseHi && (hi >> 32) <= 0xffff;
+} // isShort
+
+
+/**
+ * @brief Get the bit a 16 bit UUID sets in a set signature.
+ *
+ * The three 6 bit groups of the value are folded together so that assigned numbers sharing their low
+ * bits spread over the signature.
+ */
+uint64_t BTUUIDKey::signature() const {
+	if (!isShort()) {
+		return 0;
+	}
+	uint32_t value = (uint32_t)(hi >> 32);
+	return 1ULL << ((value ^ (value >> 6) ^ (value >> 12)) & 63);
+} // signature
+
+
+BTUUIDQuery::BTUUIDQuery() {
+	clear();
+} // BTUUIDQuery
+
+
+/**
+ * @brief Add a UUID to the query.  Duplicates are ignored.
+ */
+void BTUUIDQuery::add(BTUUID uuid) {
+	if (uuid.bitSize() == 0) {
+		return;
+	}
+	BTUUIDKey key = BTUUIDKey::fromUUID(uuid);
+	std::vector<BTUUIDKey>::iterator it = std::lower_bound(m_keys.begin(), m_keys.end(), key);
+	if (it != m_keys.end() && *it == key) {
+		return;
+	}
+	m_keys.insert(it, key);
+	if (key.isShort()) {
+		m_signature |= key.signature();
+	} else {
+		m_haveLong = true;
+	}
+} // add
+
+
+/**
+ * @brief Add a UUID given as a string, see BTUUID::fromString().
+ */
+void BTUUIDQuery::add(const char* uuid) {
+	add(BTUUID::fromString(std::string(uuid)));
+} // add
+
+
+void BTUUIDQuery::clear() {
+	m_keys.clear();
+	m_signature = 0;
+	m_haveLong  = false;
+} // clear
+
+
+size_t BTUUIDQuery::size() {
+	return m_keys.size();
+} // size
+
+
+/**
+ * @brief Does a sorted set share at least one UUID with the query?
+ * @param [in] keys The sorted, duplicate free keys of the set.
+ * @param [in] count The number of keys.
+ * @param [in] signature The signature of the short UUIDs of the set.
+ * @param [in] haveLong Whether the set holds any UUID that is not short.
+ */
+bool BTUUIDQuery::matchesAny(const BTUUIDKey* keys, size_t count, uint64_t signature, bool haveLong) {
+	if ((m_signature & signature) == 0 && !(m_haveLong && haveLong)) {
+		return false;   // No short UUID can match and there are no long ones on both sides.
+	}
+	size_t i = 0;
+	size_t j = 0;
+	while (i < count && j < m_keys.size()) {
+		if (keys[i] < m_keys[j]) {
+			i++;
+		} else if (m_keys[j] < keys[i]) {
+			j++;
+		} else {
+			return true;
+		}
+	}
+	return false;
+} // matchesAny
+
+
+/**
+ * @brief Does a sorted set hold every UUID of the query?
+ * @param [in] keys The sorted, duplicate free keys of the set.
+ * @param [in] count The number of keys.
+ * @param [in] signature The signature of the short UUIDs of the set.
+ * @param [in] haveLong Whether the set holds any UUID that is not short.
+ */
+bool BTUUIDQuery::matchesAll(const BTUUIDKey* keys, size_t count, uint64_t signature, bool haveLong) {
+	if ((m_signature & ~signature) != 0 || (m_haveLong && !haveLong) || m_keys.size() > count) {
+		return false;
+	}
+	size_t i = 0;
+	for (size_t j = 0; j < m_keys.size(); j++) {
+		while (i < count && keys[i] < m_keys[j]) {
+			i++;
+		}
+		if (i == count || !(keys[i] == m_keys[j])) {
+			return false;
+		}
+		i++;
+	}
+	return true;
+} // matchesAll
+
+#endif /* CONFIG_BT_ENABLED */
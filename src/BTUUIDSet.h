@@ -0,0 +1,76 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_UUID_SET_H_
+#define _BT_UUID_SET_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "BTUUID.h"
+
+/**
+ * @brief A UUID normalised to 128 bits, held as two big endian halves.
+ *
+ * 16 and 32 bit UUIDs are expanded on the Bluetooth base UUID, so the same service compares equal
+ * whatever form it was advertised in, and keys order like the UUID strings.
+ */
+struct BTUUIDKey {
+	uint64_t hi;
+	uint64_t lo;
+
+	static BTUUIDKey fromUUID(BTUUID uuid);
+	BTUUID   toUUID() const;
+	bool     isShort() const;      // On the Bluetooth base UUID with a 16 bit value.
+	uint64_t signature() const;    // Signature bit of a short UUID, 0 otherwise.
+
+	bool operator<(const BTUUIDKey& other) const {
+		return hi < other.hi || (hi == other.hi && lo < other.lo);
+	}
+	bool operator==(const BTUUIDKey& other) const {
+		return hi == other.hi && lo == other.lo;
+	}
+};
+
+
+/**
+ * @brief A sorted set of UUIDs a device is checked against, e.g. the services a filter accepts.
+ *
+ * Build it once and reuse it for every sighting.  Alongside the sorted keys it keeps a 64 bit
+ * signature of its 16 bit UUIDs, so a device whose UUIDs are all 16 bit is usually rejected with a
+ * single AND; otherwise the query is a linear merge of two sorted arrays.
+ */
+class BTUUIDQuery {
+public:
+	BTUUIDQuery();
+	void   add(BTUUID uuid);
+	void   add(const char* uuid);
+	void   clear();
+	size_t size();
+
+	bool   matchesAny(const BTUUIDKey* keys, size_t count, uint64_t signature, bool haveLong);
+	bool   matchesAll(const BTUUIDKey* keys, size_t count, uint64_t signature, bool haveLong);
+
+private:
+	std::vector<BTUUIDKey> m_keys;
+	uint64_t               m_signature;   // OR of the signature bits of the 16 bit UUIDs.
+	bool                   m_haveLong;    // At least one UUID is not a 16 bit one.
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_UUID_SET_H_ */
@@ -121,7 +121,7 @@ char* BTUtils::buildHexData(uint8_t *target, uint8_t *source, uint8_t length) {
 
 	int i;
 	for (i=0; i<length; i++) {
-		sprintf((char *)target, "%.2x", (char)*source);
+		sprintf((char *)target, "%.2x", *source);
 		source++;
 		target +=2;
 	}
@@ -212,5 +212,21 @@ const char* BTUtils::gapEventToString(uint32_t eventType) {
 } // gapEventToString
 
 
+/**
+ * @brief Compute a 32 bit FNV-1a hash of a piece of memory.
+ * @param [in] data Start of memory.
+ * @param [in] length Length of memory.
+ * @param [in] seed Starting value, pass a previous result to hash several ranges as one.
+ * @return The hash value.
+ */
+uint32_t BTUtils::hash32(const uint8_t* data, size_t length, uint32_t seed) {
+	uint32_t hash = seed;
+	for (size_t i = 0; i < length; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+	return hash;
+} // hash32
+
+
 
 #endif // CONFIG_BT_ENABLED
\ No newline at end of file
@@ -36,6 +36,7 @@ public:
 		esp_bt_gap_cb_param_t* param);
 	
 	static const char* gapEventToString(uint32_t eventType);
+	static uint32_t    hash32(const uint8_t* data, size_t length, uint32_t seed = 2166136261u);
 };
 
 #endif // CONFIG_BT_ENABLED
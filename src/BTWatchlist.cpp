@@ -0,0 +1,385 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <string.h>
+#include <algorithm>
+
+#include "BTWatchlist.h"
+#include "GeneralUtils.h"
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32-hal-log.h"
+#endif
+
+static const size_t   bucketCount = 1 << BT_WATCHLIST_BUCKET_BITS;
+static const uint32_t bucketShift = 8 * BT_WATCHLIST_ENTRY_BYTES - BT_WATCHLIST_BUCKET_BITS;
+
+/**
+ * @brief A key as stored, so a run of keys can be sorted in place.
+ */
+struct BTWatchlistKey {
+	uint8_t bytes[BT_WATCHLIST_ENTRY_BYTES];
+	bool operator<(const BTWatchlistKey& other) const {
+		return memcmp(bytes, other.bytes, sizeof(bytes)) < 0;
+	}
+	bool operator==(const BTWatchlistKey& other) const {
+		return memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+	}
+};
+
+
+static void putKey(uint8_t* target, uint64_t key) {
+	for (int i = BT_WATCHLIST_ENTRY_BYTES - 1; i >= 0; i--) {
+		target[i] = (uint8_t)key;
+		key >>= 8;
+	}
+} // putKey
+
+
+/**
+ * @brief Sort a run of keys and drop the repeats.
+ * @return The number of keys left.
+ */
+static size_t sortKeys(uint8_t* keys, size_t count) {
+	BTWatchlistKey* pFirst = (BTWatchlistKey*)keys;
+	std::sort(pFirst, pFirst + count);
+	return std::unique(pFirst, pFirst + count) - pFirst;
+} // sortKeys
+
+
+BTWatchlist::BTWatchlist() {
+	m_pEntries   = nullptr;
+	m_count      = 0;
+	m_mmapHandle = 0;
+	m_mapped     = false;
+} // BTWatchlist
+
+
+BTWatchlist::~BTWatchlist() {
+	unmap();
+} // ~BTWatchlist
+
+
+/**
+ * @brief Turn a packed address into a key: the LAP moves to the top.
+ * @param [in] address The address as returned by BTAddress::toUint64().
+ */
+/* STATIC */ uint64_t BTWatchlist::toKey(uint64_t address) {
+	return ((address & 0xffffff) << 24) | ((address >> 24) & 0xffffff);
+} // toKey
+
+
+/**
+ * @brief Turn a key back into a packed address.
+ */
+/* STATIC */ uint64_t BTWatchlist::fromKey(uint64_t key) {
+	return toKey(key);   // Swapping the halves is its own inverse.
+} // fromKey
+
+
+uint64_t BTWatchlist::keyAt(size_t i) const {
+	const uint8_t* p   = m_pEntries + i * BT_WATCHLIST_ENTRY_BYTES;
+	uint64_t       key = 0;
+	for (int j = 0; j < BT_WATCHLIST_ENTRY_BYTES; j++) {
+		key = (key << 8) | p[j];
+	}
+	return key;
+} // keyAt
+
+
+/**
+ * @brief Binary search the bucket of a key.
+ * @param [in] key The key.
+ * @param [out] pIndex Receives the index of the key, or where it would be inserted.
+ * @return True if the key is present.
+ */
+bool BTWatchlist::find(uint64_t key, size_t* pIndex) const {
+	if (m_count == 0) {
+		*pIndex = 0;
+		return false;
+	}
+	size_t bucket = (size_t)(key >> bucketShift);
+	size_t low    = m_buckets[bucket];
+	size_t high   = m_buckets[bucket + 1];
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (keyAt(middle) < key) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	*pIndex = low;
+	return low < m_count && keyAt(low) == key;
+} // find
+
+
+/**
+ * @brief Rebuild the bucket table from the keys, O(n + buckets).
+ */
+void BTWatchlist::buildBuckets() {
+	if (m_count == 0) {
+		std::vector<uint32_t>().swap(m_buckets);   // Give the table back.
+		return;
+	}
+	m_buckets.resize(bucketCount + 1);
+	size_t i = 0;
+	for (size_t b = 0; b < bucketCount; b++) {
+		while (i < m_count && (keyAt(i) >> bucketShift) < b) {
+			i++;
+		}
+		m_buckets[b] = i;
+	}
+	m_buckets[bucketCount] = m_count;
+} // buildBuckets
+
+
+/**
+ * @brief Copy mapped keys to RAM before they are modified.
+ */
+void BTWatchlist::detach() {
+	if (m_mapped) {
+		m_keys.assign(m_pEntries, m_pEntries + m_count * BT_WATCHLIST_ENTRY_BYTES);
+		unmap();
+		m_pEntries = m_keys.data();
+	}
+} // detach
+
+
+void BTWatchlist::unmap() {
+	if (m_mapped) {
+		spi_flash_munmap(m_mmapHandle);
+		m_mapped = false;
+	}
+} // unmap
+
+
+/**
+ * @brief Add an address.  O(n) for the move of the keys after it; use load() for many.
+ * @param [in] address The packed address.
+ * @return False if it was already present.
+ */
+bool BTWatchlist::add(uint64_t address) {
+	uint64_t key = toKey(address);
+	size_t   index;
+	m_lock.take("add");
+	if (find(key, &index)) {
+		m_lock.give();
+		return false;
+	}
+	detach();
+	uint8_t bytes[BT_WATCHLIST_ENTRY_BYTES];
+	putKey(bytes, key);
+	m_keys.insert(m_keys.begin() + index * BT_WATCHLIST_ENTRY_BYTES, bytes, bytes + BT_WATCHLIST_ENTRY_BYTES);
+	m_pEntries = m_keys.data();
+	m_count++;
+	if (m_buckets.empty()) {
+		buildBuckets();
+	} else {
+		for (size_t b = (size_t)(key >> bucketShift) + 1; b <= bucketCount; b++) {
+			m_buckets[b]++;
+		}
+	}
+	m_lock.give();
+	return true;
+} // add
+
+
+/**
+ * @brief Remove an address.
+ * @param [in] address The packed address.
+ * @return False if it was not present.
+ */
+bool BTWatchlist::remove(uint64_t address) {
+	uint64_t key = toKey(address);
+	size_t   index;
+	m_lock.take("remove");
+	if (!find(key, &index)) {
+		m_lock.give();
+		return false;
+	}
+	detach();
+	m_keys.erase(m_keys.begin() + index * BT_WATCHLIST_ENTRY_BYTES,
+		m_keys.begin() + (index + 1) * BT_WATCHLIST_ENTRY_BYTES);
+	m_pEntries = m_keys.data();
+	m_count--;
+	if (m_count == 0) {
+		buildBuckets();
+	} else {
+		for (size_t b = (size_t)(key >> bucketShift) + 1; b <= bucketCount; b++) {
+			m_buckets[b]--;
+		}
+	}
+	m_lock.give();
+	return true;
+} // remove
+
+
+/**
+ * @brief Add many addresses at once, in O(n log n) overall.
+ * @param [in] addresses The packed addresses, in any order.
+ * @param [in] count The number of addresses.
+ * @return The number of addresses that were not already present.
+ */
+size_t BTWatchlist::load(const uint64_t* addresses, size_t count) {
+	m_lock.take("load");
+	detach();
+	size_t before = m_count;
+	m_keys.resize((m_count + count) * BT_WATCHLIST_ENTRY_BYTES);
+	for (size_t i = 0; i < count; i++) {
+		putKey(&m_keys[(m_count + i) * BT_WATCHLIST_ENTRY_BYTES], toKey(addresses[i]));
+	}
+	m_count = sortKeys(m_keys.data(), m_count + count);
+	m_keys.resize(m_count * BT_WATCHLIST_ENTRY_BYTES);
+	m_pEntries = m_keys.data();
+	buildBuckets();
+	size_t added = m_count - before;
+	m_lock.give();
+	return added;
+} // load
+
+
+/**
+ * @brief Replace the contents with a data partition, see the class description for its layout.
+ *
+ * The partition is memory mapped and its keys are used in place when they are sorted; otherwise they
+ * are copied to RAM and sorted there.
+ *
+ * @param [in] label The label of the partition.
+ * @return ESP_OK, ESP_ERR_NOT_FOUND without such a partition, ESP_ERR_INVALID_ARG for a bad header.
+ */
+esp_err_t BTWatchlist::loadPartition(const char* label) {
+	const esp_partition_t* pPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+	if (pPartition == nullptr) {
+		log_e("loadPartition: no partition %s", label);
+		return ESP_ERR_NOT_FOUND;
+	}
+	if (pPartition->size < BT_WATCHLIST_HEADER_BYTES) {
+		log_e("loadPartition: %s is not a watchlist", label);
+		return ESP_ERR_INVALID_ARG;
+	}
+	const void*             pMapped;
+	spi_flash_mmap_handle_t handle;
+	esp_err_t errRc = esp_partition_mmap(pPartition, 0, pPartition->size, ESP_PARTITION_MMAP_DATA, &pMapped, &handle);
+	if (errRc != ESP_OK) {
+		log_e("esp_partition_mmap: rc=%d %s", errRc, GeneralUtils::errorToString(errRc));
+		return errRc;
+	}
+
+	const uint8_t* pData = (const uint8_t*)pMapped;
+	uint32_t magic;
+	uint32_t count;
+	memcpy(&magic, pData, sizeof(magic));
+	memcpy(&count, pData + 8, sizeof(count));
+	if (magic != BT_WATCHLIST_MAGIC || pData[4] != BT_WATCHLIST_VERSION ||
+		count > (pPartition->size - BT_WATCHLIST_HEADER_BYTES) / BT_WATCHLIST_ENTRY_BYTES) {
+		log_e("loadPartition: %s is not a watchlist", label);
+		spi_flash_munmap(handle);
+		return ESP_ERR_INVALID_ARG;
+	}
+	const uint8_t* pKeys  = pData + BT_WATCHLIST_HEADER_BYTES;
+	bool           sorted = true;
+	for (size_t i = 1; i < count && sorted; i++) {
+		sorted = memcmp(pKeys + (i - 1) * BT_WATCHLIST_ENTRY_BYTES, pKeys + i * BT_WATCHLIST_ENTRY_BYTES,
+			BT_WATCHLIST_ENTRY_BYTES) < 0;
+	}
+
+	m_lock.take("loadPartition");
+	unmap();
+	std::vector<uint8_t>().swap(m_keys);
+	if (sorted) {
+		m_pEntries   = pKeys;
+		m_count      = count;
+		m_mmapHandle = handle;
+		m_mapped     = true;
+	} else {
+		log_w("loadPartition: %s is not sorted, copying it to RAM", label);
+		m_keys.assign(pKeys, pKeys + count * BT_WATCHLIST_ENTRY_BYTES);
+		spi_flash_munmap(handle);
+		m_count = sortKeys(m_keys.data(), count);
+		m_keys.resize(m_count * BT_WATCHLIST_ENTRY_BYTES);
+		m_pEntries = m_keys.data();
+	}
+	buildBuckets();
+	m_lock.give();
+	log_i("loadPartition: %d addresses from %s", (int)m_count, label);
+	return ESP_OK;
+} // loadPartition
+
+
+/**
+ * @brief Remove every address and give the memory back.
+ */
+void BTWatchlist::clear() {
+	m_lock.take("clear");
+	unmap();
+	std::vector<uint8_t>().swap(m_keys);
+	m_pEntries = nullptr;
+	m_count    = 0;
+	buildBuckets();
+	m_lock.give();
+} // clear
+
+
+/**
+ * @brief Tell whether an address is watched, and optionally whether any is, under a single lock.
+ * @param [in] address The packed address.
+ * @param [out] pEmpty Receives whether the watchlist holds no address at all, if not nullptr.
+ * @return True if the address is watched.
+ */
+bool BTWatchlist::contains(uint64_t address, bool* pEmpty) {
+	size_t index;
+	m_lock.take("contains");
+	bool found = find(toKey(address), &index);
+	if (pEmpty != nullptr) {
+		*pEmpty = m_count == 0;
+	}
+	m_lock.give();
+	return found;
+} // contains
+
+
+bool BTWatchlist::isEmpty() {
+	return getCount() == 0;
+} // isEmpty
+
+
+size_t BTWatchlist::getCount() {
+	m_lock.take("getCount");
+	size_t count = m_count;
+	m_lock.give();
+	return count;
+} // getCount
+
+
+/**
+ * @brief Get the RAM held by the watchlist.  Mapped keys are in flash and not counted.
+ */
+size_t BTWatchlist::getMemoryUsage() {
+	m_lock.take("getMemoryUsage");
+	size_t bytes = sizeof(*this) + m_keys.capacity() + m_buckets.capacity() * sizeof(uint32_t);
+	m_lock.give();
+	return bytes;
+} // getMemoryUsage
+
+
+/**
+ * @brief Tell whether the keys are used in place from a mapped partition.
+ */
+bool BTWatchlist::isMapped() {
+	return m_mapped;
+} // isMapped
+
+#endif /* CONFIG_BT_ENABLED */
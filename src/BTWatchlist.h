@@ -0,0 +1,87 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_WATCHLIST_H_
+#define _BT_WATCHLIST_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "FreeRTOS.h"
+
+#define BT_WATCHLIST_MAGIC        0x4c575442   // "BTWL", little endian.
+#define BT_WATCHLIST_VERSION      1
+#define BT_WATCHLIST_ENTRY_BYTES  6
+#define BT_WATCHLIST_HEADER_BYTES 12
+#define BT_WATCHLIST_BUCKET_BITS  12
+
+/**
+ * @brief A set of classic addresses, sized for tens of thousands of entries.
+ *
+ * Entries are 6 byte keys in a sorted array, with a table of 4096 bucket starts over the top 12 bits
+ * of the key.  A lookup is a bucket read and a binary search over the handful of keys in it, so it
+ * stays O(1) on average and the answer is exact.  10,000 addresses take 60 KB of keys plus 16 KB of
+ * table.
+ *
+ * The key is the address with its LAP (the 3 low bytes) first: the 3 high bytes are the vendor OUI,
+ * shared by many devices, so bucketing on them would not spread the keys.
+ *
+ * The keys can stay in flash: loadPartition() maps a data partition laid out as
+ * [magic u32][version u8][reserved 3][count u32][count keys], all little endian, keys sorted
+ * ascending as big endian 6 byte numbers.  Only the bucket table is then held in RAM.  The first
+ * add() or remove() copies the keys to RAM.
+ */
+class BTWatchlist {
+public:
+	BTWatchlist();
+	~BTWatchlist();
+
+	bool      add(uint64_t address);
+	bool      remove(uint64_t address);
+	size_t    load(const uint64_t* addresses, size_t count);
+	esp_err_t loadPartition(const char* label);
+	void      clear();
+	bool      contains(uint64_t address, bool* pEmpty = nullptr);
+	bool      isEmpty();
+	size_t    getCount();
+	size_t    getMemoryUsage();
+	bool      isMapped();
+
+	static uint64_t toKey(uint64_t address);
+	static uint64_t fromKey(uint64_t key);
+
+private:
+	uint64_t  keyAt(size_t i) const;
+	bool      find(uint64_t key, size_t* pIndex) const;
+	void      buildBuckets();
+	void      detach();
+	void      unmap();
+
+	std::vector<uint8_t>    m_keys;          // In RAM, unless mapped.
+	const uint8_t*          m_pEntries;      // The keys, in m_keys or in flash.
+	size_t                  m_count;
+	std::vector<uint32_t>   m_buckets;       // Index of the first key of each bucket, plus the end.
+	spi_flash_mmap_handle_t m_mmapHandle;
+	bool                    m_mapped;
+	FreeRTOS::Semaphore     m_lock = FreeRTOS::Semaphore("Watchlist");
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_WATCHLIST_H_ */
@@ -0,0 +1,132 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "BTWireDecoder.h"
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+#include <string.h>
+
+
+static size_t getVarint(const uint8_t* source, size_t length, uint32_t* value) {
+	uint32_t result = 0;
+	for (size_t i = 0; i < length && i < 5; i++) {
+		result |= (uint32_t)(source[i] & 0x7f) << (7 * i);
+		if ((source[i] & 0x80) == 0) {
+			*value = result;
+			return i + 1;
+		}
+	}
+	return 0;
+} // getVarint
+
+
+/**
+ * @brief Create a decoder over an encoded buffer.
+ * @param [in] data The encoded bytes.
+ * @param [in] length The number of encoded bytes.
+ */
+BTWireDecoder::BTWireDecoder(const uint8_t* data, size_t length) {
+	m_data      = data;
+	m_length    = length;
+	m_pos       = 0;
+	m_scanStart = 0;
+	m_dictCount = 0;
+	m_valid     = false;
+	if (length >= 2 && data[0] == BT_WIRE_VERSION) {
+		size_t used = getVarint(data + 1, length - 1, &m_scanStart);
+		m_valid = used != 0;
+		m_pos   = 1 + used;
+	}
+} // BTWireDecoder
+
+
+bool BTWireDecoder::isValid() {
+	return m_valid;
+} // isValid
+
+
+uint32_t BTWireDecoder::getScanStart() {
+	return m_scanStart;
+} // getScanStart
+
+
+/**
+ * @brief Decode the next device.
+ * @param [out] record The decoded device.
+ * @return False at the end of the buffer or if the data is malformed.
+ */
+bool BTWireDecoder::next(BTWireRecord* record) {
+	if (!m_valid || m_pos >= m_length) {
+		return false;
+	}
+	const uint8_t* p   = m_data + m_pos;
+	size_t         end = m_length - m_pos;
+	size_t         pos = 0;
+	memset(record, 0, sizeof(*record));
+
+	if (end < 1 + BT_WIRE_ADDR_LEN) {
+		m_valid = false;
+		return false;
+	}
+	record->presence = p[pos++];
+	memcpy(record->address, p + pos, BT_WIRE_ADDR_LEN);
+	pos += BT_WIRE_ADDR_LEN;
+
+	if (record->presence & BT_WIRE_HAVE_RSSI) {
+		if (pos + 1 > end) { m_valid = false; return false; }
+		record->rssi = (int8_t)p[pos++];
+	}
+	if (record->presence & BT_WIRE_HAVE_COD) {
+		if (pos + 3 > end) { m_valid = false; return false; }
+		record->cod = p[pos] | (p[pos + 1] << 8) | ((uint32_t)p[pos + 2] << 16);
+		pos += 3;
+	}
+	uint32_t relative;
+	size_t   used = getVarint(p + pos, end - pos, &relative);
+	if (used == 0) { m_valid = false; return false; }
+	pos += used;
+	record->timestamp = m_scanStart + relative;
+
+	if (record->presence & BT_WIRE_HAVE_NAME) {
+		uint32_t ref;
+		used = getVarint(p + pos, end - pos, &ref);
+		if (used == 0) { m_valid = false; return false; }
+		pos += used;
+		if (ref & 1) {
+			uint32_t index = ref >> 1;
+			if (index >= m_dictCount) { m_valid = false; return false; }
+			record->nameLen = m_dictLen[index];
+			memcpy(record->name, m_data + m_dictOffset[index], record->nameLen);
+		} else {
+			uint32_t len = ref >> 1;
+			if (len > BT_WIRE_MAX_NAME_LEN || pos + len > end) { m_valid = false; return false; }
+			if (m_dictCount < BT_WIRE_DICT_SIZE && m_pos + pos <= 0xffff) {
+				m_dictOffset[m_dictCount] = (uint16_t)(m_pos + pos);
+				m_dictLen[m_dictCount]    = (uint8_t)len;
+				m_dictCount++;
+			}
+			record->nameLen = (uint8_t)len;
+			memcpy(record->name, p + pos, len);
+			pos += len;
+		}
+		record->name[record->nameLen] = '\0';
+	}
+	if (record->presence & BT_WIRE_HAVE_TXPOWER) {
+		if (pos + 1 > end) { m_valid = false; return false; }
+		record->txPower = (int8_t)p[pos++];
+	}
+	m_pos += pos;
+	return true;
+} // next
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
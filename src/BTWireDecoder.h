@@ -0,0 +1,76 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_WIRE_DECODER_H_
+#define _BT_WIRE_DECODER_H_
+
+// The decoding side of the wire format is plain C++11 so that whatever receives the buffers can build
+// it on its own; only the encoder in BTWireFormat.h needs the ESP32 Bluetooth stack.
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+#if !defined(ESP_PLATFORM) || defined(CONFIG_BT_ENABLED)
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BT_WIRE_VERSION        1
+#define BT_WIRE_DICT_SIZE      32    // Names remembered per buffer for back references.
+#define BT_WIRE_ADDR_LEN       6     // ESP_BD_ADDR_LEN
+#define BT_WIRE_MAX_NAME_LEN   248   // ESP_BT_GAP_MAX_BDNAME_LEN
+
+// Presence bitmap of a device record.
+#define BT_WIRE_HAVE_RSSI      0x01
+#define BT_WIRE_HAVE_COD       0x02
+#define BT_WIRE_HAVE_NAME      0x04
+#define BT_WIRE_HAVE_TXPOWER   0x08
+
+/**
+ * @brief One device as decoded from the wire format.
+ */
+struct BTWireRecord {
+	uint8_t  address[BT_WIRE_ADDR_LEN];
+	uint8_t  presence;
+	int8_t   rssi;
+	uint32_t cod;
+	uint32_t timestamp;      // Milliseconds since boot, as recorded by the scanner.
+	int8_t   txPower;
+	uint8_t  nameLen;
+	char     name[BT_WIRE_MAX_NAME_LEN + 1];
+};
+
+
+/**
+ * @brief Decode a buffer produced by BTWireEncoder.
+ */
+class BTWireDecoder {
+public:
+	BTWireDecoder(const uint8_t* data, size_t length);
+	bool     isValid();
+	uint32_t getScanStart();
+	bool     next(BTWireRecord* record);
+
+private:
+	const uint8_t* m_data;
+	size_t         m_length;
+	size_t         m_pos;
+	bool           m_valid;
+	uint32_t       m_scanStart;
+	uint8_t        m_dictCount;
+	uint16_t       m_dictOffset[BT_WIRE_DICT_SIZE];
+	uint8_t        m_dictLen[BT_WIRE_DICT_SIZE];
+};
+
+#endif /* !ESP_PLATFORM || CONFIG_BT_ENABLED */
+#endif /* _BT_WIRE_DECODER_H_ */
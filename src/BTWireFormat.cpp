@@ -0,0 +1,186 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include <string.h>
+#include <string>
+
+#include "BTWireFormat.h"
+#include "BTAdvertisedDevice.h"
+#include "BTScan.h"
+#include "BTUtils.h"
+#ifdef ARDUINO_ARCH_ESP32
+#include "esp32-hal-log.h"
+#endif
+
+// Largest possible device record: presence, address, rssi, cod, timestamp, name, txPower.
+static const size_t maxRecordLen = 1 + ESP_BD_ADDR_LEN + 1 + 3 + 5 + 2 + ESP_BT_GAP_MAX_BDNAME_LEN + 1;
+
+static_assert(BT_WIRE_ADDR_LEN == ESP_BD_ADDR_LEN, "BTWireRecord address size");
+static_assert(BT_WIRE_MAX_NAME_LEN == ESP_BT_GAP_MAX_BDNAME_LEN, "BTWireRecord name size");
+
+
+static size_t putVarint(uint8_t* target, uint32_t value) {
+	size_t i = 0;
+	while (value >= 0x80) {
+		target[i++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	target[i++] = (uint8_t)value;
+	return i;
+} // putVarint
+
+
+
+/**
+ * @brief Create an encoder over a caller owned buffer.
+ * @param [in] buffer Where the encoded bytes are written.
+ * @param [in] capacity The size of the buffer.
+ */
+BTWireEncoder::BTWireEncoder(uint8_t* buffer, size_t capacity) {
+	m_buffer   = buffer;
+	m_capacity = capacity;
+	reset(0);
+} // BTWireEncoder
+
+
+/**
+ * @brief Discard the buffer content and start a new one.
+ * @param [in] scanStart The time, in ms, that device timestamps are relative to.
+ */
+void BTWireEncoder::reset(uint32_t scanStart) {
+	m_length      = 0;
+	m_scanStart   = scanStart;
+	m_deviceCount = 0;
+	m_dictCount   = 0;
+	if (m_capacity >= 6) {
+		m_buffer[m_length++] = BT_WIRE_VERSION;
+		m_length += putVarint(m_buffer + m_length, scanStart);
+	}
+} // reset
+
+
+/**
+ * @brief Write a name either as a literal or as a reference to an earlier occurrence.
+ * @param [in] record The record being built.
+ * @param [in] pos Where the name starts within the record.
+ * @param [in] bytes The name to encode.
+ * @param [in] len The length of the name.
+ * @return The number of bytes written.
+ */
+size_t BTWireEncoder::encodeName(uint8_t* record, size_t pos, const uint8_t* bytes, uint8_t len) {
+	uint32_t hash = BTUtils::hash32(bytes, len);
+
+	for (uint8_t i = 0; i < m_dictCount; i++) {
+		if (m_dictHash[i] == hash && m_dictLen[i] == len &&
+			memcmp(m_buffer + m_dictOffset[i], bytes, len) == 0) {
+			return putVarint(record + pos, ((uint32_t)i << 1) | 1);
+		}
+	}
+
+	size_t used = putVarint(record + pos, (uint32_t)len << 1);
+	memcpy(record + pos + used, bytes, len);
+	// Remember where the literal will land once the record is copied into the buffer.
+	size_t offset = m_length + pos + used;
+	if (m_dictCount < BT_WIRE_DICT_SIZE && offset <= 0xffff) {
+		m_dictHash[m_dictCount]   = hash;
+		m_dictOffset[m_dictCount] = (uint16_t)offset;
+		m_dictLen[m_dictCount]    = len;
+		m_dictCount++;
+	}
+	return used + len;
+} // encodeName
+
+
+/**
+ * @brief Append one device to the buffer.
+ * @param [in] device The device to encode.
+ * @return False, leaving the buffer untouched, if the record does not fit.
+ */
+bool BTWireEncoder::addDevice(BTAdvertisedDevice& device) {
+	uint8_t record[maxRecordLen];
+	size_t  len = 0;
+	uint8_t presence = 0;
+	uint8_t dictCount = m_dictCount;
+
+	if (device.haveRSSI())    presence |= BT_WIRE_HAVE_RSSI;
+	if (device.haveCod())     presence |= BT_WIRE_HAVE_COD;
+	if (device.haveName())    presence |= BT_WIRE_HAVE_NAME;
+	if (device.haveTXPower()) presence |= BT_WIRE_HAVE_TXPOWER;
+
+	record[len++] = presence;
+	memcpy(record + len, *device.getAddress().getNative(), ESP_BD_ADDR_LEN);
+	len += ESP_BD_ADDR_LEN;
+	if (presence & BT_WIRE_HAVE_RSSI) {
+		record[len++] = (uint8_t)(int8_t)device.m_rssi;
+	}
+	if (presence & BT_WIRE_HAVE_COD) {
+		record[len++] = (uint8_t)(device.m_cod);
+		record[len++] = (uint8_t)(device.m_cod >> 8);
+		record[len++] = (uint8_t)(device.m_cod >> 16);
+	}
+	uint32_t relative = (device.m_timestamp >= m_scanStart) ? device.m_timestamp - m_scanStart : 0;
+	len += putVarint(record + len, relative);
+	if (presence & BT_WIRE_HAVE_NAME) {
+		len += encodeName(record, len, reinterpret_cast<const uint8_t*>(device.m_name), device.m_nameLen);
+	}
+	if (presence & BT_WIRE_HAVE_TXPOWER) {
+		record[len++] = (uint8_t)device.m_txPower;
+	}
+
+	if (m_length + len > m_capacity) {
+		m_dictCount = dictCount;   // Forget any name this record would have introduced.
+		return false;
+	}
+	memcpy(m_buffer + m_length, record, len);
+	m_length += len;
+	m_deviceCount++;
+	return true;
+} // addDevice
+
+
+/**
+ * @brief Append as many devices of a scan as fit in the buffer.
+ * @param [in] results The scan results.
+ * @param [in] first Index of the first device to encode.
+ * @return The index of the first device that was not encoded, getCount() when all were.
+ */
+size_t BTWireEncoder::addResults(BTScanResults& results, size_t first) {
+	size_t count = results.m_vectorAdvertisedDevices.size();
+	for (size_t i = first; i < count; i++) {
+		if (!addDevice(results.m_vectorAdvertisedDevices[i])) {
+			return i;
+		}
+	}
+	return count;
+} // addResults
+
+
+uint8_t* BTWireEncoder::getData() {
+	return m_buffer;
+} // getData
+
+
+size_t BTWireEncoder::getLength() {
+	return m_length;
+} // getLength
+
+
+uint32_t BTWireEncoder::getDeviceCount() {
+	return m_deviceCount;
+} // getDeviceCount
+
+
+#endif /* CONFIG_BT_ENABLED */
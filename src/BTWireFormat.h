@@ -0,0 +1,71 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_WIRE_FORMAT_H_
+#define _BT_WIRE_FORMAT_H_
+
+#include "sdkconfig.h"
+#if defined(CONFIG_BT_ENABLED)
+#include "esp_gap_bt_api.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "BTWireDecoder.h"
+
+class BTAdvertisedDevice;
+class BTScanResults;
+
+/**
+ * @brief Encode scan results into a compact binary buffer.
+ *
+ * A buffer starts with [version][varint: scan start ms].  Each device then follows as:
+ *
+ * ```
+ * [presence][address: 6][rssi: 1]?[cod: 3]?[varint: ms since scan start][name]?[txPower: 1]?
+ * ```
+ *
+ * A name is a varint whose low bit selects between a literal (length << 1, then the bytes)
+ * and a reference to a name already written to this buffer ((index << 1) | 1).
+ *
+ * The encoder writes into a caller supplied buffer and never allocates.  When addDevice()
+ * reports the buffer is full, ship the bytes and call reset(); each buffer decodes on its own,
+ * with BTWireDecoder.
+ */
+class BTWireEncoder {
+public:
+	BTWireEncoder(uint8_t* buffer, size_t capacity);
+	void     reset(uint32_t scanStart);
+	bool     addDevice(BTAdvertisedDevice& device);
+	size_t   addResults(BTScanResults& results, size_t first = 0);
+	uint8_t* getData();
+	size_t   getLength();
+	uint32_t getDeviceCount();
+
+private:
+	size_t   encodeName(uint8_t* record, size_t pos, const uint8_t* bytes, uint8_t len);
+
+	uint8_t* m_buffer;
+	size_t   m_capacity;
+	size_t   m_length;
+	uint32_t m_scanStart;
+	uint32_t m_deviceCount;
+	uint8_t  m_dictCount;
+	uint32_t m_dictHash[BT_WIRE_DICT_SIZE];
+	uint16_t m_dictOffset[BT_WIRE_DICT_SIZE];   // Offset of the literal bytes in m_buffer.
+	uint8_t  m_dictLen[BT_WIRE_DICT_SIZE];
+};
+
+#endif /* CONFIG_BT_ENABLED */
+#endif /* _BT_WIRE_FORMAT_H_ */
@@ -0,0 +1,60 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _BT_TEST_H_
+#define _BT_TEST_H_
+
+// Minimal harness for the host tests: each test is a plain executable, CHECK() records a failure and
+// carries on, and main() returns BT_TEST_RESULT() so ctest sees the outcome.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+static int btTestFailures = 0;
+
+#define CHECK(condition) do { \
+	if (!(condition)) { \
+		fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #condition); \
+		btTestFailures++; \
+	} \
+} while (0)
+
+#define CHECK_EQ(expected, actual) do { \
+	long long btExpected = (long long)(expected); \
+	long long btActual   = (long long)(actual); \
+	if (btExpected != btActual) { \
+		fprintf(stderr, "%s:%d: CHECK_EQ failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, \
+			#expected, #actual, btExpected, btActual); \
+		btTestFailures++; \
+	} \
+} while (0)
+
+#define RUN(test) do { \
+	int btBefore = btTestFailures; \
+	test(); \
+	printf("%-40s %s\n", #test, btTestFailures == btBefore ? "ok" : "FAILED"); \
+} while (0)
+
+#define BT_TEST_RESULT() (btTestFailures == 0 ? 0 : 1)
+
+/**
+ * @brief A scratch file name unique to this test executable.
+ */
+static inline std::string btTestPath(const char* name) {
+	const char* dir = getenv("TMPDIR");
+	return std::string(dir != nullptr ? dir : "/tmp") + "/bt_test_" + name;
+} // btTestPath
+
+#endif /* _BT_TEST_H_ */
@@ -0,0 +1,925 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Definitions behind the stand-in headers of stubs/, see FakeStack.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FakeStack.h"
+#include "FreeRTOS.h"
+#include "GeneralUtils.h"
+#include "esp32-hal-bt.h"
+#include "esp_bt_device.h"
+#include "esp_heap_caps.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+
+struct esp_timer {
+	esp_timer_cb_t callback;
+	void*          arg;
+	int64_t        deadline;
+	bool           armed;
+};
+
+struct tskTaskControlBlock {
+	std::mutex              lock;
+	std::condition_variable notified;
+	uint32_t                notifications = 0;
+	bool                    waiting       = false;   // In ulTaskNotifyTake(), or returned.
+};
+
+namespace {
+	std::atomic<int64_t>         clockMicros(1000000);
+	std::mutex                   timersLock;
+	std::vector<esp_timer*>      timers;
+
+	struct Scheduled {
+		int64_t                      deadline;
+		esp_bt_gap_discovery_state_t state;
+		uint32_t                     inquiry;
+	};
+
+	// Played inquiries, all under timersLock.
+	bool                         playing        = false;
+	std::deque<Scheduled>        scheduled;            // In delivery order.
+	uint32_t                     inquiry        = 0;   // The inquiry last started.
+	bool                         inquiryRunning = false;
+
+	std::mutex                        tasksLock;
+	std::vector<tskTaskControlBlock*> tasks;
+	thread_local bool                 inTimer = false;
+
+	FakeStack::Calls             stackCalls;
+	FakeStack::Faults            stackFaults;
+	std::atomic<esp_bt_gap_cb_t> gapCallback(nullptr);
+	std::atomic<esp_gap_ble_cb_t> bleCallback(nullptr);
+
+	std::atomic<int>             controllerStatus(ESP_BT_CONTROLLER_STATUS_IDLE);
+	std::atomic<int>             controllerMode(ESP_BT_MODE_IDLE);
+	std::atomic<int>             releasedMemory(ESP_BT_MODE_IDLE);
+	std::atomic<int>             bluedroidStatus(ESP_BLUEDROID_STATUS_UNINITIALIZED);
+
+	esp_partition_t              partition;            // Of setPartition(), found when size is not 0.
+	std::vector<uint8_t>         partitionData;
+
+	thread_local tskTaskControlBlock* currentTask = nullptr;
+	const std::chrono::steady_clock::time_point bootTime = std::chrono::steady_clock::now();
+
+	template <typename T>
+	void zero(std::atomic<T>& value) {
+		value = T();
+	}
+
+	/**
+	 * @brief Queue a discovery state event, never ahead of one already queued.  timersLock is held.
+	 */
+	void schedule(int64_t deadline, esp_bt_gap_discovery_state_t state) {
+		if (!scheduled.empty()) {
+			deadline = std::max(deadline, scheduled.back().deadline);
+		}
+		Scheduled event = { deadline, state, inquiry };
+		scheduled.push_back(event);
+	}
+
+	/**
+	 * @brief Wait until every task is blocked on its notifications with none pending.
+	 */
+	void settle() {
+		for (;;) {
+			bool idle = true;
+			{
+				std::lock_guard<std::mutex> lock(tasksLock);
+				for (tskTaskControlBlock* pTask : tasks) {
+					std::lock_guard<std::mutex> taskLock(pTask->lock);
+					idle = idle && pTask->waiting && pTask->notifications == 0;
+				}
+			}
+			if (idle) {
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	}
+} // namespace
+
+
+void FakeStack::reset() {
+	zero(stackCalls.startDiscovery);
+	zero(stackCalls.cancelDiscovery);
+	zero(stackCalls.setScanMode);
+	zero(stackCalls.getRemoteServices);
+	zero(stackCalls.bleSetScanParams);
+	zero(stackCalls.bleStartScanning);
+	zero(stackCalls.bleStopScanning);
+	zero(stackCalls.btStart);
+	zero(stackCalls.controllerInit);
+	zero(stackCalls.controllerEnable);
+	zero(stackCalls.bluedroidInit);
+	zero(stackCalls.bluedroidEnable);
+	zero(stackCalls.inquiryLength);
+	zero(stackCalls.controllerInitMode);
+	zero(stackCalls.controllerEnableMode);
+	zero(stackCalls.fromTimer);
+	zero(stackCalls.partitionMaps);
+	stackFaults.startDiscovery   = ESP_OK;
+	stackFaults.bleStartScanning = ESP_OK;
+	stackFaults.bluedroidInit    = ESP_OK;
+	stackFaults.btStartFails     = false;
+	stackFaults.hangInquiries    = 0;
+	stackFaults.dropStopped      = 0;
+	stackFaults.stoppedDelayMs   = 0;
+	std::lock_guard<std::mutex> lock(timersLock);
+	playing        = false;
+	inquiryRunning = false;
+	scheduled.clear();
+} // reset
+
+
+FakeStack::Calls& FakeStack::calls() {
+	return stackCalls;
+} // calls
+
+
+FakeStack::Faults& FakeStack::faults() {
+	return stackFaults;
+} // faults
+
+
+int64_t FakeStack::now() {
+	return clockMicros;
+} // now
+
+
+/**
+ * @brief Move the clock forward, firing each due timer and delivering each due inquiry event at its
+ * deadline, earliest first.  The tasks a timer wakes run to completion before the clock moves on.
+ */
+void FakeStack::advance(uint64_t micros) {
+	int64_t target = clockMicros + (int64_t)micros;
+	for (;;) {
+		esp_timer* pDue = nullptr;
+		Scheduled  event;
+		bool       haveEvent = false;
+		{
+			std::lock_guard<std::mutex> lock(timersLock);
+			for (esp_timer* pTimer : timers) {
+				if (pTimer->armed && pTimer->deadline <= target &&
+					(pDue == nullptr || pTimer->deadline < pDue->deadline)) {
+					pDue = pTimer;
+				}
+			}
+			if (!scheduled.empty() && scheduled.front().deadline <= target &&
+				(pDue == nullptr || scheduled.front().deadline <= pDue->deadline)) {
+				event     = scheduled.front();
+				haveEvent = true;
+				scheduled.pop_front();
+				if (event.state == ESP_BT_GAP_DISCOVERY_STOPPED && event.inquiry == inquiry) {
+					inquiryRunning = false;
+				}
+				clockMicros = std::max(clockMicros.load(), event.deadline);
+			} else if (pDue == nullptr) {
+				break;
+			} else {
+				pDue->armed = false;
+				clockMicros = std::max(clockMicros.load(), pDue->deadline);
+			}
+		}
+		if (haveEvent) {
+			if (event.state == ESP_BT_GAP_DISCOVERY_STOPPED && stackFaults.dropStopped > 0) {
+				stackFaults.dropStopped--;
+			} else {
+				emitDiscState(event.state);
+			}
+			continue;
+		}
+		inTimer = true;
+		pDue->callback(pDue->arg);
+		inTimer = false;
+		settle();
+	}
+	clockMicros = target;
+} // advance
+
+
+void FakeStack::advanceMs(uint32_t ms) {
+	advance((uint64_t)ms * 1000);
+} // advanceMs
+
+
+/**
+ * @brief Provide a data partition to esp_partition_find_first() and esp_partition_mmap(), replacing
+ * any earlier one.  Its contents must not be replaced while mapped.
+ * @param [in] label The label, at most 16 characters.
+ * @param [in] data The contents, copied.
+ * @param [in] size The size, 0 to remove the partition.
+ */
+void FakeStack::setPartition(const char* label, const uint8_t* data, size_t size) {
+	partition = esp_partition_t();
+	partition.type    = ESP_PARTITION_TYPE_DATA;
+	partition.subtype = ESP_PARTITION_SUBTYPE_ANY;
+	partition.size    = size;
+	strncpy(partition.label, label, sizeof(partition.label) - 1);
+	partitionData.assign(data, data + size);
+} // setPartition
+
+
+void FakeStack::playInquiries(bool enable) {
+	std::lock_guard<std::mutex> lock(timersLock);
+	playing = enable;
+} // playInquiries
+
+
+/**
+ * @brief Is the calling thread running an esp_timer callback?
+ */
+bool FakeStack::inTimerCallback() {
+	return inTimer;
+} // inTimerCallback
+
+
+bool FakeStack::haveGapCallback() {
+	return gapCallback.load() != nullptr;
+} // haveGapCallback
+
+
+void FakeStack::emit(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param) {
+	esp_bt_gap_cb_t callback = gapCallback;
+	if (callback != nullptr) {
+		callback(event, param);
+	}
+} // emit
+
+
+void FakeStack::emitDiscState(esp_bt_gap_discovery_state_t state) {
+	esp_bt_gap_cb_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.disc_st_chg.state = state;
+	emit(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, &param);
+} // emitDiscState
+
+
+/**
+ * @brief Report a device found by the inquiry, with an RSSI, an optional CoD and an optional EIR.
+ */
+void FakeStack::emitDiscRes(const uint8_t* address, int8_t rssi, uint32_t cod, const uint8_t* eir, size_t eirLen) {
+	esp_bt_gap_dev_prop_t props[3];
+	int                   count = 0;
+	uint8_t               eirCopy[ESP_BT_GAP_EIR_DATA_LEN];
+	props[count].type = ESP_BT_GAP_DEV_PROP_RSSI;
+	props[count].len  = 1;
+	props[count].val  = &rssi;
+	count++;
+	if (cod != 0) {
+		props[count].type = ESP_BT_GAP_DEV_PROP_COD;
+		props[count].len  = 4;
+		props[count].val  = &cod;
+		count++;
+	}
+	if (eir != nullptr) {
+		eirLen = std::min(eirLen, sizeof(eirCopy));
+		memcpy(eirCopy, eir, eirLen);
+		props[count].type = ESP_BT_GAP_DEV_PROP_EIR;
+		props[count].len  = (int)eirLen;
+		props[count].val  = eirCopy;
+		count++;
+	}
+	esp_bt_gap_cb_param_t param;
+	memset(&param, 0, sizeof(param));
+	memcpy(param.disc_res.bda, address, ESP_BD_ADDR_LEN);
+	param.disc_res.num_prop = count;
+	param.disc_res.prop     = props;
+	emit(ESP_BT_GAP_DISC_RES_EVT, &param);
+} // emitDiscRes
+
+
+void FakeStack::emitBle(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+	esp_gap_ble_cb_t callback = bleCallback;
+	if (callback != nullptr) {
+		callback(event, param);
+	}
+} // emitBle
+
+
+void FakeStack::emitBleResult(const uint8_t* address, int rssi) {
+	esp_ble_gap_cb_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.scan_rst.search_evt = ESP_GAP_SEARCH_INQ_RES_EVT;
+	memcpy(param.scan_rst.bda, address, ESP_BD_ADDR_LEN);
+	param.scan_rst.dev_type = ESP_BT_DEVICE_TYPE_BLE;
+	param.scan_rst.rssi     = rssi;
+	emitBle(ESP_GAP_BLE_SCAN_RESULT_EVT, &param);
+} // emitBleResult
+
+
+void FakeStack::emitBleComplete() {
+	esp_ble_gap_cb_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.scan_rst.search_evt = ESP_GAP_SEARCH_INQ_CMPL_EVT;
+	emitBle(ESP_GAP_BLE_SCAN_RESULT_EVT, &param);
+} // emitBleComplete
+
+
+/**
+ * @brief A distinct address for every n, spread over all six bytes.
+ */
+void FakeStack::makeAddress(uint32_t n, uint8_t* address) {
+	uint64_t mixed = (uint64_t)(n + 1) * 0x9E3779B97F4A7C15ULL;
+	for (int i = 0; i < ESP_BD_ADDR_LEN; i++) {
+		address[i] = (uint8_t)(mixed >> (8 * i));
+	}
+	address[0] = (uint8_t)(n >> 16);   // Keeps the first 2^24 addresses distinct.
+	address[1] = (uint8_t)(n >> 8);
+	address[2] = (uint8_t)n;
+} // makeAddress
+
+
+// ---- esp_timer -----------------------------------------------------------------------------------
+
+int64_t esp_timer_get_time(void) {
+	return clockMicros;
+} // esp_timer_get_time
+
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t* create_args, esp_timer_handle_t* out_handle) {
+	esp_timer* pTimer = new esp_timer();
+	pTimer->callback = create_args->callback;
+	pTimer->arg      = create_args->arg;
+	pTimer->deadline = 0;
+	pTimer->armed    = false;
+	std::lock_guard<std::mutex> lock(timersLock);
+	timers.push_back(pTimer);
+	*out_handle = pTimer;
+	return ESP_OK;
+} // esp_timer_create
+
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us) {
+	std::lock_guard<std::mutex> lock(timersLock);
+	if (timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer->deadline = clockMicros + (int64_t)timeout_us;
+	timer->armed    = true;
+	return ESP_OK;
+} // esp_timer_start_once
+
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer) {
+	std::lock_guard<std::mutex> lock(timersLock);
+	if (!timer->armed) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	timer->armed = false;
+	return ESP_OK;
+} // esp_timer_stop
+
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer) {
+	std::lock_guard<std::mutex> lock(timersLock);
+	timers.erase(std::remove(timers.begin(), timers.end(), timer), timers.end());
+	delete timer;
+	return ESP_OK;
+} // esp_timer_delete
+
+
+// ---- Controller and Bluedroid --------------------------------------------------------------------
+
+esp_err_t esp_bt_controller_init(esp_bt_controller_config_t* cfg) {
+	stackCalls.controllerInit++;
+	stackCalls.controllerInitMode = cfg->mode;
+	if (controllerStatus != ESP_BT_CONTROLLER_STATUS_IDLE) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (cfg->mode & releasedMemory) {
+		return ESP_ERR_INVALID_ARG;   // The memory for that mode is gone.
+	}
+	controllerMode   = cfg->mode;
+	controllerStatus = ESP_BT_CONTROLLER_STATUS_INITED;
+	return ESP_OK;
+} // esp_bt_controller_init
+
+
+esp_err_t esp_bt_controller_deinit(void) {
+	if (controllerStatus != ESP_BT_CONTROLLER_STATUS_INITED) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	controllerStatus = ESP_BT_CONTROLLER_STATUS_IDLE;
+	return ESP_OK;
+} // esp_bt_controller_deinit
+
+
+esp_err_t esp_bt_controller_enable(esp_bt_mode_t mode) {
+	stackCalls.controllerEnable++;
+	stackCalls.controllerEnableMode = mode;
+	if (controllerStatus != ESP_BT_CONTROLLER_STATUS_INITED) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (mode != controllerMode) {
+		return ESP_ERR_INVALID_ARG;
+	}
+	controllerStatus = ESP_BT_CONTROLLER_STATUS_ENABLED;
+	return ESP_OK;
+} // esp_bt_controller_enable
+
+
+esp_err_t esp_bt_controller_disable(void) {
+	if (controllerStatus != ESP_BT_CONTROLLER_STATUS_ENABLED) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	controllerStatus = ESP_BT_CONTROLLER_STATUS_INITED;
+	return ESP_OK;
+} // esp_bt_controller_disable
+
+
+esp_bt_controller_status_t esp_bt_controller_get_status(void) {
+	return (esp_bt_controller_status_t)controllerStatus.load();
+} // esp_bt_controller_get_status
+
+
+esp_err_t esp_bt_controller_mem_release(esp_bt_mode_t mode) {
+	if (controllerStatus != ESP_BT_CONTROLLER_STATUS_IDLE) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	releasedMemory |= mode;
+	return ESP_OK;
+} // esp_bt_controller_mem_release
+
+
+// Arduino: the controller in the mode chosen at build time, dual mode here.
+bool btStart() {
+	stackCalls.btStart++;
+	if (stackFaults.btStartFails) {
+		return false;
+	}
+	if (controllerStatus == ESP_BT_CONTROLLER_STATUS_ENABLED) {
+		return true;
+	}
+	esp_bt_controller_config_t cfg = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+	if (controllerStatus == ESP_BT_CONTROLLER_STATUS_IDLE && esp_bt_controller_init(&cfg) != ESP_OK) {
+		return false;
+	}
+	return esp_bt_controller_enable(ESP_BT_MODE_BTDM) == ESP_OK;
+} // btStart
+
+
+bool btStarted() {
+	return controllerStatus == ESP_BT_CONTROLLER_STATUS_ENABLED;
+} // btStarted
+
+
+bool btStop() {
+	if (controllerStatus == ESP_BT_CONTROLLER_STATUS_ENABLED) {
+		esp_bt_controller_disable();
+	}
+	if (controllerStatus == ESP_BT_CONTROLLER_STATUS_INITED) {
+		esp_bt_controller_deinit();
+	}
+	return true;
+} // btStop
+
+
+esp_bluedroid_status_t esp_bluedroid_get_status(void) {
+	return (esp_bluedroid_status_t)bluedroidStatus.load();
+} // esp_bluedroid_get_status
+
+
+esp_err_t esp_bluedroid_init(void) {
+	stackCalls.bluedroidInit++;
+	if (stackFaults.bluedroidInit != ESP_OK) {
+		return stackFaults.bluedroidInit;
+	}
+	if (bluedroidStatus != ESP_BLUEDROID_STATUS_UNINITIALIZED) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	bluedroidStatus = ESP_BLUEDROID_STATUS_INITIALIZED;
+	return ESP_OK;
+} // esp_bluedroid_init
+
+
+esp_err_t esp_bluedroid_deinit(void) {
+	if (bluedroidStatus != ESP_BLUEDROID_STATUS_INITIALIZED) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	bluedroidStatus = ESP_BLUEDROID_STATUS_UNINITIALIZED;
+	gapCallback     = nullptr;
+	bleCallback     = nullptr;
+	std::lock_guard<std::mutex> lock(timersLock);   // Pending events go away with the stack.
+	inquiryRunning = false;
+	scheduled.clear();
+	return ESP_OK;
+} // esp_bluedroid_deinit
+
+
+esp_err_t esp_bluedroid_enable(void) {
+	stackCalls.bluedroidEnable++;
+	if (bluedroidStatus != ESP_BLUEDROID_STATUS_INITIALIZED || controllerStatus != ESP_BT_CONTROLLER_STATUS_ENABLED) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	bluedroidStatus = ESP_BLUEDROID_STATUS_ENABLED;
+	return ESP_OK;
+} // esp_bluedroid_enable
+
+
+esp_err_t esp_bluedroid_disable(void) {
+	if (bluedroidStatus != ESP_BLUEDROID_STATUS_ENABLED) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	bluedroidStatus = ESP_BLUEDROID_STATUS_INITIALIZED;
+	return ESP_OK;
+} // esp_bluedroid_disable
+
+
+const uint8_t* esp_bt_dev_get_address(void) {
+	static const uint8_t address[ESP_BD_ADDR_LEN] = { 0x24, 0x0a, 0xc4, 0x00, 0x00, 0x01 };
+	return address;
+} // esp_bt_dev_get_address
+
+
+esp_err_t esp_bt_dev_set_device_name(const char* name) {
+	return bluedroidStatus == ESP_BLUEDROID_STATUS_ENABLED ? ESP_OK : ESP_ERR_INVALID_STATE;
+} // esp_bt_dev_set_device_name
+
+
+// ---- Classic GAP ---------------------------------------------------------------------------------
+
+esp_err_t esp_bt_gap_register_callback(esp_bt_gap_cb_t callback) {
+	gapCallback = callback;
+	return ESP_OK;
+} // esp_bt_gap_register_callback
+
+
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_scan_mode_t mode) {
+	stackCalls.setScanMode++;
+	return ESP_OK;
+} // esp_bt_gap_set_scan_mode
+
+
+esp_err_t esp_bt_gap_start_discovery(esp_bt_inq_mode_t mode, uint8_t inq_len, uint8_t num_rsps) {
+	stackCalls.startDiscovery++;
+	stackCalls.fromTimer    += inTimer;
+	stackCalls.inquiryLength = inq_len;
+	if (stackFaults.startDiscovery != ESP_OK) {
+		return stackFaults.startDiscovery;
+	}
+	std::lock_guard<std::mutex> lock(timersLock);
+	if (playing) {
+		inquiry++;
+		inquiryRunning = true;
+		schedule(clockMicros, ESP_BT_GAP_DISCOVERY_STARTED);
+		if (stackFaults.hangInquiries > 0) {
+			stackFaults.hangInquiries--;
+		} else {
+			schedule(clockMicros + (int64_t)inq_len * 1280000 + (int64_t)stackFaults.stoppedDelayMs * 1000,
+				ESP_BT_GAP_DISCOVERY_STOPPED);
+		}
+	}
+	return ESP_OK;
+} // esp_bt_gap_start_discovery
+
+
+esp_err_t esp_bt_gap_cancel_discovery(void) {
+	stackCalls.cancelDiscovery++;
+	stackCalls.fromTimer += inTimer;
+	std::lock_guard<std::mutex> lock(timersLock);
+	if (playing && inquiryRunning) {   // Its own end, if still to come, is replaced by that of the cancel.
+		inquiryRunning = false;
+		for (std::deque<Scheduled>::iterator it = scheduled.begin(); it != scheduled.end();) {
+			if (it->state == ESP_BT_GAP_DISCOVERY_STOPPED && it->inquiry == inquiry) {
+				it = scheduled.erase(it);
+			} else {
+				++it;
+			}
+		}
+		schedule(clockMicros + (int64_t)stackFaults.stoppedDelayMs * 1000, ESP_BT_GAP_DISCOVERY_STOPPED);
+	}
+	return ESP_OK;
+} // esp_bt_gap_cancel_discovery
+
+
+esp_err_t esp_bt_gap_get_remote_services(esp_bd_addr_t remote_bda) {
+	stackCalls.getRemoteServices++;
+	return ESP_OK;
+} // esp_bt_gap_get_remote_services
+
+
+/**
+ * @brief Find a structure in [length][type][data...] EIR data, as Bluedroid does.
+ */
+static uint8_t* resolveAdvertising(uint8_t* data, size_t maxLength, uint8_t type, uint8_t* length) {
+	size_t pos = 0;
+	while (data != nullptr && pos < maxLength && data[pos] != 0) {
+		uint8_t fieldLength = data[pos];
+		if (pos + 1 + fieldLength > maxLength) {
+			break;
+		}
+		if (data[pos + 1] == type) {
+			*length = fieldLength - 1;
+			return data + pos + 2;
+		}
+		pos += 1 + fieldLength;
+	}
+	*length = 0;
+	return nullptr;
+} // resolveAdvertising
+
+
+uint8_t* esp_bt_gap_resolve_eir_data(uint8_t* eir, esp_bt_eir_type_t type, uint8_t* length) {
+	return resolveAdvertising(eir, ESP_BT_GAP_EIR_DATA_LEN, (uint8_t)type, length);
+} // esp_bt_gap_resolve_eir_data
+
+
+bool esp_bt_gap_is_valid_cod(uint32_t cod) {
+	return (cod & 0x3) == 0;
+} // esp_bt_gap_is_valid_cod
+
+
+uint32_t esp_bt_gap_get_cod_major_dev(uint32_t cod) {
+	return (cod >> 8) & 0x1f;
+} // esp_bt_gap_get_cod_major_dev
+
+
+uint32_t esp_bt_gap_get_cod_minor_dev(uint32_t cod) {
+	return (cod >> 2) & 0x3f;
+} // esp_bt_gap_get_cod_minor_dev
+
+
+uint32_t esp_bt_gap_get_cod_srvc(uint32_t cod) {
+	return (cod >> 13) & 0x7ff;
+} // esp_bt_gap_get_cod_srvc
+
+
+// ---- BLE GAP -------------------------------------------------------------------------------------
+
+esp_err_t esp_ble_gap_register_callback(esp_gap_ble_cb_t callback) {
+	bleCallback = callback;
+	return ESP_OK;
+} // esp_ble_gap_register_callback
+
+
+esp_err_t esp_ble_gap_set_scan_params(esp_ble_scan_params_t* scan_params) {
+	stackCalls.bleSetScanParams++;
+	return ESP_OK;
+} // esp_ble_gap_set_scan_params
+
+
+esp_err_t esp_ble_gap_start_scanning(uint32_t duration) {
+	stackCalls.bleStartScanning++;
+	stackCalls.fromTimer += inTimer;
+	return stackFaults.bleStartScanning;
+} // esp_ble_gap_start_scanning
+
+
+esp_err_t esp_ble_gap_stop_scanning(void) {
+	stackCalls.bleStopScanning++;
+	stackCalls.fromTimer += inTimer;
+	return ESP_OK;
+} // esp_ble_gap_stop_scanning
+
+
+esp_err_t esp_ble_gap_set_device_name(const char* name) {
+	return ESP_OK;
+} // esp_ble_gap_set_device_name
+
+
+uint8_t* esp_ble_resolve_adv_data(uint8_t* adv_data, uint8_t type, uint8_t* length) {
+	return resolveAdvertising(adv_data, ESP_BLE_ADV_DATA_LEN_MAX + ESP_BLE_SCAN_RSP_DATA_LEN_MAX, type, length);
+} // esp_ble_resolve_adv_data
+
+
+// ---- Memory and flash ----------------------------------------------------------------------------
+
+void* heap_caps_malloc(size_t size, uint32_t caps) {
+	return malloc(size);
+} // heap_caps_malloc
+
+
+void heap_caps_free(void* ptr) {
+	free(ptr);
+} // heap_caps_free
+
+
+size_t heap_caps_get_free_size(uint32_t caps) {
+	return 256 * 1024;
+} // heap_caps_get_free_size
+
+
+size_t heap_caps_get_minimum_free_size(uint32_t caps) {
+	return 128 * 1024;
+} // heap_caps_get_minimum_free_size
+
+
+size_t heap_caps_get_largest_free_block(uint32_t caps) {
+	return 64 * 1024;
+} // heap_caps_get_largest_free_block
+
+
+uint32_t esp_get_free_heap_size(void) {
+	return 256 * 1024;
+} // esp_get_free_heap_size
+
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+	return 128 * 1024;
+} // esp_get_minimum_free_heap_size
+
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label) {
+	if (partition.size == 0 || type != ESP_PARTITION_TYPE_DATA || label == nullptr || strcmp(label, partition.label) != 0) {
+		return nullptr;
+	}
+	return &partition;
+} // esp_partition_find_first
+
+
+esp_err_t esp_partition_mmap(const esp_partition_t* pPartition, size_t offset, size_t size,
+	spi_flash_mmap_memory_t memory, const void** out_ptr, spi_flash_mmap_handle_t* out_handle) {
+	if (pPartition != &partition || offset + size > partition.size) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	*out_ptr    = partitionData.data() + offset;
+	*out_handle = 1;
+	stackCalls.partitionMaps++;
+	return ESP_OK;
+} // esp_partition_mmap
+
+
+void spi_flash_munmap(spi_flash_mmap_handle_t handle) {
+	stackCalls.partitionMaps--;
+} // spi_flash_munmap
+
+
+const char* GeneralUtils::errorToString(esp_err_t errCode) {
+	switch (errCode) {
+		case ESP_OK:                return "ESP_OK";
+		case ESP_FAIL:              return "ESP_FAIL";
+		case ESP_ERR_NO_MEM:        return "ESP_ERR_NO_MEM";
+		case ESP_ERR_INVALID_ARG:   return "ESP_ERR_INVALID_ARG";
+		case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+		case ESP_ERR_NOT_FOUND:     return "ESP_ERR_NOT_FOUND";
+		case ESP_ERR_TIMEOUT:       return "ESP_ERR_TIMEOUT";
+		default:                    return "Unknown ESP_ERR error";
+	}
+} // errorToString
+
+
+// ---- FreeRTOS ------------------------------------------------------------------------------------
+
+void vTaskDelay(TickType_t ticks) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+} // vTaskDelay
+
+
+TickType_t xTaskGetTickCount(void) {
+	return (TickType_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - bootTime).count();
+} // xTaskGetTickCount
+
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stackDepth,
+	void* pvParameters, UBaseType_t priority, TaskHandle_t* pCreatedTask, BaseType_t coreId) {
+	tskTaskControlBlock* pTask = new tskTaskControlBlock();
+	if (pCreatedTask != nullptr) {
+		*pCreatedTask = pTask;
+	}
+	{
+		std::lock_guard<std::mutex> lock(tasksLock);
+		tasks.push_back(pTask);
+	}
+	std::thread([pTask, function, pvParameters]() {
+		currentTask = pTask;
+		function(pvParameters);
+		std::lock_guard<std::mutex> lock(pTask->lock);
+		pTask->waiting = true;   // Idle for good.
+	}).detach();
+	return pdPASS;
+} // xTaskCreatePinnedToCore
+
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stackDepth, void* pvParameters,
+	UBaseType_t priority, TaskHandle_t* pCreatedTask) {
+	return xTaskCreatePinnedToCore(function, name, stackDepth, pvParameters, priority, pCreatedTask, tskNO_AFFINITY);
+} // xTaskCreate
+
+
+// Threads cannot be killed from outside; a host task has to return instead.
+void vTaskDelete(TaskHandle_t task) {
+} // vTaskDelete
+
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+	std::lock_guard<std::mutex> lock(task->lock);
+	task->notifications++;
+	task->notified.notify_one();
+	return pdPASS;
+} // xTaskNotifyGive
+
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait) {
+	tskTaskControlBlock* pTask = currentTask;
+	std::unique_lock<std::mutex> lock(pTask->lock);
+	pTask->waiting = true;
+	if (ticksToWait == portMAX_DELAY) {
+		pTask->notified.wait(lock, [pTask]() { return pTask->notifications > 0; });
+	} else {
+		pTask->notified.wait_for(lock, std::chrono::milliseconds(ticksToWait * portTICK_PERIOD_MS),
+			[pTask]() { return pTask->notifications > 0; });
+	}
+	pTask->waiting = false;
+	uint32_t count = pTask->notifications;
+	if (count > 0) {
+		pTask->notifications = clearCountOnExit ? 0 : count - 1;
+	}
+	return count;
+} // ulTaskNotifyTake
+
+
+void FreeRTOS::sleep(uint32_t ms) {
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+} // sleep
+
+
+uint32_t FreeRTOS::getTimeSinceStart() {
+	return xTaskGetTickCount() * portTICK_PERIOD_MS;
+} // getTimeSinceStart
+
+
+FreeRTOS::Semaphore::Semaphore(std::string name) : m_state(new State()) {
+	m_state->free  = true;
+	m_state->value = 0;
+	m_state->name  = name;
+} // Semaphore
+
+
+void FreeRTOS::Semaphore::give() {
+	std::lock_guard<std::mutex> lock(m_state->lock);
+	m_state->free  = true;
+	m_state->owner = "<N/A>";
+	m_state->given.notify_all();
+} // give
+
+
+void FreeRTOS::Semaphore::give(uint32_t value) {
+	m_state->value = value;
+	give();
+} // give
+
+
+bool FreeRTOS::Semaphore::take(std::string owner) {
+	return take(portMAX_DELAY, owner);
+} // take
+
+
+bool FreeRTOS::Semaphore::take(uint32_t timeoutMs, std::string owner) {
+	std::unique_lock<std::mutex> lock(m_state->lock);
+	State* pState = m_state.get();
+	if (timeoutMs == portMAX_DELAY) {
+		pState->given.wait(lock, [pState]() { return pState->free; });
+	} else if (!pState->given.wait_for(lock, std::chrono::milliseconds(timeoutMs), [pState]() { return pState->free; })) {
+		return false;
+	}
+	pState->free  = false;
+	pState->owner = owner;
+	return true;
+} // take
+
+
+uint32_t FreeRTOS::Semaphore::wait(std::string owner) {
+	take(owner);
+	give();
+	return m_state->value;
+} // wait
+
+
+bool FreeRTOS::Semaphore::timedWait(std::string owner, uint32_t timeoutMs) {
+	if (!take(timeoutMs, owner)) {
+		return false;
+	}
+	give();
+	return true;
+} // timedWait
+
+
+std::string FreeRTOS::Semaphore::toString() {
+	return "name: " + m_state->name + ", owner: " + m_state->owner;
+} // toString
@@ -0,0 +1,96 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef _FAKE_STACK_H_
+#define _FAKE_STACK_H_
+
+// A scripted Bluetooth stack behind the stand-in headers of stubs/.
+//
+// Nothing happens on its own: the GAP calls made by the library are counted, and the test decides
+// which events come back and when, with emit*().  Time is simulated: esp_timer_get_time() only moves
+// with advance(), which also fires the esp_timers that fall due, on the calling thread, the way the
+// esp_timer task would.  Tasks are real threads; advance() lets the tasks a timer woke finish before
+// moving on.
+//
+// With playInquiries(), classic inquiries play out on their own instead: start_discovery reports
+// STARTED, then STOPPED once its length has passed, and cancel_discovery reports STOPPED at once.
+// The events are delivered by advance(), in order, as from the Bluedroid queue; the hangInquiries,
+// dropStopped and stoppedDelayMs faults break that the ways a controller does.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include "esp_bt.h"
+#include "esp_bt_main.h"
+#include "esp_gap_bt_api.h"
+#include "esp_gap_ble_api.h"
+
+namespace FakeStack {
+
+	struct Calls {
+		std::atomic<int> startDiscovery;
+		std::atomic<int> cancelDiscovery;
+		std::atomic<int> setScanMode;
+		std::atomic<int> getRemoteServices;
+		std::atomic<int> bleSetScanParams;
+		std::atomic<int> bleStartScanning;
+		std::atomic<int> bleStopScanning;
+		std::atomic<int> btStart;
+		std::atomic<int> controllerInit;
+		std::atomic<int> controllerEnable;
+		std::atomic<int> bluedroidInit;
+		std::atomic<int> bluedroidEnable;
+		std::atomic<int> inquiryLength;        // Of the last start_discovery, in 1.28 s units.
+		std::atomic<int> controllerInitMode;   // esp_bt_mode_t of the last controller init.
+		std::atomic<int> controllerEnableMode;
+		std::atomic<int> fromTimer;            // GAP calls made from an esp_timer callback, which must not block.
+		std::atomic<int> partitionMaps;        // esp_partition_mmap() calls not unmapped yet.
+	};
+
+	struct Faults {
+		std::atomic<esp_err_t> startDiscovery;    // Returned by esp_bt_gap_start_discovery().
+		std::atomic<esp_err_t> bleStartScanning;
+		std::atomic<esp_err_t> bluedroidInit;
+		std::atomic<bool>      btStartFails;      // Arduino btStart() reports failure.
+		std::atomic<int>       hangInquiries;     // The next n inquiries never end unless cancelled.
+		std::atomic<int>       dropStopped;       // The next n DISCOVERY_STOPPED events are lost.
+		std::atomic<uint32_t>  stoppedDelayMs;    // How late every DISCOVERY_STOPPED comes.
+	};
+
+	void     reset();
+	Calls&   calls();
+	Faults&  faults();
+
+	int64_t  now();
+	void     advance(uint64_t micros);
+	void     advanceMs(uint32_t ms);
+	bool     inTimerCallback();
+
+	void     playInquiries(bool enable);
+	bool     haveGapCallback();
+	void     emit(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param);
+	void     emitDiscState(esp_bt_gap_discovery_state_t state);
+	void     emitDiscRes(const uint8_t* address, int8_t rssi, uint32_t cod = 0,
+		const uint8_t* eir = nullptr, size_t eirLen = 0);
+	void     emitBle(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param);
+	void     emitBleResult(const uint8_t* address, int rssi);
+	void     emitBleComplete();
+
+	void     makeAddress(uint32_t n, uint8_t* address);
+	void     setPartition(const char* label, const uint8_t* data, size_t size);
+
+} // namespace FakeStack
+
+#endif /* _FAKE_STACK_H_ */
@@ -0,0 +1,152 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The scan storage allocators: the heap allocator, BTStaticAllocator with its single live allocation,
+// and BTScan::setRecordAllocator() taking the records, the RSSI histories and the tracked devices
+// along, while the hot index stays behind.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTAllocator.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+
+/**
+ * @brief A heap allocator that counts what goes through it.
+ */
+class CountingAllocator : public BTAllocator {
+public:
+	size_t allocations = 0;
+	size_t live        = 0;
+
+	void* allocate(size_t size) {
+		allocations++;
+		live++;
+		return malloc(size);
+	}
+	void deallocate(void* ptr) {
+		if (ptr != nullptr) {
+			live--;
+		}
+		free(ptr);
+	}
+};
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+static void scan(BTScan* pScan, uint32_t first, uint32_t count) {
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	for (uint32_t n = first; n < first + count; n++) {
+		uint8_t address[ESP_BD_ADDR_LEN];
+		FakeStack::makeAddress(n, address);
+		FakeStack::emitDiscRes(address, -60);
+		FakeStack::advanceMs(1);
+	}
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+} // scan
+
+
+/**
+ * @brief The heap allocators hand out distinct, usable blocks.
+ */
+static void testHeapAllocator() {
+	BTAllocator* allocators[] = { BTAllocator::getDefault(), BTAllocator::getInternal() };
+	for (int i = 0; i < 2; i++) {
+		uint8_t* a = static_cast<uint8_t*>(allocators[i]->allocate(100));
+		uint8_t* b = static_cast<uint8_t*>(allocators[i]->allocate(100));
+		CHECK(a != nullptr && b != nullptr && a != b);
+		a[99] = 1;
+		b[0]  = 2;
+		allocators[i]->deallocate(a);
+		allocators[i]->deallocate(b);
+	}
+	CHECK(BTAllocator::getDefault() == BTAllocator::getDefault());
+} // testHeapAllocator
+
+
+/**
+ * @brief One live allocation of at most the buffer size, aligned for any record, free again once
+ * returned; a pointer it did not hand out is ignored.
+ */
+static void testStaticAllocator() {
+	BTStaticAllocator<64> allocator;
+	CHECK(allocator.allocate(65) == nullptr);
+	void* p = allocator.allocate(64);
+	CHECK(p != nullptr);
+	CHECK_EQ(0, (uintptr_t)p % 8);
+	CHECK(allocator.allocate(1) == nullptr);
+	int other;
+	allocator.deallocate(&other);
+	CHECK(allocator.allocate(1) == nullptr);
+	allocator.deallocate(p);
+	CHECK(allocator.allocate(8) == p);
+	allocator.deallocate(p);
+
+	std::vector<uint32_t, BTStlAllocator<uint32_t> > table((BTStlAllocator<uint32_t>(&allocator)));
+	table.reserve(16);   // The whole buffer.
+	table.assign(16, 7);
+	CHECK((void*)table.data() == p);
+	CHECK(allocator.allocate(1) == nullptr);
+} // testStaticAllocator
+
+
+/**
+ * @brief After setRecordAllocator() the records, the per slot RSSI histories and every tracked
+ * device are allocated from it, and moving to another allocator returns all of it.
+ */
+static void testRecordAllocator() {
+	CountingAllocator counting;
+	FakeStack::reset();
+	BTDevice::init("allocator_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	pScan->getGeneration();   // Tracking on.
+	pScan->setRecordAllocator(&counting);
+	CHECK(counting.allocations > 0);   // The change log.
+
+	pScan->setMaxResults(32);
+	size_t before = counting.allocations;
+	pScan->setRssiHistory(4);
+	CHECK(counting.allocations >= before + 1 + 32);   // The history table and the blocks of each slot.
+
+	before = counting.allocations;
+	scan(pScan, 1, 20);
+	CHECK_EQ(20, pScan->getResultsRef().getCount());
+	CHECK(pScan->getResultsRef().getRssiHistory(0) != nullptr);
+	CHECK(counting.allocations >= before + 20);   // A tracker entry each.
+	size_t tracked = counting.live;
+
+	scan(pScan, 1, 20);   // The same devices: nothing new is tracked.
+	CHECK_EQ(tracked, counting.live);
+
+	pScan->setRecordAllocator(BTAllocator::getDefault());
+	CHECK_EQ(0, counting.live);
+	pScan->setRssiHistory(0);
+	pScan->setMaxResults(0);
+} // testRecordAllocator
+
+
+int main() {
+	RUN(testHeapAllocator);
+	RUN(testStaticAllocator);
+	RUN(testRecordAllocator);
+	return BT_TEST_RESULT();
+} // main
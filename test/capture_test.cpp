@@ -0,0 +1,277 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Capture files on the host: writer/replayer round trips and fixed fixtures for each format version.
+
+#include <string.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "BTCapture.h"
+#include "BTTest.h"
+
+// Version 1 fixture: STARTED, a DISC_RES with a CoD and an RSSI 0xffffffff us later, STOPPED.
+static const uint8_t fixtureV1[] = {
+	'B', 'T', 'C', 'P', 1, 0, 0, 0,
+	0xe8, 0x07, ESP_BT_GAP_DISC_STATE_CHANGED_EVT, 1, ESP_BT_GAP_DISCOVERY_STARTED,
+	0xff, 0xff, 0xff, 0xff, 0x0f, ESP_BT_GAP_DISC_RES_EVT, 16,
+		0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 2,
+		ESP_BT_GAP_DEV_PROP_COD, 4, 0x0c, 0x02, 0x5a, 0x00,
+		ESP_BT_GAP_DEV_PROP_RSSI, 1, 0xc4,
+	0x05, ESP_BT_GAP_DISC_STATE_CHANGED_EVT, 1, ESP_BT_GAP_DISCOVERY_STOPPED,
+};
+
+
+static void putVarint(std::vector<uint8_t>& target, uint64_t value) {
+	while (value >= 0x80) {
+		target.push_back((uint8_t)(value | 0x80));
+		value >>= 7;
+	}
+	target.push_back((uint8_t)value);
+} // putVarint
+
+
+static void writeFile(const std::string& path, const uint8_t* data, size_t length) {
+	FILE* file = fopen(path.c_str(), "wb");
+	fwrite(data, 1, length, file);
+	fclose(file);
+} // writeFile
+
+
+static void testFixtureV1() {
+	std::string path = btTestPath("capture_v1");
+	writeFile(path, fixtureV1, sizeof(fixtureV1));
+
+	BTCaptureReplayer replayer;
+	CHECK(replayer.open(path.c_str()));
+	esp_bt_gap_cb_event_t event;
+	esp_bt_gap_cb_param_t param;
+	uint64_t              delta;
+
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, event);
+	CHECK_EQ(ESP_BT_GAP_DISCOVERY_STARTED, param.disc_st_chg.state);
+	CHECK_EQ(1000, delta);
+
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(ESP_BT_GAP_DISC_RES_EVT, event);
+	CHECK_EQ(0xffffffffull, delta);
+	CHECK_EQ(0x66, param.disc_res.bda[5]);
+	CHECK_EQ(2, param.disc_res.num_prop);
+	CHECK_EQ(ESP_BT_GAP_DEV_PROP_COD, param.disc_res.prop[0].type);
+	CHECK_EQ(0x5a020c, *(uint32_t*)param.disc_res.prop[0].val);
+	CHECK_EQ(-60, *(int8_t*)param.disc_res.prop[1].val);
+
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(ESP_BT_GAP_DISCOVERY_STOPPED, param.disc_st_chg.state);
+	CHECK(!replayer.next(&event, &param, &delta));
+	remove(path.c_str());
+} // testFixtureV1
+
+
+// Version 2 deltas are 64 bit: a gap of five hours no longer wraps.
+static void testFixtureV2LongGap() {
+	const uint64_t fiveHours = 5ull * 3600 * 1000000;
+	std::vector<uint8_t> data = { 'B', 'T', 'C', 'P', 2, 0, 0, 0 };
+	putVarint(data, fiveHours);
+	data.push_back(ESP_BT_GAP_DISC_STATE_CHANGED_EVT);
+	data.push_back(1);
+	data.push_back(ESP_BT_GAP_DISCOVERY_STOPPED);
+	std::string path = btTestPath("capture_v2");
+	writeFile(path, data.data(), data.size());
+
+	BTCaptureReplayer     replayer;
+	esp_bt_gap_cb_event_t event;
+	esp_bt_gap_cb_param_t param;
+	uint64_t              delta = 0;
+	CHECK(replayer.open(path.c_str()));
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(fiveHours, delta);
+	remove(path.c_str());
+} // testFixtureV2LongGap
+
+
+static void testFutureVersionRejected() {
+	const uint8_t data[] = { 'B', 'T', 'C', 'P', BT_CAPTURE_VERSION + 1, 0, 0, 0 };
+	std::string path = btTestPath("capture_future");
+	writeFile(path, data, sizeof(data));
+	BTCaptureReplayer replayer;
+	CHECK(!replayer.open(path.c_str()));
+	remove(path.c_str());
+} // testFutureVersionRejected
+
+
+// Properties past BT_CAPTURE_MAX_PROPS are dropped, with a warning, and the rest stay usable.
+static void testTooManyProps() {
+	std::vector<uint8_t> data = { 'B', 'T', 'C', 'P', 2, 0, 0, 0, 0, ESP_BT_GAP_DISC_RES_EVT };
+	const int props = BT_CAPTURE_MAX_PROPS + 2;
+	putVarint(data, ESP_BD_ADDR_LEN + 1 + props * 3);
+	data.insert(data.end(), ESP_BD_ADDR_LEN, 0xaa);
+	data.push_back(props);
+	for (int i = 0; i < props; i++) {
+		data.push_back(ESP_BT_GAP_DEV_PROP_RSSI);
+		data.push_back(1);
+		data.push_back((uint8_t)(-40 - i));
+	}
+	std::string path = btTestPath("capture_props");
+	writeFile(path, data.data(), data.size());
+
+	BTCaptureReplayer     replayer;
+	esp_bt_gap_cb_event_t event;
+	esp_bt_gap_cb_param_t param;
+	uint64_t              delta;
+	CHECK(replayer.open(path.c_str()));
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(BT_CAPTURE_MAX_PROPS, param.disc_res.num_prop);
+	CHECK_EQ(-40 - (BT_CAPTURE_MAX_PROPS - 1), *(int8_t*)param.disc_res.prop[BT_CAPTURE_MAX_PROPS - 1].val);
+	remove(path.c_str());
+} // testTooManyProps
+
+
+static void testRoundTrip() {
+	std::string path = btTestPath("capture_round_trip");
+	BTCaptureWriter writer;
+	CHECK(writer.open(path.c_str()));
+
+	uint8_t  name[] = "Headset";
+	uint32_t cod    = 0x240404;
+	int8_t   rssi   = -71;
+	uint8_t  eir[240];
+	for (size_t i = 0; i < sizeof(eir); i++) {
+		eir[i] = (uint8_t)i;
+	}
+	esp_bt_gap_dev_prop_t props[] = {
+		{ ESP_BT_GAP_DEV_PROP_BDNAME, (int)sizeof(name) - 1, name },
+		{ ESP_BT_GAP_DEV_PROP_COD,    4,                     &cod },
+		{ ESP_BT_GAP_DEV_PROP_RSSI,   1,                     &rssi },
+		{ ESP_BT_GAP_DEV_PROP_EIR,    (int)sizeof(eir),      eir },
+	};
+	esp_bt_gap_cb_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.disc_st_chg.state = ESP_BT_GAP_DISCOVERY_STARTED;
+	writer.record(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, &param);
+	memset(&param, 0, sizeof(param));
+	const uint8_t address[ESP_BD_ADDR_LEN] = { 1, 2, 3, 4, 5, 6 };
+	memcpy(param.disc_res.bda, address, ESP_BD_ADDR_LEN);
+	param.disc_res.num_prop = 4;
+	param.disc_res.prop     = props;
+	writer.record(ESP_BT_GAP_DISC_RES_EVT, &param);
+	writer.record(ESP_BT_GAP_RMT_SRVCS_EVT, &param);
+	memset(&param, 0, sizeof(param));
+	param.disc_st_chg.state = ESP_BT_GAP_DISCOVERY_STOPPED;
+	writer.record(ESP_BT_GAP_DISC_STATE_CHANGED_EVT, &param);
+	CHECK_EQ(4, writer.getRecordCount());
+	CHECK_EQ(0, writer.getDroppedCount());
+	writer.close();
+
+	BTCaptureReplayer     replayer;
+	esp_bt_gap_cb_event_t event;
+	uint64_t              delta;
+	CHECK(replayer.open(path.c_str()));
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(ESP_BT_GAP_DISCOVERY_STARTED, param.disc_st_chg.state);
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(ESP_BT_GAP_DISC_RES_EVT, event);
+	CHECK(memcmp(param.disc_res.bda, address, ESP_BD_ADDR_LEN) == 0);
+	CHECK_EQ(4, param.disc_res.num_prop);
+	CHECK_EQ(7, param.disc_res.prop[0].len);
+	CHECK(memcmp(param.disc_res.prop[0].val, "Headset", 7) == 0);
+	CHECK_EQ(cod, *(uint32_t*)param.disc_res.prop[1].val);
+	CHECK_EQ(rssi, *(int8_t*)param.disc_res.prop[2].val);
+	CHECK_EQ(sizeof(eir), param.disc_res.prop[3].len);
+	CHECK(memcmp(param.disc_res.prop[3].val, eir, sizeof(eir)) == 0);
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(ESP_BT_GAP_RMT_SRVCS_EVT, event);
+	CHECK(replayer.next(&event, &param, &delta));
+	CHECK_EQ(ESP_BT_GAP_DISCOVERY_STOPPED, param.disc_st_chg.state);
+	CHECK(!replayer.next(&event, &param, &delta));
+	remove(path.c_str());
+} // testRoundTrip
+
+
+// Events that can never fit are dropped and counted instead of truncated.
+static void testOversizeDropped() {
+	std::string path = btTestPath("capture_oversize");
+	BTCaptureWriter writer;
+	CHECK(writer.open(path.c_str(), 64));
+
+	static uint8_t big[BT_CAPTURE_MAX_PAYLOAD];
+	esp_bt_gap_dev_prop_t prop = { ESP_BT_GAP_DEV_PROP_EIR, 100, big };
+	esp_bt_gap_cb_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.disc_res.num_prop = 1;
+	param.disc_res.prop     = &prop;
+	writer.record(ESP_BT_GAP_DISC_RES_EVT, &param);     // Larger than the ring.
+	CHECK_EQ(1, writer.getDroppedCount());
+	CHECK(writer.open(path.c_str()));
+	prop.len = sizeof(big);
+	writer.record(ESP_BT_GAP_DISC_RES_EVT, &param);     // Larger than a record may be.
+	CHECK_EQ(1, writer.getDroppedCount());
+	CHECK_EQ(0, writer.getRecordCount());
+	writer.close();
+	remove(path.c_str());
+} // testOversizeDropped
+
+
+static uint32_t replayedEvents = 0;
+
+static void countEvent(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param) {
+	replayedEvents++;
+} // countEvent
+
+
+// Many events through a small ring: it wraps many times, and everything not dropped comes back.
+static void testRingWraps() {
+	std::string path = btTestPath("capture_wrap");
+	BTCaptureWriter writer;
+	CHECK(writer.open(path.c_str(), 256));
+
+	int8_t rssi = -50;
+	esp_bt_gap_dev_prop_t prop = { ESP_BT_GAP_DEV_PROP_RSSI, 1, &rssi };
+	esp_bt_gap_cb_param_t param;
+	memset(&param, 0, sizeof(param));
+	param.disc_res.num_prop = 1;
+	param.disc_res.prop     = &prop;
+	const uint32_t total = 20000;
+	for (uint32_t i = 0; i < total; i++) {
+		param.disc_res.bda[0] = (uint8_t)i;
+		writer.record(ESP_BT_GAP_DISC_RES_EVT, &param);
+		if (i % 8 == 0) {
+			std::this_thread::sleep_for(std::chrono::microseconds(20));   // Let the drain thread keep up.
+		}
+	}
+	writer.close();
+	CHECK_EQ(total, writer.getRecordCount() + writer.getDroppedCount());
+	CHECK(writer.getRecordCount() > 256 / 12 * 8);
+
+	BTCaptureReplayer replayer;
+	CHECK(replayer.open(path.c_str()));
+	replayedEvents = 0;
+	CHECK_EQ(writer.getRecordCount(), replayer.replay(countEvent, false));
+	CHECK_EQ(writer.getRecordCount(), replayedEvents);
+	remove(path.c_str());
+} // testRingWraps
+
+
+int main() {
+	RUN(testFixtureV1);
+	RUN(testFixtureV2LongGap);
+	RUN(testFutureVersionRejected);
+	RUN(testTooManyProps);
+	RUN(testRoundTrip);
+	RUN(testOversizeDropped);
+	RUN(testRingWraps);
+	return BT_TEST_RESULT();
+} // main
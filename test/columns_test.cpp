@@ -0,0 +1,130 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Column queries built as plain C++, without any ESP header, and checked against row by row loops.
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "BTTest.h"
+#include "BTScanColumns.h"
+
+struct Row {
+	uint64_t address;
+	uint32_t cod;
+	int8_t   rssi;
+	uint32_t lastSeen;
+	uint8_t  flags;
+};
+
+static std::vector<Row> makeRows(BTScanColumns& columns, size_t count) {
+	std::vector<Row> rows;
+	uint32_t seed = 7;
+	columns.clear();
+	for (size_t i = 0; i < count; i++) {
+		seed = seed * 1664525u + 1013904223u;
+		Row row;
+		row.address  = 0x240ac4000000ULL + i;
+		row.cod      = (seed % 3 == 0) ? 0 : ((seed >> 4) & 0x1f00) | 0x200000;
+		row.rssi     = (int8_t)(-100 + (int)((seed >> 12) % 70));
+		row.lastSeen = (seed >> 8) % 100000;
+		row.flags    = (uint8_t)(seed >> 20) | (row.cod != 0 ? BT_COLUMN_HAVE_COD : 0);
+		if (row.cod == 0) {
+			row.flags &= ~BT_COLUMN_HAVE_COD;
+		}
+		rows.push_back(row);
+		columns.append(row.address, row.cod, row.rssi, row.lastSeen, row.flags);
+	}
+	return rows;
+} // makeRows
+
+
+static bool passes(const Row& row, const BTColumnFilter& filter) {
+	return row.rssi >= filter.minRssi && (row.cod & filter.codMask) == filter.codValue &&
+		(row.flags & filter.flagsMask) == filter.flagsValue && row.lastSeen >= filter.minLastSeen;
+} // passes
+
+
+static std::vector<BTColumnFilter> filters() {
+	std::vector<BTColumnFilter> all;
+	all.push_back(BTColumnFilter());
+	all.push_back(BTColumnFilter().rssiAtLeast(-60));
+	all.push_back(BTColumnFilter().majorClass(0x04));
+	all.push_back(BTColumnFilter().withFlags(BT_COLUMN_HAVE_NAME | BT_COLUMN_SEEN_BLE));
+	all.push_back(BTColumnFilter().seenSince(50000).rssiAtLeast(-80).majorClass(0x02));
+	return all;
+} // filters
+
+
+static void testRowsAndClear() {
+	BTScanColumns columns;
+	std::vector<Row> rows = makeRows(columns, 100);
+	CHECK_EQ(100, columns.getCount());
+	CHECK_EQ(rows[42].address, columns.getAddress(42));
+	CHECK_EQ(rows[42].cod, columns.getCod(42));
+	CHECK_EQ(rows[42].rssi, columns.getRSSI(42));
+	CHECK_EQ(rows[42].lastSeen, columns.getLastSeen(42));
+	CHECK_EQ(rows[42].flags, columns.getFlags(42));
+	columns.clear();
+	CHECK_EQ(0, columns.getCount());
+	CHECK_EQ(0, columns.count(BTColumnFilter()));
+} // testRowsAndClear
+
+
+static void testQueriesMatchRowLoops() {
+	BTScanColumns columns;
+	std::vector<Row> rows = makeRows(columns, 1000);
+	for (const BTColumnFilter& filter : filters()) {
+		std::vector<uint32_t> expected;
+		uint32_t              byClass[BT_COD_MAJOR_CLASSES] = { 0 };
+		for (size_t i = 0; i < rows.size(); i++) {
+			if (passes(rows[i], filter)) {
+				expected.push_back(i);
+				byClass[(rows[i].cod >> 8) & 0x1f]++;
+			}
+		}
+		CHECK_EQ(expected.size(), columns.count(filter));
+
+		std::vector<uint32_t> selection;
+		CHECK_EQ(expected.size(), columns.select(filter, selection));
+		CHECK(selection == expected);
+
+		uint32_t counts[BT_COD_MAJOR_CLASSES];
+		columns.countByMajorClass(filter, counts);
+		CHECK(std::equal(counts, counts + BT_COD_MAJOR_CLASSES, byClass));
+
+		// Top 10: strongest first, and nothing left out is stronger than the weakest kept.
+		size_t k = columns.topRssi(filter, 10, selection);
+		CHECK_EQ(std::min<size_t>(10, expected.size()), k);
+		for (size_t i = 1; i < k; i++) {
+			CHECK(rows[selection[i - 1]].rssi >= rows[selection[i]].rssi);
+		}
+		if (k > 0) {
+			int8_t weakest = rows[selection[k - 1]].rssi;
+			size_t stronger = 0;
+			for (uint32_t i : expected) {
+				stronger += rows[i].rssi > weakest;
+			}
+			CHECK(stronger <= k);
+		}
+	}
+} // testQueriesMatchRowLoops
+
+
+int main() {
+	RUN(testRowsAndClear);
+	RUN(testQueriesMatchRowLoops);
+	return BT_TEST_RESULT();
+} // main
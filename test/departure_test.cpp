@@ -0,0 +1,290 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The departure wheel on a simulated clock, against a reference that keeps every deadline in a map
+// and scans it on each advance: every device departs at the tick of its deadline, not earlier and not
+// later, whatever the mix of timeouts, cascades and jumps of the clock.
+
+#include <stdint.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "BTTest.h"
+#include "BTDepartureWheel.h"
+
+static const uint32_t horizonTicks = 1 << (BT_DEPARTURE_LEVEL0_BITS + 2 * BT_DEPARTURE_LEVEL_BITS);
+
+class Collector : public BTDepartureCallbacks {
+public:
+	BTDepartureWheel*        pWheel = nullptr;
+	std::vector<BTDeparture> departures;
+	size_t                   largestBatch = 0;
+
+	void onDepartures(const BTDeparture* batch, size_t count) {
+		largestBatch = std::max(largestBatch, count);
+		departures.insert(departures.end(), batch, batch + count);
+		if (pWheel != nullptr) {
+			pWheel->getCount();   // The wheel is not locked here.
+		}
+	}
+};
+
+
+/**
+ * @brief Every deadline in a map, in ticks, checked one by one.
+ */
+class Reference {
+public:
+	struct Device {
+		uint32_t seen;
+		uint32_t timeout;
+		uint8_t  majorClass;
+		bool     custom;
+	};
+
+	Reference(uint32_t tickMs, uint32_t defaultTimeoutMs) : m_tickMs(tickMs) {
+		for (size_t i = 0; i < BT_DEPARTURE_CLASSES; i++) {
+			m_timeouts[i] = std::max(defaultTimeoutMs / tickMs, (uint32_t)1);
+		}
+	}
+
+	void setClassTimeout(uint8_t majorClass, uint32_t timeoutMs) {
+		m_timeouts[majorClass % BT_DEPARTURE_CLASSES] = std::max(timeoutMs / m_tickMs, (uint32_t)1);
+	}
+
+	bool setDeviceTimeout(uint64_t address, uint32_t timeoutMs) {
+		std::map<uint64_t, Device>::iterator it = m_devices.find(address);
+		if (it == m_devices.end()) {
+			return false;
+		}
+		it->second.timeout = std::max(timeoutMs / m_tickMs, (uint32_t)1);
+		it->second.custom  = true;
+		return true;
+	}
+
+	bool touch(uint64_t address, uint64_t nowMs, uint8_t majorClass) {
+		majorClass %= BT_DEPARTURE_CLASSES;
+		std::map<uint64_t, Device>::iterator it = m_devices.find(address);
+		bool added = it == m_devices.end();
+		Device& device = m_devices[address];
+		if (added) {
+			device.custom = false;
+		}
+		if (!device.custom) {
+			device.majorClass = majorClass;
+			device.timeout    = m_timeouts[majorClass];
+		}
+		device.seen = (uint32_t)(nowMs / m_tickMs);
+		return added;
+	}
+
+	void forget(uint64_t address) {
+		m_devices.erase(address);
+	}
+
+	/**
+	 * @brief The devices whose deadline is at or before the tick of nowMs, removed.
+	 */
+	void advance(uint64_t nowMs, std::vector<BTDeparture>& departures) {
+		uint32_t now = (uint32_t)(nowMs / m_tickMs);
+		for (std::map<uint64_t, Device>::iterator it = m_devices.begin(); it != m_devices.end();) {
+			if ((uint64_t)it->second.seen + it->second.timeout <= now) {
+				BTDeparture departure = { it->first, (uint64_t)it->second.seen * m_tickMs, it->second.majorClass };
+				departures.push_back(departure);
+				it = m_devices.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	size_t getCount() {
+		return m_devices.size();
+	}
+
+	std::vector<uint64_t> addresses() {
+		std::vector<uint64_t> result;
+		for (std::map<uint64_t, Device>::iterator it = m_devices.begin(); it != m_devices.end(); ++it) {
+			result.push_back(it->first);
+		}
+		return result;
+	}
+
+private:
+	uint32_t                   m_tickMs;
+	uint32_t                   m_timeouts[BT_DEPARTURE_CLASSES];
+	std::map<uint64_t, Device> m_devices;
+};
+
+
+static bool byAddress(const BTDeparture& a, const BTDeparture& b) {
+	return a.address < b.address;
+} // byAddress
+
+
+static bool sameDepartures(std::vector<BTDeparture> actual, std::vector<BTDeparture> expected) {
+	if (actual.size() != expected.size()) {
+		return false;
+	}
+	std::sort(actual.begin(), actual.end(), byAddress);
+	std::sort(expected.begin(), expected.end(), byAddress);
+	for (size_t i = 0; i < actual.size(); i++) {
+		if (actual[i].address != expected[i].address || actual[i].lastSeenMs != expected[i].lastSeenMs ||
+			actual[i].majorClass != expected[i].majorClass) {
+			return false;
+		}
+	}
+	return true;
+} // sameDepartures
+
+
+/**
+ * @brief Random sightings, timeouts and clock steps, from single ticks to jumps past the horizon.
+ * @param [in] tickMs The tick of the wheel.
+ * @param [in] seed The seed of the run.
+ * @param [in] steps The number of clock steps.
+ */
+static void runAgainstReference(uint32_t tickMs, uint32_t seed, int steps) {
+	std::mt19937     random(seed);
+	BTDepartureWheel wheel(tickMs, 30000);
+	Reference        reference(tickMs, 30000);
+	Collector        collector;
+	collector.pWheel = &wheel;
+	wheel.setCallbacks(&collector);
+
+	// Timeouts in ticks: within level 0, in level 1, in level 2 and past the horizon.
+	const uint32_t timeouts[] = { 1, 3, 200, 255, 256, 257, 5000, 16384, 16385, 300000, horizonTicks - 1,
+		horizonTicks, horizonTicks + 77, 3 * horizonTicks };
+
+	uint64_t now        = 1000ULL * tickMs;
+	size_t   mismatches = 0;
+	size_t   departed   = 0;
+	wheel.advance(now);
+	for (int step = 0; step < steps; step++) {
+		int sightings = random() % 8;
+		for (int i = 0; i < sightings; i++) {
+			uint64_t address    = 0x30aea4000000ULL + random() % 300;
+			uint8_t  majorClass = random() % 6;
+			CHECK_EQ(reference.touch(address, now, majorClass), wheel.touch(address, now, majorClass));
+		}
+		switch (random() % 16) {
+			case 0: {
+				uint32_t timeout = timeouts[random() % (sizeof(timeouts) / sizeof(timeouts[0]))];
+				uint8_t  majorClass = random() % 6;
+				reference.setClassTimeout(majorClass, timeout * tickMs);
+				wheel.setClassTimeout(majorClass, timeout * tickMs);
+				break;
+			}
+			case 1: {   // Longer or shorter than the current one, possibly already past.
+				std::vector<uint64_t> tracked = reference.addresses();
+				uint64_t address = tracked.empty() ? 1 : tracked[random() % tracked.size()];
+				uint32_t timeout = timeouts[random() % (sizeof(timeouts) / sizeof(timeouts[0]))];
+				CHECK_EQ(reference.setDeviceTimeout(address, timeout * tickMs), wheel.setDeviceTimeout(address, timeout * tickMs));
+				break;
+			}
+			case 2: {
+				std::vector<uint64_t> tracked = reference.addresses();
+				if (!tracked.empty()) {
+					uint64_t address = tracked[random() % tracked.size()];
+					reference.forget(address);
+					CHECK(wheel.forget(address));
+				}
+				break;
+			}
+			default: {
+				break;
+			}
+		}
+
+		uint32_t r = random() % 100;   // Mostly single ticks and short steps, sometimes long jumps.
+		uint64_t ticks = r < 50 ? 1 : r < 90 ? 1 + random() % 300 : r < 99 ? 1 + random() % 20000 : 1 + random() % (2 * horizonTicks);
+		now += ticks * tickMs + random() % tickMs;   // Not always on a tick boundary.
+
+		std::vector<BTDeparture> expected;
+		reference.advance(now, expected);
+		collector.departures.clear();
+		size_t reported = wheel.advance(now);
+		mismatches += reported != expected.size() || !sameDepartures(collector.departures, expected);
+		mismatches += wheel.getCount() != reference.getCount();
+		departed   += reported;
+	}
+	CHECK_EQ(0, mismatches);
+	CHECK(departed > 100);
+	CHECK(collector.largestBatch <= BT_DEPARTURE_BATCH);
+} // runAgainstReference
+
+
+static void testMatchesReference() {
+	runAgainstReference(1, 1, 20000);
+} // testMatchesReference
+
+
+static void testMatchesReferenceCoarseTicks() {
+	runAgainstReference(250, 2, 20000);
+} // testMatchesReferenceCoarseTicks
+
+
+/**
+ * @brief A crowd leaving at once is reported in bounded batches, all on the tick of the deadline.
+ */
+static void testCrowdDepartsOnTime() {
+	BTDepartureWheel wheel(1000, 60000);
+	Collector collector;
+	wheel.setCallbacks(&collector);
+	for (uint64_t i = 0; i < 1000; i++) {
+		CHECK(wheel.touch(0x30aea4000000ULL + i, 5000 + i % 1000, 2));   // All within tick 5.
+	}
+	CHECK_EQ(0, wheel.advance(64999));
+	CHECK(collector.departures.empty());
+	CHECK_EQ(1000, wheel.advance(65000));
+	CHECK_EQ(1000, collector.departures.size());
+	CHECK_EQ(BT_DEPARTURE_BATCH, collector.largestBatch);
+	for (size_t i = 0; i < collector.departures.size(); i++) {
+		CHECK_EQ(5000, collector.departures[i].lastSeenMs);
+		CHECK_EQ(2, collector.departures[i].majorClass);
+	}
+	CHECK_EQ(0, wheel.getCount());
+} // testCrowdDepartsOnTime
+
+
+/**
+ * @brief A device seen every tick never departs, however many cascades go by.
+ */
+static void testRegularSightingsKeepDevice() {
+	BTDepartureWheel wheel(1, 300);
+	Collector collector;
+	wheel.setCallbacks(&collector);
+	uint64_t address = 0x30aea4000001ULL;
+	uint64_t seen    = 0;
+	for (uint64_t now = 0; now < 3 * horizonTicks / 64; now += 299) {   // Just inside the timeout each time.
+		wheel.touch(address, now);
+		wheel.advance(now);
+		seen = now;
+	}
+	CHECK(collector.departures.empty());
+	CHECK_EQ(0, wheel.advance(seen + 299));
+	CHECK_EQ(1, wheel.advance(seen + 300));
+	CHECK_EQ(1, collector.departures.size());
+} // testRegularSightingsKeepDevice
+
+
+int main() {
+	RUN(testMatchesReference);
+	RUN(testMatchesReferenceCoarseTicks);
+	RUN(testCrowdDepartsOnTime);
+	RUN(testRegularSightingsKeepDevice);
+	return BT_TEST_RESULT();
+} // main
@@ -0,0 +1,206 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Dual mode scanning against the scripted classic and BLE GAP of FakeStack: slices alternate within
+// the time budget, both transports feed one result table, and failures and stop() end the scan.
+
+#include <stdint.h>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+
+static int scansCompleted = 0;
+
+static void onScanComplete(const BTScanResults& results) {
+	scansCompleted++;
+} // onScanComplete
+
+
+class CountingCallbacks : public BTAdvertisedDeviceCallbacks {
+public:
+	int results = 0;
+	void onResult(BTAdvertisedDevice advertisedDevice) {
+		results++;
+	}
+};
+
+
+static uint8_t deviceAddress[ESP_BD_ADDR_LEN];
+
+static BTScan* startDualScan(uint32_t duration) {
+	BTDevice::init("dual_mode_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setDualMode(true, 2, 1);   // 2.56 s of classic inquiry, then 1 s of BLE.
+	CHECK(pScan->start(duration, onScanComplete));
+	return pScan;
+} // startDualScan
+
+
+/**
+ * @brief End the running classic slice the way the controller does: its inquiry reported started,
+ * then stopped.
+ */
+static void finishClassicSlice() {
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+} // finishClassicSlice
+
+
+/**
+ * @brief End the running BLE slice the way the controller does, parameters first if they were just set.
+ */
+static void finishBleSlice(int paramsBefore) {
+	if (FakeStack::calls().bleSetScanParams > paramsBefore) {
+		esp_ble_gap_cb_param_t param = {};
+		param.scan_param_cmpl.status = ESP_BT_STATUS_SUCCESS;
+		FakeStack::emitBle(ESP_GAP_BLE_SCAN_PARAM_SET_COMPLETE_EVT, &param);
+	}
+	FakeStack::advanceMs(1000);
+	FakeStack::emitBleComplete();
+} // finishBleSlice
+
+
+/**
+ * @brief Classic, BLE, classic, BLE, then the 8 s budget has no room for another slice.
+ */
+static void testSlicesAlternateWithinBudget() {
+	FakeStack::reset();
+	int before = scansCompleted;
+	CountingCallbacks callbacks;
+	BTScan* pScan = startDualScan(8);
+	pScan->setAdvertisedDeviceCallbacks(&callbacks);
+
+	CHECK_EQ(1, FakeStack::calls().startDiscovery);
+	CHECK_EQ(2, FakeStack::calls().inquiryLength);
+	FakeStack::makeAddress(1, deviceAddress);
+	FakeStack::emitDiscRes(deviceAddress, -50);
+	FakeStack::advanceMs(2560);
+	finishClassicSlice();
+
+	CHECK_EQ(1, FakeStack::calls().bleSetScanParams);   // Parameters go first, scanning follows.
+	CHECK_EQ(0, FakeStack::calls().bleStartScanning);
+	finishBleSlice(0);
+	CHECK_EQ(1, FakeStack::calls().bleStartScanning);
+	CHECK_EQ(2, FakeStack::calls().startDiscovery);
+
+	FakeStack::advanceMs(2560);
+	finishClassicSlice();
+	CHECK_EQ(1, FakeStack::calls().bleSetScanParams);   // Set once, reused by later slices.
+	CHECK_EQ(2, FakeStack::calls().bleStartScanning);
+	CHECK_EQ(before, scansCompleted);
+
+	finishBleSlice(1);
+	CHECK_EQ(2, FakeStack::calls().startDiscovery);
+	CHECK_EQ(before + 1, scansCompleted);
+	CHECK_EQ(1, callbacks.results);
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+} // testSlicesAlternateWithinBudget
+
+
+/**
+ * @brief A device heard on both transports is one result, flagged with both.
+ */
+static void testOneResultForBothTransports() {
+	FakeStack::reset();
+	BTScan* pScan = startDualScan(4);
+	uint8_t other[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(2, deviceAddress);
+	FakeStack::makeAddress(3, other);
+	FakeStack::emitDiscRes(deviceAddress, -70);
+	FakeStack::advanceMs(2560);
+	finishClassicSlice();
+	CHECK_EQ(1, FakeStack::calls().bleStartScanning);
+
+	FakeStack::emitBleResult(deviceAddress, -40);
+	FakeStack::emitBleResult(deviceAddress, -41);
+	FakeStack::emitBleResult(other, -90);
+	FakeStack::advanceMs(1000);
+	FakeStack::emitBleComplete();
+
+	const BTScanResults& results = pScan->getResultsRef();
+	CHECK_EQ(2, results.getCount());
+	for (int i = 0; i < results.getCount(); i++) {
+		BTAdvertisedDevice device = results.getDevice(i);
+		if (device.getAddress().toUint64() == BTAddress(deviceAddress).toUint64()) {
+			CHECK_EQ(BT_TRANSPORT_CLASSIC | BT_TRANSPORT_BLE, device.getTransports());
+			CHECK_EQ(-41, results.getRSSI(i));
+		} else {
+			CHECK_EQ(BT_TRANSPORT_BLE, device.getTransports());
+		}
+	}
+} // testOneResultForBothTransports
+
+
+/**
+ * @brief When BLE scanning cannot start, the next slice falls back to classic inquiry.
+ */
+static void testBleFailureFallsBackToClassic() {
+	FakeStack::reset();
+	int before = scansCompleted;
+	startDualScan(8);
+	FakeStack::faults().bleStartScanning = ESP_FAIL;
+	FakeStack::advanceMs(2560);
+	finishClassicSlice();
+	CHECK_EQ(1, FakeStack::calls().bleStartScanning);
+	CHECK_EQ(2, FakeStack::calls().startDiscovery);
+	FakeStack::faults().bleStartScanning = ESP_OK;
+
+	FakeStack::advanceMs(2560);
+	finishClassicSlice();
+	CHECK_EQ(2, FakeStack::calls().bleStartScanning);
+	finishBleSlice(0);
+
+	// 1.88 s left: too short for the preferred slice, so a single unit of inquiry.
+	CHECK_EQ(3, FakeStack::calls().startDiscovery);
+	CHECK_EQ(1, FakeStack::calls().inquiryLength);
+	FakeStack::advanceMs(1280);
+	finishClassicSlice();
+	CHECK_EQ(before + 1, scansCompleted);
+
+	BTScanStats stats = BTDevice::getScan()->getStats();
+	CHECK(stats.inquiryErrors >= 1);
+} // testBleFailureFallsBackToClassic
+
+
+/**
+ * @brief stop() during a BLE slice stops BLE scanning, and its stop complete ends the scan once.
+ */
+static void testStopDuringBleSlice() {
+	FakeStack::reset();
+	int before = scansCompleted;
+	BTScan* pScan = startDualScan(8);
+	FakeStack::advanceMs(2560);
+	finishClassicSlice();
+	CHECK_EQ(1, FakeStack::calls().bleStartScanning);
+
+	pScan->stop();
+	CHECK_EQ(1, FakeStack::calls().bleStopScanning);
+	esp_ble_gap_cb_param_t param = {};
+	FakeStack::emitBle(ESP_GAP_BLE_SCAN_STOP_COMPLETE_EVT, &param);
+	CHECK_EQ(before + 1, scansCompleted);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);   // The cancel of the idle inquiry.
+	CHECK_EQ(before + 1, scansCompleted);
+	CHECK_EQ(1, FakeStack::calls().startDiscovery);
+} // testStopDuringBleSlice
+
+
+int main() {
+	RUN(testSlicesAlternateWithinBudget);
+	RUN(testOneResultForBothTransports);
+	RUN(testBleFailureFallsBackToClassic);
+	RUN(testStopDuringBleSlice);
+	return BT_TEST_RESULT();
+} // main
@@ -0,0 +1,105 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// EIR parsing cost on the host, run by hand: a dense 240 byte EIR indexed once and looked up, against
+// the repeated linear walks of esp_bt_gap_resolve_eir_data() it replaced, and a full discovery result
+// through a scan.  Only the ratios mean anything for the ESP32.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTEirIndex.h"
+#include "BTScan.h"
+
+static const int iterations = 1000000;
+
+static double nanosSince(std::chrono::steady_clock::time_point start, int count) {
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+} // nanosSince
+
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+class CountingCallbacks : public BTAdvertisedDeviceCallbacks {
+public:
+	void onResult(BTAdvertisedDevice advertisedDevice) {}
+};
+
+
+int main() {
+	uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
+	memset(eir, 0, sizeof(eir));
+	const char* name = "Living room speaker";
+	size_t pos = 0;
+	eir[pos++] = 1 + strlen(name);
+	eir[pos++] = ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME;
+	memcpy(eir + pos, name, strlen(name));
+	pos += strlen(name);
+	while (pos + 6 < sizeof(eir)) {
+		eir[pos++] = 5;
+		eir[pos++] = ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID;
+		pos += 4;
+	}
+	const uint8_t lookups[] = { ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME, ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME,
+		ESP_BT_EIR_TYPE_TX_POWER_LEVEL, ESP_BT_EIR_TYPE_MANU_SPECIFIC };
+
+	volatile uint32_t sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		BTEirIndex index;
+		index.build(eir, sizeof(eir));
+		for (uint8_t type : lookups) {
+			uint8_t length;
+			sink += index.find(eir, type, &length) != nullptr;
+		}
+	}
+	double indexed = nanosSince(start, iterations);
+
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		for (uint8_t type : lookups) {
+			uint8_t length;
+			sink += esp_bt_gap_resolve_eir_data(eir, (esp_bt_eir_type_t)type, &length) != nullptr;
+		}
+	}
+	double walked = nanosSince(start, iterations);
+
+	BTDevice::init("eir_bench");
+	BTScan* pScan = BTDevice::getScan();
+	CountingCallbacks callbacks;
+	pScan->setMaxResults(64);
+	pScan->setAdvertisedDeviceCallbacks(&callbacks, true);
+	pScan->start(10, onScanComplete);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	uint8_t address[ESP_BD_ADDR_LEN];
+	const int results = iterations / 10;
+	start = std::chrono::steady_clock::now();
+	for (int i = 0; i < results; i++) {
+		FakeStack::makeAddress(i, address);   // Always new: parse, store and evict.
+		FakeStack::emitDiscRes(address, -60, 0x240404, eir, sizeof(eir));
+	}
+	double discovered = nanosSince(start, results);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+
+	printf("index build + %d lookups: %8.1f ns per EIR\n", (int)sizeof(lookups), indexed);
+	printf("%d linear walks:          %8.1f ns per EIR\n", (int)sizeof(lookups), walked);
+	printf("new device through scan:  %8.1f ns per result\n", discovered);
+	return sink == 0xffffffff;
+} // main
@@ -0,0 +1,303 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// EIR parsing: fields anywhere in the 240 bytes, truncated fields, and fuzzing of both the field index
+// against a straightforward reference walk and the whole discovery result path of a scan.  Configure
+// with -DBT_SANITIZE=ON to run the fuzzing under AddressSanitizer.
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTEirIndex.h"
+#include "BTScan.h"
+#include "BTUtils.h"
+
+static uint32_t fuzzSeed = 1;
+
+static uint32_t nextRandom() {
+	fuzzSeed = fuzzSeed * 1664525u + 1013904223u;
+	return fuzzSeed >> 8;
+} // nextRandom
+
+
+/**
+ * @brief A random EIR, biased towards short lengths so that fields are actually found.
+ */
+static size_t randomEir(uint8_t* eir) {
+	size_t length = nextRandom() % (ESP_BT_GAP_EIR_DATA_LEN + 1);
+	for (size_t i = 0; i < length; i++) {
+		eir[i] = (nextRandom() % 4 == 0) ? (uint8_t)(nextRandom() % 12) : (uint8_t)nextRandom();
+	}
+	return length;
+} // randomEir
+
+
+struct Bounds {
+	const uint8_t* begin;
+	const uint8_t* end;
+	int            fields;
+	bool           inside;
+};
+
+static void checkField(uint8_t type, const uint8_t* data, uint8_t length, void* pContext) {
+	Bounds* pBounds = (Bounds*)pContext;
+	pBounds->fields++;
+	pBounds->inside = pBounds->inside && data >= pBounds->begin && data + length <= pBounds->end;
+} // checkField
+
+
+static void testFieldsPastByte31() {
+	uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
+	memset(eir, 0, sizeof(eir));
+	size_t pos = 0;
+	while (pos < 200) {   // Filler of 16 bit UUID lists.
+		eir[pos++] = 5;
+		eir[pos++] = ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID;
+		pos += 4;
+	}
+	eir[pos++] = 6;
+	eir[pos++] = ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME;
+	memcpy(eir + pos, "Radio", 5);
+
+	BTEirIndex index;
+	CHECK(index.build(eir, sizeof(eir)));
+	uint8_t length = 0;
+	const uint8_t* name = index.find(eir, ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME, &length);
+	CHECK(name != nullptr);
+	CHECK_EQ(5, length);
+	CHECK(name != nullptr && memcmp(name, "Radio", 5) == 0);
+	CHECK_EQ(35, index.getFieldCount());
+} // testFieldsPastByte31
+
+
+static void testTruncatedField() {
+	uint8_t eir[] = { 3, 0x09, 'A', 'B', 9, 0x08, 'x' };
+	BTEirIndex index;
+	CHECK(!index.build(eir, sizeof(eir)));
+	CHECK(index.has(0x09));
+	CHECK(!index.has(0x08));
+	CHECK_EQ(1, index.getFieldCount());
+
+	uint8_t manufacturer[] = { 3, 0xff, 0x34, 0x12, 0, 7, 0x09 };   // Nothing after the terminator.
+	CHECK(index.build(manufacturer, sizeof(manufacturer)));
+	CHECK(index.has(0xff));
+	CHECK(!index.has(0x09));
+} // testTruncatedField
+
+
+/**
+ * @brief Random buffers against a reference walk: same fields, same first offsets, all in bounds.
+ */
+static void testFuzzIndex() {
+	uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
+	for (int iteration = 0; iteration < 200000; iteration++) {
+		size_t length = randomEir(eir);
+		Bounds bounds = { eir, eir + length, 0, true };
+		BTEirIndex index;
+		bool valid = index.build(eir, length, checkField, &bounds);
+		CHECK(bounds.inside);
+
+		// Reference: the first field of each type and whether the walk ended cleanly.
+		int    firstOffset[256];
+		int    fields        = 0;
+		bool   expectedValid = true;
+		size_t pos           = 0;
+		memset(firstOffset, 0, sizeof(firstOffset));
+		while (pos < length && eir[pos] != 0) {
+			if (pos + 1 + eir[pos] > length) {
+				expectedValid = false;
+				break;
+			}
+			if (firstOffset[eir[pos + 1]] == 0) {
+				firstOffset[eir[pos + 1]] = (int)pos + 2;
+			}
+			fields++;
+			pos += 1 + eir[pos];
+		}
+		CHECK_EQ(expectedValid, valid);
+		CHECK_EQ(fields, bounds.fields);
+		CHECK_EQ(fields, index.getFieldCount());
+
+		for (int type = 0; type < 256; type++) {
+			uint8_t        fieldLength = 0;
+			const uint8_t* data        = index.find(eir, (uint8_t)type, &fieldLength);
+			bool indexed = type == 0xff || (type != 0 && type < BT_EIR_INDEX_SLOTS);
+			if (!indexed) {
+				CHECK(data == nullptr);
+				continue;
+			}
+			CHECK_EQ(firstOffset[type], data == nullptr ? 0 : data - eir);
+			if (data != nullptr) {
+				CHECK(data + fieldLength <= eir + length);
+			}
+		}
+		if (btTestFailures > 0) {
+			fprintf(stderr, "testFuzzIndex: failed at iteration %d\n", iteration);
+			return;
+		}
+	}
+} // testFuzzIndex
+
+
+class FuzzCallbacks : public BTAdvertisedDeviceCallbacks {
+public:
+	int results = 0;
+
+	void onResult(BTAdvertisedDevice advertisedDevice) {
+		results++;
+		// Touch everything parsed from the EIR.
+		std::string name = advertisedDevice.getName();
+		CHECK(name.size() <= ESP_BT_GAP_EIR_DATA_LEN);
+		advertisedDevice.getManufacturerData();
+		advertisedDevice.getServiceData();
+		advertisedDevice.getServiceUUID();
+		advertisedDevice.getTXPower();
+		advertisedDevice.toString();
+	}
+};
+
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+/**
+ * @brief Random EIRs and CoDs through the discovery result path, repeats included, into bounded results.
+ */
+/**
+ * @brief The EIR hash is BTUtils::hash32() of the CoD bytes followed by the EIR, as one range.
+ */
+static void testHashChainsHash32() {
+	uint8_t joined[3 + 20] = { 0x0c, 0x02, 0x5a };   // CoD 0x5a020c, low byte first.
+	for (int i = 0; i < 20; i++) {
+		joined[3 + i] = (uint8_t)(i * 37);
+	}
+	CHECK_EQ(BTUtils::hash32(joined, sizeof(joined)), BTEirIndex::hash(joined + 3, 20, 0x5a020c));
+	CHECK_EQ(BTUtils::hash32(joined, 3), BTEirIndex::hash(nullptr, 0, 0x5a020c));
+	CHECK(BTEirIndex::hash(joined + 3, 20, 0x5a020c) != BTEirIndex::hash(joined + 3, 20, 0x5a020d));
+} // testHashChainsHash32
+
+
+/**
+ * @brief A known device whose EIR changed is parsed again and its stored record replaced, so that
+ * the next repeat of the new EIR reuses the new record.
+ */
+static void testChangedEirReplacesRecord() {
+	FuzzCallbacks callbacks;
+	BTDevice::init("eir_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(&callbacks, true);
+	pScan->getStats(true);
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(7, address);
+	uint8_t before[] = { 4, 0x09, 'o', 'l', 'd' };
+	uint8_t after[]  = { 4, 0x09, 'n', 'e', 'w' };
+	FakeStack::emitDiscRes(address, -50, 0x5a020c, before, sizeof(before));
+	FakeStack::emitDiscRes(address, -50, 0x5a020c, after, sizeof(after));
+	CHECK_EQ(1, pScan->getResultsRef().getCount());
+	CHECK(pScan->getResultsRef().getDevice(0).getName() == "new");
+	FakeStack::emitDiscRes(address, -50, 0x5a020c, after, sizeof(after));
+	FakeStack::emitDiscRes(address, -50, 0x5a0204, after, sizeof(after));   // The CoD counts too.
+	CHECK_EQ(0x5a0204, pScan->getResultsRef().getDevice(0).getCod());
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+
+	BTScanStats stats = pScan->getStats(true);
+	CHECK_EQ(1, stats.eirCacheHits);
+	CHECK_EQ(2, stats.eirCacheMisses);
+	CHECK_EQ(4, callbacks.results);
+	pScan->setAdvertisedDeviceCallbacks(nullptr, false);
+} // testChangedEirReplacesRecord
+
+
+/**
+ * @brief A repeat of the same EIR reuses the stored record and brings its RSSI and timestamp up to
+ * the latest sighting.
+ */
+static void testCacheHitRefreshesRecord() {
+	FuzzCallbacks callbacks;
+	BTDevice::init("eir_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(&callbacks, true);
+	pScan->getStats(true);
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(8, address);
+	uint8_t eir[] = { 5, 0x09, 'k', 'e', 'p', 't' };
+	FakeStack::emitDiscRes(address, -50, 0x5a020c, eir, sizeof(eir));
+	uint32_t first = pScan->getResultsRef().getDevice(0).getTimestamp();
+	FakeStack::advanceMs(250);
+	FakeStack::emitDiscRes(address, -72, 0x5a020c, eir, sizeof(eir));
+	CHECK_EQ(1, pScan->getStats().eirCacheHits);
+
+	BTAdvertisedDevice stored = pScan->getResultsRef().getDevice(0);
+	CHECK_EQ(-72, stored.getRSSI());
+	CHECK_EQ(first + 250, stored.getTimestamp());
+	CHECK(stored.getName() == "kept");
+	CHECK_EQ(first + 250, pScan->getResultsRef().getLastSeen(0));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	pScan->setAdvertisedDeviceCallbacks(nullptr, false);
+} // testCacheHitRefreshesRecord
+
+
+static void testFuzzThroughScan() {
+	FuzzCallbacks callbacks;
+	BTDevice::init("eir_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setMaxResults(32);
+	pScan->setAdvertisedDeviceCallbacks(&callbacks, true);   // Repeats go through the EIR cache.
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+
+	const int sightings = 20000;
+	uint8_t   eir[ESP_BT_GAP_EIR_DATA_LEN];
+	uint8_t   address[ESP_BD_ADDR_LEN];
+	for (int i = 0; i < sightings; i++) {
+		FakeStack::makeAddress(nextRandom() % 64, address);
+		uint32_t cod    = (nextRandom() % 2) ? (nextRandom() & 0xfffffc) : 0;
+		size_t   length = randomEir(eir);
+		if (nextRandom() % 8 == 0) {
+			FakeStack::emitDiscRes(address, -50, cod);   // No EIR at all.
+		} else {
+			FakeStack::emitDiscRes(address, -50, cod, eir, length);
+		}
+	}
+	CHECK_EQ(sightings, callbacks.results);
+	CHECK(pScan->getResultsRef().getCount() <= 32);
+
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	pScan->setAdvertisedDeviceCallbacks(nullptr, false);
+	pScan->setMaxResults(0);
+} // testFuzzThroughScan
+
+
+int main() {
+	FakeStack::reset();
+	RUN(testFieldsPastByte31);
+	RUN(testTruncatedField);
+	RUN(testFuzzIndex);
+	RUN(testHashChainsHash32);
+	RUN(testChangedEirReplacesRecord);
+	RUN(testCacheHitRefreshesRecord);
+	RUN(testFuzzThroughScan);
+	return BT_TEST_RESULT();
+} // main
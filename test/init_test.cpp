@@ -0,0 +1,172 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Bringing the stack up: a failed step leaves the device uninitialized and retryable, standby parks the
+// stack without tearing it down while deinit() does, and with the BLE memory released the controller
+// is started in classic mode.  The tests share one stack and run in order, since the BLE memory cannot
+// be taken back.
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+
+static int completions = 0;
+
+static void onScanComplete(const BTScanResults& results) {
+	completions++;
+} // onScanComplete
+
+
+static void testFailedControllerFailsInit() {
+	FakeStack::reset();
+	FakeStack::faults().btStartFails = true;
+	BTDevice::init("init_test");
+	CHECK(!BTDevice::getInitialized());
+	CHECK_EQ(1, FakeStack::calls().btStart);
+	CHECK_EQ(0, FakeStack::calls().bluedroidInit);
+	CHECK(!FakeStack::haveGapCallback());
+
+	FakeStack::faults().btStartFails = false;
+	BTDevice::init("init_test");
+	CHECK(BTDevice::getInitialized());
+	CHECK_EQ(2, FakeStack::calls().btStart);
+	CHECK_EQ(1, FakeStack::calls().bluedroidInit);
+	CHECK(FakeStack::haveGapCallback());
+
+	BTDevice::init("init_test");   // Already up: nothing more.
+	CHECK_EQ(2, FakeStack::calls().btStart);
+	CHECK_EQ(1, FakeStack::calls().bluedroidInit);
+	BTDevice::deinit();
+	CHECK(!BTDevice::getInitialized());
+} // testFailedControllerFailsInit
+
+
+static void testFailedBluedroidIsRetried() {
+	FakeStack::reset();
+	FakeStack::faults().bluedroidInit = ESP_FAIL;
+	BTDevice::init("init_test");
+	CHECK(!BTDevice::getInitialized());
+	CHECK_EQ(0, FakeStack::calls().bluedroidEnable);
+
+	FakeStack::faults().bluedroidInit = ESP_OK;
+	BTDevice::init("init_test");
+	CHECK(BTDevice::getInitialized());
+	CHECK_EQ(1, FakeStack::calls().btStart);   // The controller was already up.
+	CHECK_EQ(2, FakeStack::calls().bluedroidInit);
+	CHECK_EQ(1, FakeStack::calls().bluedroidEnable);
+	BTDevice::deinit();
+} // testFailedBluedroidIsRetried
+
+
+/**
+ * @brief standby() stops the scan and the scan mode but keeps Bluedroid up: the next start() leaves
+ * standby without initializing anything, and the time to its first inquiry is reported.
+ */
+static void testStandbyKeepsStack() {
+	FakeStack::reset();
+	BTDevice::init("init_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->getStats(true);
+	CHECK_EQ(1, FakeStack::calls().bluedroidInit);
+
+	CHECK(pScan->start(5, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	int before   = completions;
+	int setModes = FakeStack::calls().setScanMode;
+	BTDevice::standby();
+	CHECK(BTDevice::isStandby());
+	CHECK(BTDevice::getInitialized());
+	CHECK_EQ(1, FakeStack::calls().cancelDiscovery);
+	CHECK_EQ(setModes + 1, FakeStack::calls().setScanMode);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	CHECK_EQ(before + 1, completions);
+
+	BTDevice::standby();   // Already parked: nothing more.
+	CHECK_EQ(setModes + 1, FakeStack::calls().setScanMode);
+
+	FakeStack::advanceMs(1000);
+	CHECK(pScan->start(5, onScanComplete));
+	CHECK(!BTDevice::isStandby());
+	FakeStack::advanceMs(30);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	CHECK_EQ(1, FakeStack::calls().btStart);
+	CHECK_EQ(1, FakeStack::calls().bluedroidInit);
+	CHECK_EQ(1, FakeStack::calls().bluedroidEnable);
+	CHECK_EQ(30, pScan->getStats().restartLatencyMs);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	CHECK_EQ(before + 2, completions);
+
+	setModes = FakeStack::calls().setScanMode;
+	BTDevice::standby();
+	BTDevice::resume();
+	CHECK(!BTDevice::isStandby());
+	BTDevice::resume();   // Not parked: nothing more.
+	BTDevice::init("init_test");
+	CHECK_EQ(1, FakeStack::calls().bluedroidInit);
+	CHECK_EQ(setModes + 2, FakeStack::calls().setScanMode);
+	BTDevice::deinit();
+} // testStandbyKeepsStack
+
+
+/**
+ * @brief deinit() tears the stack down, from standby too, and the next init() starts from scratch.
+ */
+static void testDeinitTearsDown() {
+	FakeStack::reset();
+	BTDevice::init("init_test");
+	BTDevice::standby();
+	BTDevice::deinit();
+	CHECK(!BTDevice::getInitialized());
+	CHECK(!BTDevice::isStandby());
+	CHECK(!FakeStack::haveGapCallback());
+
+	BTDevice::init("init_test");
+	CHECK(BTDevice::getInitialized());
+	CHECK_EQ(2, FakeStack::calls().btStart);
+	CHECK_EQ(2, FakeStack::calls().bluedroidInit);
+	CHECK(FakeStack::haveGapCallback());
+	BTDevice::deinit();
+} // testDeinitTearsDown
+
+
+static void testReleasedBleMemoryStartsClassicController() {
+	FakeStack::reset();
+	CHECK_EQ(ESP_OK, BTDevice::releaseBleMemory());
+	CHECK(BTDevice::isBleMemoryReleased());
+	BTDevice::init("init_test");
+	CHECK(BTDevice::getInitialized());
+	CHECK_EQ(0, FakeStack::calls().btStart);   // It would ask for dual mode.
+	CHECK_EQ(ESP_BT_MODE_CLASSIC_BT, FakeStack::calls().controllerInitMode);
+	CHECK_EQ(ESP_BT_MODE_CLASSIC_BT, FakeStack::calls().controllerEnableMode);
+
+	CHECK_EQ(ESP_ERR_INVALID_STATE, BTDevice::releaseBleMemory());   // Too late now.
+
+	// A stack restart keeps to classic mode.
+	BTDevice::reinit();
+	CHECK(BTDevice::getInitialized());
+	CHECK_EQ(0, FakeStack::calls().btStart);
+	CHECK_EQ(2, FakeStack::calls().controllerInit);
+	CHECK_EQ(ESP_BT_MODE_CLASSIC_BT, FakeStack::calls().controllerInitMode);
+} // testReleasedBleMemoryStartsClassicController
+
+
+int main() {
+	RUN(testFailedControllerFailsInit);
+	RUN(testFailedBluedroidIsRetried);
+	RUN(testStandbyKeepsStack);
+	RUN(testDeinitTearsDown);
+	RUN(testReleasedBleMemoryStartsClassicController);
+	return BT_TEST_RESULT();
+} // main
@@ -0,0 +1,368 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BTJsonWriter: a scan of 500 devices streamed through a 4 KB buffer into a sink and parsed back, the
+// escaping of names byte for byte, the field selection, and the failures of a full buffer or a sink
+// that gives up.
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTJsonWriter.h"
+#include "BTScan.h"
+
+static const int    DEVICES     = 500;
+static const size_t BUFFER_SIZE = 4096;
+
+/**
+ * @brief Just enough of a JSON parser to read back what the writer produces.
+ */
+struct Json {
+	enum Type { NUL, NUMBER, STRING, ARRAY, OBJECT } type = NUL;
+	double                                     number = 0;
+	std::string                                string;
+	std::vector<Json>                          items;
+	std::vector<std::pair<std::string, Json> > members;
+
+	const Json* get(const char* key) const {
+		for (size_t i = 0; i < members.size(); i++) {
+			if (members[i].first == key) return &members[i].second;
+		}
+		return nullptr;
+	}
+};
+
+
+class JsonParser {
+public:
+	JsonParser(const std::string& text) : m_text(text), m_pos(0) {}
+
+	bool parse(Json& value) {
+		return parseValue(value) && (skip(), m_pos == m_text.size());
+	}
+
+private:
+	void skip() {
+		while (m_pos < m_text.size() && strchr(" \t\r\n", m_text[m_pos]) != nullptr) m_pos++;
+	}
+
+	bool expect(char c) {
+		skip();
+		if (m_pos < m_text.size() && m_text[m_pos] == c) {
+			m_pos++;
+			return true;
+		}
+		return false;
+	}
+
+	bool parseString(std::string& out) {
+		if (!expect('"')) return false;
+		while (m_pos < m_text.size()) {
+			unsigned char c = m_text[m_pos++];
+			if (c == '"') return true;
+			if (c < 0x20) return false;   // Raw control characters are not valid JSON.
+			if (c != '\\') {
+				out += (char)c;
+				continue;
+			}
+			if (m_pos >= m_text.size()) return false;
+			char e = m_text[m_pos++];
+			if (e == '"' || e == '\\' || e == '/') {
+				out += e;
+			} else if (e == 'u' && m_pos + 4 <= m_text.size()) {
+				uint32_t cp = (uint32_t)strtoul(m_text.substr(m_pos, 4).c_str(), nullptr, 16);
+				m_pos += 4;
+				if (cp > 0xff) return false;   // The writer only escapes single bytes.
+				out += (char)cp;               // Kept as the byte it stands for.
+			} else {
+				return false;
+			}
+		}
+		return false;
+	}
+
+	bool parseValue(Json& value) {
+		skip();
+		if (m_pos >= m_text.size()) return false;
+		char c = m_text[m_pos];
+		if (c == '"') {
+			value.type = Json::STRING;
+			return parseString(value.string);
+		}
+		if (c == '[') {
+			m_pos++;
+			value.type = Json::ARRAY;
+			if (expect(']')) return true;
+			do {
+				value.items.push_back(Json());
+				if (!parseValue(value.items.back())) return false;
+			} while (expect(','));
+			return expect(']');
+		}
+		if (c == '{') {
+			m_pos++;
+			value.type = Json::OBJECT;
+			if (expect('}')) return true;
+			do {
+				value.members.push_back(std::make_pair(std::string(), Json()));
+				if (!parseString(value.members.back().first) || !expect(':') ||
+					!parseValue(value.members.back().second)) return false;
+			} while (expect(','));
+			return expect('}');
+		}
+		size_t start = m_pos;
+		if (c == '-') m_pos++;
+		while (m_pos < m_text.size() && m_text[m_pos] >= '0' && m_text[m_pos] <= '9') m_pos++;
+		if (m_pos == start || (c == '-' && m_pos == start + 1)) return false;
+		value.type   = Json::NUMBER;
+		value.number = strtod(m_text.substr(start, m_pos - start).c_str(), nullptr);
+		return true;
+	}
+
+	const std::string& m_text;
+	size_t             m_pos;
+};
+
+
+struct Sink {
+	std::string         text;
+	std::vector<size_t> chunks;
+	int                 failAfter = -1;   // Chunks accepted before the sink gives up, -1 for never.
+};
+
+static bool toSink(const char* data, size_t length, void* pArg) {
+	Sink* pSink = (Sink*)pArg;
+	if (pSink->failAfter >= 0 && (int)pSink->chunks.size() >= pSink->failAfter) {
+		return false;
+	}
+	pSink->text.append(data, length);
+	pSink->chunks.push_back(length);
+	return true;
+} // toSink
+
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+static std::string nameOf(int n) {
+	std::string name = "device " + std::to_string(n);
+	if (n % 7 == 0) {
+		name += " \"quoted\" back\\slash";
+	}
+	return name;
+} // nameOf
+
+
+/**
+ * @brief Sight a device whose EIR carries a name and, optionally, a TX power.
+ */
+static void sight(uint32_t n, const std::string& name, int8_t rssi, uint32_t cod, bool txPower) {
+	uint8_t address[ESP_BD_ADDR_LEN];
+	uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
+	size_t  length = 0;
+	FakeStack::makeAddress(n, address);
+	eir[length++] = 1 + name.size();
+	eir[length++] = ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME;
+	memcpy(eir + length, name.data(), name.size());
+	length += name.size();
+	if (txPower) {
+		eir[length++] = 2;
+		eir[length++] = ESP_BT_EIR_TYPE_TX_POWER_LEVEL;
+		eir[length++] = (uint8_t)-4;
+	}
+	FakeStack::emitDiscRes(address, rssi, cod, eir, length);
+} // sight
+
+
+static BTScan* scanStart() {
+	FakeStack::reset();
+	BTDevice::init("json_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	return pScan;
+} // scanStart
+
+
+/**
+ * @brief Scan one device and return a copy of it.
+ */
+static BTAdvertisedDevice scanOne(const std::string& name, uint32_t cod, bool txPower) {
+	BTScan* pScan = scanStart();
+	sight(1, name, -42, cod, txPower);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	return pScan->getResults().getDevice(0);
+} // scanOne
+
+
+static std::string write(BTAdvertisedDevice& device, uint16_t fields) {
+	char         buffer[512];
+	BTJsonWriter writer(buffer, sizeof(buffer));
+	writer.setFields(fields);
+	CHECK(writer.writeDevice(device));
+	return std::string(writer.getData(), writer.getLength());
+} // write
+
+
+/**
+ * @brief 500 devices through a 4 KB buffer: the sink gets full chunks that, put together, parse back
+ * to the devices that were scanned.
+ */
+static void testResultsThroughSink() {
+	BTScan* pScan = scanStart();
+	for (int n = 0; n < DEVICES; n++) {
+		sight(n, nameOf(n), -30 - n % 60, 0, false);
+		FakeStack::advanceMs(1);
+	}
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	BTScanResults results = pScan->getResults();
+
+	std::vector<char> buffer(BUFFER_SIZE);
+	Sink         sink;
+	BTJsonWriter writer(buffer.data(), buffer.size(), toSink, &sink);
+	CHECK(writer.writeResults(results));
+	CHECK(!writer.hasFailed());
+	CHECK_EQ(0, writer.getLength());   // Everything was flushed.
+	CHECK(sink.chunks.size() > 1);
+	for (size_t i = 0; i + 1 < sink.chunks.size(); i++) {
+		CHECK_EQ(BUFFER_SIZE, sink.chunks[i]);
+	}
+
+	Json document;
+	CHECK(JsonParser(sink.text).parse(document));
+	CHECK_EQ(Json::OBJECT, document.type);
+	CHECK(document.get("scanStart") != nullptr);
+	CHECK(document.get("count") != nullptr && document.get("count")->number == DEVICES);
+	const Json* devices = document.get("devices");
+	CHECK(devices != nullptr && devices->type == Json::ARRAY);
+	if (devices == nullptr || devices->items.size() != (size_t)DEVICES) {
+		CHECK(false);
+		return;
+	}
+	for (int i = 0; i < DEVICES; i++) {
+		const Json&        item   = devices->items[i];
+		BTAdvertisedDevice device = results.getDevice(i);
+		const Json*        name   = item.get("name");
+		const Json*        rssi   = item.get("rssi");
+		CHECK(item.get("address") != nullptr && item.get("address")->string == device.getAddress().toString());
+		CHECK(name != nullptr && name->string == device.getName());
+		CHECK(rssi != nullptr && rssi->number == device.getRSSI());
+		CHECK(item.get("cod") == nullptr);   // Not reported by the device.
+	}
+	CHECK(devices->items[7].get("name")->string == nameOf(7));
+} // testResultsThroughSink
+
+
+/**
+ * @brief Quote and backslash are escaped, control characters and bytes that are not valid UTF-8 become
+ * \u00XX, valid UTF-8 is written as is.
+ */
+static void testEscaping() {
+	const char name[] =
+		"a\"b\\c"                 // Quote and backslash.
+		"\x01\x1f\x7f"            // Control characters and DEL.
+		"\xc3\xa9"                // Valid two, three and four byte sequences.
+		"\xe2\x82\xac"
+		"\xf0\x9f\x98\x80"
+		"\xff"                    // Never valid.
+		"\xc0\x80"                // Overlong NUL.
+		"\x80"                    // Stray continuation byte.
+		"\xed\xa0\x80"            // Surrogate.
+		"\xe2\x82";               // Truncated by the end of the name.
+	BTAdvertisedDevice device = scanOne(std::string(name, sizeof(name) - 1), 0, false);
+	CHECK(write(device, BT_JSON_NAME) ==
+		"{\"name\":\"a\\\"b\\\\c\\u0001\\u001f\\u007f\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80"
+		"\\u00ff\\u00c0\\u0080\\u0080\\u00ed\\u00a0\\u0080\\u00e2\\u0082\"}");
+
+	Json parsed;
+	CHECK(JsonParser(write(device, BT_JSON_NAME)).parse(parsed));
+	CHECK(parsed.get("name") != nullptr && parsed.get("name")->string == device.getName());
+} // testEscaping
+
+
+/**
+ * @brief Only the selected fields are written, and only those the device has.
+ */
+static void testFieldSets() {
+	BTAdvertisedDevice device = scanOne("field", 0x5a020c, true);
+	std::string address = device.getAddress().toString();
+
+	CHECK(write(device, BT_JSON_ADDRESS) == "{\"address\":\"" + address + "\"}");
+	CHECK(write(device, BT_JSON_RSSI | BT_JSON_TXPOWER) == "{\"rssi\":-42,\"txPower\":-4}");
+	CHECK(write(device, BT_JSON_COD) == "{\"cod\":" + std::to_string(0x5a020c) + "}");
+	CHECK(write(device, 0) == "{}");
+
+	Json all;
+	CHECK(JsonParser(write(device, BT_JSON_ALL)).parse(all));
+	const char* keys[] = { "address", "name", "rssi", "cod", "deviceType", "serviceType", "txPower", "timestamp" };
+	CHECK_EQ(8, all.members.size());
+	for (size_t i = 0; i < all.members.size() && i < 8; i++) {
+		CHECK(all.members[i].first == keys[i]);
+	}
+	CHECK(all.get("deviceType")->string == device.getDeviceType());
+	CHECK(all.get("timestamp")->number == device.getTimestamp());
+
+	BTAdvertisedDevice bare = scanOne("bare", 0, false);   // No CoD, no TX power: no such keys.
+	Json partial;
+	CHECK(JsonParser(write(bare, BT_JSON_ALL)).parse(partial));
+	CHECK(partial.get("cod") == nullptr);
+	CHECK(partial.get("deviceType") == nullptr);
+	CHECK(partial.get("txPower") == nullptr);
+	CHECK(partial.get("name") != nullptr);
+} // testFieldSets
+
+
+/**
+ * @brief Without a sink the document must fit the buffer; a sink that gives up stops the writer.
+ */
+static void testFailures() {
+	BTAdvertisedDevice device = scanOne("a name longer than the buffer", 0, false);
+	char         small[16];
+	BTJsonWriter writer(small, sizeof(small));
+	CHECK(!writer.writeDevice(device));
+	CHECK(writer.hasFailed());
+	writer.reset();
+	writer.setFields(BT_JSON_RSSI);
+	CHECK(writer.writeDevice(device));
+
+	BTScan* pScan = scanStart();
+	for (int n = 0; n < 100; n++) {
+		sight(n, nameOf(n), -50, 0, false);
+	}
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	BTScanResults results = pScan->getResults();
+	std::vector<char> buffer(256);
+	Sink sink;
+	sink.failAfter = 2;
+	BTJsonWriter streaming(buffer.data(), buffer.size(), toSink, &sink);
+	CHECK(!streaming.writeResults(results));
+	CHECK(streaming.hasFailed());
+	CHECK_EQ(2, sink.chunks.size());
+} // testFailures
+
+
+int main() {
+	RUN(testResultsThroughSink);
+	RUN(testEscaping);
+	RUN(testFieldSets);
+	RUN(testFailures);
+	return BT_TEST_RESULT();
+} // main
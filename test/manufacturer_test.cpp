@@ -0,0 +1,261 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Manufacturer data through a scan: BTManufacturerDecoders dispatching real Apple and Microsoft
+// payloads to their decoders and nothing else, and fields too short for a company identifier, or cut
+// off by the end of the EIR, reported the same way by haveManufacturerData(), getManufacturerData()
+// and getManufacturerDataView().
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTManufacturerData.h"
+#include "BTScan.h"
+
+struct Decoded {
+	int         apple     = 0;
+	int         microsoft = 0;
+	uint8_t     appleType = 0;
+	uint16_t    major     = 0;
+	uint16_t    minor     = 0;
+	int8_t      txPower   = 0;
+	std::string swiftPairName;
+	size_t      length    = 0;
+};
+
+/**
+ * @brief Apple continuity messages, [type][length][payload]; an iBeacon is type 0x02 of 21 bytes.
+ */
+struct AppleDecoder {
+	static const uint16_t companyId = 0x004C;
+	static void decode(const BTManufacturerData& data, Decoded& decoded) {
+		decoded.apple++;
+		decoded.length = data.length;
+		if (data.length >= 2) {
+			decoded.appleType = data.data[0];
+		}
+		if (data.length >= 23 && data.data[0] == 0x02 && data.data[1] == 0x15) {
+			decoded.major   = (data.data[18] << 8) | data.data[19];
+			decoded.minor   = (data.data[20] << 8) | data.data[21];
+			decoded.txPower = (int8_t)data.data[22];
+		}
+	}
+};
+
+/**
+ * @brief Microsoft beacons, [beacon id][scenario][reserved RSSI][payload]; Swift Pair is id 0x03
+ * followed by the display name.
+ */
+struct MicrosoftDecoder {
+	static const uint16_t companyId = 0x0006;
+	static void decode(const BTManufacturerData& data, Decoded& decoded) {
+		decoded.microsoft++;
+		decoded.length = data.length;
+		if (data.length >= 3 && data.data[0] == 0x03) {
+			decoded.swiftPairName.assign((const char*)data.data + 3, data.length - 3);
+		}
+	}
+};
+
+typedef BTManufacturerDecoders<AppleDecoder, MicrosoftDecoder> Decoders;
+
+// iBeacon E2C56DB5-DFFB-48D2-B060-D0F5A71096E0, major 1, minor 2, -59 dBm at 1 m.
+static const uint8_t appleBeacon[] = {
+	0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15,
+	0xe2, 0xc5, 0x6d, 0xb5, 0xdf, 0xfb, 0x48, 0xd2, 0xb0, 0x60, 0xd0, 0xf5, 0xa7, 0x10, 0x96, 0xe0,
+	0x00, 0x01, 0x00, 0x02, 0xc5
+};
+
+// Swift Pair of "Surface Mouse", after a name field.
+static const uint8_t microsoftSwiftPair[] = {
+	0x06, 0x09, 'M', 'o', 'u', 's', 'e',
+	0x13, 0xff, 0x06, 0x00, 0x03, 0x00, 0x80, 'S', 'u', 'r', 'f', 'a', 'c', 'e', ' ', 'M', 'o', 'u', 's', 'e'
+};
+
+// Apple Nearby Info, a real continuity message that is not a beacon.
+static const uint8_t appleNearby[] = { 0x0a, 0xff, 0x4c, 0x00, 0x10, 0x05, 0x01, 0x18, 0x1c, 0x6a, 0x7e };
+
+// Samsung, a company without a decoder.
+static const uint8_t samsung[] = { 0x06, 0xff, 0x75, 0x00, 0x42, 0x04, 0x01 };
+
+static uint32_t nextDevice = 1;
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+/**
+ * @brief Scan a single device advertising the given EIR and return its record.
+ */
+static BTAdvertisedDevice deviceWith(const uint8_t* eir, size_t length) {
+	FakeStack::reset();
+	BTDevice::init("manufacturer_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(nextDevice++, address);
+	FakeStack::emitDiscRes(address, -60, 0x5a020c, length != 0 ? eir : nullptr, length);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	BTScanResults results = pScan->getResults();
+	CHECK_EQ(1, results.getCount());
+	return results.getDevice(0);
+} // deviceWith
+
+
+/**
+ * @brief The three accessors agree, and the view covers exactly the bytes after the company id.
+ */
+static void checkAgree(BTAdvertisedDevice& device) {
+	BTManufacturerData view = device.getManufacturerDataView();
+	std::string        copy = device.getManufacturerData();
+	CHECK_EQ(view.isValid(), device.haveManufacturerData());
+	CHECK_EQ(view.isValid(), !copy.empty());
+	if (view.isValid()) {
+		CHECK_EQ(copy.size(), (size_t)view.length + 2);
+		CHECK_EQ((uint8_t)copy[0] | ((uint8_t)copy[1] << 8), view.companyId);
+		CHECK(memcmp(copy.data() + 2, view.data, view.length) == 0);
+	}
+} // checkAgree
+
+
+/**
+ * @brief An iBeacon goes to the Apple decoder only, which reads its major, minor and power.
+ */
+static void testAppleBeacon() {
+	BTAdvertisedDevice device = deviceWith(appleBeacon, sizeof(appleBeacon));
+	checkAgree(device);
+	Decoded decoded;
+	CHECK(Decoders::dispatch(device.getManufacturerDataView(), decoded));
+	CHECK_EQ(1, decoded.apple);
+	CHECK_EQ(0, decoded.microsoft);
+	CHECK_EQ(23, decoded.length);
+	CHECK_EQ(0x02, decoded.appleType);
+	CHECK_EQ(1, decoded.major);
+	CHECK_EQ(2, decoded.minor);
+	CHECK_EQ(-59, decoded.txPower);
+
+	device = deviceWith(appleNearby, sizeof(appleNearby));
+	decoded = Decoded();
+	CHECK(Decoders::dispatch(device.getManufacturerDataView(), decoded));
+	CHECK_EQ(1, decoded.apple);
+	CHECK_EQ(0x10, decoded.appleType);
+	CHECK_EQ(0, decoded.major);
+} // testAppleBeacon
+
+
+/**
+ * @brief Swift Pair goes to the Microsoft decoder, found after another field.
+ */
+static void testMicrosoftSwiftPair() {
+	BTAdvertisedDevice device = deviceWith(microsoftSwiftPair, sizeof(microsoftSwiftPair));
+	checkAgree(device);
+	CHECK(device.getName() == "Mouse");
+	Decoded decoded;
+	CHECK(Decoders::dispatch(device.getManufacturerDataView(), decoded));
+	CHECK_EQ(0, decoded.apple);
+	CHECK_EQ(1, decoded.microsoft);
+	CHECK(decoded.swiftPairName == "Surface Mouse");
+} // testMicrosoftSwiftPair
+
+
+/**
+ * @brief No decoder for the company, or no manufacturer data at all: dispatch() says so and calls
+ * nothing.
+ */
+static void testNotDispatched() {
+	BTAdvertisedDevice device = deviceWith(samsung, sizeof(samsung));
+	checkAgree(device);
+	CHECK(device.haveManufacturerData());
+	CHECK_EQ(0x0075, device.getManufacturerDataView().companyId);
+	Decoded decoded;
+	CHECK(!Decoders::dispatch(device.getManufacturerDataView(), decoded));
+
+	device = deviceWith(nullptr, 0);
+	checkAgree(device);
+	CHECK(!device.haveManufacturerData());
+	CHECK(!Decoders::dispatch(device.getManufacturerDataView(), decoded));
+	CHECK(!BTManufacturerDecoders<>::dispatch(deviceWith(appleBeacon, sizeof(appleBeacon)).getManufacturerDataView(), decoded));
+	CHECK_EQ(0, decoded.apple + decoded.microsoft);
+} // testNotDispatched
+
+
+/**
+ * @brief A field of 0 or 1 byte has no company identifier: not manufacturer data, for any of the
+ * accessors.  One of exactly 2 bytes is, with an empty payload.
+ */
+static void testShortFields() {
+	const uint8_t  empty[]   = { 0x01, 0xff };
+	const uint8_t  oneByte[] = { 0x02, 0xff, 0x4c };
+	const uint8_t  idOnly[]  = { 0x03, 0xff, 0x4c, 0x00 };
+	const uint8_t* eirs[]    = { empty, oneByte };
+	size_t         sizes[]   = { sizeof(empty), sizeof(oneByte) };
+	for (int i = 0; i < 2; i++) {
+		BTAdvertisedDevice device = deviceWith(eirs[i], sizes[i]);
+		checkAgree(device);
+		CHECK(!device.haveManufacturerData());
+		CHECK(device.getManufacturerData().empty());
+		Decoded decoded;
+		CHECK(!Decoders::dispatch(device.getManufacturerDataView(), decoded));
+		CHECK_EQ(0, decoded.apple);
+	}
+
+	BTAdvertisedDevice device = deviceWith(idOnly, sizeof(idOnly));
+	checkAgree(device);
+	CHECK(device.haveManufacturerData());
+	Decoded decoded;
+	decoded.length = 99;
+	CHECK(Decoders::dispatch(device.getManufacturerDataView(), decoded));
+	CHECK_EQ(1, decoded.apple);
+	CHECK_EQ(0, decoded.length);
+	CHECK_EQ(0, decoded.appleType);
+} // testShortFields
+
+
+/**
+ * @brief The beacon cut off at every length: the accessors agree whatever is left, and a decoder is
+ * only ever handed bytes of the EIR.
+ */
+static void testTruncatedEir() {
+	for (size_t length = 1; length <= sizeof(microsoftSwiftPair); length++) {
+		BTAdvertisedDevice device = deviceWith(microsoftSwiftPair, length);
+		checkAgree(device);
+		Decoded decoded;
+		bool dispatched = Decoders::dispatch(device.getManufacturerDataView(), decoded);
+		CHECK_EQ(device.haveManufacturerData(), dispatched);
+		if (dispatched) {
+			CHECK(decoded.length <= length - 11);
+		}
+	}
+	for (size_t length = 1; length <= sizeof(appleBeacon); length++) {
+		BTAdvertisedDevice device = deviceWith(appleBeacon, length);
+		checkAgree(device);
+	}
+} // testTruncatedEir
+
+
+int main() {
+	RUN(testAppleBeacon);
+	RUN(testMicrosoftSwiftPair);
+	RUN(testNotDispatched);
+	RUN(testShortFields);
+	RUN(testTruncatedEir);
+	return BT_TEST_RESULT();
+} // main
@@ -0,0 +1,110 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Export of scan metrics: Prometheus counters must stay monotonic, so read-and-reset values go out as
+// gauges, and the binary layout carries its version and flags.
+
+#include <string.h>
+#include <string>
+
+#include "BTTest.h"
+#include "BTScanMetrics.h"
+
+static BTScanStats takeStats(BTScanMetrics& metrics, bool reset) {
+	BTScanStats stats;
+	memset(&stats, 0, sizeof(stats));
+	metrics.snapshot(&stats, reset);
+	stats.arenaOverflows = 2;
+	return stats;
+} // takeStats
+
+
+static std::string prometheus(BTScanStats& stats) {
+	char buffer[4096];
+	size_t length = stats.toPrometheus(buffer, sizeof(buffer));
+	CHECK(length > 0);
+	return std::string(buffer, length);
+} // prometheus
+
+
+static bool contains(const std::string& text, const char* line) {
+	return text.find(line) != std::string::npos;
+} // contains
+
+
+static void testCountersWithoutReset() {
+	BTScanMetrics metrics;
+	metrics.inc(metrics.discResults);
+	BTScanStats stats = takeStats(metrics, false);
+	std::string text = prometheus(stats);
+	CHECK(contains(text, "# TYPE btscan_disc_results_total counter\nbtscan_disc_results_total 1\n"));
+	CHECK(contains(text, "# TYPE btscan_result_count gauge\n"));
+	CHECK(!contains(text, "counter\nbtscan_disc_results 1"));
+	CHECK_EQ(1, metrics.discResults.load());
+} // testCountersWithoutReset
+
+
+static void testResetCountersAreGauges() {
+	BTScanMetrics metrics;
+	metrics.inc(metrics.discResults);
+	metrics.inc(metrics.discResults);
+	BTScanStats stats = takeStats(metrics, true);
+	std::string text = prometheus(stats);
+	CHECK(contains(text, "# TYPE btscan_disc_results gauge\nbtscan_disc_results 2\n"));
+	CHECK(!contains(text, "btscan_disc_results_total"));
+	CHECK(contains(text, "# TYPE btscan_arena_overflows_total counter\nbtscan_arena_overflows_total 2\n"));
+	CHECK_EQ(0, metrics.discResults.load());
+
+	// No "_total" family may carry the counter type while it is being reset.
+	size_t pos = 0;
+	while ((pos = text.find("_total counter", pos)) != std::string::npos) {
+		size_t start = text.rfind("# TYPE ", pos) + 7;
+		CHECK(text.compare(start, pos - start, "btscan_arena_overflows") == 0);
+		pos++;
+	}
+} // testResetCountersAreGauges
+
+
+static void testBinaryHeader() {
+	BTScanMetrics metrics;
+	metrics.inc(metrics.uniqueDevices);
+	uint8_t buffer[160];
+
+	BTScanStats stats = takeStats(metrics, false);
+	size_t length = stats.toBinary(buffer, sizeof(buffer));
+	CHECK(length > 3);
+	CHECK_EQ(6, BT_METRICS_BINARY_VERSION);
+	CHECK_EQ(BT_METRICS_BINARY_VERSION, buffer[0]);
+	CHECK_EQ(30, buffer[1]);
+	CHECK_EQ(0, buffer[2]);
+	CHECK_EQ(1, buffer[5]);   // uniqueDevices, after two single byte zeros.
+
+	stats = takeStats(metrics, true);
+	CHECK(stats.toBinary(buffer, sizeof(buffer)) > 3);
+	CHECK_EQ(BT_METRICS_FLAG_RESET, buffer[2]);
+
+	// The documented bound holds with every field at its widest.
+	memset(&stats, 0xff, sizeof(stats));
+	stats.countersReset = true;
+	CHECK_EQ(153, stats.toBinary(buffer, 153));
+	CHECK_EQ(0, stats.toBinary(buffer, 152));
+} // testBinaryHeader
+
+
+int main() {
+	RUN(testCountersWithoutReset);
+	RUN(testResetCountersAreGauges);
+	RUN(testBinaryHeader);
+	return BT_TEST_RESULT();
+} // main
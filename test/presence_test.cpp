@@ -0,0 +1,319 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Presence classification replayed over a synthetic site: scanners in the corners of a floor of
+// rooms, devices walking between the rooms, each scanner hearing them through a path loss model with
+// noise.  Every classification is checked against a reference that recomputes the windowed means and
+// the distances from the raw sightings, and the zones against where the devices really are.
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "BTTest.h"
+#include "BTPresence.h"
+#include "BTScanSnapshot.h"
+
+static const uint8_t  NODES    = 4;
+static const uint16_t ZONES    = 3;
+static const uint32_t WINDOW   = 8000;
+static const int16_t  MISSING  = -100 * 16;
+
+static const double nodeX[NODES] = { 0, 30, 0, 30 };
+static const double nodeY[NODES] = { 0, 0, 10, 10 };
+static const double zoneX[ZONES] = { 5, 15, 25 };
+static const double zoneY[ZONES] = { 5, 5, 5 };
+
+/**
+ * @brief Log distance path loss, BT_PRESENCE_UNHEARD below the sensitivity of the scanners.
+ */
+static int8_t modelRssi(uint8_t node, double x, double y, double noise) {
+	double d    = std::max(sqrt((x - nodeX[node]) * (x - nodeX[node]) + (y - nodeY[node]) * (y - nodeY[node])), 1.0);
+	double rssi = -45 - 25 * log10(d) + noise;
+	return rssi < -95 ? (int8_t)BT_PRESENCE_UNHEARD : (int8_t)lround(rssi);
+} // modelRssi
+
+
+struct Sighting {
+	uint64_t address;
+	uint64_t ms;
+	uint16_t node;
+	int8_t   rssi;
+	uint16_t zone;      // Where the device really is.
+	uint64_t arrived;   // When it got there.
+};
+
+
+/**
+ * @brief The classifier recomputed from scratch: every sighting is kept and nothing is incremental.
+ */
+class Reference {
+public:
+	std::vector<int16_t>  fingerprints;   // fingerprint x node, in 1/16 dB.
+	std::vector<uint16_t> zones;
+	std::vector<Sighting> sightings;
+	uint32_t              bucketMs = WINDOW / BT_PRESENCE_BUCKETS;
+
+	void addFingerprint(uint16_t zone, const int8_t* rssi) {
+		for (uint8_t n = 0; n < NODES; n++) {
+			fingerprints.push_back(rssi[n] == BT_PRESENCE_UNHEARD ? MISSING : rssi[n] * 16);
+		}
+		zones.push_back(zone);
+	}
+
+	void means(uint64_t address, uint32_t epoch, int16_t* mean) {
+		for (uint8_t n = 0; n < NODES; n++) {
+			int32_t sum   = 0;
+			int32_t count = 0;
+			for (size_t i = 0; i < sightings.size(); i++) {
+				const Sighting& s = sightings[i];
+				uint32_t e = (uint32_t)(s.ms / bucketMs);
+				if (s.address == address && s.node == n && e <= epoch && e + BT_PRESENCE_BUCKETS > epoch) {
+					sum += s.rssi;
+					count++;
+				}
+			}
+			int32_t scaled = sum * 16;
+			mean[n] = count == 0 ? MISSING : (int16_t)((scaled >= 0 ? scaled + count / 2 : scaled - count / 2) / count);
+		}
+	}
+
+	BTPresenceResult classify(uint64_t address, uint32_t epoch) {
+		int16_t mean[NODES];
+		means(address, epoch, mean);
+		std::vector<uint32_t> distance(zones.size(), 0);
+		for (size_t f = 0; f < zones.size(); f++) {
+			for (uint8_t n = 0; n < NODES; n++) {
+				int32_t d = mean[n] - fingerprints[f * NODES + n];
+				distance[f] += d * d;
+			}
+		}
+		size_t best = 0;
+		for (size_t f = 1; f < zones.size(); f++) {
+			if (distance[f] < distance[best]) {
+				best = f;
+			}
+		}
+		BTPresenceResult result = { (int32_t)zones[best], distance[best], UINT32_MAX, false };
+		for (size_t f = 0; f < zones.size(); f++) {
+			if (zones[f] != zones[best]) {
+				result.margin = std::min(result.margin, distance[f] - distance[best]);
+			}
+		}
+		return result;
+	}
+};
+
+
+/**
+ * @brief One fingerprint per zone, taken noise free at the centre of the zone.
+ */
+static void calibrate(BTPresenceClassifier& classifier, Reference& reference) {
+	for (uint16_t z = 0; z < ZONES; z++) {
+		int8_t rssi[NODES];
+		for (uint8_t n = 0; n < NODES; n++) {
+			rssi[n] = modelRssi(n, zoneX[z], zoneY[z], 0);
+		}
+		classifier.addFingerprint(z, rssi);
+		reference.addFingerprint(z, rssi);
+	}
+} // calibrate
+
+
+/**
+ * @brief Devices dwell 20 to 40 s in a room, somewhere within 3 m of its centre, then walk to another.
+ * Each node hears each device about once a second, and misses some sightings.
+ */
+static std::vector<Sighting> makeReplay(size_t devices, uint64_t durationMs, uint32_t seed) {
+	std::mt19937 random(seed);
+	std::normal_distribution<double> noise(0, 3);
+	std::uniform_real_distribution<double> offset(-3, 3);
+	std::vector<Sighting> replay;
+	uint64_t start = 1700000000000ULL;
+	for (size_t d = 0; d < devices; d++) {
+		uint64_t address = 0x30aea4000000ULL + d;
+		uint16_t zone    = random() % ZONES;
+		uint64_t arrived = start;
+		uint64_t leave   = start + 20000 + random() % 20000;
+		double   x = zoneX[zone] + offset(random);
+		double   y = zoneY[zone] + offset(random);
+		for (uint64_t ms = start + random() % 1000; ms < start + durationMs; ms += 900 + random() % 200) {
+			if (ms >= leave) {
+				zone    = (zone + 1 + random() % (ZONES - 1)) % ZONES;
+				arrived = ms;
+				leave   = ms + 20000 + random() % 20000;
+				x = zoneX[zone] + offset(random);
+				y = zoneY[zone] + offset(random);
+			}
+			for (uint8_t n = 0; n < NODES; n++) {
+				int8_t rssi = modelRssi(n, x, y, noise(random));
+				if (rssi == BT_PRESENCE_UNHEARD || random() % 10 == 0) {
+					continue;
+				}
+				Sighting s = { address, ms + n * 7, n, rssi, zone, arrived };
+				replay.push_back(s);
+			}
+		}
+	}
+	std::stable_sort(replay.begin(), replay.end(),
+		[](const Sighting& a, const Sighting& b) { return a.ms < b.ms; });
+	return replay;
+} // makeReplay
+
+
+/**
+ * @brief Every incremental classification equals the from scratch one, and once a device has spent a
+ * window in a room it is placed in that room.
+ */
+static void testReplayMatchesReference() {
+	BTPresenceClassifier classifier(NODES, WINDOW);
+	Reference reference;
+	calibrate(classifier, reference);
+	std::vector<Sighting> replay = makeReplay(12, 180000, 1);
+
+	size_t settled   = 0;
+	size_t correct   = 0;
+	size_t mismatch  = 0;
+	for (size_t i = 0; i < replay.size(); i++) {
+		const Sighting& s = replay[i];
+		reference.sightings.push_back(s);
+		BTPresenceResult result   = classifier.ingest(s.address, s.node, s.rssi, s.ms);
+		BTPresenceResult expected = reference.classify(s.address, (uint32_t)(s.ms / reference.bucketMs));
+		if (result.zone != expected.zone || result.distance != expected.distance || result.margin != expected.margin) {
+			mismatch++;
+		}
+		if (s.ms >= s.arrived + WINDOW + reference.bucketMs) {   // Only sightings from this room left in the window.
+			settled++;
+			correct += result.zone == (int32_t)s.zone;
+		}
+	}
+	CHECK_EQ(0, mismatch);
+	CHECK(settled > replay.size() / 2);
+	CHECK(correct * 100 >= settled * 98);
+
+	uint64_t end = replay.back().ms;
+	int8_t vector[NODES];
+	int16_t mean[NODES];
+	for (size_t d = 0; d < 12; d++) {   // The windowed vectors agree too.
+		uint64_t address = 0x30aea4000000ULL + d;
+		CHECK(classifier.getVector(address, end, vector));
+		reference.means(address, (uint32_t)(end / reference.bucketMs), mean);
+		for (uint8_t n = 0; n < NODES; n++) {
+			int8_t rounded = (int8_t)((mean[n] >= 0 ? mean[n] + 8 : mean[n] - 8) / 16);
+			CHECK_EQ(mean[n] == MISSING ? BT_PRESENCE_UNHEARD : rounded, vector[n]);
+		}
+	}
+} // testReplayMatchesReference
+
+
+/**
+ * @brief Calibrating after the devices were seen recomputes their distances.
+ */
+static void testRecalibrationMidReplay() {
+	BTPresenceClassifier classifier(NODES, WINDOW);
+	Reference reference;
+	std::vector<Sighting> replay = makeReplay(6, 60000, 2);
+	size_t half = replay.size() / 2;
+	for (size_t i = 0; i < half; i++) {
+		reference.sightings.push_back(replay[i]);
+		CHECK_EQ(-1, classifier.ingest(replay[i].address, replay[i].node, replay[i].rssi, replay[i].ms).zone);
+	}
+	calibrate(classifier, reference);
+	size_t mismatch = 0;
+	for (size_t i = half; i < replay.size(); i++) {
+		const Sighting& s = replay[i];
+		reference.sightings.push_back(s);
+		BTPresenceResult result   = classifier.ingest(s.address, s.node, s.rssi, s.ms);
+		BTPresenceResult expected = reference.classify(s.address, (uint32_t)(s.ms / reference.bucketMs));
+		mismatch += result.zone != expected.zone || result.distance != expected.distance;
+	}
+	CHECK_EQ(0, mismatch);
+} // testRecalibrationMidReplay
+
+
+/**
+ * @brief Devices leave the site: classify() ages their sightings out and expire() drops them.
+ */
+static void testDevicesExpire() {
+	BTPresenceClassifier classifier(NODES, WINDOW);
+	Reference reference;
+	calibrate(classifier, reference);
+	std::vector<Sighting> replay = makeReplay(10, 30000, 3);
+	for (size_t i = 0; i < replay.size(); i++) {
+		classifier.ingest(replay[i].address, replay[i].node, replay[i].rssi, replay[i].ms);
+	}
+	uint64_t end = replay.back().ms;
+	CHECK_EQ(10, classifier.getDeviceCount());
+	CHECK_EQ(0, classifier.expire(end));
+
+	int8_t vector[NODES];
+	CHECK(classifier.getVector(replay[0].address, end + WINDOW + 1, vector));
+	for (uint8_t n = 0; n < NODES; n++) {
+		CHECK_EQ(BT_PRESENCE_UNHEARD, vector[n]);
+	}
+	CHECK_EQ(10, classifier.expire(end + WINDOW + 1));
+	CHECK_EQ(0, classifier.getDeviceCount());
+	CHECK_EQ(-1, classifier.classify(replay[0].address, end + WINDOW + 1).zone);
+} // testDevicesExpire
+
+
+/**
+ * @brief The aggregator path: each node ships a snapshot, the merged snapshot places every device.
+ */
+static void testSnapshotsFromNodes() {
+	BTPresenceClassifier classifier(NODES, WINDOW);
+	Reference reference;
+	calibrate(classifier, reference);
+
+	std::vector<BTScanSnapshot> snapshots(NODES);
+	uint64_t now = 1700000000000ULL;
+	for (size_t d = 0; d < 30; d++) {
+		uint16_t zone = d % ZONES;
+		for (uint8_t n = 0; n < NODES; n++) {
+			int8_t rssi = modelRssi(n, zoneX[zone], zoneY[zone], 0);
+			if (rssi == BT_PRESENCE_UNHEARD) {
+				continue;
+			}
+			BTSnapshotEntry entry = { 0x30aea4000000ULL + d, now, 1, n, rssi };
+			snapshots[n].add(entry);
+		}
+	}
+	std::vector<const BTScanSnapshot*> inputs;
+	for (uint8_t n = 0; n < NODES; n++) {
+		snapshots[n].normalize();
+		inputs.push_back(&snapshots[n]);
+	}
+	BTScanSnapshot merged;
+	BTScanSnapshot::merge(inputs.data(), inputs.size(), merged);
+	classifier.ingest(merged);
+
+	CHECK_EQ(30, classifier.getDeviceCount());
+	for (size_t d = 0; d < 30; d++) {
+		BTPresenceResult result = classifier.classify(0x30aea4000000ULL + d, now);
+		CHECK_EQ(d % ZONES, result.zone);
+		CHECK_EQ(0, result.distance);
+		CHECK(result.margin > 0);
+	}
+} // testSnapshotsFromNodes
+
+
+int main() {
+	RUN(testReplayMatchesReference);
+	RUN(testRecalibrationMidReplay);
+	RUN(testDevicesExpire);
+	RUN(testSnapshotsFromNodes);
+	return BT_TEST_RESULT();
+} // main
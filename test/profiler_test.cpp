@@ -0,0 +1,161 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BTLatencyHistogram, built with BT_PROFILING: buckets that tile the whole uint32_t range up to
+// UINT32_MAX, exact below 8 and no wider than a quarter of their values above, and percentiles of
+// known distributions that are never below the true value and within the 25% the header promises.
+
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "BTTest.h"
+#include "BTProfiler.h"
+
+/**
+ * @brief The upper bound of the bucket holding a value, as percentile() reports it: the maximum is
+ * pushed out of the way so the bound is not clamped to it.
+ */
+static uint32_t boundOf(uint32_t value) {
+	BTLatencyHistogram histogram;
+	histogram.add(value);
+	histogram.add(UINT32_MAX);
+	return histogram.percentile(50);
+} // boundOf
+
+
+/**
+ * @brief Walk the buckets from 0: each one ends where the next begins, the last ends at UINT32_MAX,
+ * and there are exactly BT_HISTOGRAM_BUCKETS of them.
+ */
+static void testBucketBoundaries() {
+	for (uint32_t value = 0; value < 8; value++) {
+		CHECK_EQ(value, boundOf(value));
+	}
+	uint32_t buckets = 0;
+	uint32_t lower   = 0;
+	while (true) {
+		uint32_t upper = boundOf(lower);
+		buckets++;
+		CHECK(upper >= lower);
+		CHECK(upper - lower <= lower / 4);   // Width at most a quarter of the smallest value in it.
+		CHECK_EQ(upper, boundOf(upper));
+		if (lower > 0) {
+			CHECK_EQ(lower - 1, boundOf(lower - 1));   // The previous bucket ended just before.
+		}
+		if (upper == UINT32_MAX || buckets > BT_HISTOGRAM_BUCKETS) {
+			break;
+		}
+		lower = upper + 1;
+	}
+	CHECK_EQ(BT_HISTOGRAM_BUCKETS, buckets);
+	CHECK_EQ(0x9fffffffu, boundOf(0x80000000u));
+	CHECK_EQ(0xbfffffffu, boundOf(0xa0000000u));
+	CHECK_EQ(UINT32_MAX, boundOf(0xe0000000u));   // The last bucket.
+} // testBucketBoundaries
+
+
+/**
+ * @brief Empty, a single value and only UINT32_MAX: nothing overflows, and the maximum caps every
+ * percentile.
+ */
+static void testEdges() {
+	BTLatencyHistogram histogram;
+	CHECK_EQ(0, histogram.getCount());
+	CHECK_EQ(0, histogram.percentile(50));
+
+	histogram.add(1000);
+	CHECK_EQ(1000, histogram.percentile(0));
+	CHECK_EQ(1000, histogram.percentile(100));
+	CHECK_EQ(1000, histogram.getMax());
+
+	histogram.reset();
+	for (int i = 0; i < 10; i++) {
+		histogram.add(UINT32_MAX);
+	}
+	CHECK_EQ(10, histogram.getCount());
+	CHECK_EQ(UINT32_MAX, histogram.getMax());
+	CHECK_EQ(UINT32_MAX, histogram.percentile(1));
+	CHECK_EQ(UINT32_MAX, histogram.percentile(100));
+	histogram.add(0);
+	CHECK_EQ(0, histogram.percentile(0));
+} // testEdges
+
+
+/**
+ * @brief Check the reported percentiles of a sample against the exact ones, the value of rank
+ * ceil(n * p / 100).
+ */
+static void checkPercentiles(std::vector<uint32_t> values) {
+	BTLatencyHistogram histogram;
+	for (uint32_t value : values) {
+		histogram.add(value);
+	}
+	std::sort(values.begin(), values.end());
+	CHECK_EQ(values.size(), histogram.getCount());
+	CHECK_EQ(values.back(), histogram.getMax());
+	const uint8_t percents[] = { 1, 10, 25, 50, 75, 90, 99, 100 };
+	for (uint8_t percent : percents) {
+		size_t   rank     = (values.size() * percent + 99) / 100;
+		uint32_t exact    = values[rank - 1];
+		uint32_t reported = histogram.percentile(percent);
+		CHECK(reported >= exact);
+		CHECK((uint64_t)reported * 4 <= (uint64_t)exact * 5);   // Within 25%.
+	}
+	CHECK_EQ(values.back(), histogram.percentile(100));
+} // checkPercentiles
+
+
+/**
+ * @brief Uniform, log-uniform over the whole range, a tight cluster around a bucket boundary,
+ * bimodal and constant samples.
+ */
+static void testKnownDistributions() {
+	std::mt19937 random(7);
+	std::vector<uint32_t> uniform;
+	for (int i = 0; i < 100000; i++) {
+		uniform.push_back(random() % 1000000);
+	}
+	checkPercentiles(uniform);
+
+	std::vector<uint32_t> logUniform;
+	for (int i = 0; i < 100000; i++) {
+		logUniform.push_back(random() >> (random() % 32));
+	}
+	checkPercentiles(logUniform);
+
+	std::vector<uint32_t> boundary;
+	for (int i = 0; i < 10000; i++) {
+		boundary.push_back(4095 + random() % 3);   // 4095 ends a bucket, 4096 starts the next.
+	}
+	checkPercentiles(boundary);
+
+	std::vector<uint32_t> bimodal;
+	for (int i = 0; i < 10000; i++) {
+		bimodal.push_back(i % 10 == 0 ? 2000000 + random() % 1000 : 5000 + random() % 100);
+	}
+	checkPercentiles(bimodal);
+
+	checkPercentiles(std::vector<uint32_t>(1000, 12345));
+	checkPercentiles(std::vector<uint32_t>(1000, UINT32_MAX - 1));
+} // testKnownDistributions
+
+
+int main() {
+	RUN(testBucketBoundaries);
+	RUN(testEdges);
+	RUN(testKnownDistributions);
+	return BT_TEST_RESULT();
+} // main
@@ -0,0 +1,341 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Bounded results under eviction: the open addressing index must always point at the slot holding an
+// address, the stored set must be the least recently seen ones, and the preallocated RSSI histories
+// must be reused, not grown.  onEvicted() sees the evicted record before its slot is reused.  Copies
+// taken out of the results keep their names after the next scan.
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+
+static int scansCompleted = 0;
+
+static void onScanComplete(const BTScanResults& results) {
+	scansCompleted++;
+} // onScanComplete
+
+
+static uint64_t addressOf(uint32_t n) {
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(n, address);
+	return BTAddress(address).toUint64();
+} // addressOf
+
+
+static void sight(uint32_t n, int8_t rssi) {
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(n, address);
+	FakeStack::emitDiscRes(address, rssi);
+} // sight
+
+
+/**
+ * @brief Start a scan and leave the inquiry running.
+ */
+static BTScan* beginScan(uint32_t maxResults, uint8_t historyBlocks) {
+	BTDevice::init("results_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setMaxResults(maxResults);
+	pScan->setRssiHistory(historyBlocks);
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	return pScan;
+} // beginScan
+
+
+static void endScan() {
+	int before = scansCompleted;
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	CHECK_EQ(before + 1, scansCompleted);
+} // endScan
+
+
+/**
+ * @brief Random sightings of more devices than fit, checked against a reference LRU after each one.
+ */
+static void testEvictionFollowsReference() {
+	const uint32_t capacity = 8;
+	BTScan* pScan = beginScan(capacity, 0);
+
+	std::list<uint32_t>         lru;       // Most recently seen first.
+	std::map<uint32_t, int8_t>  lastRssi;
+	uint32_t                    seed = 12345;
+	for (int i = 0; i < 300; i++) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t n    = (seed >> 16) % 24;
+		int8_t   rssi = -30 - (int8_t)((seed >> 8) % 60);
+		sight(n, rssi);
+
+		lru.remove(n);
+		lru.push_front(n);
+		if (lru.size() > capacity) {
+			lru.pop_back();
+		}
+		lastRssi[n] = rssi;
+
+		const BTScanResults& results = pScan->getResultsRef();
+		CHECK_EQ(lru.size(), results.getCount());
+		std::set<uint64_t> stored;
+		for (int slot = 0; slot < results.getCount(); slot++) {
+			stored.insert(results.getDevice(slot).getAddress().toUint64());
+		}
+		for (uint32_t expected : lru) {
+			CHECK(stored.count(addressOf(expected)) == 1);
+		}
+	}
+
+	// The index finds every stored address in its own slot, so a repeat refreshes that slot only.
+	const BTScanResults& results = pScan->getResultsRef();
+	for (uint32_t n : lru) {
+		for (int slot = 0; slot < results.getCount(); slot++) {
+			if (results.getDevice(slot).getAddress().toUint64() == addressOf(n)) {
+				CHECK_EQ(lastRssi[n], results.getRSSI(slot));
+			}
+		}
+	}
+	endScan();
+} // testEvictionFollowsReference
+
+
+/**
+ * @brief Records every eviction, checking from inside the callback that the evicted record is still
+ * stored and the incoming device not yet.
+ */
+class EvictionCallbacks : public BTAdvertisedDeviceCallbacks {
+public:
+	BTScan*               pScan    = nullptr;
+	uint64_t              incoming = 0;
+	std::vector<uint64_t> evicted;
+	std::vector<int8_t>   evictedRssi;
+	void onResult(BTAdvertisedDevice advertisedDevice) {}
+	void onEvicted(BTAdvertisedDevice& advertisedDevice) {
+		uint64_t address = advertisedDevice.getAddress().toUint64();
+		evicted.push_back(address);
+		evictedRssi.push_back(advertisedDevice.getRSSI());
+		const BTScanResults& results = pScan->getResultsRef();
+		bool stored = false;
+		bool reused = false;
+		for (int slot = 0; slot < results.getCount(); slot++) {
+			uint64_t inSlot = results.getDevice(slot).getAddress().toUint64();
+			stored = stored || inSlot == address;
+			reused = reused || inSlot == incoming;
+		}
+		CHECK(stored);
+		CHECK(!reused);
+	}
+};
+
+
+/**
+ * @brief Each device pushed out of full results reaches onEvicted() with its last RSSI, in the
+ * order of a reference LRU, while its slot still holds it; afterwards the slot holds the newcomer.
+ */
+static void testEvictedBeforeReuse() {
+	const uint32_t    capacity = 4;
+	EvictionCallbacks callbacks;
+	BTScan* pScan = beginScan(capacity, 0);
+	pScan->setAdvertisedDeviceCallbacks(&callbacks);
+	callbacks.pScan = pScan;
+
+	std::list<uint32_t>        lru;   // Most recently seen first.
+	std::map<uint32_t, int8_t> lastRssi;
+	std::vector<uint32_t>      expected;
+	uint32_t                   seed = 777;
+	for (int i = 0; i < 200; i++) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t n    = (seed >> 16) % 10;
+		int8_t   rssi = -30 - (int8_t)((seed >> 8) % 60);
+		callbacks.incoming = addressOf(n);
+		sight(n, rssi);
+
+		lru.remove(n);
+		lru.push_front(n);
+		if (lru.size() > capacity) {
+			expected.push_back(lru.back());
+			lru.pop_back();
+		}
+		CHECK_EQ(expected.size(), callbacks.evicted.size());
+		if (!expected.empty() && expected.size() == callbacks.evicted.size()) {
+			CHECK_EQ(addressOf(expected.back()), callbacks.evicted.back());
+			CHECK_EQ(lastRssi[expected.back()], callbacks.evictedRssi.back());
+		}
+		lastRssi[n] = rssi;
+	}
+	CHECK(expected.size() > 50);
+	endScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+} // testEvictedBeforeReuse
+
+
+/**
+ * @brief A second scan over the same storage starts from an empty index.
+ */
+static void testClearEmptiesIndex() {
+	BTScan* pScan = beginScan(4, 0);
+	for (uint32_t n = 0; n < 4; n++) {
+		sight(n, -40);
+	}
+	endScan();
+
+	beginScan(4, 0);
+	for (uint32_t n = 0; n < 4; n++) {
+		sight(n, -50);
+	}
+	const BTScanResults& results = pScan->getResultsRef();
+	CHECK_EQ(4, results.getCount());
+	for (int slot = 0; slot < results.getCount(); slot++) {
+		CHECK_EQ(-50, results.getRSSI(slot));
+	}
+	endScan();
+} // testClearEmptiesIndex
+
+
+/**
+ * @brief With bounded results there is one history per slot from the start, cleared when reused.
+ */
+static void testHistoriesPreallocated() {
+	BTScan* pScan = beginScan(4, 2);
+	const BTScanResults& results = pScan->getResultsRef();
+	size_t before = results.getMemoryUsage();
+	for (uint32_t n = 0; n < 10; n++) {
+		sight(n, -40);
+		sight(n, -45);
+	}
+	CHECK_EQ(4, results.getCount());
+	for (uint32_t slot = 0; slot < 4; slot++) {
+		const BTRssiHistory* pHistory = results.getRssiHistory(slot);
+		CHECK(pHistory != nullptr);
+		if (pHistory != nullptr) {
+			CHECK_EQ(2, pHistory->getCount());   // The previous owner of the slot left nothing behind.
+		}
+	}
+	CHECK(results.getRssiHistory(4) == nullptr);
+	CHECK(results.getRssiHistory(100) == nullptr);
+
+	// Records keep their strings in the arena, so only what the results themselves hold is compared.
+	CHECK(results.getMemoryUsage() - before < 4 * sizeof(BTAdvertisedDevice) + 1024);
+	endScan();
+
+	pScan->setRssiHistory(0);
+	pScan->setMaxResults(0);
+} // testHistoriesPreallocated
+
+
+/**
+ * @brief Unbounded results grow the index as they go.
+ */
+static void testUnboundedGrows() {
+	BTScan* pScan = beginScan(0, 0);
+	for (uint32_t n = 0; n < 200; n++) {
+		sight(n, -60);
+	}
+	sight(7, -33);
+	const BTScanResults& results = pScan->getResultsRef();
+	CHECK_EQ(200, results.getCount());
+	for (int slot = 0; slot < results.getCount(); slot++) {
+		if (results.getDevice(slot).getAddress().toUint64() == addressOf(7)) {
+			CHECK_EQ(-33, results.getRSSI(slot));
+		}
+	}
+	endScan();
+} // testUnboundedGrows
+
+
+static BTScanResults completedCopy;
+
+static void onScanCompleteCopy(BTScanResults results) {
+	completedCopy = results;
+	scansCompleted++;
+} // onScanCompleteCopy
+
+
+/**
+ * @brief Sight a device advertising a name and a 16 bit service UUID in its EIR.
+ */
+static void sightNamed(uint32_t n, const char* name, uint16_t uuid) {
+	uint8_t address[ESP_BD_ADDR_LEN];
+	uint8_t eir[32];
+	size_t  length = strlen(name);
+	FakeStack::makeAddress(n, address);
+	eir[0] = 1 + length;
+	eir[1] = ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME;
+	memcpy(eir + 2, name, length);
+	eir[2 + length] = 3;
+	eir[3 + length] = ESP_BT_EIR_TYPE_CMPL_16BITS_UUID;
+	eir[4 + length] = uuid & 0xff;
+	eir[5 + length] = uuid >> 8;
+	FakeStack::emitDiscRes(address, -60, 0, eir, length + 6);
+} // sightNamed
+
+
+/**
+ * @brief Copies that leave the results keep the name and service UUIDs, which live in the scan
+ * arena, after the next scan reset it and reused the memory.
+ */
+static void testCopiesOutliveScan() {
+	BTScan* pScan = beginScan(0, 0);
+	sightNamed(1, "kitchen", 0x110b);
+	endScan();
+
+	BTScanResults      results = pScan->getResults();
+	BTAdvertisedDevice device  = pScan->getResultsRef().getDevice(0);
+	BTAdvertisedDevice copy    = results.getDevice(0);
+
+	CHECK(pScan->start(10, onScanCompleteCopy));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	sightNamed(2, "garage!", 0x1108);   // Same length, lands where the old name was.
+	endScan();
+	BTScanResults completed = completedCopy;
+
+	pScan->clearResults();
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	sightNamed(3, "cellar!", 0x1101);
+	endScan();
+
+	CHECK(device.haveName());
+	CHECK(device.getName() == "kitchen");
+	CHECK(device.isAdvertisingService(BTUUID((uint16_t)0x110b)));
+	CHECK(copy.getName() == "kitchen");
+	CHECK(results.getDevice(0).getName() == "kitchen");
+	CHECK(results.getDevice(0).getServiceUUID().equals(BTUUID((uint16_t)0x110b)));
+	CHECK_EQ(1, completed.getCount());
+	CHECK(completed.getDevice(0).getName() == "garage!");
+	CHECK(completed.getDevice(0).isAdvertisingService(BTUUID((uint16_t)0x1108)));
+	CHECK(pScan->getResultsRef().getDevice(0).getName() == "cellar!");
+	completedCopy = BTScanResults();
+} // testCopiesOutliveScan
+
+
+int main() {
+	FakeStack::reset();
+	RUN(testEvictionFollowsReference);
+	RUN(testEvictedBeforeReuse);
+	RUN(testClearEmptiesIndex);
+	RUN(testHistoriesPreallocated);
+	RUN(testUnboundedGrows);
+	RUN(testCopiesOutliveScan);
+	return BT_TEST_RESULT();
+} // main
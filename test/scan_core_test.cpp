@@ -0,0 +1,140 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BTScanCore over FakeStack: it receives its events through the BTDevice dispatcher, next to BTScan,
+// and starts its inquiries the way BTScan does.
+
+#include <stdint.h>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+#include "BTScanCore.h"
+
+struct CountDevices {
+	int results = 0;
+	void operator()(BTAdvertisedDevice&) {
+		results++;
+	}
+};
+
+typedef BTScanCore<BTStaticStorage<4>, BTDedupMerge, BTStaticDispatch<CountDevices> > StaticCore;
+
+static int completions = 0;
+
+static void onComplete(void* pContext) {
+	completions++;
+} // onComplete
+
+
+static void testAttachedNextToBTScan() {
+	FakeStack::reset();
+	BTDevice::init("scan_core_test");
+	BTDevice::getScan();   // BTScan keeps its own registration.
+	StaticCore core;
+	core.setCompleteCallback(onComplete);
+	CHECK(core.attach());
+
+	CHECK(core.start(5));
+	CHECK_EQ(1, FakeStack::calls().setScanMode);
+	CHECK_EQ(BTScan::inquiryUnits(5), FakeStack::calls().inquiryLength);
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(1, address);
+	FakeStack::emitDiscRes(address, -70);
+	FakeStack::emitDiscRes(address, -40);
+	FakeStack::makeAddress(2, address);
+	FakeStack::emitDiscRes(address, -60);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+
+	CHECK_EQ(2, core.getCount());
+	CHECK_EQ(2, core.getFunctor().results);
+	CHECK_EQ(-40, core.getDevice(0).getRSSI());   // Merged from the repeat.
+	CHECK_EQ(1, completions);
+	CHECK(!core.isScanning());
+
+	core.detach();
+	CHECK(core.start(1));
+	CHECK_EQ(1, FakeStack::calls().inquiryLength);
+	FakeStack::emitDiscRes(address, -60);
+	CHECK_EQ(0, core.getCount());   // No longer routed.
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	CHECK_EQ(1, completions);
+} // testAttachedNextToBTScan
+
+
+/**
+ * @brief The dispatcher's per event limit is reported rather than silently taking the slot of another.
+ */
+static void testAttachFailsWhenFull() {
+	std::vector<StaticCore*> cores;
+	bool failed = false;
+	for (int i = 0; i < BT_GAP_MAX_HANDLERS + 1 && !failed; i++) {
+		cores.push_back(new StaticCore());
+		failed = !cores.back()->attach();
+	}
+	CHECK(failed);
+	for (size_t i = 0; i < cores.size(); i++) {
+		cores[i]->detach();
+		delete cores[i];
+	}
+	StaticCore core;
+	CHECK(core.attach());
+	core.detach();
+} // testAttachFailsWhenFull
+
+
+static int handled = 0;
+
+static void countEvent(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param, void* pArg) {
+	handled++;
+} // countEvent
+
+
+/**
+ * @brief eventsReceived counts every GAP event at the dispatcher, including those BTScan has no
+ * handler for, and each handler's stats count its own calls.
+ */
+static void testEventsCountedAtDispatcher() {
+	FakeStack::reset();
+	BTDevice::init("scan_core_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->getStats(true);
+	CHECK(BTDevice::registerGapHandler(ESP_BT_GAP_CFM_REQ_EVT, countEvent));
+
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(1, address);
+	FakeStack::emitDiscRes(address, -70);
+	esp_bt_gap_cb_param_t param = {};
+	FakeStack::emit(ESP_BT_GAP_AUTH_CMPL_EVT, &param);   // No handler at all.
+	FakeStack::emit(ESP_BT_GAP_CFM_REQ_EVT, &param);
+	FakeStack::emit(ESP_BT_GAP_CFM_REQ_EVT, &param);
+	CHECK_EQ(4, pScan->getStats().eventsReceived);
+
+	BTGapHandlerStats stats;
+	CHECK(BTDevice::getGapHandlerStats(ESP_BT_GAP_CFM_REQ_EVT, countEvent, nullptr, &stats));
+	CHECK_EQ(2, handled);
+	CHECK_EQ(2, stats.calls);
+	CHECK(stats.maxUs <= stats.totalUs);
+	CHECK(BTDevice::unregisterGapHandler(ESP_BT_GAP_CFM_REQ_EVT, countEvent));
+	CHECK(!BTDevice::getGapHandlerStats(ESP_BT_GAP_CFM_REQ_EVT, countEvent, nullptr, &stats));
+} // testEventsCountedAtDispatcher
+
+
+int main() {
+	RUN(testAttachedNextToBTScan);
+	RUN(testAttachFailsWhenFull);
+	RUN(testEventsCountedAtDispatcher);
+	return BT_TEST_RESULT();
+} // main
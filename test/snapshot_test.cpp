@@ -0,0 +1,260 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Snapshot merging: the parallel merge agrees with the serial one, merging is commutative, associative
+// and idempotent, and the counts a node publishes survive its scans.
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+#include "BTScanSnapshot.h"
+
+static const size_t NODES = 8;
+
+/**
+ * @brief Random snapshots of overlapping address spaces, as scanners of one site would produce.
+ */
+static void makeSnapshots(std::vector<BTScanSnapshot>& snapshots, size_t entries, uint32_t seed) {
+	std::mt19937 random(seed);
+	snapshots.assign(NODES, BTScanSnapshot());
+	for (size_t n = 0; n < NODES; n++) {
+		for (size_t i = 0; i < entries; i++) {
+			BTSnapshotEntry entry;
+			entry.address  = random() % (entries * 2);   // Most devices are heard by several nodes.
+			entry.node     = (uint16_t)(random() % 3 == 0 ? (n + 1) % NODES : n);   // Some keys repeat across inputs.
+			entry.lastSeen = 1700000000000ULL + random() % 100000;
+			entry.count    = random() % 1000;
+			entry.bestRssi = (int8_t)(-30 - (int)(random() % 70));
+			snapshots[n].add(entry);
+		}
+		snapshots[n].normalize();
+	}
+} // makeSnapshots
+
+
+static bool sameEntries(const BTScanSnapshot& a, const BTScanSnapshot& b) {
+	if (a.getCount() != b.getCount()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.getCount(); i++) {
+		const BTSnapshotEntry& x = a.getEntry(i);
+		const BTSnapshotEntry& y = b.getEntry(i);
+		if (!x.sameKey(y) || x.lastSeen != y.lastSeen || x.count != y.count || x.bestRssi != y.bestRssi) {
+			return false;
+		}
+	}
+	return true;
+} // sameEntries
+
+
+static void mergeAll(const std::vector<BTScanSnapshot>& snapshots, BTScanSnapshot& output, bool parallel,
+		unsigned threads = 4) {
+	std::vector<const BTScanSnapshot*> inputs;
+	for (size_t i = 0; i < snapshots.size(); i++) {
+		inputs.push_back(&snapshots[i]);
+	}
+	if (parallel) {
+		BTScanSnapshot::mergeParallel(inputs.data(), inputs.size(), output, threads);
+	} else {
+		BTScanSnapshot::merge(inputs.data(), inputs.size(), output);
+	}
+} // mergeAll
+
+
+static void testParallelMatchesSerial() {
+	std::vector<BTScanSnapshot> snapshots;
+	makeSnapshots(snapshots, 20000, 1);
+	BTScanSnapshot serial;
+	mergeAll(snapshots, serial, false);
+	CHECK(serial.getCount() > 0);
+	for (unsigned threads = 1; threads <= 8; threads++) {
+		BTScanSnapshot parallel;
+		mergeAll(snapshots, parallel, true, threads);
+		CHECK(sameEntries(serial, parallel));
+	}
+
+	BTScanSnapshot folded = snapshots[0];   // mergeFrom() one at a time agrees too.
+	for (size_t i = 1; i < snapshots.size(); i++) {
+		folded.mergeFrom(snapshots[i]);
+	}
+	CHECK(sameEntries(serial, folded));
+} // testParallelMatchesSerial
+
+
+static void testMergeIsCommutativeAndAssociative() {
+	std::vector<BTScanSnapshot> snapshots;
+	makeSnapshots(snapshots, 2000, 2);
+	BTScanSnapshot expected;
+	mergeAll(snapshots, expected, false);
+
+	std::mt19937 random(3);
+	for (int round = 0; round < 20; round++) {
+		std::vector<BTScanSnapshot> shuffled = snapshots;
+		std::shuffle(shuffled.begin(), shuffled.end(), random);
+		BTScanSnapshot merged;
+		mergeAll(shuffled, merged, round % 2 == 0);
+		CHECK(sameEntries(expected, merged));
+
+		// Any grouping: merge a random split separately, then the two halves.
+		size_t split = 1 + random() % (shuffled.size() - 1);
+		std::vector<BTScanSnapshot> left(shuffled.begin(), shuffled.begin() + split);
+		std::vector<BTScanSnapshot> right(shuffled.begin() + split, shuffled.end());
+		std::vector<BTScanSnapshot> halves(2);
+		mergeAll(left, halves[0], false);
+		mergeAll(right, halves[1], true);
+		BTScanSnapshot grouped;
+		mergeAll(halves, grouped, false);
+		CHECK(sameEntries(expected, grouped));
+	}
+} // testMergeIsCommutativeAndAssociative
+
+
+static void testMergeIsIdempotent() {
+	std::vector<BTScanSnapshot> snapshots;
+	makeSnapshots(snapshots, 2000, 4);
+	BTScanSnapshot once;
+	mergeAll(snapshots, once, false);
+
+	std::vector<BTScanSnapshot> twice = snapshots;   // Every snapshot delivered twice.
+	twice.insert(twice.end(), snapshots.begin(), snapshots.end());
+	BTScanSnapshot merged;
+	mergeAll(twice, merged, true);
+	CHECK(sameEntries(once, merged));
+
+	std::vector<BTScanSnapshot> again(2, once);   // Merging a result with itself changes nothing.
+	BTScanSnapshot self;
+	mergeAll(again, self, false);
+	CHECK(sameEntries(once, self));
+
+	std::vector<BTScanSnapshot> withResult = snapshots;   // Nor does merging it back into its inputs.
+	withResult.push_back(once);
+	BTScanSnapshot fed;
+	mergeAll(withResult, fed, true);
+	CHECK(sameEntries(once, fed));
+} // testMergeIsIdempotent
+
+
+static void testSerializeRoundTrip() {
+	std::vector<BTScanSnapshot> snapshots;
+	makeSnapshots(snapshots, 2000, 5);
+	BTScanSnapshot merged;
+	mergeAll(snapshots, merged, false);
+	std::vector<uint8_t> buffer(merged.getMaxSerializedSize());
+	size_t length = merged.serialize(buffer.data(), buffer.size());
+	CHECK(length > 0);
+	BTScanSnapshot decoded;
+	CHECK(decoded.deserialize(buffer.data(), length));
+	CHECK(sameEntries(merged, decoded));
+} // testSerializeRoundTrip
+
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+static void scan(BTScan* pScan, const uint8_t* address, int sightings) {
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	for (int i = 0; i < sightings; i++) {
+		FakeStack::emitDiscRes(address, -60);
+		FakeStack::advanceMs(10);
+	}
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+} // scan
+
+
+static const BTSnapshotEntry* findEntry(const BTScanSnapshot& snapshot, uint64_t address) {
+	for (size_t i = 0; i < snapshot.getCount(); i++) {
+		if (snapshot.getEntry(i).address == address) {
+			return &snapshot.getEntry(i);
+		}
+	}
+	return nullptr;
+} // findEntry
+
+
+/**
+ * @brief The count a node publishes keeps growing over scans, clearResults() and eviction, so the
+ * aggregator's maximum is the latest value rather than the largest single scan.  The results hold
+ * no totals: only the snapshot carries them.
+ */
+static void testCountsSurviveScans() {
+	FakeStack::reset();
+	BTDevice::init("snapshot_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	pScan->setMaxResults(2);
+
+	uint8_t first[ESP_BD_ADDR_LEN];
+	uint8_t second[ESP_BD_ADDR_LEN];
+	uint8_t third[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(1, first);
+	FakeStack::makeAddress(2, second);
+	FakeStack::makeAddress(3, third);
+	uint64_t firstAddress = BTAddress(first).toUint64();
+
+	BTScanSnapshot snapshot;
+	scan(pScan, first, 5);
+	snapshot.fromResults(pScan->getResultsRef(), 7);
+	CHECK(findEntry(snapshot, firstAddress) != nullptr);
+	CHECK_EQ(5, findEntry(snapshot, firstAddress)->count);
+	CHECK_EQ(7, findEntry(snapshot, firstAddress)->node);
+
+	scan(pScan, first, 2);   // start() cleared the results.
+	snapshot.fromResults(pScan->getResultsRef(), 7);
+	CHECK_EQ(7, findEntry(snapshot, firstAddress)->count);
+
+	pScan->clearResults();
+	scan(pScan, first, 1);
+	snapshot.fromResults(pScan->getResultsRef(), 7);
+	CHECK_EQ(8, findEntry(snapshot, firstAddress)->count);
+
+	CHECK(pScan->start(10, onScanComplete));   // Evicted by two newer devices, then seen again.
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	FakeStack::emitDiscRes(first, -60);
+	FakeStack::emitDiscRes(second, -60);
+	FakeStack::emitDiscRes(third, -60);
+	FakeStack::emitDiscRes(first, -60);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	snapshot.fromResults(pScan->getResultsRef(), 7);
+	CHECK_EQ(9, findEntry(snapshot, firstAddress)->count);   // The sighting before the eviction is lost.
+	snapshot.fromResults(pScan->getResultsRef(), 7);
+	CHECK_EQ(9, findEntry(snapshot, firstAddress)->count);   // Idempotent within a scan.
+
+	size_t memory = pScan->getResultsRef().getMemoryUsage();
+	for (int i = 0; i < 100; i++) {   // Churning through new devices does not grow the results.
+		uint8_t address[ESP_BD_ADDR_LEN];
+		FakeStack::makeAddress(100 + i, address);
+		scan(pScan, address, 1);
+	}
+	CHECK_EQ(memory, pScan->getResultsRef().getMemoryUsage());
+	pScan->setMaxResults(0);
+} // testCountsSurviveScans
+
+
+int main() {
+	RUN(testParallelMatchesSerial);
+	RUN(testMergeIsCommutativeAndAssociative);
+	RUN(testMergeIsIdempotent);
+	RUN(testSerializeRoundTrip);
+	RUN(testCountsSurviveScans);
+	return BT_TEST_RESULT();
+} // main
@@ -0,0 +1,38 @@
+// Host stand-in for the FreeRTOS wrapper of the Arduino-ESP32 BLE library: the Semaphore is a binary
+// semaphore over std::mutex, created given.  Copies share the semaphore, like copies of a handle.
+#pragma once
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "freertos/FreeRTOS.h"
+
+class FreeRTOS {
+public:
+	static void     sleep(uint32_t ms);
+	static uint32_t getTimeSinceStart();
+
+	class Semaphore {
+	public:
+		Semaphore(std::string owner = "<Unknown>");
+		void        give();
+		void        give(uint32_t value);
+		bool        take(std::string owner = "<Unknown>");
+		bool        take(uint32_t timeoutMs, std::string owner = "<Unknown>");
+		uint32_t    wait(std::string owner = "<Unknown>");
+		bool        timedWait(std::string owner = "<Unknown>", uint32_t timeoutMs = portMAX_DELAY);
+		std::string toString();
+
+	private:
+		struct State {
+			std::mutex              lock;
+			std::condition_variable given;
+			bool                    free;
+			uint32_t                value;
+			std::string             name;
+			std::string             owner;
+		};
+		std::shared_ptr<State> m_state;
+	};
+};
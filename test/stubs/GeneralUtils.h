@@ -0,0 +1,8 @@
+// Host stand-in for the GeneralUtils helper of the Arduino-ESP32 BLE library.
+#pragma once
+#include "esp_err.h"
+
+class GeneralUtils {
+public:
+	static const char* errorToString(esp_err_t errCode);
+};
@@ -0,0 +1,6 @@
+// Host stand-in for the Arduino-ESP32 header of the same name.
+#pragma once
+
+bool btStarted();
+bool btStart();
+bool btStop();
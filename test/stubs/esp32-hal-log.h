@@ -0,0 +1,10 @@
+// Host stand-in for the Arduino-ESP32 header of the same name: errors and warnings go to stderr,
+// the chattier levels are compiled out.
+#pragma once
+#include <stdio.h>
+
+#define log_e(format, ...) fprintf(stderr, "E " format "\n", ##__VA_ARGS__)
+#define log_w(format, ...) fprintf(stderr, "W " format "\n", ##__VA_ARGS__)
+#define log_i(format, ...) do {} while (0)
+#define log_d(format, ...) do {} while (0)
+#define log_v(format, ...) do {} while (0)
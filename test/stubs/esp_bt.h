@@ -0,0 +1,31 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+#pragma once
+#include "esp_bt_defs.h"
+
+typedef enum {
+	ESP_BT_MODE_IDLE       = 0x00,
+	ESP_BT_MODE_BLE        = 0x01,
+	ESP_BT_MODE_CLASSIC_BT = 0x02,
+	ESP_BT_MODE_BTDM       = 0x03,
+} esp_bt_mode_t;
+
+typedef enum {
+	ESP_BT_CONTROLLER_STATUS_IDLE = 0,
+	ESP_BT_CONTROLLER_STATUS_INITED,
+	ESP_BT_CONTROLLER_STATUS_ENABLED,
+	ESP_BT_CONTROLLER_STATUS_NUM,
+} esp_bt_controller_status_t;
+
+typedef struct {
+	uint8_t mode;             // The controller modes the memory is reserved for.
+	uint8_t bt_max_acl_conn;
+} esp_bt_controller_config_t;
+
+#define BT_CONTROLLER_INIT_CONFIG_DEFAULT() { ESP_BT_MODE_BTDM, 2 }
+
+esp_err_t                  esp_bt_controller_init(esp_bt_controller_config_t* cfg);
+esp_err_t                  esp_bt_controller_deinit(void);
+esp_err_t                  esp_bt_controller_enable(esp_bt_mode_t mode);
+esp_err_t                  esp_bt_controller_disable(void);
+esp_bt_controller_status_t esp_bt_controller_get_status(void);
+esp_err_t                  esp_bt_controller_mem_release(esp_bt_mode_t mode);
@@ -0,0 +1,32 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+#define ESP_BD_ADDR_LEN  6
+typedef uint8_t esp_bd_addr_t[ESP_BD_ADDR_LEN];
+
+#define ESP_UUID_LEN_16  2
+#define ESP_UUID_LEN_32  4
+#define ESP_UUID_LEN_128 16
+typedef struct {
+	uint16_t len;
+	union {
+		uint16_t uuid16;
+		uint32_t uuid32;
+		uint8_t  uuid128[ESP_UUID_LEN_128];
+	} uuid;
+} __attribute__((packed)) esp_bt_uuid_t;
+
+typedef enum {
+	ESP_BT_DEVICE_TYPE_BREDR = 0x01,
+	ESP_BT_DEVICE_TYPE_BLE   = 0x02,
+	ESP_BT_DEVICE_TYPE_DUMO  = 0x03,
+} esp_bt_dev_type_t;
+
+typedef enum {
+	ESP_BT_STATUS_SUCCESS = 0,
+	ESP_BT_STATUS_FAIL,
+} esp_bt_status_t;
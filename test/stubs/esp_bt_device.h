@@ -0,0 +1,6 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+#pragma once
+#include "esp_bt_defs.h"
+
+const uint8_t* esp_bt_dev_get_address(void);
+esp_err_t      esp_bt_dev_set_device_name(const char* name);
@@ -0,0 +1,15 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+#pragma once
+#include "esp_bt_defs.h"
+
+typedef enum {
+	ESP_BLUEDROID_STATUS_UNINITIALIZED = 0,
+	ESP_BLUEDROID_STATUS_INITIALIZED,
+	ESP_BLUEDROID_STATUS_ENABLED,
+} esp_bluedroid_status_t;
+
+esp_bluedroid_status_t esp_bluedroid_get_status(void);
+esp_err_t              esp_bluedroid_init(void);
+esp_err_t              esp_bluedroid_deinit(void);
+esp_err_t              esp_bluedroid_enable(void);
+esp_err_t              esp_bluedroid_disable(void);
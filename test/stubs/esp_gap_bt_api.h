@@ -0,0 +1,127 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+#pragma once
+#include "esp_bt_defs.h"
+
+#define ESP_BT_GAP_EIR_DATA_LEN   240
+#define ESP_BT_GAP_MAX_BDNAME_LEN 248
+#define ESP_BT_GAP_MIN_INQ_LEN    0x01
+#define ESP_BT_GAP_MAX_INQ_LEN    0x30
+
+typedef enum {
+	ESP_BT_GAP_DEV_PROP_BDNAME = 1,
+	ESP_BT_GAP_DEV_PROP_COD,
+	ESP_BT_GAP_DEV_PROP_RSSI,
+	ESP_BT_GAP_DEV_PROP_EIR,
+} esp_bt_gap_dev_prop_type_t;
+
+typedef struct {
+	esp_bt_gap_dev_prop_type_t type;
+	int                        len;
+	void*                      val;
+} esp_bt_gap_dev_prop_t;
+
+typedef enum {
+	ESP_BT_GAP_DISC_RES_EVT = 0,
+	ESP_BT_GAP_DISC_STATE_CHANGED_EVT,
+	ESP_BT_GAP_RMT_SRVCS_EVT,
+	ESP_BT_GAP_RMT_SRVC_REC_EVT,
+	ESP_BT_GAP_AUTH_CMPL_EVT,
+	ESP_BT_GAP_PIN_REQ_EVT,
+	ESP_BT_GAP_CFM_REQ_EVT,
+	ESP_BT_GAP_KEY_NOTIF_EVT,
+	ESP_BT_GAP_KEY_REQ_EVT,
+	ESP_BT_GAP_READ_RSSI_DELTA_EVT,
+	ESP_BT_GAP_EVT_MAX,
+} esp_bt_gap_cb_event_t;
+
+typedef enum {
+	ESP_BT_GAP_DISCOVERY_STOPPED,
+	ESP_BT_GAP_DISCOVERY_STARTED,
+} esp_bt_gap_discovery_state_t;
+
+typedef union {
+	struct disc_res_param {
+		esp_bd_addr_t          bda;
+		int                    num_prop;
+		esp_bt_gap_dev_prop_t* prop;
+	} disc_res;
+	struct disc_state_changed_param {
+		esp_bt_gap_discovery_state_t state;
+	} disc_st_chg;
+	struct rmt_srvcs_param {
+		esp_bd_addr_t   bda;
+		esp_bt_status_t stat;
+		int             num_uuids;
+		esp_bt_uuid_t*  uuid_list;
+	} rmt_srvcs;
+	struct read_rssi_delta_param {
+		esp_bd_addr_t   bda;
+		esp_bt_status_t stat;
+		int8_t          rssi_delta;
+	} read_rssi_delta;
+} esp_bt_gap_cb_param_t;
+
+typedef void (*esp_bt_gap_cb_t)(esp_bt_gap_cb_event_t event, esp_bt_gap_cb_param_t* param);
+
+typedef enum {
+	ESP_BT_EIR_TYPE_FLAGS               = 0x01,
+	ESP_BT_EIR_TYPE_INCMPL_16BITS_UUID  = 0x02,
+	ESP_BT_EIR_TYPE_CMPL_16BITS_UUID    = 0x03,
+	ESP_BT_EIR_TYPE_INCMPL_32BITS_UUID  = 0x04,
+	ESP_BT_EIR_TYPE_CMPL_32BITS_UUID    = 0x05,
+	ESP_BT_EIR_TYPE_INCMPL_128BITS_UUID = 0x06,
+	ESP_BT_EIR_TYPE_CMPL_128BITS_UUID   = 0x07,
+	ESP_BT_EIR_TYPE_SHORT_LOCAL_NAME    = 0x08,
+	ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME     = 0x09,
+	ESP_BT_EIR_TYPE_TX_POWER_LEVEL      = 0x0a,
+	ESP_BT_EIR_TYPE_MANU_SPECIFIC       = 0xff,
+} esp_bt_eir_type_t;
+
+enum {
+	ESP_BT_COD_MAJOR_DEV_MISC = 0,
+	ESP_BT_COD_MAJOR_DEV_COMPUTER,
+	ESP_BT_COD_MAJOR_DEV_PHONE,
+	ESP_BT_COD_MAJOR_DEV_LAN_NAP,
+	ESP_BT_COD_MAJOR_DEV_AV,
+	ESP_BT_COD_MAJOR_DEV_PERIPHERAL,
+	ESP_BT_COD_MAJOR_DEV_IMAGING,
+	ESP_BT_COD_MAJOR_DEV_WEARABLE,
+	ESP_BT_COD_MAJOR_DEV_TOY,
+	ESP_BT_COD_MAJOR_DEV_HEALTH,
+	ESP_BT_COD_MAJOR_DEV_UNCATEGORIZED = 31,
+};
+
+enum {
+	ESP_BT_COD_SRVC_NONE         = 0,
+	ESP_BT_COD_SRVC_LMTD_DISCOVER = 0x1,
+	ESP_BT_COD_SRVC_POSITIONING  = 0x8,
+	ESP_BT_COD_SRVC_NETWORKING   = 0x10,
+	ESP_BT_COD_SRVC_RENDERING    = 0x20,
+	ESP_BT_COD_SRVC_CAPTURING    = 0x40,
+	ESP_BT_COD_SRVC_OBJ_TRANSFER = 0x80,
+	ESP_BT_COD_SRVC_AUDIO        = 0x100,
+	ESP_BT_COD_SRVC_TELEPHONY    = 0x200,
+	ESP_BT_COD_SRVC_INFORMATION  = 0x400,
+};
+
+typedef enum {
+	ESP_BT_SCAN_MODE_NONE = 0,
+	ESP_BT_SCAN_MODE_CONNECTABLE,
+	ESP_BT_SCAN_MODE_CONNECTABLE_DISCOVERABLE,
+} esp_bt_scan_mode_t;
+
+typedef enum {
+	ESP_BT_INQ_MODE_GENERAL_INQUIRY,
+	ESP_BT_INQ_MODE_LIMITED_INQUIRY,
+} esp_bt_inq_mode_t;
+
+esp_err_t esp_bt_gap_register_callback(esp_bt_gap_cb_t callback);
+esp_err_t esp_bt_gap_set_scan_mode(esp_bt_scan_mode_t mode);
+esp_err_t esp_bt_gap_start_discovery(esp_bt_inq_mode_t mode, uint8_t inq_len, uint8_t num_rsps);
+esp_err_t esp_bt_gap_cancel_discovery(void);
+esp_err_t esp_bt_gap_get_remote_services(esp_bd_addr_t remote_bda);
+uint8_t*  esp_bt_gap_resolve_eir_data(uint8_t* eir, esp_bt_eir_type_t type, uint8_t* length);
+bool      esp_bt_gap_is_valid_cod(uint32_t cod);
+uint32_t  esp_bt_gap_get_cod_major_dev(uint32_t cod);
+uint32_t  esp_bt_gap_get_cod_minor_dev(uint32_t cod);
+uint32_t  esp_bt_gap_get_cod_srvc(uint32_t cod);
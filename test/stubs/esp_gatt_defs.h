@@ -0,0 +1,8 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+#pragma once
+#include "esp_bt_defs.h"
+
+typedef struct {
+	esp_bt_uuid_t uuid;
+	uint8_t       inst_id;
+} __attribute__((packed)) esp_gatt_id_t;
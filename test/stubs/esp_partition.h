@@ -0,0 +1,38 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+// There is no flash on the host: esp_partition_find_first() only finds what FakeStack::setPartition()
+// provides, and esp_partition_mmap() maps it from RAM.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef enum {
+	ESP_PARTITION_TYPE_APP  = 0x00,
+	ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef enum {
+	ESP_PARTITION_SUBTYPE_ANY = 0xff,
+} esp_partition_subtype_t;
+
+typedef struct {
+	esp_partition_type_t    type;
+	esp_partition_subtype_t subtype;
+	uint32_t                address;
+	uint32_t                size;
+	char                    label[17];
+} esp_partition_t;
+
+typedef uint32_t spi_flash_mmap_handle_t;
+
+typedef enum {
+	SPI_FLASH_MMAP_DATA,
+	SPI_FLASH_MMAP_INST,
+} spi_flash_mmap_memory_t;
+
+#define ESP_PARTITION_MMAP_DATA SPI_FLASH_MMAP_DATA
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label);
+esp_err_t esp_partition_mmap(const esp_partition_t* partition, size_t offset, size_t size,
+	spi_flash_mmap_memory_t memory, const void** out_ptr, spi_flash_mmap_handle_t* out_handle);
+void      spi_flash_munmap(spi_flash_mmap_handle_t handle);
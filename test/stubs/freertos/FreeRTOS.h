@@ -0,0 +1,17 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+typedef uint32_t TickType_t;
+typedef int      BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define portTICK_PERIOD_MS 1
+#define portMAX_DELAY      0xffffffff
+#define pdMS_TO_TICKS(ms)  (ms)
+#define pdTRUE             1
+#define pdFALSE            0
+#define pdPASS             1
+#define pdFAIL             0
+#define tskNO_AFFINITY     0x7fffffff
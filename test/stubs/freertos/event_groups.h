@@ -0,0 +1,3 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+#pragma once
+#include "FreeRTOS.h"
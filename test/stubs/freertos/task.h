@@ -0,0 +1,17 @@
+// Host stand-in for the ESP-IDF header of the same name, just enough to build the library on Linux.
+// Tasks are std::threads and the tick is a real millisecond.
+#pragma once
+#include "FreeRTOS.h"
+
+typedef struct tskTaskControlBlock* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* pvParameters);
+
+void       vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stackDepth, void* pvParameters,
+	UBaseType_t priority, TaskHandle_t* pCreatedTask);
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char* name, uint32_t stackDepth,
+	void* pvParameters, UBaseType_t priority, TaskHandle_t* pCreatedTask, BaseType_t coreId);
+void       vTaskDelete(TaskHandle_t task);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t   ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait);
@@ -0,0 +1,8 @@
+// Host stand-in for the generated ESP-IDF configuration.  ESP_PLATFORM is deliberately not defined:
+// host-portable modules key off it to leave out the parts that need the real stack, and the host
+// library of the tests adds CONFIG_BT_ENABLED to the command line for the parts that only need a stack.
+#pragma once
+#define CONFIG_BT_ENABLED                1
+#define CONFIG_BLUEDROID_ENABLED         1
+#define CONFIG_CLASSIC_BT_ENABLED        1
+#define CONFIG_BTDM_CONTROLLER_MODE_BTDM 1
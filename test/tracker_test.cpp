@@ -0,0 +1,225 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Change tracking across scans: off until asked for, arrivals, RSSI changes past the threshold and
+// departures after the configured number of scans, a log that only holds what changed and that stays
+// within BT_TRACKER_MAX_CHANGES.
+
+#include <stdint.h>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+
+struct Sighting {
+	uint32_t n;
+	int8_t   rssi;
+};
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+static uint64_t addressOf(uint32_t n) {
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(n, address);
+	return BTAddress(address).toUint64();
+} // addressOf
+
+
+/**
+ * @brief Run a whole scan that sees the given devices.
+ */
+static void scan(BTScan* pScan, const std::vector<Sighting>& sightings) {
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	for (size_t i = 0; i < sightings.size(); i++) {
+		uint8_t address[ESP_BD_ADDR_LEN];
+		FakeStack::makeAddress(sightings[i].n, address);
+		FakeStack::emitDiscRes(address, sightings[i].rssi);
+		FakeStack::advanceMs(1);
+	}
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+} // scan
+
+
+static std::vector<Sighting> population(uint32_t first, uint32_t count, int8_t rssi) {
+	std::vector<Sighting> sightings;
+	for (uint32_t n = first; n < first + count; n++) {
+		sightings.push_back({ n, rssi });
+	}
+	return sightings;
+} // population
+
+
+static BTScan* getScan() {
+	FakeStack::reset();
+	BTDevice::init("tracker_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	return pScan;
+} // getScan
+
+
+/**
+ * @brief Get the scanner with tracking on and the devices of earlier tests departed.
+ */
+static BTScan* setUp() {
+	BTScan* pScan = getScan();
+	pScan->setChangeThresholds(10, 1);
+	scan(pScan, {});
+	return pScan;
+} // setUp
+
+
+/**
+ * @brief Without getGeneration() or setChangeThresholds() nothing is tracked, and changesSince()
+ * asks for a resynchronization.
+ */
+static void testOffUntilAsked() {
+	BTScan* pScan = getScan();
+	scan(pScan, population(1, 3, -60));
+	std::vector<BTScanChange> changes;
+	CHECK(!pScan->changesSince(0, changes));
+	CHECK(changes.empty());
+
+	uint32_t generation = pScan->getGeneration();   // Tracking starts here.
+	CHECK(!pScan->changesSince(generation - 1, changes));
+	scan(pScan, population(1, 3, -60));
+	CHECK(pScan->changesSince(generation, changes));
+	CHECK_EQ(3, changes.size());   // Devices already there arrive with the first tracked scan.
+	for (size_t i = 0; i < changes.size(); i++) {
+		CHECK_EQ(BT_CHANGE_ARRIVED, changes[i].type);
+		CHECK_EQ(generation + 1, changes[i].generation);
+	}
+} // testOffUntilAsked
+
+
+/**
+ * @brief Two scans: an RSSI move below the threshold is not a change, one past it is, a new device
+ * arrives and a missing one departs when the scan ends.
+ */
+static void testChangesAcrossScans() {
+	BTScan* pScan = setUp();
+	uint32_t start = pScan->getGeneration();
+	scan(pScan, population(1, 3, -60));
+	uint32_t first = pScan->getGeneration();
+
+	std::vector<BTScanChange> changes;
+	CHECK(pScan->changesSince(start, changes));
+	CHECK_EQ(3, changes.size());
+	CHECK_EQ(addressOf(1), changes[0].address);
+	CHECK_EQ(-60, changes[0].rssi);
+
+	scan(pScan, { { 1, -55 }, { 2, -45 }, { 4, -70 } });
+	CHECK(pScan->changesSince(first, changes));
+	CHECK_EQ(3, changes.size());
+	CHECK_EQ(BT_CHANGE_UPDATED, changes[0].type);
+	CHECK_EQ(BT_CHANGED_RSSI, changes[0].changed);
+	CHECK_EQ(addressOf(2), changes[0].address);
+	CHECK_EQ(-45, changes[0].rssi);
+	CHECK_EQ(BT_CHANGE_ARRIVED, changes[1].type);
+	CHECK_EQ(addressOf(4), changes[1].address);
+	CHECK_EQ(BT_CHANGE_DEPARTED, changes[2].type);
+	CHECK_EQ(addressOf(3), changes[2].address);
+	for (size_t i = 0; i < changes.size(); i++) {
+		CHECK_EQ(first + 1, changes[i].generation);
+	}
+
+	CHECK(pScan->changesSince(start, changes));   // Both scans, in order.
+	CHECK_EQ(6, changes.size());
+} // testChangesAcrossScans
+
+
+/**
+ * @brief A device departs only after the configured number of scans without a sighting.
+ */
+static void testDepartureScans() {
+	BTScan* pScan = setUp();
+	pScan->setChangeThresholds(10, 2);
+	scan(pScan, population(1, 2, -60));
+	uint32_t generation = pScan->getGeneration();
+
+	std::vector<BTScanChange> changes;
+	scan(pScan, population(1, 1, -60));
+	CHECK(pScan->changesSince(generation, changes));
+	CHECK(changes.empty());
+
+	scan(pScan, population(1, 1, -60));
+	CHECK(pScan->changesSince(generation, changes));
+	CHECK_EQ(1, changes.size());
+	CHECK_EQ(BT_CHANGE_DEPARTED, changes[0].type);
+	CHECK_EQ(addressOf(2), changes[0].address);
+	CHECK_EQ(generation + 2, changes[0].generation);
+} // testDepartureScans
+
+
+/**
+ * @brief A steady population logs nothing after it arrived, so what changesSince() returns is the
+ * changes, not the devices.
+ */
+static void testSteadyPopulationLogsNothing() {
+	BTScan* pScan = setUp();
+	scan(pScan, population(1, 300, -60));
+	std::vector<BTScanChange> changes;
+	for (int i = 0; i < 5; i++) {
+		uint32_t generation = pScan->getGeneration();
+		scan(pScan, population(1, 300, -65));
+		CHECK(pScan->changesSince(generation, changes));
+		CHECK(changes.empty());
+	}
+	uint32_t generation = pScan->getGeneration();
+	std::vector<Sighting> sightings = population(1, 300, -65);
+	sightings[123].rssi = -90;
+	scan(pScan, sightings);
+	CHECK(pScan->changesSince(generation, changes));
+	CHECK_EQ(1, changes.size());
+	CHECK_EQ(addressOf(124), changes[0].address);
+} // testSteadyPopulationLogsNothing
+
+
+/**
+ * @brief More changes than the log holds: the oldest go, and changesSince() says so for the
+ * generations they belonged to.
+ */
+static void testLogBounded() {
+	BTScan* pScan = setUp();
+	uint32_t start = pScan->getGeneration();
+	scan(pScan, population(1, 10, -60));
+	uint32_t generation = pScan->getGeneration();
+	scan(pScan, population(1000, BT_TRACKER_MAX_CHANGES + 50, -60));
+
+	std::vector<BTScanChange> changes;
+	CHECK(!pScan->changesSince(start, changes));
+	CHECK(!pScan->changesSince(generation, changes));
+	CHECK_EQ(BT_TRACKER_MAX_CHANGES, changes.size());
+	CHECK_EQ(BT_CHANGE_DEPARTED, changes.back().type);   // The newest are kept.
+
+	uint32_t last = pScan->getGeneration();
+	scan(pScan, population(1000, BT_TRACKER_MAX_CHANGES + 50, -60));
+	CHECK(pScan->changesSince(last, changes));
+	CHECK(changes.empty());
+} // testLogBounded
+
+
+int main() {
+	RUN(testOffUntilAsked);   // First, while tracking is still off.
+	RUN(testChangesAcrossScans);
+	RUN(testDepartureScans);
+	RUN(testSteadyPopulationLogsNothing);
+	RUN(testLogBounded);
+	return BT_TEST_RESULT();
+} // main
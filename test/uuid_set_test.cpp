@@ -0,0 +1,299 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BTUUIDKey and BTUUIDQuery: 16, 32 and 128 bit UUIDs normalised to one key, duplicates dropped, and
+// any/all matching on empty, disjoint and overlapping sets, checked against std::set including 16 bit
+// UUIDs that share a signature bit.  Then the same through isAdvertisingAny() and isAdvertisingAll()
+// of a scanned device.
+
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+#include "BTUUIDSet.h"
+
+static const char* nordicUart = "6e400001-b5a3-f393-e0a9-e50e24dcca9e";
+
+/**
+ * @brief A sorted, duplicate free set with its signature, the way a device keeps its services.
+ */
+struct KeySet {
+	std::vector<BTUUIDKey> keys;
+	uint64_t               signature = 0;
+	bool                   haveLong  = false;
+
+	void add(BTUUID uuid) {
+		BTUUIDKey key = BTUUIDKey::fromUUID(uuid);
+		std::vector<BTUUIDKey>::iterator it = std::lower_bound(keys.begin(), keys.end(), key);
+		if (it != keys.end() && *it == key) {
+			return;
+		}
+		keys.insert(it, key);
+		signature |= key.signature();
+		haveLong   = haveLong || !key.isShort();
+	}
+	bool any(BTUUIDQuery& query) {
+		return query.matchesAny(keys.data(), keys.size(), signature, haveLong);
+	}
+	bool all(BTUUIDQuery& query) {
+		return query.matchesAll(keys.data(), keys.size(), signature, haveLong);
+	}
+};
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+/**
+ * @brief The same service in its 16, 32 and 128 bit forms is one key, and converts back to 16 bits;
+ * a 32 bit value above 0xffff and a vendor UUID are long keys.
+ */
+static void testKeyForms() {
+	BTUUIDKey k16  = BTUUIDKey::fromUUID(BTUUID((uint16_t)0x180d));
+	BTUUIDKey k32  = BTUUIDKey::fromUUID(BTUUID((uint32_t)0x180d));
+	BTUUIDKey k128 = BTUUIDKey::fromUUID(BTUUID(std::string("0000180d-0000-1000-8000-00805f9b34fb")));
+	CHECK(k16 == k32);
+	CHECK(k16 == k128);
+	CHECK(k16.isShort());
+	CHECK(k16.signature() != 0 && (k16.signature() & (k16.signature() - 1)) == 0);   // One bit.
+	CHECK_EQ(16, k128.toUUID().bitSize());
+	CHECK(k128.toUUID().equals(BTUUID((uint16_t)0x180d)));
+
+	BTUUIDKey long32 = BTUUIDKey::fromUUID(BTUUID((uint32_t)0x12345678));
+	CHECK(!long32.isShort());
+	CHECK_EQ(0, long32.signature());
+	CHECK_EQ(32, long32.toUUID().bitSize());
+	CHECK(long32.toUUID().equals(BTUUID((uint32_t)0x12345678)));
+
+	BTUUIDKey vendor = BTUUIDKey::fromUUID(BTUUID(std::string(nordicUart)));
+	CHECK(!vendor.isShort());
+	CHECK_EQ(0, vendor.signature());
+	CHECK_EQ(128, vendor.toUUID().bitSize());
+	CHECK(vendor.toUUID().toString() == nordicUart);
+
+	// Keys order like the UUID strings.
+	CHECK(k16 < long32);
+	CHECK(long32 < vendor);
+	CHECK(!(vendor < vendor));
+
+	BTUUIDKey unset = BTUUIDKey::fromUUID(BTUUID());
+	CHECK_EQ(0, unset.hi);
+	CHECK_EQ(0, unset.lo);
+} // testKeyForms
+
+
+/**
+ * @brief A query keeps one key per UUID whatever form it was added in, and ignores unset UUIDs.
+ */
+static void testQueryDedup() {
+	BTUUIDQuery query;
+	CHECK_EQ(0, query.size());
+	query.add(BTUUID((uint16_t)0x180d));
+	query.add(BTUUID((uint32_t)0x180d));
+	query.add("0000180d-0000-1000-8000-00805f9b34fb");
+	query.add("180d");
+	CHECK_EQ(1, query.size());
+	query.add(BTUUID((uint32_t)0x12345678));
+	query.add(BTUUID((uint32_t)0x12345678));
+	CHECK_EQ(2, query.size());
+	query.add(nordicUart);
+	query.add("6E400001-B5A3-F393-E0A9-E50E24DCCA9E");
+	CHECK_EQ(3, query.size());
+	query.add(BTUUID());
+	CHECK_EQ(3, query.size());
+	query.clear();
+	CHECK_EQ(0, query.size());
+
+	KeySet set;
+	set.add(BTUUID((uint16_t)0x180d));
+	CHECK(!set.any(query));   // Cleared: the signature went with the keys.
+	CHECK(set.all(query));
+} // testQueryDedup
+
+
+/**
+ * @brief Empty on either side, disjoint, overlapping, contained, across the three sizes.
+ */
+static void testAnyAll() {
+	BTUUIDQuery empty;
+	KeySet      none;
+	KeySet      heart;
+	heart.add(BTUUID((uint16_t)0x180d));
+	heart.add(BTUUID((uint16_t)0x180f));
+	heart.add(BTUUID((uint32_t)0x12345678));
+	heart.add(BTUUID(std::string(nordicUart)));
+
+	CHECK(!none.any(empty));
+	CHECK(none.all(empty));
+	CHECK(!heart.any(empty));   // Nothing asked for, nothing shared.
+	CHECK(heart.all(empty));
+
+	BTUUIDQuery shortOnly;
+	shortOnly.add(BTUUID((uint16_t)0x180d));
+	shortOnly.add(BTUUID((uint16_t)0x180a));
+	CHECK(!none.any(shortOnly));
+	CHECK(!none.all(shortOnly));
+	CHECK(heart.any(shortOnly));
+	CHECK(!heart.all(shortOnly));
+
+	BTUUIDQuery contained;
+	contained.add(BTUUID((uint16_t)0x180f));
+	contained.add(nordicUart);
+	CHECK(heart.any(contained));
+	CHECK(heart.all(contained));
+
+	BTUUIDQuery longOnly;
+	longOnly.add(BTUUID((uint32_t)0x12345678));
+	CHECK(heart.any(longOnly));
+	CHECK(heart.all(longOnly));
+	KeySet shortSet;
+	shortSet.add(BTUUID((uint16_t)0x180d));
+	CHECK(!shortSet.any(longOnly));
+	CHECK(!shortSet.all(longOnly));
+
+	BTUUIDQuery otherLong;
+	otherLong.add("6e400002-b5a3-f393-e0a9-e50e24dcca9e");
+	CHECK(!heart.any(otherLong));   // Both sides have long keys, none shared.
+	CHECK(!heart.all(otherLong));
+} // testAnyAll
+
+
+/**
+ * @brief Random sets and queries over a pool crowded with 16 bit UUIDs that share signature bits:
+ * the signature shortcuts never change the answer of the merge.
+ */
+static void testAgainstModel() {
+	std::vector<BTUUID> pool;
+	for (uint16_t value = 0x1800; value < 0x1810; value++) {
+		pool.push_back(BTUUID(value));
+		pool.push_back(BTUUID((uint16_t)(value ^ 0x0041)));   // Folds onto the same signature bit.
+	}
+	pool.push_back(BTUUID((uint32_t)0x12345678));
+	pool.push_back(BTUUID((uint32_t)0x00010000));
+	pool.push_back(BTUUID(std::string(nordicUart)));
+	pool.push_back(BTUUID(std::string("6e400002-b5a3-f393-e0a9-e50e24dcca9e")));
+
+	std::mt19937 random(1);
+	int anyTrue = 0;
+	int allTrue = 0;
+	for (int round = 0; round < 5000; round++) {
+		KeySet              set;
+		BTUUIDQuery         query;
+		std::set<BTUUIDKey> inSet;
+		std::set<BTUUIDKey> inQuery;
+		for (uint32_t i = random() % 8; i > 0; i--) {
+			BTUUID uuid = pool[random() % pool.size()];
+			set.add(uuid);
+			inSet.insert(BTUUIDKey::fromUUID(uuid));
+		}
+		for (uint32_t i = random() % 4; i > 0; i--) {
+			BTUUID uuid = pool[random() % pool.size()];
+			query.add(uuid);
+			inQuery.insert(BTUUIDKey::fromUUID(uuid));
+		}
+		CHECK_EQ(inSet.size(), set.keys.size());
+		CHECK_EQ(inQuery.size(), query.size());
+
+		bool any = false;
+		bool all = true;
+		for (std::set<BTUUIDKey>::iterator it = inQuery.begin(); it != inQuery.end(); ++it) {
+			any = any || inSet.count(*it) == 1;
+			all = all && inSet.count(*it) == 1;
+		}
+		CHECK_EQ(any, set.any(query));
+		CHECK_EQ(all, set.all(query));
+		anyTrue += any;
+		allTrue += all && !inQuery.empty();
+	}
+	CHECK(anyTrue > 500);   // Both answers were exercised.
+	CHECK(allTrue > 100);
+} // testAgainstModel
+
+
+/**
+ * @brief A scanned device with 16, 32 and 128 bit service lists, one UUID in two of them, answers
+ * through isAdvertisingService(), isAdvertisingAny() and isAdvertisingAll(); one without services
+ * only matches the empty query, and only for all.
+ */
+static void testDeviceQueries() {
+	FakeStack::reset();
+	BTDevice::init("uuid_set_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	const uint8_t eir[] = {
+		0x05, ESP_BT_EIR_TYPE_CMPL_16BITS_UUID, 0x0d, 0x18, 0x0f, 0x18,
+		0x09, ESP_BT_EIR_TYPE_CMPL_32BITS_UUID, 0x78, 0x56, 0x34, 0x12, 0x0d, 0x18, 0x00, 0x00,
+		0x11, ESP_BT_EIR_TYPE_CMPL_128BITS_UUID,
+		0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0, 0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e
+	};
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(1, address);
+	FakeStack::emitDiscRes(address, -60, 0, eir, sizeof(eir));
+	FakeStack::makeAddress(2, address);
+	FakeStack::emitDiscRes(address, -60);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	BTScanResults      results = pScan->getResults();
+	BTAdvertisedDevice device  = results.getDevice(0);
+	BTAdvertisedDevice bare    = results.getDevice(1);
+
+	CHECK(device.isAdvertisingService(BTUUID((uint16_t)0x180d)));
+	CHECK(device.isAdvertisingService(BTUUID(std::string("0000180f-0000-1000-8000-00805f9b34fb"))));
+	CHECK(device.isAdvertisingService(BTUUID((uint32_t)0x12345678)));
+	CHECK(device.isAdvertisingService(BTUUID(std::string(nordicUart))));
+	CHECK(!device.isAdvertisingService(BTUUID((uint16_t)0x180a)));
+
+	BTUUIDQuery every;
+	every.add(BTUUID((uint16_t)0x180d));
+	every.add(BTUUID((uint16_t)0x180f));
+	every.add(BTUUID((uint32_t)0x12345678));
+	every.add(nordicUart);
+	CHECK(device.isAdvertisingAll(every));   // Four keys: 0x180D is there once.
+	CHECK(device.isAdvertisingAny(every));
+	every.add(BTUUID((uint16_t)0x180a));
+	CHECK(!device.isAdvertisingAll(every));
+	CHECK(device.isAdvertisingAny(every));
+
+	BTUUIDQuery missing;
+	missing.add(BTUUID((uint16_t)0x180a));
+	missing.add("6e400002-b5a3-f393-e0a9-e50e24dcca9e");
+	CHECK(!device.isAdvertisingAny(missing));
+	CHECK(!device.isAdvertisingAll(missing));
+
+	BTUUIDQuery empty;
+	CHECK(!device.isAdvertisingAny(empty));
+	CHECK(device.isAdvertisingAll(empty));
+	CHECK(!bare.isAdvertisingAny(empty));
+	CHECK(bare.isAdvertisingAll(empty));
+	CHECK(!bare.isAdvertisingAny(every));
+	CHECK(!bare.isAdvertisingAll(every));
+} // testDeviceQueries
+
+
+int main() {
+	RUN(testKeyForms);
+	RUN(testQueryDedup);
+	RUN(testAnyAll);
+	RUN(testAgainstModel);
+	RUN(testDeviceQueries);
+	return BT_TEST_RESULT();
+} // main
@@ -0,0 +1,228 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The scan watchdog against a controller that hangs, loses or delays the end of its inquiries: the
+// recovery runs on the watchdog task rather than the timer's, the stop event of a cancelled inquiry
+// does not end the one that replaced it, and every scan ends within getMaxScanLatency().
+
+#include <stdint.h>
+#include <atomic>
+#include <random>
+#include <thread>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+
+static std::atomic<int>     completions(0);
+static std::atomic<int>     completionsFromTimer(0);
+static std::atomic<int64_t> completedAt(0);
+static std::thread::id      completedOn;
+static std::thread::id      mainThread;
+
+static void onScanComplete(const BTScanResults& results) {
+	completedAt = FakeStack::now();
+	completedOn = std::this_thread::get_id();
+	completionsFromTimer += FakeStack::inTimerCallback();
+	completions++;
+} // onScanComplete
+
+
+static BTScan* setUp(uint32_t graceMs, uint8_t maxRetries, bool allowReinit) {
+	FakeStack::reset();
+	FakeStack::playInquiries(true);
+	BTDevice::init("watchdog_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setWatchdog(graceMs, maxRetries, allowReinit);
+	pScan->getStats(true);
+	return pScan;
+} // setUp
+
+
+/**
+ * @brief An inquiry that ends on time is left alone.
+ */
+static void testHealthyInquiryUntouched() {
+	BTScan* pScan = setUp(3000, 2, true);
+	int before = completions;
+	CHECK(pScan->start(5, onScanComplete));
+	FakeStack::advanceMs(4 * 1280 - 1);
+	CHECK_EQ(before, completions);
+	FakeStack::advanceMs(1);
+	CHECK_EQ(before + 1, completions);
+	CHECK(completedOn == mainThread);   // Delivered with the event, as on the Bluedroid task.
+
+	FakeStack::advanceMs(10000);
+	BTScanStats stats = pScan->getStats();
+	CHECK_EQ(0, stats.watchdogFires);
+	CHECK_EQ(0, FakeStack::calls().cancelDiscovery);
+	CHECK_EQ(1, FakeStack::calls().startDiscovery);
+} // testHealthyInquiryUntouched
+
+
+/**
+ * @brief A hung inquiry is cancelled and restarted; the stop event of the cancel, which comes after
+ * the restart, is stale and the scan runs to the end of the new inquiry.
+ */
+static void testStaleStoppedIgnored() {
+	BTScan* pScan = setUp(500, 2, true);
+	FakeStack::faults().hangInquiries = 1;
+	int before = completions;
+	int64_t start = FakeStack::now();
+	CHECK(pScan->start(20, onScanComplete));   // 10 units, 12.8 s.
+	FakeStack::advanceMs(12800 + 500 - 1);
+	CHECK_EQ(0, FakeStack::calls().cancelDiscovery);
+	FakeStack::advanceMs(1);
+
+	// 6.7 s of the budget left: 5 units.
+	CHECK_EQ(1, FakeStack::calls().cancelDiscovery);
+	CHECK_EQ(2, FakeStack::calls().startDiscovery);
+	CHECK_EQ(5, FakeStack::calls().inquiryLength);
+	CHECK_EQ(before, completions);
+	FakeStack::advanceMs(5 * 1280 - 1);
+	CHECK_EQ(before, completions);
+	FakeStack::advanceMs(1);
+	CHECK_EQ(before + 1, completions);
+	CHECK_EQ((12800 + 500 + 5 * 1280) * 1000LL, completedAt - start);
+
+	BTScanStats stats = pScan->getStats();
+	CHECK_EQ(1, stats.watchdogFires);
+	CHECK_EQ(1, stats.watchdogRestarts);
+	CHECK_EQ(0, stats.watchdogAborts);
+	CHECK_EQ(5 * 1280, stats.recoveryTimeMs);
+	CHECK_EQ(0, FakeStack::calls().fromTimer);
+} // testStaleStoppedIgnored
+
+
+/**
+ * @brief An inquiry that never even reported started is cancelled and restarted; its stop event, which
+ * comes after the restart and before the new inquiry starts, does not end the restarted one.
+ */
+static void testStoppedBeforeStartedIgnored() {
+	BTScan* pScan = setUp(500, 2, true);
+	FakeStack::playInquiries(false);   // Events only as emitted below.
+	int before = completions;
+	CHECK(pScan->start(20, onScanComplete));   // 10 units, 12.8 s, never reported started.
+	FakeStack::advanceMs(12800 + 500);
+	CHECK_EQ(1, FakeStack::calls().cancelDiscovery);
+	CHECK_EQ(2, FakeStack::calls().startDiscovery);
+
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);   // Of the cancelled inquiry.
+	CHECK_EQ(before, completions);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	FakeStack::advanceMs(1000);
+	CHECK_EQ(before, completions);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);   // The restarted inquiry ends.
+	CHECK_EQ(before + 1, completions);
+	CHECK_EQ(1, pScan->getStats().watchdogRestarts);
+	CHECK_EQ(0, pScan->getStats().watchdogAborts);
+} // testStoppedBeforeStartedIgnored
+
+
+/**
+ * @brief A controller that never ends an inquiry: restart, restart with the stack restarted, then the
+ * scan is ended with what it found, on the watchdog task, within the bound.
+ */
+static void testReinitThenAbort() {
+	BTScan* pScan = setUp(500, 1, true);
+	FakeStack::faults().hangInquiries = 100;
+	int before = completions;
+	int inits  = FakeStack::calls().bluedroidInit;
+	int64_t start = FakeStack::now();
+	CHECK(pScan->start(30, onScanComplete));
+	uint32_t bound = pScan->getMaxScanLatency(30);
+
+	// 12.8 + 0.5 s, then 12.8 + 0.5 s, then the 3.4 s left as 2 units.
+	FakeStack::advanceMs(2 * (12800 + 500) + 2 * 1280 + 500 - 1);
+	CHECK_EQ(before, completions);
+	CHECK_EQ(inits + 1, FakeStack::calls().bluedroidInit);
+	FakeStack::advanceMs(1);
+	CHECK_EQ(before + 1, completions);
+	CHECK(completedOn != mainThread);
+	CHECK(completedAt - start <= (int64_t)bound * 1000);
+
+	BTScanStats stats = pScan->getStats();
+	CHECK_EQ(3, stats.watchdogFires);
+	CHECK_EQ(2, stats.watchdogRestarts);
+	CHECK_EQ(1, stats.watchdogReinits);
+	CHECK_EQ(1, stats.watchdogAborts);
+	CHECK_EQ(3, FakeStack::calls().startDiscovery);
+	CHECK_EQ(0, FakeStack::calls().fromTimer);
+	CHECK_EQ(0, completionsFromTimer);
+} // testReinitThenAbort
+
+
+/**
+ * @brief stop() whose stop event is lost: the watchdog closes the scan at its deadline, without
+ * restarting it.
+ */
+static void testStopWithLostStopped() {
+	BTScan* pScan = setUp(3000, 2, true);
+	int before = completions;
+	CHECK(pScan->start(10, onScanComplete));   // 8 units, 10.24 s.
+	FakeStack::advanceMs(1000);
+	FakeStack::faults().dropStopped = 1;
+	pScan->stop();
+	FakeStack::advanceMs(10240 + 3000 - 1000 - 1);
+	CHECK_EQ(before, completions);
+	FakeStack::advanceMs(1);
+	CHECK_EQ(before + 1, completions);
+	CHECK(completedOn != mainThread);
+	CHECK_EQ(1, FakeStack::calls().startDiscovery);
+	CHECK_EQ(0, pScan->getStats().watchdogRestarts);
+} // testStopWithLostStopped
+
+
+/**
+ * @brief Random mixes of hung inquiries, lost and late stop events: every scan ends, within the
+ * bound, and nothing runs on the timer task.
+ */
+static void testLatencyBoundUnderFaults() {
+	std::mt19937 random(1);
+	BTScan* pScan = setUp(3000, 2, true);
+	for (int round = 0; round < 200; round++) {
+		uint32_t duration = 1 + random() % 30;
+		uint32_t graceMs  = 100 + random() % 3000;
+		pScan->setWatchdog(graceMs, random() % 3, random() % 2 == 0);
+		FakeStack::faults().hangInquiries  = random() % 3 == 0 ? random() % 4 : 0;
+		FakeStack::faults().dropStopped    = random() % 3 == 0 ? random() % 4 : 0;
+		FakeStack::faults().stoppedDelayMs = random() % 3 == 0 ? random() % (2 * graceMs) : 0;
+
+		uint32_t bound  = pScan->getMaxScanLatency(duration);
+		int      before = completions;
+		int64_t  start  = FakeStack::now();
+		CHECK(pScan->start(duration, onScanComplete));
+		while (completions == before && FakeStack::now() - start <= (int64_t)(bound + 10000) * 1000) {
+			FakeStack::advanceMs(10);
+		}
+		CHECK_EQ(before + 1, completions);
+		CHECK(completedAt - start <= (int64_t)bound * 1000);
+		FakeStack::advanceMs(random() % 2000);   // Leftover events of this scan reach the next.
+	}
+	CHECK_EQ(0, FakeStack::calls().fromTimer);
+	CHECK_EQ(0, completionsFromTimer);
+} // testLatencyBoundUnderFaults
+
+
+int main() {
+	mainThread = std::this_thread::get_id();
+	RUN(testHealthyInquiryUntouched);
+	RUN(testStaleStoppedIgnored);
+	RUN(testStoppedBeforeStartedIgnored);
+	RUN(testReinitThenAbort);
+	RUN(testStopWithLostStopped);
+	RUN(testLatencyBoundUnderFaults);
+	return BT_TEST_RESULT();
+} // main
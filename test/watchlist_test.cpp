@@ -0,0 +1,342 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BTWatchlist against a std::set: the bucket table kept right by add() and remove(), load() dropping
+// repeats, loadPartition() using sorted keys in place and refusing bad headers, 10,000 addresses within
+// 100 KB.  And match-only scanning dropping the other results before anything is parsed or stored.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+#include "BTWatchlist.h"
+
+/**
+ * @brief A heap allocator that counts what goes through it.
+ */
+class CountingAllocator : public BTAllocator {
+public:
+	size_t allocations = 0;
+
+	void* allocate(size_t size) {
+		allocations++;
+		return malloc(size);
+	}
+	void deallocate(void* ptr) {
+		free(ptr);
+	}
+};
+
+class WatchCallbacks : public BTAdvertisedDeviceCallbacks {
+public:
+	int results = 0;
+	int hits    = 0;
+	int misses  = 0;
+
+	void onResult(BTAdvertisedDevice advertisedDevice) {
+		results++;
+	}
+	void onWatchlistHit(BTAdvertisedDevice& advertisedDevice) {
+		hits++;
+	}
+	void onWatchlistMiss(BTAdvertisedDevice& advertisedDevice) {
+		misses++;
+	}
+};
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+static uint64_t addressOf(uint32_t n) {
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(n, address);
+	return BTAddress(address).toUint64();
+} // addressOf
+
+
+/**
+ * @brief Lay a watchlist partition out, keys sorted, see BTWatchlist.
+ */
+static std::vector<uint8_t> partitionOf(const std::vector<uint64_t>& addresses) {
+	std::vector<uint64_t> keys;
+	for (size_t i = 0; i < addresses.size(); i++) {
+		keys.push_back(BTWatchlist::toKey(addresses[i]));
+	}
+	std::sort(keys.begin(), keys.end());
+	std::vector<uint8_t> data(BT_WATCHLIST_HEADER_BYTES);
+	uint32_t magic = BT_WATCHLIST_MAGIC;
+	uint32_t count = keys.size();
+	memcpy(&data[0], &magic, sizeof(magic));
+	data[4] = BT_WATCHLIST_VERSION;
+	memcpy(&data[8], &count, sizeof(count));
+	for (size_t i = 0; i < keys.size(); i++) {
+		for (int j = BT_WATCHLIST_ENTRY_BYTES - 1; j >= 0; j--) {
+			data.push_back((uint8_t)(keys[i] >> (8 * j)));
+		}
+	}
+	return data;
+} // partitionOf
+
+
+/**
+ * @brief Random adds and removes over addresses crowded into a few buckets and spread over the
+ * others: after each one the watchlist answers as the set does, for every address.
+ */
+static void testAddRemoveKeepsBuckets() {
+	std::mt19937 random(1);
+	std::vector<uint64_t> pool;
+	for (uint32_t i = 0; i < 200; i++) {
+		pool.push_back(0x001122000000ULL | (uint64_t)(random() & 0x0fffff));   // One LAP byte: few buckets.
+		pool.push_back(((uint64_t)random() << 16 ^ random()) & 0xffffffffffffULL);
+	}
+	pool.push_back(0);
+	pool.push_back(0xffffffffffffULL);   // The first and the last bucket.
+
+	BTWatchlist        watchlist;
+	std::set<uint64_t> model;
+	CHECK(watchlist.isEmpty());
+	CHECK(!watchlist.contains(pool[0]));
+	for (int op = 0; op < 3000; op++) {
+		uint64_t address = pool[random() % pool.size()];
+		if (random() % 3 != 0) {
+			CHECK_EQ(model.insert(address).second, watchlist.add(address));
+		} else {
+			CHECK_EQ(model.erase(address) == 1, watchlist.remove(address));
+		}
+		if (op % 50 == 0) {
+			for (size_t i = 0; i < pool.size(); i++) {
+				CHECK_EQ(model.count(pool[i]) == 1, watchlist.contains(pool[i]));
+			}
+		}
+		CHECK_EQ(model.size(), watchlist.getCount());
+	}
+
+	for (std::set<uint64_t>::iterator it = model.begin(); it != model.end(); ++it) {
+		CHECK(watchlist.remove(*it));
+	}
+	CHECK(watchlist.isEmpty());
+	bool empty = false;
+	CHECK(!watchlist.contains(pool[1], &empty));
+	CHECK(empty);
+	CHECK(watchlist.add(pool[1]));   // From empty again, the table comes back.
+	CHECK(watchlist.contains(pool[1], &empty));
+	CHECK(!empty);
+} // testAddRemoveKeepsBuckets
+
+
+/**
+ * @brief load() counts only the addresses that are new, repeated in the batch or already present.
+ */
+static void testLoadDropsRepeats() {
+	BTWatchlist watchlist;
+	CHECK(watchlist.add(addressOf(1)));
+	std::vector<uint64_t> batch;
+	for (uint32_t n = 0; n < 100; n++) {
+		batch.push_back(addressOf(n % 40));
+	}
+	CHECK_EQ(39, watchlist.load(batch.data(), batch.size()));
+	CHECK_EQ(40, watchlist.getCount());
+	CHECK_EQ(0, watchlist.load(batch.data(), batch.size()));
+	CHECK_EQ(40, watchlist.getCount());
+	for (uint32_t n = 0; n < 50; n++) {
+		CHECK_EQ(n < 40, watchlist.contains(addressOf(n)));
+	}
+	watchlist.clear();
+	CHECK(watchlist.isEmpty());
+	CHECK_EQ(sizeof(watchlist), watchlist.getMemoryUsage());
+} // testLoadDropsRepeats
+
+
+/**
+ * @brief A sorted partition is used in place until modified, an unsorted one is copied and sorted,
+ * and a bad header is refused without touching what was loaded or leaving it mapped.
+ */
+static void testLoadPartition() {
+	std::vector<uint64_t> addresses;
+	for (uint32_t n = 0; n < 500; n++) {
+		addresses.push_back(addressOf(n * 7));
+	}
+	BTWatchlist watchlist;
+	CHECK_EQ(ESP_ERR_NOT_FOUND, watchlist.loadPartition("watchlist"));
+
+	std::vector<uint8_t> data = partitionOf(addresses);
+	FakeStack::setPartition("watchlist", data.data(), data.size());
+	CHECK_EQ(ESP_OK, watchlist.loadPartition("watchlist"));
+	CHECK(watchlist.isMapped());
+	CHECK_EQ(1, FakeStack::calls().partitionMaps);
+	CHECK_EQ(500, watchlist.getCount());
+	CHECK(watchlist.getMemoryUsage() < 20 * 1024);   // The bucket table only.
+	for (uint32_t n = 0; n < 3500; n++) {
+		CHECK_EQ(n % 7 == 0, watchlist.contains(addressOf(n)));
+	}
+	CHECK(watchlist.add(addressOf(1)));   // Copied to RAM first.
+	CHECK(!watchlist.isMapped());
+	CHECK_EQ(0, FakeStack::calls().partitionMaps);
+	CHECK(watchlist.contains(addressOf(7 * 499)));
+
+	data = partitionOf(addresses);
+	std::swap_ranges(data.begin() + BT_WATCHLIST_HEADER_BYTES, data.begin() + BT_WATCHLIST_HEADER_BYTES + BT_WATCHLIST_ENTRY_BYTES,
+		data.end() - BT_WATCHLIST_ENTRY_BYTES);   // The first key last, out of order.
+	FakeStack::setPartition("watchlist", data.data(), data.size());
+	CHECK_EQ(ESP_OK, watchlist.loadPartition("watchlist"));
+	CHECK(!watchlist.isMapped());
+	CHECK_EQ(0, FakeStack::calls().partitionMaps);
+	CHECK_EQ(500, watchlist.getCount());
+	CHECK(!watchlist.contains(addressOf(1)));   // Replaced, not merged.
+	for (size_t i = 0; i < addresses.size(); i++) {
+		CHECK(watchlist.contains(addresses[i]));
+	}
+
+	std::vector<uint8_t> good = partitionOf(addresses);
+	for (int fault = 0; fault < 5; fault++) {
+		data = good;
+		switch (fault) {
+			case 0: data[0] ^= 1; break;                                                // Magic.
+			case 1: data[4] = BT_WATCHLIST_VERSION + 1; break;
+			case 2: data[8] += 1; break;                                                // One key more than the partition holds.
+			case 3: data.resize(BT_WATCHLIST_HEADER_BYTES - 1); break;
+			case 4: data.resize(BT_WATCHLIST_HEADER_BYTES + 499 * BT_WATCHLIST_ENTRY_BYTES); break;   // Truncated.
+		}
+		FakeStack::setPartition("watchlist", data.data(), data.size());
+		CHECK_EQ(ESP_ERR_INVALID_ARG, watchlist.loadPartition("watchlist"));
+		CHECK_EQ(0, FakeStack::calls().partitionMaps);
+		CHECK_EQ(500, watchlist.getCount());
+		CHECK(watchlist.contains(addresses[0]));
+	}
+	FakeStack::setPartition("watchlist", nullptr, 0);
+} // testLoadPartition
+
+
+/**
+ * @brief The class description's sizing: 10,000 addresses in RAM stay under 100 KB, lookups exact.
+ */
+static void testTenThousandUnder100KB() {
+	std::mt19937 random(2);
+	std::vector<uint64_t> addresses;
+	for (int i = 0; i < 10000; i++) {
+		addresses.push_back(((uint64_t)random() << 16 ^ random()) & 0xffffffffffffULL);
+	}
+	BTWatchlist watchlist;
+	size_t added = watchlist.load(addresses.data(), addresses.size());
+	CHECK_EQ(added, watchlist.getCount());
+	CHECK(added > 9990);
+	CHECK(watchlist.getMemoryUsage() < 100 * 1024);
+	for (size_t i = 0; i < addresses.size(); i++) {
+		CHECK(watchlist.contains(addresses[i]));
+	}
+	std::set<uint64_t> members(addresses.begin(), addresses.end());
+	for (int i = 0; i < 10000; i++) {
+		uint64_t other = ((uint64_t)random() << 16 ^ random()) & 0xffffffffffffULL;
+		CHECK_EQ(members.count(other) == 1, watchlist.contains(other));
+	}
+} // testTenThousandUnder100KB
+
+
+/**
+ * @brief In match-only mode a result for an address not watched is counted and dropped: no callback,
+ * no record, nothing taken from the record allocator or the arena for parsing.
+ */
+static void testMatchOnlyDropsBeforeParsing() {
+	CountingAllocator counting;
+	WatchCallbacks    callbacks;
+	FakeStack::reset();
+	BTDevice::init("watchlist_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setRecordAllocator(&counting);
+	pScan->setAdvertisedDeviceCallbacks(&callbacks);
+	pScan->getWatchlist().add(addressOf(5));
+	pScan->setMatchOnly(true);
+	pScan->getStats(true);
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+
+	size_t  before = counting.allocations;
+	uint8_t eir[]  = { 8, 0x09, 'd', 'r', 'o', 'p', 'p', 'e', 'd' };
+	for (uint32_t n = 100; n < 200; n++) {
+		uint8_t address[ESP_BD_ADDR_LEN];
+		FakeStack::makeAddress(n, address);
+		FakeStack::emitDiscRes(address, -60, 0x5a020c, eir, sizeof(eir));
+	}
+	CHECK_EQ(100, pScan->getStats().watchlistDropped);
+	CHECK_EQ(before, counting.allocations);
+	CHECK_EQ(0, pScan->getResultsRef().getCount());
+	CHECK_EQ(0, callbacks.results);
+
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(5, address);
+	FakeStack::emitDiscRes(address, -60, 0x5a020c, eir, sizeof(eir));
+	CHECK_EQ(1, pScan->getResultsRef().getCount());
+	CHECK_EQ(1, callbacks.results);
+	CHECK_EQ(1, callbacks.hits);
+	CHECK_EQ(0, callbacks.misses);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+
+	pScan->setMatchOnly(false);
+	pScan->getWatchlist().clear();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	pScan->setRecordAllocator(BTAllocator::getDefault());
+} // testMatchOnlyDropsBeforeParsing
+
+
+/**
+ * @brief Outside match-only mode every result is kept and reported as a hit or a miss, and neither
+ * once the watchlist is empty.
+ */
+static void testHitsAndMisses() {
+	WatchCallbacks callbacks;
+	FakeStack::reset();
+	BTDevice::init("watchlist_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(&callbacks);
+	pScan->getWatchlist().add(addressOf(5));
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	for (uint32_t n = 1; n <= 10; n++) {
+		uint8_t address[ESP_BD_ADDR_LEN];
+		FakeStack::makeAddress(n, address);
+		FakeStack::emitDiscRes(address, -60);
+	}
+	CHECK_EQ(1, callbacks.hits);
+	CHECK_EQ(9, callbacks.misses);
+
+	pScan->getWatchlist().clear();
+	uint8_t address[ESP_BD_ADDR_LEN];
+	FakeStack::makeAddress(11, address);
+	FakeStack::emitDiscRes(address, -60);
+	CHECK_EQ(11, callbacks.results);
+	CHECK_EQ(1, callbacks.hits);
+	CHECK_EQ(9, callbacks.misses);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+} // testHitsAndMisses
+
+
+int main() {
+	RUN(testAddRemoveKeepsBuckets);
+	RUN(testLoadDropsRepeats);
+	RUN(testLoadPartition);
+	RUN(testTenThousandUnder100KB);
+	RUN(testMatchOnlyDropsBeforeParsing);
+	RUN(testHitsAndMisses);
+	return BT_TEST_RESULT();
+} // main
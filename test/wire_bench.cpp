@@ -0,0 +1,97 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Result export cost on the host, run by hand: bytes per device and time per device of BTWireEncoder,
+// against the BTAdvertisedDevice::toString() text it replaces for shipping results.  A scan of 64
+// devices with names, some shared, CoD and TX power.  Only the ratios mean anything for the ESP32.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+#include "BTWireFormat.h"
+
+static const int devices = 64;
+static const int rounds  = 20000;
+
+static double nanosSince(std::chrono::steady_clock::time_point start, int count) {
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count;
+} // nanosSince
+
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+int main() {
+	const char* names[] = { "Living room speaker", "Galaxy S21", "JBL Flip 5", "Car kit", "Office PC" };
+	BTDevice::init("wire_bench");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	pScan->start(10, onScanComplete);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	for (int i = 0; i < devices; i++) {
+		const char* name = names[i % 5];
+		uint8_t     eir[ESP_BT_GAP_EIR_DATA_LEN];
+		size_t      length = 0;
+		eir[length++] = 1 + strlen(name);
+		eir[length++] = ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME;
+		memcpy(eir + length, name, strlen(name));
+		length += strlen(name);
+		eir[length++] = 2;
+		eir[length++] = ESP_BT_EIR_TYPE_TX_POWER_LEVEL;
+		eir[length++] = 4;
+		uint8_t address[ESP_BD_ADDR_LEN];
+		FakeStack::makeAddress(i, address);
+		FakeStack::emitDiscRes(address, -40 - i % 50, 0x5a020c, eir, length);
+		FakeStack::advanceMs(37);
+	}
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	BTScanResults results = pScan->getResults();
+
+	std::vector<uint8_t> buffer(4096);
+	BTWireEncoder encoder(buffer.data(), buffer.size());
+	size_t wireBytes = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds; r++) {
+		encoder.reset(results.getScanStart());
+		encoder.addResults(results);
+		wireBytes = encoder.getLength();
+	}
+	double encoded = nanosSince(start, rounds * devices);
+
+	std::vector<BTAdvertisedDevice> copies;
+	for (int i = 0; i < devices; i++) {
+		copies.push_back(results.getDevice(i));
+	}
+	size_t textBytes = 0;
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < rounds / 10; r++) {
+		textBytes = 0;
+		for (int i = 0; i < devices; i++) {
+			textBytes += copies[i].toString().size();
+		}
+	}
+	double text = nanosSince(start, rounds / 10 * devices);
+
+	printf("wire format: %6.1f bytes, %8.1f ns per device\n", (double)wireBytes / devices, encoded);
+	printf("toString():  %6.1f bytes, %8.1f ns per device\n", (double)textBytes / devices, text);
+	return wireBytes == 0;
+} // main
@@ -0,0 +1,122 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BTWireDecoder built on its own, against buffers laid out by hand from the format description.
+
+#include <string.h>
+#include <vector>
+
+#include "BTWireDecoder.h"
+#include "BTTest.h"
+
+static const uint8_t address1[BT_WIRE_ADDR_LEN] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+static const uint8_t address2[BT_WIRE_ADDR_LEN] = { 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6 };
+
+
+// Scan start 1000 ms, a phone with RSSI, CoD and a literal name, then a second device reusing the name.
+static std::vector<uint8_t> sampleBuffer() {
+	std::vector<uint8_t> data = { BT_WIRE_VERSION, 0xe8, 0x07 };
+	data.push_back(BT_WIRE_HAVE_RSSI | BT_WIRE_HAVE_COD | BT_WIRE_HAVE_NAME);
+	data.insert(data.end(), address1, address1 + BT_WIRE_ADDR_LEN);
+	data.push_back((uint8_t)-62);
+	data.push_back(0x0c);
+	data.push_back(0x02);
+	data.push_back(0x5a);
+	data.push_back(5);
+	data.push_back(5 << 1);
+	data.insert(data.end(), { 'P', 'h', 'o', 'n', 'e' });
+
+	data.push_back(BT_WIRE_HAVE_NAME | BT_WIRE_HAVE_TXPOWER);
+	data.insert(data.end(), address2, address2 + BT_WIRE_ADDR_LEN);
+	data.push_back(0x96);
+	data.push_back(0x01);
+	data.push_back((0 << 1) | 1);
+	data.push_back((uint8_t)-4);
+	return data;
+} // sampleBuffer
+
+
+static void testDecode() {
+	std::vector<uint8_t> data = sampleBuffer();
+	BTWireDecoder decoder(data.data(), data.size());
+	BTWireRecord  record;
+	CHECK(decoder.isValid());
+	CHECK_EQ(1000, decoder.getScanStart());
+
+	CHECK(decoder.next(&record));
+	CHECK(memcmp(record.address, address1, BT_WIRE_ADDR_LEN) == 0);
+	CHECK_EQ(-62, record.rssi);
+	CHECK_EQ(0x5a020c, record.cod);
+	CHECK_EQ(1005, record.timestamp);
+	CHECK_EQ(5, record.nameLen);
+	CHECK(strcmp(record.name, "Phone") == 0);
+
+	CHECK(decoder.next(&record));
+	CHECK(memcmp(record.address, address2, BT_WIRE_ADDR_LEN) == 0);
+	CHECK_EQ(BT_WIRE_HAVE_NAME | BT_WIRE_HAVE_TXPOWER, record.presence);
+	CHECK_EQ(1150, record.timestamp);
+	CHECK(strcmp(record.name, "Phone") == 0);
+	CHECK_EQ(-4, record.txPower);
+
+	CHECK(!decoder.next(&record));
+	CHECK(decoder.isValid());
+} // testDecode
+
+
+static void testWrongVersion() {
+	std::vector<uint8_t> data = sampleBuffer();
+	data[0] = BT_WIRE_VERSION + 1;
+	BTWireDecoder decoder(data.data(), data.size());
+	BTWireRecord  record;
+	CHECK(!decoder.isValid());
+	CHECK(!decoder.next(&record));
+} // testWrongVersion
+
+
+// Every truncation point either decodes whole records only or stops as invalid, never reads past.
+static void testTruncated() {
+	std::vector<uint8_t> data = sampleBuffer();
+	for (size_t length = 0; length < data.size(); length++) {
+		std::vector<uint8_t> part(data.begin(), data.begin() + length);
+		BTWireDecoder decoder(part.data(), part.size());
+		BTWireRecord  record;
+		int count = 0;
+		while (decoder.next(&record)) {
+			count++;
+		}
+		CHECK(count < 2);
+	}
+} // testTruncated
+
+
+static void testBadReference() {
+	std::vector<uint8_t> data = { BT_WIRE_VERSION, 0 };
+	data.push_back(BT_WIRE_HAVE_NAME);
+	data.insert(data.end(), address1, address1 + BT_WIRE_ADDR_LEN);
+	data.push_back(0);
+	data.push_back((3 << 1) | 1);   // No name has been written yet.
+	BTWireDecoder decoder(data.data(), data.size());
+	BTWireRecord  record;
+	CHECK(!decoder.next(&record));
+	CHECK(!decoder.isValid());
+} // testBadReference
+
+
+int main() {
+	RUN(testDecode);
+	RUN(testWrongVersion);
+	RUN(testTruncated);
+	RUN(testBadReference);
+	return BT_TEST_RESULT();
+} // main
@@ -0,0 +1,247 @@
+// Copyright 2018 AntorFR
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// BTWireEncoder against BTWireDecoder: scanned devices survive the round trip field for field, with the
+// presence bitmap, multi-byte timestamps and names both as literals and as dictionary references, split
+// over buffers that each decode alone, and a buffer too small for the header.
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "BTTest.h"
+#include "FakeStack.h"
+#include "BTDevice.h"
+#include "BTScan.h"
+#include "BTWireFormat.h"
+
+static const int DEVICES = 100;
+
+static void onScanComplete(const BTScanResults& results) {
+} // onScanComplete
+
+
+/**
+ * @brief Sight a device, with a name and a TX power in its EIR when given.
+ */
+static void sight(uint32_t n, const std::string& name, int8_t rssi, uint32_t cod, bool txPower) {
+	uint8_t address[ESP_BD_ADDR_LEN];
+	uint8_t eir[ESP_BT_GAP_EIR_DATA_LEN];
+	size_t  length = 0;
+	FakeStack::makeAddress(n, address);
+	if (!name.empty()) {
+		eir[length++] = 1 + name.size();
+		eir[length++] = ESP_BT_EIR_TYPE_CMPL_LOCAL_NAME;
+		memcpy(eir + length, name.data(), name.size());
+		length += name.size();
+	}
+	if (txPower) {
+		eir[length++] = 2;
+		eir[length++] = ESP_BT_EIR_TYPE_TX_POWER_LEVEL;
+		eir[length++] = (uint8_t)(int8_t)(n % 20 - 10);
+	}
+	FakeStack::emitDiscRes(address, rssi, cod, length != 0 ? eir : nullptr, length);
+} // sight
+
+
+/**
+ * @brief A scan mixing every combination of fields.  40 distinct names, more than the dictionary
+ * holds, most of them repeated; the gaps between sightings grow so timestamps need 1 and 2 bytes.
+ */
+static BTScanResults scanMixed() {
+	FakeStack::reset();
+	BTDevice::init("wire_encoder_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	FakeStack::advanceMs(20000);   // Room for an earlier time base, see testRoundTrip().
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	for (int n = 0; n < DEVICES; n++) {
+		std::string name = (n % 5 == 4) ? "" : "name " + std::to_string(n % 40);
+		uint32_t    cod  = (n % 3 == 0) ? 0x5a020c : 0;
+		sight(n, name, -40 - n % 50, cod, n % 4 == 0);
+		FakeStack::advanceMs(n * 2);   // Within the 10.24 s inquiry.
+	}
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	return pScan->getResults();
+} // scanMixed
+
+
+/**
+ * @brief Check a decoded record against the device it was encoded from.
+ */
+static void checkRecord(BTAdvertisedDevice device, const BTWireRecord& record) {
+	uint8_t presence = (device.haveRSSI() ? BT_WIRE_HAVE_RSSI : 0) | (device.haveCod() ? BT_WIRE_HAVE_COD : 0)
+		| (device.haveName() ? BT_WIRE_HAVE_NAME : 0) | (device.haveTXPower() ? BT_WIRE_HAVE_TXPOWER : 0);
+	CHECK_EQ(presence, record.presence);
+	CHECK(memcmp(record.address, *device.getAddress().getNative(), BT_WIRE_ADDR_LEN) == 0);
+	CHECK_EQ(device.getTimestamp(), record.timestamp);
+	if (presence & BT_WIRE_HAVE_RSSI) {
+		CHECK_EQ(device.getRSSI(), record.rssi);
+	}
+	if (presence & BT_WIRE_HAVE_COD) {
+		CHECK_EQ(device.getCod(), record.cod);
+	}
+	if (presence & BT_WIRE_HAVE_NAME) {
+		CHECK(device.getName() == std::string(record.name, record.nameLen));
+	}
+	if (presence & BT_WIRE_HAVE_TXPOWER) {
+		CHECK_EQ(device.getTXPower(), record.txPower);
+	}
+} // checkRecord
+
+
+/**
+ * @brief One buffer large enough for the whole scan decodes back to it, relative to the scan start
+ * and to a time base 20 s earlier, where every timestamp takes 3 bytes.
+ */
+static void testRoundTrip() {
+	BTScanResults results = scanMixed();
+	CHECK_EQ(DEVICES, results.getCount());
+	const uint32_t bases[] = { results.getScanStart(), results.getScanStart() - 20000 };
+	size_t lengths[2];
+	for (int b = 0; b < 2; b++) {
+		std::vector<uint8_t> buffer(16384);
+		BTWireEncoder encoder(buffer.data(), buffer.size());
+		encoder.reset(bases[b]);
+		CHECK_EQ((size_t)DEVICES, encoder.addResults(results));
+		CHECK_EQ(DEVICES, encoder.getDeviceCount());
+		lengths[b] = encoder.getLength();
+
+		BTWireDecoder decoder(encoder.getData(), encoder.getLength());
+		BTWireRecord  record;
+		CHECK(decoder.isValid());
+		CHECK_EQ(bases[b], decoder.getScanStart());
+		for (int i = 0; i < DEVICES; i++) {
+			CHECK(decoder.next(&record));
+			checkRecord(results.getDevice(i), record);
+		}
+		CHECK(!decoder.next(&record));
+		CHECK(decoder.isValid());
+	}
+	CHECK(lengths[1] > lengths[0] + DEVICES / 2);   // Most timestamps grew from 1 or 2 bytes to 3.
+} // testRoundTrip
+
+
+/**
+ * @brief A name already in the buffer costs a one byte reference instead of the literal.
+ */
+static void testDictionary() {
+	FakeStack::reset();
+	BTDevice::init("wire_encoder_test");
+	BTScan* pScan = BTDevice::getScan();
+	pScan->setAdvertisedDeviceCallbacks(nullptr);
+	CHECK(pScan->start(10, onScanComplete));
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STARTED);
+	sight(1, "Living room", -50, 0, false);
+	sight(2, "Living room", -50, 0, false);
+	sight(3, "Kitchen", -50, 0, false);
+	FakeStack::emitDiscState(ESP_BT_GAP_DISCOVERY_STOPPED);
+	BTScanResults results = pScan->getResults();
+
+	uint8_t       buffer[256];
+	BTWireEncoder encoder(buffer, sizeof(buffer));
+	encoder.reset(results.getScanStart());
+	std::vector<size_t> lengths;
+	for (int i = 0; i < 3; i++) {
+		size_t before = encoder.getLength();
+		BTAdvertisedDevice device = results.getDevice(i);
+		CHECK(encoder.addDevice(device));
+		lengths.push_back(encoder.getLength() - before);
+	}
+	CHECK_EQ(lengths[0] - 1 - strlen("Living room") + 1, lengths[1]);   // Literal length and bytes, for one reference.
+	CHECK_EQ(lengths[0] - strlen("Living room") + strlen("Kitchen"), lengths[2]);
+
+	BTWireDecoder decoder(encoder.getData(), encoder.getLength());
+	BTWireRecord  record;
+	for (int i = 0; i < 3; i++) {
+		CHECK(decoder.next(&record));
+		checkRecord(results.getDevice(i), record);
+	}
+} // testDictionary
+
+
+/**
+ * @brief Small buffers shipped one after the other: every buffer decodes alone, and together they
+ * hold every device once, in order.
+ */
+static void testSplitBuffers() {
+	BTScanResults results = scanMixed();
+	uint8_t       buffer[64];
+	BTWireEncoder encoder(buffer, sizeof(buffer));
+	size_t next    = 0;
+	int    decoded = 0;
+	int    buffers = 0;
+	while (next < (size_t)results.getCount()) {
+		encoder.reset(results.getScanStart());
+		size_t end = encoder.addResults(results, next);
+		CHECK(end > next);   // Every record fits an empty buffer.
+		if (end == next) {
+			break;
+		}
+		CHECK_EQ(end - next, encoder.getDeviceCount());
+		CHECK(encoder.getLength() <= sizeof(buffer));
+
+		std::vector<uint8_t> shipped(encoder.getData(), encoder.getData() + encoder.getLength());   // Alone, as received.
+		BTWireDecoder decoder(shipped.data(), shipped.size());
+		BTWireRecord  record;
+		while (decoder.next(&record)) {
+			checkRecord(results.getDevice(decoded++), record);
+		}
+		CHECK(decoder.isValid());
+		next = end;
+		buffers++;
+	}
+	CHECK_EQ(DEVICES, decoded);
+	CHECK(buffers > 1);
+} // testSplitBuffers
+
+
+/**
+ * @brief Below 6 bytes reset() does not even write the header, and no device is accepted.
+ */
+static void testResetSmallCapacity() {
+	BTScanResults results = scanMixed();
+	BTAdvertisedDevice device = results.getDevice(0);
+	for (size_t capacity = 0; capacity < 6; capacity++) {
+		uint8_t       buffer[6];
+		BTWireEncoder encoder(buffer, capacity);
+		encoder.reset(0xffffffff);
+		CHECK_EQ(0, encoder.getLength());
+		CHECK(!encoder.addDevice(device));
+		CHECK_EQ(0, encoder.getDeviceCount());
+		CHECK_EQ(0, encoder.getLength());
+	}
+
+	uint8_t       buffer[6];
+	BTWireEncoder encoder(buffer, sizeof(buffer));
+	encoder.reset(0xffffffff);   // The largest header: version and a 5 byte varint.
+	CHECK_EQ(6, encoder.getLength());
+	CHECK(!encoder.addDevice(device));
+	BTWireDecoder decoder(encoder.getData(), encoder.getLength());
+	BTWireRecord  record;
+	CHECK(decoder.isValid());
+	CHECK_EQ(0xffffffff, decoder.getScanStart());
+	CHECK(!decoder.next(&record));
+} // testResetSmallCapacity
+
+
+int main() {
+	RUN(testRoundTrip);
+	RUN(testDictionary);
+	RUN(testSplitBuffers);
+	RUN(testResetSmallCapacity);
+	return BT_TEST_RESULT();
+} // main